@@ -7,16 +7,40 @@
 #include <ngx_core.h>
 #include <ngx_http.h>
 
+#if (NGX_LINUX)
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+#endif
+
+#if (NGX_LINUX && !defined FICLONE)
+#define FICLONE  _IOW(0x94, 9, int)
+#endif
+
 #include "ngx_http_lua_io.h"
 
 
 static ngx_chain_t *ngx_http_lua_io_chain_to_iovec(ngx_iovec_t *vec,
     ngx_chain_t *cl);
-static ngx_int_t ngx_http_lua_io_thread_post_task(ngx_thread_task_t *task,
+static ngx_thread_task_t *ngx_http_lua_io_thread_get_task(
     ngx_http_lua_io_file_ctx_t *file_ctx);
+static ngx_int_t ngx_http_lua_io_thread_post_file_task(
+    ngx_thread_task_t *task, ngx_http_lua_io_file_ctx_t *file_ctx);
+static void ngx_http_lua_io_thread_open_file(void *data, ngx_log_t *log);
 static void ngx_http_lua_io_thread_write_chain_to_file(void *data,
     ngx_log_t *log);
-static void ngx_http_lua_io_thread_read_file(void *data, ngx_log_t *log);
+static void ngx_http_lua_io_thread_write_body(void *data, ngx_log_t *log);
+static ngx_int_t ngx_http_lua_io_copy_range(ngx_http_lua_io_thread_ctx_t *ctx,
+    ngx_fd_t src, off_t offset, off_t size, ngx_log_t *log);
+static void ngx_http_lua_io_thread_read_all(void *data, ngx_log_t *log);
+static void ngx_http_lua_io_thread_map_file(ngx_http_lua_io_thread_ctx_t *ctx,
+    ngx_log_t *log);
+#if (NGX_HAVE_O_DIRECT)
+static size_t ngx_http_lua_io_dio_alignment(ngx_fd_t fd);
+static ngx_int_t ngx_http_lua_io_iovec_aligned(ngx_iovec_t *vec, off_t offset,
+    size_t alignment);
+static ssize_t ngx_http_lua_io_thread_read_direct(
+    ngx_http_lua_io_thread_ctx_t *ctx);
+#endif
 
 
 static ngx_chain_t *
@@ -38,6 +62,12 @@ ngx_http_lua_io_chain_to_iovec(ngx_iovec_t *vec, ngx_chain_t *cl)
             continue;
         }
 
+        /* the file bufs, e.g. of the request body, are copied separately */
+
+        if (!ngx_buf_in_memory(cl->buf)) {
+            break;
+        }
+
         size = cl->buf->last - cl->buf->pos;
 
         if (prev == cl->buf->pos) {
@@ -65,18 +95,35 @@ ngx_http_lua_io_chain_to_iovec(ngx_iovec_t *vec, ngx_chain_t *cl)
 }
 
 
-static ngx_int_t
-ngx_http_lua_io_thread_post_task(ngx_thread_task_t *task,
-    ngx_http_lua_io_file_ctx_t *file_ctx)
+static ngx_thread_task_t *
+ngx_http_lua_io_thread_get_task(ngx_http_lua_io_file_ctx_t *file_ctx)
 {
-    ngx_http_request_t  *r;
+    ngx_thread_task_t  *task;
 
-    r = file_ctx->request;
+    task = file_ctx->thread_task;
+
+    if (task == NULL) {
+        task = ngx_thread_task_alloc(file_ctx->request->pool,
+                                     sizeof(ngx_http_lua_io_thread_ctx_t));
+        if (task == NULL) {
+            file_ctx->ft_type |= NGX_HTTP_LUA_IO_FT_NO_MEMORY;
+            return NULL;
+        }
+
+        file_ctx->thread_task = task;
+    }
+
+    return task;
+}
 
-    task->event.data = file_ctx;
-    task->event.handler = file_ctx->handler;
 
-    if (ngx_thread_task_post(file_ctx->thread_pool, task) != NGX_OK) {
+ngx_int_t
+ngx_http_lua_io_thread_post_task(ngx_thread_task_t *task,
+    ngx_thread_pool_t *tp, ngx_http_request_t *r)
+{
+    /* the request waits for the task, task->event is set by the caller */
+
+    if (ngx_thread_task_post(tp, task) != NGX_OK) {
         return NGX_ERROR;
     }
 
@@ -87,6 +134,179 @@ ngx_http_lua_io_thread_post_task(ngx_thread_task_t *task,
 }
 
 
+static ngx_int_t
+ngx_http_lua_io_thread_post_file_task(ngx_thread_task_t *task,
+    ngx_http_lua_io_file_ctx_t *file_ctx)
+{
+    task->event.data = file_ctx;
+    task->event.handler = file_ctx->handler;
+
+    return ngx_http_lua_io_thread_post_task(task, file_ctx->thread_pool,
+                                            file_ctx->request);
+}
+
+
+static void
+ngx_http_lua_io_thread_open_file(void *data, ngx_log_t *log)
+{
+    ngx_http_lua_io_thread_ctx_t *ctx = data;
+
+    off_t            offset;
+    ngx_file_info_t  fi;
+
+    ctx->err = 0;
+    ctx->offset = 0;
+    ctx->valid = 0;
+
+    if (ctx->revalidate
+        && ngx_file_info(ctx->path, &fi) != NGX_FILE_ERROR
+        && ngx_file_uniq(&fi) == ctx->uniq
+        && ngx_file_mtime(&fi) == ctx->mtime
+        && ngx_file_size(&fi) == ctx->file_size)
+    {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+                       "lua io thread open \"%s\" cached file is valid",
+                       ctx->path);
+
+        ctx->info = fi;
+        ctx->valid = 1;
+        return;
+    }
+
+    ctx->fd = ngx_open_file(ctx->path, ctx->mode, ctx->create, ctx->access);
+
+#if (NGX_LINUX && defined O_NOATIME)
+
+    if (ctx->fd == NGX_INVALID_FILE
+        && ngx_errno == NGX_EPERM
+        && (ctx->mode & O_NOATIME))
+    {
+        /* O_NOATIME is only permitted to the owner of the file */
+
+        ctx->fd = ngx_open_file(ctx->path, (ctx->mode & ~O_NOATIME),
+                                ctx->create, ctx->access);
+    }
+
+#endif
+
+    if (ctx->fd == NGX_INVALID_FILE) {
+        ctx->err = ngx_errno;
+        return;
+    }
+
+    ctx->alignment = 0;
+
+    if (ctx->direct) {
+        if (ngx_directio_on(ctx->fd) == NGX_FILE_ERROR) {
+            ctx->err = ngx_errno;
+            ngx_log_error(NGX_LOG_ALERT, log, ctx->err,
+                          ngx_directio_on_n " \"%s\" failed", ctx->path);
+            goto failed;
+        }
+
+#if (NGX_HAVE_O_DIRECT)
+        ctx->alignment = ngx_http_lua_io_dio_alignment(ctx->fd);
+#endif
+    }
+
+    if (ctx->mmap) {
+        ngx_http_lua_io_thread_map_file(ctx, log);
+    }
+
+    /*
+     * the file identity is needed by the open file cache and by the shared
+     * durable flushes, fstat() is done here as it might block as well
+     */
+
+    if (ngx_fd_info(ctx->fd, &ctx->info) == NGX_FILE_ERROR) {
+        ctx->err = ngx_errno;
+        goto failed;
+    }
+
+    if (ctx->append) {
+        offset = lseek(ctx->fd, 0, SEEK_END);
+
+        if (offset < 0) {
+            ctx->err = ngx_errno;
+            goto failed;
+        }
+
+        ctx->offset = offset;
+    }
+
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "lua io thread open \"%s\" fd:%d offset:%O alignment:%uz",
+                   ctx->path, ctx->fd, ctx->offset, ctx->alignment);
+
+    return;
+
+failed:
+
+    if (ngx_close_file(ctx->fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", ctx->path);
+    }
+
+    ctx->fd = NGX_INVALID_FILE;
+}
+
+
+static void
+ngx_http_lua_io_thread_map_file(ngx_http_lua_io_thread_ctx_t *ctx,
+    ngx_log_t *log)
+{
+    void             *p;
+    ngx_file_info_t   fi;
+
+    ctx->map = NULL;
+    ctx->map_size = 0;
+
+    if (ngx_fd_info(ctx->fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", ctx->path);
+        goto failed;
+    }
+
+    if (!ngx_is_file(&fi)
+        || ngx_file_size(&fi) > (off_t) NGX_MAX_SIZE_T_VALUE)
+    {
+        goto failed;
+    }
+
+    if (ngx_file_size(&fi) == 0) {
+
+        /* nothing to map, every read hits the end of file */
+
+        return;
+    }
+
+    p = mmap(NULL, (size_t) ngx_file_size(&fi), PROT_READ, MAP_SHARED,
+             ctx->fd, 0);
+
+    if (p == MAP_FAILED) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      "mmap(%O) \"%s\" failed", ngx_file_size(&fi),
+                      ctx->path);
+        goto failed;
+    }
+
+    ctx->map = p;
+    ctx->map_size = (size_t) ngx_file_size(&fi);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "lua io thread map \"%s\" %uz bytes",
+                   ctx->path, ctx->map_size);
+
+    return;
+
+failed:
+
+    /* fall back to the buffered reading */
+
+    ctx->mmap = 0;
+}
+
+
 static void
 ngx_http_lua_io_thread_write_chain_to_file(void *data, ngx_log_t *log)
 {
@@ -98,6 +318,12 @@ ngx_http_lua_io_thread_write_chain_to_file(void *data, ngx_log_t *log)
     ngx_iovec_t    vec;
     struct iovec   iovs[NGX_IOVS_PREALLOCATE];
 
+#if (NGX_HAVE_O_DIRECT)
+    ngx_uint_t     buffered;
+
+    buffered = 0;
+#endif
+
     vec.iovs = iovs;
     vec.nalloc = NGX_IOVS_PREALLOCATE;
 
@@ -110,13 +336,52 @@ ngx_http_lua_io_thread_write_chain_to_file(void *data, ngx_log_t *log)
         goto flush;
     }
 
+    /*
+     * the data is written at the tracked file position, like the reads,
+     * the offset of the descriptor itself is not relied on
+     */
+
+#if !(NGX_HAVE_PWRITEV)
+
+    if (lseek(ctx->fd, ctx->offset, SEEK_SET) == -1) {
+        ctx->err = ngx_errno;
+        return;
+    }
+
+#endif
+
     do {
         /* create the iovec and coalesce the neighbouring bufs */
         cl = ngx_http_lua_io_chain_to_iovec(&vec, cl);
 
+#if (NGX_HAVE_O_DIRECT)
+
+        /*
+         * the unaligned parts (usually the tail of the file) are written
+         * with the O_DIRECT flag temporarily turned off
+         */
+
+        if (ctx->alignment
+            && !ngx_http_lua_io_iovec_aligned(&vec, ctx->offset + ctx->nbytes,
+                                              ctx->alignment))
+        {
+            if (ngx_directio_off(ctx->fd) == NGX_FILE_ERROR) {
+                ctx->err = ngx_errno;
+                return;
+            }
+
+            buffered = 1;
+        }
+
+#endif
+
 eintr:
 
+#if (NGX_HAVE_PWRITEV)
+        n = pwritev(ctx->fd, iovs, vec.count, ctx->offset + ctx->nbytes);
+#else
         n = writev(ctx->fd, iovs, vec.count);
+#endif
 
         if (n == -1) {
             err = ngx_errno;
@@ -127,10 +392,44 @@ eintr:
                 goto eintr;
             }
 
+#if (NGX_HAVE_O_DIRECT)
+
+            if (err == NGX_EINVAL && ctx->alignment && !buffered) {
+
+                /* the real file position might be unaligned, e.g. "a" mode */
+
+                if (ngx_directio_off(ctx->fd) == NGX_FILE_ERROR) {
+                    ctx->err = ngx_errno;
+                    return;
+                }
+
+                buffered = 1;
+                goto eintr;
+            }
+
+#endif
+
             ctx->err = err;
-            return;
+            goto done;
+        }
+
+#if (NGX_HAVE_O_DIRECT)
+
+        if (buffered) {
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
+                           "lua io thread write %z unaligned bytes @%O",
+                           n, ctx->offset + ctx->nbytes);
+
+            buffered = 0;
+
+            if (ngx_directio_on(ctx->fd) == NGX_FILE_ERROR) {
+                ctx->err = ngx_errno;
+                return;
+            }
         }
 
+#endif
+
         if ((size_t) n != vec.size) {
             ctx->nbytes = 0;
             return;
@@ -144,128 +443,1679 @@ flush:
     if(ctx->flush && fsync(ctx->fd) < 0) {
         ctx->err = ngx_errno;
     }
+
+    return;
+
+done:
+
+#if (NGX_HAVE_O_DIRECT)
+
+    if (buffered && ngx_directio_on(ctx->fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_directio_on_n " failed");
+    }
+
+#endif
+
+    return;
 }
 
 
 static void
-ngx_http_lua_io_thread_read_file(void *data, ngx_log_t *log)
+ngx_http_lua_io_thread_write_body(void *data, ngx_log_t *log)
 {
     ngx_http_lua_io_thread_ctx_t *ctx = data;
 
     ssize_t        n;
-    size_t         size;
+    ngx_int_t      rc;
+    ngx_err_t      err;
+    ngx_buf_t     *b;
+    ngx_chain_t   *cl, *next;
+    ngx_iovec_t    vec;
+    struct iovec   iovs[NGX_IOVS_PREALLOCATE];
+
+    /*
+     * the chain is the buffered data followed by the shadows of the request
+     * body bufs, the memory bufs are written with writev() and the file bufs
+     * (the client body temporary file) are copied within the kernel
+     */
 
     ctx->nbytes = 0;
     ctx->err = 0;
-    ctx->eof = 0;
 
-    size = ctx->size;
-    if (size == 0) {
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
-                       "lua io thread read zero bytes");
+    /*
+     * copy_file_range() and sendfile() write at the offset of the descriptor,
+     * so it is moved to the tracked file position first
+     */
+
+    if (!ctx->append && lseek(ctx->fd, ctx->offset, SEEK_SET) == -1) {
+        ctx->err = ngx_errno;
         return;
     }
 
-    n = read(ctx->fd, ctx->buf, size);
+#if (NGX_HAVE_O_DIRECT)
 
-    if (n == -1) {
+    /* the request body is hardly aligned, write it through the page cache */
+
+    if (ctx->alignment && ngx_directio_off(ctx->fd) == NGX_FILE_ERROR) {
         ctx->err = ngx_errno;
+        return;
+    }
 
-    } else {
-        ctx->nbytes = n;
-        ctx->err = 0;
+#endif
 
-        if ((size_t) n < size) {
-            ctx->eof = 1;
+    vec.iovs = iovs;
+    vec.nalloc = NGX_IOVS_PREALLOCATE;
+
+    cl = ctx->chain;
+
+    while (cl) {
+        b = cl->buf;
+
+        if (!ngx_buf_special(b) && !ngx_buf_in_memory(b)) {
+            rc = ngx_http_lua_io_copy_range(ctx, b->file->fd, b->file_pos,
+                                            b->file_last - b->file_pos, log);
+
+            if (rc == NGX_DONE) {
+                ngx_log_error(NGX_LOG_ALERT, log, 0,
+                              "lua io client body file \"%V\" was truncated",
+                              &b->file->name);
+
+                ctx->err = NGX_EINVAL;
+            }
+
+            if (rc != NGX_OK) {
+                goto done;
+            }
+
+            cl = cl->next;
+            continue;
         }
-    }
 
-    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, log, 0,
-                   "lua io thread read %z (err: %d) of %uz, eof:%d",
-                   n, ctx->err, size, ctx->eof);
-}
+        next = ngx_http_lua_io_chain_to_iovec(&vec, cl);
 
+        if (vec.size == 0) {
+            cl = next;
+            continue;
+        }
 
-ngx_int_t
-ngx_http_lua_io_thread_post_write_task(ngx_http_lua_io_file_ctx_t *file_ctx,
-    ngx_chain_t *cl, ngx_int_t flush)
-{
-    ngx_thread_task_t             *task;
-    ngx_http_lua_io_thread_ctx_t  *thread_ctx;
-    ngx_http_request_t            *r;
+        n = writev(ctx->fd, iovs, vec.count);
 
-    r = file_ctx->request;
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, log, 0,
+                       "lua io thread write body %z of %uz bytes (err: %d)",
+                       n, vec.size, n == -1 ? ngx_errno : 0);
 
-    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "lua io thread write chain: %d, %p flush:%d",
-                   file_ctx->fd, cl, flush);
+        if (n == -1) {
+            err = ngx_errno;
 
-    task = file_ctx->thread_task;
+            if (err == NGX_EINTR) {
+                continue;
+            }
 
-    if (task == NULL) {
-        task = ngx_thread_task_alloc(r->pool,
-                                     sizeof(ngx_http_lua_io_thread_ctx_t));
-        if (task == NULL) {
-            file_ctx->ft_type |= NGX_HTTP_LUA_IO_FT_NO_MEMORY;
-            return NGX_ERROR;
+            ctx->err = err;
+            goto done;
         }
 
-        file_ctx->thread_task = task;
+        if (n == 0) {
+            ctx->err = NGX_ENOSPC;
+            goto done;
+        }
+
+        ctx->nbytes += n;
+
+        if ((size_t) n == vec.size) {
+            cl = next;
+            continue;
+        }
+
+        /* a short write, the shadow bufs are consumed by the written part */
+
+        cl = ngx_chain_update_sent(cl, n);
     }
 
-    task->handler = ngx_http_lua_io_thread_write_chain_to_file;
+done:
 
-    thread_ctx = task->ctx;
-    thread_ctx->fd = file_ctx->fd;
-    thread_ctx->chain = cl;
-    thread_ctx->flush = flush;
+#if (NGX_HAVE_O_DIRECT)
 
-    if (ngx_http_lua_io_thread_post_task(task, file_ctx) != NGX_OK) {
-        file_ctx->ft_type |= NGX_HTTP_LUA_IO_FT_TASK_POST_ERROR;
-        return NGX_ERROR;
+    if (ctx->alignment && ngx_directio_on(ctx->fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_directio_on_n " failed");
     }
 
-    return NGX_OK;
+#endif
+
+    return;
 }
 
 
-ngx_int_t
-ngx_http_lua_io_thread_post_read_task(ngx_http_lua_io_file_ctx_t *file_ctx,
-    ngx_buf_t *buf)
+/*
+ * copies "size" bytes of the file "src" from "offset" to the file position
+ * of ctx->fd, NGX_DONE is returned if the end of "src" is reached before,
+ * copy_file_range() and sendfile() are tried first to keep the data in the
+ * kernel, then read() and write() are used
+ */
+
+static ngx_int_t
+ngx_http_lua_io_copy_range(ngx_http_lua_io_thread_ctx_t *ctx, ngx_fd_t src,
+    off_t offset, off_t size, ngx_log_t *log)
 {
-    ngx_thread_task_t             *task;
-    ngx_http_lua_io_thread_ctx_t  *thread_ctx;
-    ngx_http_request_t            *r;
+    size_t      len;
+    ssize_t     n, written;
+    u_char     *buf, *p;
+    ngx_err_t   err;
 
-    r = file_ctx->request;
+#if (NGX_HAVE_COPY_FILE_RANGE)
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "lua io thread read: %d", file_ctx->fd);
+    /* copy_file_range() fails with EBADF if the output has O_APPEND */
 
-    task = file_ctx->thread_task;
+    while (size > 0 && !ctx->append) {
+        len = (size_t) ngx_min(size, NGX_MAX_SIZE_T_VALUE);
 
-    if (task == NULL) {
-        task = ngx_thread_task_alloc(r->pool,
-                                     sizeof(ngx_http_lua_io_thread_ctx_t));
-        if (task == NULL) {
-            file_ctx->ft_type |= NGX_HTTP_LUA_IO_FT_NO_MEMORY;
-            return NGX_ERROR;
-        }
+        n = copy_file_range(src, &offset, ctx->fd, NULL, len, 0);
 
-        file_ctx->thread_task = task;
-    }
+        ngx_log_debug4(NGX_LOG_DEBUG_HTTP, log, 0,
+                       "lua io thread copy_file_range() %z of %uz bytes @%O "
+                       "(err: %d)", n, len, offset, n == -1 ? ngx_errno : 0);
 
-    task->handler = ngx_http_lua_io_thread_read_file;
+        if (n == -1) {
+            err = ngx_errno;
 
-    thread_ctx = task->ctx;
-    thread_ctx->fd = file_ctx->fd;
-    thread_ctx->buf = buf->last;
-    thread_ctx->size = buf->end - buf->last;
+            if (err == NGX_EINTR) {
+                continue;
+            }
 
-    if (ngx_http_lua_io_thread_post_task(task, file_ctx) != NGX_OK) {
+            if (err == NGX_ENOSYS || err == NGX_EXDEV || err == NGX_EINVAL
+                || err == NGX_EOPNOTSUPP)
+            {
+                /* not supported by the kernel or the file systems */
+                break;
+            }
+
+            ctx->err = err;
+            return NGX_ERROR;
+        }
+
+        if (n == 0) {
+            return NGX_DONE;
+        }
+
+        ctx->nbytes += n;
+        size -= n;
+    }
+
+#endif
+
+#if (NGX_LINUX && NGX_HAVE_SENDFILE)
+
+    /* sendfile() fails with EINVAL if the output has O_APPEND */
+
+    while (size > 0 && !ctx->append) {
+        len = (size_t) ngx_min(size, NGX_MAX_INT32_VALUE);
+
+        n = sendfile(ctx->fd, src, &offset, len);
+
+        ngx_log_debug4(NGX_LOG_DEBUG_HTTP, log, 0,
+                       "lua io thread sendfile() %z of %uz bytes @%O "
+                       "(err: %d)", n, len, offset, n == -1 ? ngx_errno : 0);
+
+        if (n == -1) {
+            err = ngx_errno;
+
+            if (err == NGX_EINTR) {
+                continue;
+            }
+
+            if (err == NGX_ENOSYS || err == NGX_EINVAL) {
+                break;
+            }
+
+            ctx->err = err;
+            return NGX_ERROR;
+        }
+
+        if (n == 0) {
+            return NGX_DONE;
+        }
+
+        ctx->nbytes += n;
+        size -= n;
+    }
+
+#endif
+
+    if (size == 0) {
+        return NGX_OK;
+    }
+
+    buf = ngx_alloc(NGX_HTTP_LUA_IO_COPY_BUF_SIZE, log);
+    if (buf == NULL) {
+        ctx->err = NGX_ENOMEM;
+        return NGX_ERROR;
+    }
+
+    while (size > 0) {
+        len = (size_t) ngx_min(size, NGX_HTTP_LUA_IO_COPY_BUF_SIZE);
+
+        n = pread(src, buf, len, offset);
+
+        if (n == -1) {
+            err = ngx_errno;
+
+            if (err == NGX_EINTR) {
+                continue;
+            }
+
+            ctx->err = err;
+            goto failed;
+        }
+
+        if (n == 0) {
+            ngx_free(buf);
+            return NGX_DONE;
+        }
+
+        offset += n;
+        size -= n;
+
+        for (p = buf; p < buf + n; p += written) {
+            written = write(ctx->fd, p, buf + n - p);
+
+            if (written == -1) {
+                err = ngx_errno;
+
+                if (err == NGX_EINTR) {
+                    written = 0;
+                    continue;
+                }
+
+                ctx->err = err;
+                goto failed;
+            }
+
+            if (written == 0) {
+                ctx->err = NGX_ENOSPC;
+                goto failed;
+            }
+
+            ctx->nbytes += written;
+        }
+    }
+
+    ngx_free(buf);
+
+    return NGX_OK;
+
+failed:
+
+    ngx_free(buf);
+
+    return NGX_ERROR;
+}
+
+
+void
+ngx_http_lua_io_thread_read_file(void *data, ngx_log_t *log)
+{
+    ngx_http_lua_io_thread_ctx_t *ctx = data;
+
+    ssize_t        n;
+    size_t         size;
+
+    ctx->nbytes = 0;
+    ctx->err = 0;
+    ctx->eof = 0;
+
+    size = ctx->size;
+    if (size == 0) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
+                       "lua io thread read zero bytes");
+        return;
+    }
+
+#if (NGX_HAVE_O_DIRECT)
+
+    if (ctx->alignment) {
+        n = ngx_http_lua_io_thread_read_direct(ctx);
+        goto done;
+    }
+
+#endif
+
+    n = pread(ctx->fd, ctx->buf, size, ctx->offset);
+
+    if (n == -1) {
+        ctx->err = ngx_errno;
+
+    } else {
+        ctx->nbytes = n;
+        ctx->err = 0;
+
+        if ((size_t) n < size) {
+            ctx->eof = 1;
+        }
+    }
+
+#if (NGX_HAVE_O_DIRECT)
+done:
+#endif
+
+    ngx_log_debug5(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "lua io thread read %z (err: %d) of %uz @%O, eof:%d",
+                   n, ctx->err, size, ctx->offset, ctx->eof);
+}
+
+
+static void
+ngx_http_lua_io_thread_read_all(void *data, ngx_log_t *log)
+{
+    ngx_http_lua_io_thread_ctx_t *ctx = data;
+
+    off_t            offset, size;
+    u_char          *buf, *p;
+    size_t           len, cap;
+    ssize_t          n;
+    ngx_uint_t       regular;
+    ngx_file_info_t  fi;
+
+    ctx->buf = NULL;
+    ctx->nbytes = 0;
+    ctx->size = 0;
+    ctx->err = 0;
+    ctx->eof = 1;
+
+    if (ngx_fd_info(ctx->fd, &fi) == NGX_FILE_ERROR) {
+        ctx->err = ngx_errno;
+        return;
+    }
+
+    regular = ngx_is_file(&fi);
+
+    size = 0;
+
+    if (regular && ngx_file_size(&fi) > ctx->offset) {
+        size = ngx_file_size(&fi) - ctx->offset;
+    }
+
+    if (size > (off_t) (NGX_MAX_SIZE_T_VALUE / 2 - ctx->head_size)) {
+        ctx->err = NGX_ENOMEM;
+        return;
+    }
+
+    /*
+     * one more byte to see the end of file by a short read,
+     * the size of a special file is unknown
+     */
+
+    cap = ctx->head_size + (size_t) size + (regular ? 1 : 65536);
+
+    buf = ngx_alloc(cap, log);
+    if (buf == NULL) {
+        ctx->err = NGX_ENOMEM;
+        return;
+    }
+
+    len = ctx->head_size;
+    offset = ctx->offset;
+
+    if (len) {
+        ngx_memcpy(buf, ctx->head, len);
+    }
+
+    for ( ;; ) {
+        n = pread(ctx->fd, buf + len, cap - len, offset);
+
+        if (n == -1) {
+            if (ngx_errno == NGX_EINTR) {
+                continue;
+            }
+
+            ctx->err = ngx_errno;
+            ngx_free(buf);
+            return;
+        }
+
+        if (n == 0) {
+            break;
+        }
+
+        len += n;
+        offset += n;
+
+        if (len < cap) {
+            if (regular) {
+                break;
+            }
+
+            continue;
+        }
+
+        /* the file has grown meanwhile */
+
+        p = ngx_alloc(cap * 2, log);
+        if (p == NULL) {
+            ctx->err = NGX_ENOMEM;
+            ngx_free(buf);
+            return;
+        }
+
+        ngx_memcpy(p, buf, len);
+        ngx_free(buf);
+
+        buf = p;
+        cap *= 2;
+    }
+
+    ctx->buf = buf;
+    ctx->size = len;
+    ctx->nbytes = offset - ctx->offset;
+
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "lua io thread read all %uz of %O @%O, total:%uz",
+                   ctx->nbytes, size, ctx->offset, ctx->size);
+}
+
+
+#if (NGX_HAVE_O_DIRECT)
+
+static size_t
+ngx_http_lua_io_dio_alignment(ngx_fd_t fd)
+{
+    size_t           alignment;
+    ngx_file_info_t  fi;
+
+#if (NGX_LINUX && defined STATX_DIOALIGN)
+    struct statx     stx;
+
+    if (statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0
+        && (stx.stx_mask & STATX_DIOALIGN)
+        && stx.stx_dio_offset_align)
+    {
+        return ngx_max(stx.stx_dio_offset_align, stx.stx_dio_mem_align);
+    }
+#endif
+
+    /* the preferred I/O size is a multiple of the logical block size */
+
+    alignment = 512;
+
+    if (ngx_fd_info(fd, &fi) != NGX_FILE_ERROR
+        && fi.st_blksize > 512
+        && (fi.st_blksize & (fi.st_blksize - 1)) == 0)
+    {
+        alignment = fi.st_blksize;
+    }
+
+    return alignment;
+}
+
+
+static ngx_int_t
+ngx_http_lua_io_iovec_aligned(ngx_iovec_t *vec, off_t offset,
+    size_t alignment)
+{
+    ngx_uint_t  i;
+
+    if (offset & (alignment - 1)) {
+        return 0;
+    }
+
+    for (i = 0; i < vec->count; i++) {
+        if (((uintptr_t) vec->iovs[i].iov_base & (alignment - 1))
+            || (vec->iovs[i].iov_len & (alignment - 1)))
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+
+static ssize_t
+ngx_http_lua_io_thread_read_direct(ngx_http_lua_io_thread_ctx_t *ctx)
+{
+    off_t    start, end;
+    size_t   a, delta;
+    ssize_t  n;
+
+    a = ctx->alignment;
+
+    if (((uintptr_t) ctx->buf & (a - 1)) == 0
+        && (ctx->offset & (a - 1)) == 0
+        && (ctx->size & (a - 1)) == 0)
+    {
+        n = pread(ctx->fd, ctx->buf, ctx->size, ctx->offset);
+
+        if (n == -1) {
+            ctx->err = ngx_errno;
+            return n;
+        }
+
+        ctx->nbytes = n;
+        ctx->eof = ((size_t) n < ctx->size);
+
+        return n;
+    }
+
+    /* read the covering aligned blocks into the bounce buffer */
+
+    start = ctx->offset & ~((off_t) a - 1);
+    end = ngx_align(ctx->offset + (off_t) ctx->size, (off_t) a);
+
+    if (end - start > (off_t) ctx->bounce_size) {
+        end = start + ctx->bounce_size;
+    }
+
+    n = pread(ctx->fd, ctx->bounce, end - start, start);
+
+    if (n == -1) {
+        ctx->err = ngx_errno;
+        return n;
+    }
+
+    ctx->eof = (n < end - start);
+
+    delta = ctx->offset - start;
+
+    if ((size_t) n <= delta) {
+        ctx->nbytes = 0;
+        ctx->eof = 1;
+        return 0;
+    }
+
+    n = ngx_min((size_t) n - delta, ctx->size);
+
+    ngx_memcpy(ctx->buf, ctx->bounce + delta, n);
+
+    ctx->nbytes = n;
+
+    return n;
+}
+
+#endif
+
+
+ngx_int_t
+ngx_http_lua_io_thread_post_open_task(ngx_http_lua_io_file_ctx_t *file_ctx,
+    u_char *path, ngx_int_t mode, ngx_int_t create, ngx_uint_t access,
+    ngx_int_t append)
+{
+    ngx_thread_task_t             *task;
+    ngx_http_lua_io_thread_ctx_t  *thread_ctx;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, file_ctx->request->connection->log, 0,
+                   "lua io thread open: \"%s\"", path);
+
+    task = ngx_http_lua_io_thread_get_task(file_ctx);
+    if (task == NULL) {
+        return NGX_ERROR;
+    }
+
+    task->handler = ngx_http_lua_io_thread_open_file;
+
+    thread_ctx = task->ctx;
+    thread_ctx->fd = NGX_INVALID_FILE;
+    thread_ctx->path = path;
+    thread_ctx->mode = mode;
+    thread_ctx->create = create;
+    thread_ctx->access = access;
+    thread_ctx->append = append ? 1 : 0;
+    thread_ctx->cacheable = file_ctx->cacheable;
+    thread_ctx->direct = file_ctx->direct;
+    thread_ctx->mmap = file_ctx->mmap;
+    thread_ctx->alignment = 0;
+    thread_ctx->revalidate = 0;
+
+    if (file_ctx->cached_file) {
+        thread_ctx->revalidate = 1;
+        thread_ctx->uniq = file_ctx->cached_file->uniq;
+        thread_ctx->mtime = file_ctx->cached_file->mtime;
+        thread_ctx->file_size = file_ctx->cached_file->size;
+    }
+
+    if (ngx_http_lua_io_thread_post_file_task(task, file_ctx) != NGX_OK) {
         file_ctx->ft_type |= NGX_HTTP_LUA_IO_FT_TASK_POST_ERROR;
         return NGX_ERROR;
     }
 
     return NGX_OK;
 }
+
+
+ngx_int_t
+ngx_http_lua_io_thread_post_write_task(ngx_http_lua_io_file_ctx_t *file_ctx,
+    ngx_chain_t *cl, ngx_int_t flush)
+{
+    ngx_thread_task_t             *task;
+    ngx_http_lua_io_thread_ctx_t  *thread_ctx;
+    ngx_http_request_t            *r;
+
+    r = file_ctx->request;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io thread write chain: %d, %p flush:%d",
+                   file_ctx->fd, cl, flush);
+
+    task = ngx_http_lua_io_thread_get_task(file_ctx);
+    if (task == NULL) {
+        return NGX_ERROR;
+    }
+
+    task->handler = ngx_http_lua_io_thread_write_chain_to_file;
+
+    thread_ctx = task->ctx;
+    thread_ctx->fd = file_ctx->fd;
+    thread_ctx->chain = cl;
+    thread_ctx->flush = flush;
+    thread_ctx->offset = file_ctx->offset;
+    thread_ctx->alignment = file_ctx->alignment;
+
+    if (ngx_http_lua_io_thread_post_file_task(task, file_ctx) != NGX_OK) {
+        file_ctx->ft_type |= NGX_HTTP_LUA_IO_FT_TASK_POST_ERROR;
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_lua_io_thread_post_write_body_task(
+    ngx_http_lua_io_file_ctx_t *file_ctx, ngx_chain_t *cl, ngx_int_t append)
+{
+    ngx_thread_task_t             *task;
+    ngx_http_lua_io_thread_ctx_t  *thread_ctx;
+    ngx_http_request_t            *r;
+
+    r = file_ctx->request;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io thread write body chain: %d, %p",
+                   file_ctx->fd, cl);
+
+    task = ngx_http_lua_io_thread_get_task(file_ctx);
+    if (task == NULL) {
+        return NGX_ERROR;
+    }
+
+    task->handler = ngx_http_lua_io_thread_write_body;
+
+    thread_ctx = task->ctx;
+    thread_ctx->fd = file_ctx->fd;
+    thread_ctx->chain = cl;
+    thread_ctx->flush = 0;
+    thread_ctx->offset = file_ctx->offset;
+    thread_ctx->alignment = file_ctx->alignment;
+    thread_ctx->append = append ? 1 : 0;
+
+    if (ngx_http_lua_io_thread_post_file_task(task, file_ctx) != NGX_OK) {
+        file_ctx->ft_type |= NGX_HTTP_LUA_IO_FT_TASK_POST_ERROR;
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_lua_io_thread_post_read_task(ngx_http_lua_io_file_ctx_t *file_ctx,
+    ngx_buf_t *buf)
+{
+    size_t                         size;
+    ngx_thread_task_t             *task;
+    ngx_http_lua_io_thread_ctx_t  *thread_ctx;
+    ngx_http_request_t            *r;
+
+    r = file_ctx->request;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io thread read: %d", file_ctx->fd);
+
+    task = ngx_http_lua_io_thread_get_task(file_ctx);
+    if (task == NULL) {
+        return NGX_ERROR;
+    }
+
+    task->handler = ngx_http_lua_io_thread_read_file;
+
+    thread_ctx = task->ctx;
+    thread_ctx->fd = file_ctx->fd;
+    thread_ctx->buf = buf->last;
+    thread_ctx->size = buf->end - buf->last;
+    thread_ctx->offset = file_ctx->read_offset;
+    thread_ctx->alignment = file_ctx->alignment;
+
+    if (file_ctx->alignment) {
+        size = ngx_align(thread_ctx->size, file_ctx->alignment)
+               + 2 * file_ctx->alignment;
+
+        if (file_ctx->bounce_size < size) {
+            file_ctx->bounce = ngx_pmemalign(r->pool, size,
+                                             file_ctx->alignment);
+            if (file_ctx->bounce == NULL) {
+                file_ctx->bounce_size = 0;
+                file_ctx->ft_type |= NGX_HTTP_LUA_IO_FT_NO_MEMORY;
+                return NGX_ERROR;
+            }
+
+            file_ctx->bounce_size = size;
+        }
+
+        thread_ctx->bounce = file_ctx->bounce;
+        thread_ctx->bounce_size = file_ctx->bounce_size;
+    }
+
+    if (ngx_http_lua_io_thread_post_file_task(task, file_ctx) != NGX_OK) {
+        file_ctx->ft_type |= NGX_HTTP_LUA_IO_FT_TASK_POST_ERROR;
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_lua_io_thread_post_read_all_task(ngx_http_lua_io_file_ctx_t *file_ctx,
+    ngx_buf_t *buf)
+{
+    ngx_thread_task_t             *task;
+    ngx_http_lua_io_thread_ctx_t  *thread_ctx;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, file_ctx->request->connection->log, 0,
+                   "lua io thread read all: %d", file_ctx->fd);
+
+    task = ngx_http_lua_io_thread_get_task(file_ctx);
+    if (task == NULL) {
+        return NGX_ERROR;
+    }
+
+    task->handler = ngx_http_lua_io_thread_read_all;
+
+    /* the unconsumed buffered data is put in front of the result */
+
+    thread_ctx = task->ctx;
+    thread_ctx->fd = file_ctx->fd;
+    thread_ctx->head = buf->pos;
+    thread_ctx->head_size = buf->last - buf->pos;
+    thread_ctx->offset = file_ctx->read_offset;
+
+    if (ngx_http_lua_io_thread_post_file_task(task, file_ctx) != NGX_OK) {
+        file_ctx->ft_type |= NGX_HTTP_LUA_IO_FT_TASK_POST_ERROR;
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+void
+ngx_http_lua_io_thread_append(void *data, ngx_log_t *log)
+{
+    ngx_http_lua_io_thread_ctx_t *ctx = data;
+
+    ngx_file_info_t  fi;
+
+    ctx->err = 0;
+    ctx->nbytes = 0;
+
+    if (ctx->fd != NGX_INVALID_FILE
+        && (ngx_file_info(ctx->path, &fi) == NGX_FILE_ERROR
+            || ngx_file_uniq(&fi) != ctx->uniq))
+    {
+        /* the file has been renamed or removed, e.g. by logrotate */
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+                       "lua io thread append \"%s\" reopen", ctx->path);
+
+        if (ngx_close_file(ctx->fd) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                          ngx_close_file_n " \"%s\" failed", ctx->path);
+        }
+
+        ctx->fd = NGX_INVALID_FILE;
+    }
+
+    if (ctx->fd == NGX_INVALID_FILE) {
+        ctx->fd = ngx_open_file(ctx->path, NGX_FILE_APPEND,
+                                NGX_FILE_CREATE_OR_OPEN, ctx->access);
+
+        if (ctx->fd == NGX_INVALID_FILE) {
+            ctx->err = ngx_errno;
+            ngx_log_error(NGX_LOG_CRIT, log, ctx->err,
+                          ngx_open_file_n " \"%s\" failed", ctx->path);
+            return;
+        }
+
+        if (ngx_fd_info(ctx->fd, &fi) == NGX_FILE_ERROR) {
+            ctx->err = ngx_errno;
+            ngx_log_error(NGX_LOG_CRIT, log, ctx->err,
+                          ngx_fd_info_n " \"%s\" failed", ctx->path);
+
+            if (ngx_close_file(ctx->fd) == NGX_FILE_ERROR) {
+                ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                              ngx_close_file_n " \"%s\" failed", ctx->path);
+            }
+
+            ctx->fd = NGX_INVALID_FILE;
+            return;
+        }
+
+        ctx->uniq = ngx_file_uniq(&fi);
+    }
+
+    ngx_http_lua_io_thread_write_chain_to_file(data, log);
+}
+
+
+void
+ngx_http_lua_io_thread_sync(void *data, ngx_log_t *log)
+{
+    ngx_http_lua_io_thread_ctx_t *ctx = data;
+
+    int  rc;
+
+    /* the data was written by the tasks of the files, only sync it here */
+
+    ctx->err = 0;
+
+    switch (ctx->sync_mode) {
+
+#if (NGX_HAVE_SYNC_FILE_RANGE)
+    case NGX_HTTP_LUA_IO_SYNC_RANGE:
+        rc = sync_file_range(ctx->fd, ctx->offset, ctx->sync_size,
+                             SYNC_FILE_RANGE_WAIT_BEFORE
+                             |SYNC_FILE_RANGE_WRITE
+                             |SYNC_FILE_RANGE_WAIT_AFTER);
+        break;
+#endif
+
+#if (NGX_HAVE_FDATASYNC)
+    case NGX_HTTP_LUA_IO_SYNC_DATA:
+        rc = fdatasync(ctx->fd);
+        break;
+#endif
+
+    default:
+        rc = fsync(ctx->fd);
+    }
+
+    if (rc == -1) {
+        ctx->err = ngx_errno;
+    }
+
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "lua io thread sync fd:%d mode:%ui @%O:%O",
+                   ctx->fd, ctx->sync_mode, ctx->offset, ctx->sync_size);
+}
+
+
+void
+ngx_http_lua_io_thread_pwrite(void *data, ngx_log_t *log)
+{
+    ngx_http_lua_io_thread_ctx_t *ctx = data;
+
+    ssize_t        n;
+    ngx_err_t      err;
+    ngx_chain_t   *cl, *next;
+    ngx_iovec_t    vec;
+    struct iovec   iovs[NGX_IOVS_PREALLOCATE];
+
+    /* the context is filled by the caller, the file offset is never used */
+
+    vec.iovs = iovs;
+
+#if (NGX_HAVE_PWRITEV)
+    vec.nalloc = NGX_IOVS_PREALLOCATE;
+#else
+    vec.nalloc = 1;
+#endif
+
+    ctx->nbytes = 0;
+    ctx->err = 0;
+
+    cl = ctx->chain;
+
+    while (cl) {
+        next = ngx_http_lua_io_chain_to_iovec(&vec, cl);
+
+        if (vec.count == 0) {
+            break;
+        }
+
+#if (NGX_HAVE_PWRITEV)
+        n = pwritev(ctx->fd, iovs, vec.count, ctx->offset + ctx->nbytes);
+#else
+        n = pwrite(ctx->fd, iovs[0].iov_base, iovs[0].iov_len,
+                   ctx->offset + ctx->nbytes);
+#endif
+
+        ngx_log_debug4(NGX_LOG_DEBUG_HTTP, log, 0,
+                       "lua io thread pwrite %z of %uz bytes @%O (err: %d)",
+                       n, vec.size, ctx->offset + ctx->nbytes,
+                       n == -1 ? ngx_errno : 0);
+
+        if (n == -1) {
+            err = ngx_errno;
+
+            if (err == NGX_EINTR) {
+                continue;
+            }
+
+            ctx->err = err;
+            return;
+        }
+
+        if (n == 0) {
+            ctx->err = NGX_ENOSPC;
+            return;
+        }
+
+        ctx->nbytes += n;
+
+        if ((size_t) n == vec.size) {
+            cl = next;
+            continue;
+        }
+
+        /* a short write, the rest of the data is written again */
+
+        cl = ngx_chain_update_sent(cl, n);
+    }
+}
+
+
+void
+ngx_http_lua_io_thread_copy(void *data, ngx_log_t *log)
+{
+    ngx_http_lua_io_thread_ctx_t *ctx = data;
+
+    off_t            size, nbytes;
+    ngx_fd_t         src;
+    ngx_int_t        rc;
+    ngx_file_info_t  fi, to;
+
+    /*
+     * copies a chunk of the file, ctx->offset is the position of "path",
+     * ctx->nbytes is the position of "to" and ctx->file_size is the end,
+     * the files are opened by every task, so nothing is left open if the
+     * caller goes away between the chunks
+     */
+
+    ctx->err = 0;
+    size = 0;
+
+    src = ngx_open_file(ctx->path, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+
+    if (src == NGX_INVALID_FILE) {
+        ctx->err = ngx_errno;
+        return;
+    }
+
+    if (ctx->create) {
+        if (ngx_fd_info(src, &fi) == NGX_FILE_ERROR) {
+            ctx->err = ngx_errno;
+            goto done;
+        }
+
+        size = ngx_file_size(&fi);
+
+        if (ctx->file_size < 0 || ctx->file_size > size) {
+            ctx->file_size = size;
+        }
+
+        /* the source would be truncated by opening the destination */
+
+        if (ngx_file_info(ctx->to, &to) != NGX_FILE_ERROR
+            && to.st_dev == fi.st_dev
+            && ngx_file_uniq(&to) == ngx_file_uniq(&fi))
+        {
+            ctx->err = NGX_EINVAL;
+            goto done;
+        }
+    }
+
+    ctx->fd = ngx_open_file(ctx->to, NGX_FILE_WRONLY,
+                            ctx->create ? NGX_FILE_TRUNCATE : NGX_FILE_OPEN,
+                            ctx->access);
+
+    if (ctx->fd == NGX_INVALID_FILE) {
+        ctx->err = ngx_errno;
+        goto done;
+    }
+
+#if (NGX_LINUX)
+
+    /* a whole file is cloned with the shared extents, e.g. on XFS or btrfs */
+
+    if (ctx->create && ctx->offset == 0 && ctx->file_size == size
+        && size > 0)
+    {
+        if (ioctl(ctx->fd, FICLONE, src) == 0) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+                           "lua io thread copy \"%s\" cloned", ctx->path);
+
+            ctx->nbytes = (size_t) size;
+            ctx->eof = 1;
+            goto done;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, ngx_errno,
+                       "lua io thread copy \"%s\" not cloned", ctx->path);
+    }
+
+#endif
+
+    size = ctx->file_size - ctx->offset;
+
+    if (size <= 0) {
+        ctx->eof = 1;
+        goto done;
+    }
+
+    if (ctx->size && size > (off_t) ctx->size) {
+        size = ctx->size;
+    }
+
+    if (lseek(ctx->fd, (off_t) ctx->nbytes, SEEK_SET) == -1) {
+        ctx->err = ngx_errno;
+        goto done;
+    }
+
+    nbytes = ctx->nbytes;
+
+    rc = ngx_http_lua_io_copy_range(ctx, src, ctx->offset, size, log);
+
+    ctx->offset += ctx->nbytes - nbytes;
+
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "lua io thread copy \"%s\" %O bytes, rc:%i, @%O",
+                   ctx->path, (off_t) ctx->nbytes - nbytes, rc, ctx->offset);
+
+    if (rc == NGX_DONE || ctx->offset >= ctx->file_size) {
+        ctx->eof = 1;
+    }
+
+done:
+
+    ctx->create = 0;
+
+    if (ctx->fd != NGX_INVALID_FILE) {
+        if (ngx_close_file(ctx->fd) == NGX_FILE_ERROR && ctx->err == 0) {
+            ctx->err = ngx_errno;
+        }
+
+        ctx->fd = NGX_INVALID_FILE;
+    }
+
+    if (ngx_close_file(src) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", ctx->path);
+    }
+}
+
+
+void
+ngx_http_lua_io_thread_readv(void *data, ngx_log_t *log)
+{
+    ngx_http_lua_io_thread_ctx_t *ctx = data;
+
+    size_t                    i, j, k, nranges, rest;
+    ssize_t                   n;
+    ngx_http_lua_io_range_t  *ranges;
+#if (NGX_HAVE_PREADV)
+    struct iovec              iovs[NGX_IOVS_PREALLOCATE];
+#endif
+
+    /* ctx->head_size ranges are placed in the array ctx->head */
+
+    ranges = (ngx_http_lua_io_range_t *) ctx->head;
+    nranges = ctx->head_size;
+
+    ctx->err = 0;
+
+    for (i = 0; i < nranges; i = j) {
+        j = i + 1;
+
+        if (ctx->alignment) {
+
+            /* the unaligned ranges are read one by one with the bounce */
+
+            ctx->buf = ranges[i].buf;
+            ctx->size = ranges[i].size;
+            ctx->offset = ranges[i].offset;
+            ctx->nbytes = 0;
+
+            ngx_http_lua_io_thread_read_file(ctx, log);
+
+            if (ctx->err) {
+                return;
+            }
+
+            ranges[i].nbytes = ctx->nbytes;
+            continue;
+        }
+
+#if (NGX_HAVE_PREADV)
+
+        /* the ranges adjacent in the file are read by one preadv() */
+
+        while (j < nranges
+               && j - i < NGX_IOVS_PREALLOCATE
+               && ranges[j].offset
+                  == ranges[j - 1].offset + (off_t) ranges[j - 1].size)
+        {
+            j++;
+        }
+
+        for (k = i; k < j; k++) {
+            iovs[k - i].iov_base = ranges[k].buf;
+            iovs[k - i].iov_len = ranges[k].size;
+        }
+
+        n = preadv(ctx->fd, iovs, (int) (j - i), ranges[i].offset);
+
+#else
+
+        n = pread(ctx->fd, ranges[i].buf, ranges[i].size, ranges[i].offset);
+
+#endif
+
+        ngx_log_debug4(NGX_LOG_DEBUG_HTTP, log, 0,
+                       "lua io thread readv %z of %uz range(s) @%O (err: %d)",
+                       n, j - i, ranges[i].offset, n == -1 ? ngx_errno : 0);
+
+        if (n == -1) {
+            ctx->err = ngx_errno;
+            return;
+        }
+
+        /* a short read stops at the end of file */
+
+        rest = (size_t) n;
+
+        for (k = i; k < j; k++) {
+            ranges[k].nbytes = ngx_min(rest, ranges[k].size);
+            rest -= ranges[k].nbytes;
+        }
+    }
+}
+
+
+void
+ngx_http_lua_io_thread_read_backward(void *data, ngx_log_t *log)
+{
+    ngx_http_lua_io_op_t *op = data;
+
+    u_char                        *buf, *p, *q, *last;
+    off_t                          start, end, aligned, top;
+    size_t                         a, cap, len, ncap;
+    ssize_t                        n;
+    ngx_uint_t                     nl;
+    ngx_file_info_t                fi;
+    ngx_http_lua_io_thread_ctx_t  *ctx;
+
+    /*
+     * reads the blocks before ctx->offset (the end of file if it is -1)
+     * one by one, until ctx->size line feeds are seen before the last byte,
+     * the region read is returned in ctx->head and starts at ctx->offset;
+     * ctx->overflow is set instead if the region would exceed ctx->limit
+     */
+
+    ctx = &op->thread_ctx;
+
+    ctx->err = 0;
+    ctx->head = NULL;
+    ctx->head_size = 0;
+
+    end = ctx->offset;
+
+    if (end < 0) {
+        if (ngx_fd_info(ctx->fd, &fi) == NGX_FILE_ERROR) {
+            ctx->err = ngx_errno;
+            return;
+        }
+
+        end = ngx_file_size(&fi);
+    }
+
+    ctx->offset = end;
+    ctx->file_size = end;
+
+    if (end == 0) {
+        return;
+    }
+
+    /*
+     * the blocks are aligned in the file, and the end of the buffer
+     * stands for the aligned end of the region, which keeps the blocks
+     * aligned in the memory for the direct I/O mode as well
+     */
+
+    a = ctx->alignment;
+
+    aligned = ngx_align(end, NGX_HTTP_LUA_IO_BACKWARD_BLOCK_SIZE);
+    start = aligned;
+
+    buf = op->buf;
+    cap = op->buf_size;
+
+    if (cap < NGX_HTTP_LUA_IO_BACKWARD_BLOCK_SIZE
+        || (a && ((uintptr_t) (buf + cap) & (a - 1))))
+    {
+        cap = 0;
+    }
+
+    nl = 0;
+
+    while (start > 0) {
+        len = aligned - start;
+
+        if (len + NGX_HTTP_LUA_IO_BACKWARD_BLOCK_SIZE > cap) {
+            ncap = cap ? 2 * cap : NGX_HTTP_LUA_IO_BACKWARD_BLOCK_SIZE;
+
+            p = a ? ngx_memalign(a, ncap, log) : ngx_alloc(ncap, log);
+            if (p == NULL) {
+                ctx->err = NGX_ENOMEM;
+                return;
+            }
+
+            if (len) {
+                ngx_memcpy(p + ncap - len, buf + cap - len, len);
+            }
+
+            if (op->buf) {
+                ngx_free(op->buf);
+            }
+
+            op->buf = p;
+            op->buf_size = ncap;
+
+            buf = p;
+            cap = ncap;
+        }
+
+        start -= NGX_HTTP_LUA_IO_BACKWARD_BLOCK_SIZE;
+        p = buf + cap - len - NGX_HTTP_LUA_IO_BACKWARD_BLOCK_SIZE;
+
+        n = pread(ctx->fd, p, NGX_HTTP_LUA_IO_BACKWARD_BLOCK_SIZE, start);
+
+        if (n == -1) {
+            if (ngx_errno == NGX_EINTR) {
+                start += NGX_HTTP_LUA_IO_BACKWARD_BLOCK_SIZE;
+                continue;
+            }
+
+            ctx->err = ngx_errno;
+            return;
+        }
+
+        top = ngx_min(start + NGX_HTTP_LUA_IO_BACKWARD_BLOCK_SIZE, end);
+
+        if (start + n < top) {
+
+            /* the file has been truncated meanwhile */
+
+            end = start + n;
+            top = end;
+        }
+
+        /* the line feed in the last byte ends the region, not a line */
+
+        last = p + (top - start);
+
+        if (top == end && last > p) {
+            last--;
+        }
+
+        for (q = p; q < last; q++) {
+            q = memchr(q, LF, last - q);
+            if (q == NULL) {
+                break;
+            }
+
+            nl++;
+        }
+
+        ngx_log_debug4(NGX_LOG_DEBUG_HTTP, log, 0,
+                       "lua io thread read backward %z @%O, "
+                       "lines:%ui of %uz", n, start, nl, ctx->size);
+
+        if (nl >= ctx->size) {
+            break;
+        }
+
+        if (ctx->limit && (size_t) (end - start) > ctx->limit) {
+
+            /* a line longer than the limit, stop before the buffer grows */
+
+            ctx->overflow = 1;
+            return;
+        }
+    }
+
+    ctx->offset = start;
+    ctx->file_size = end;
+    ctx->head = buf + cap - (aligned - start);
+    ctx->head_size = (size_t) (end - start);
+}
+
+
+void
+ngx_http_lua_io_thread_stat(void *data, ngx_log_t *log)
+{
+    ngx_http_lua_io_thread_ctx_t *ctx = data;
+
+#if (NGX_LINUX && defined STATX_BASIC_STATS)
+    int            flags;
+    struct statx   stx;
+#endif
+
+    ctx->err = 0;
+
+#if (NGX_LINUX && defined STATX_BASIC_STATS)
+
+    flags = ctx->dont_sync ? AT_STATX_DONT_SYNC : AT_STATX_SYNC_AS_STAT;
+
+    if (ctx->fd != NGX_INVALID_FILE) {
+        flags |= AT_EMPTY_PATH;
+    }
+
+    if (statx(ctx->fd != NGX_INVALID_FILE ? ctx->fd : AT_FDCWD,
+              ctx->fd != NGX_INVALID_FILE ? "" : (char *) ctx->path,
+              flags, STATX_BASIC_STATS, &stx)
+        == -1)
+    {
+        ctx->err = ngx_errno;
+
+        if (ctx->err != NGX_ENOSYS) {
+            return;
+        }
+
+        /* fall back to stat() and fstat() */
+
+    } else {
+        ngx_memzero(&ctx->info, sizeof(ngx_file_info_t));
+
+        ctx->info.st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+        ctx->info.st_ino = stx.stx_ino;
+        ctx->info.st_mode = stx.stx_mode;
+        ctx->info.st_nlink = stx.stx_nlink;
+        ctx->info.st_uid = stx.stx_uid;
+        ctx->info.st_gid = stx.stx_gid;
+        ctx->info.st_size = stx.stx_size;
+        ctx->info.st_blksize = stx.stx_blksize;
+        ctx->info.st_blocks = stx.stx_blocks;
+        ctx->info.st_atime = stx.stx_atime.tv_sec;
+        ctx->info.st_mtime = stx.stx_mtime.tv_sec;
+        ctx->info.st_ctime = stx.stx_ctime.tv_sec;
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
+                       "lua io thread statx fd:%d size:%O",
+                       ctx->fd, ngx_file_size(&ctx->info));
+
+        return;
+    }
+
+    ctx->err = 0;
+
+#endif
+
+    if (ctx->fd != NGX_INVALID_FILE) {
+        if (ngx_fd_info(ctx->fd, &ctx->info) == NGX_FILE_ERROR) {
+            ctx->err = ngx_errno;
+        }
+
+    } else if (ngx_file_info(ctx->path, &ctx->info) == NGX_FILE_ERROR) {
+        ctx->err = ngx_errno;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, ctx->err,
+                   "lua io thread stat fd:%d size:%O",
+                   ctx->fd, ngx_file_size(&ctx->info));
+}
+
+
+void
+ngx_http_lua_io_thread_growth_check(void *data, ngx_log_t *log)
+{
+    ngx_http_lua_io_thread_ctx_t *ctx = data;
+
+    ngx_file_info_t  fi;
+
+    ctx->err = 0;
+    ctx->valid = 0;
+
+    if (ngx_fd_info(ctx->fd, &ctx->info) == NGX_FILE_ERROR) {
+        ctx->err = ngx_errno;
+        return;
+    }
+
+    /*
+     * a rotation done before the watch was added makes no event,
+     * the name is compared with the descriptor instead
+     */
+
+    if (ngx_file_info(ctx->path, &fi) != NGX_FILE_ERROR
+        && fi.st_dev == ctx->info.st_dev
+        && fi.st_ino == ctx->info.st_ino)
+    {
+        ctx->valid = 1;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "lua io thread growth check fd:%d size:%O valid:%d",
+                   ctx->fd, ngx_file_size(&ctx->info), ctx->valid);
+}
+
+
+void
+ngx_http_lua_io_thread_readdir(void *data, ngx_log_t *log)
+{
+    ngx_http_lua_io_op_t *op = data;
+
+    ssize_t                    n;
+    u_char                    *p, *last;
+    ngx_http_lua_io_dir_t     *dir;
+    ngx_http_lua_io_dirent_t  *de;
+
+#if !(NGX_LINUX)
+    size_t                     len, reclen;
+    struct dirent             *sde;
+#endif
+
+    dir = op->data;
+
+    op->thread_ctx.err = 0;
+    op->thread_ctx.nbytes = 0;
+
+    if (dir->fd == NGX_INVALID_FILE) {
+        dir->fd = ngx_open_file(dir->path, NGX_FILE_RDONLY|O_DIRECTORY,
+                                NGX_FILE_OPEN, 0);
+
+        if (dir->fd == NGX_INVALID_FILE) {
+            op->thread_ctx.err = ngx_errno;
+            return;
+        }
+
+#if !(NGX_LINUX)
+        dir->dir = fdopendir(dir->fd);
+        if (dir->dir == NULL) {
+            op->thread_ctx.err = ngx_errno;
+            (void) ngx_close_file(dir->fd);
+            dir->fd = NGX_INVALID_FILE;
+            return;
+        }
+#endif
+    }
+
+    for ( ;; ) {
+
+#if (NGX_LINUX)
+
+        n = syscall(SYS_getdents64, dir->fd, dir->buf,
+                    NGX_HTTP_LUA_IO_READDIR_BUF_SIZE);
+
+        if (n == -1) {
+            op->thread_ctx.err = ngx_errno;
+            return;
+        }
+
+#else
+
+        /* emulate the batch with readdir(), using the same record layout */
+
+        n = 0;
+
+        /* leave room for the longest possible name */
+
+        while (n + offsetof(ngx_http_lua_io_dirent_t, name) + NAME_MAX + 8
+               <= NGX_HTTP_LUA_IO_READDIR_BUF_SIZE)
+        {
+            ngx_set_errno(0);
+
+            sde = readdir(dir->dir);
+            if (sde == NULL) {
+                if (ngx_errno != 0) {
+                    op->thread_ctx.err = ngx_errno;
+                    return;
+                }
+
+                break;
+            }
+
+            len = ngx_strlen(sde->d_name);
+            reclen = ngx_align(offsetof(ngx_http_lua_io_dirent_t, name)
+                               + len + 1, 8);
+
+            de = (ngx_http_lua_io_dirent_t *) (dir->buf + n);
+
+            de->ino = sde->d_ino;
+            de->off = 0;
+            de->reclen = (unsigned short) reclen;
+#if (NGX_HAVE_D_TYPE)
+            de->type = sde->d_type;
+#else
+            de->type = DT_UNKNOWN;
+#endif
+            ngx_memcpy(de->name, sde->d_name, len + 1);
+
+            n += reclen;
+        }
+
+#endif
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
+                       "lua io thread readdir fd:%d, %z bytes", dir->fd, n);
+
+        op->thread_ctx.nbytes = n;
+
+        if (n == 0) {
+            return;
+        }
+
+        /* read the next batch if there is nothing but "." and ".." */
+
+        p = dir->buf;
+        last = dir->buf + n;
+
+        while (p < last) {
+            de = (ngx_http_lua_io_dirent_t *) p;
+
+            if (!(de->name[0] == '.'
+                  && (de->name[1] == '\0'
+                      || (de->name[1] == '.' && de->name[2] == '\0'))))
+            {
+                return;
+            }
+
+            p += de->reclen;
+        }
+    }
+}
+
+
+void
+ngx_http_lua_io_thread_fs(void *data, ngx_log_t *log)
+{
+    ngx_http_lua_io_thread_ctx_t *ctx = data;
+
+    u_char      *p;
+    size_t       i;
+    ngx_err_t    err, *errs;
+    ngx_int_t    rc;
+
+    ctx->err = 0;
+    ctx->nbytes = 0;
+
+    if (ctx->opcode == NGX_HTTP_LUA_IO_FS_UNLINK) {
+
+        /*
+         * ctx->size names are packed one after another, for a list
+         * the per name errors are saved in the ngx_err_t array ctx->buf
+         */
+
+        errs = (ngx_err_t *) ctx->buf;
+        p = ctx->path;
+
+        for (i = 0; i < ctx->size; i++) {
+            err = 0;
+
+            if (ngx_delete_file(p) == NGX_FILE_ERROR) {
+                err = ngx_errno;
+
+                if (ctx->err == 0) {
+                    ctx->err = err;
+                }
+
+            } else {
+                ctx->nbytes++;
+            }
+
+            if (errs) {
+                errs[i] = err;
+            }
+
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, err,
+                           "lua io thread unlink \"%s\" (err: %d)", p, err);
+
+            p += ngx_strlen(p) + 1;
+        }
+
+        return;
+    }
+
+    switch (ctx->opcode) {
+
+    case NGX_HTTP_LUA_IO_FS_RENAME:
+        rc = ngx_rename_file(ctx->path, ctx->to);
+        break;
+
+    case NGX_HTTP_LUA_IO_FS_MKDIR:
+        rc = ngx_create_dir(ctx->path, ctx->access);
+        break;
+
+    case NGX_HTTP_LUA_IO_FS_RMDIR:
+        rc = ngx_delete_dir(ctx->path);
+        break;
+
+    case NGX_HTTP_LUA_IO_FS_LINK:
+        rc = link((const char *) ctx->path, (const char *) ctx->to);
+        break;
+
+    case NGX_HTTP_LUA_IO_FS_SYMLINK:
+        rc = symlink((const char *) ctx->to, (const char *) ctx->path);
+        break;
+
+    default:
+        rc = NGX_FILE_ERROR;
+        ngx_set_errno(NGX_EINVAL);
+    }
+
+    if (rc == NGX_FILE_ERROR) {
+        ctx->err = ngx_errno;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, log, ctx->err,
+                   "lua io thread fs op:%ui \"%s\" (err: %d)",
+                   ctx->opcode, ctx->path, ctx->err);
+}
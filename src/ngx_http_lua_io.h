@@ -11,6 +11,8 @@
 #include <ngx_http.h>
 #include <ngx_http_lua_common.h>
 
+#include "ngx_http_lua_io_file_cache.h"
+
 
 #ifdef __GNUC__
 #define NGX_LIKELY(x)                               __builtin_expect(!!(x), 1)
@@ -24,6 +26,27 @@
 #define NGX_HTTP_LUA_IO_FT_TASK_POST_ERROR          (1 << 1)
 #define NGX_HTTP_LUA_IO_FT_NO_MEMORY                (1 << 2)
 
+#define NGX_HTTP_LUA_IO_READDIR_BUF_SIZE            32768
+#define NGX_HTTP_LUA_IO_BACKWARD_BLOCK_SIZE         65536
+#define NGX_HTTP_LUA_IO_BACKWARD_LINE_MAX           1048576
+#define NGX_HTTP_LUA_IO_COPY_BUF_SIZE               65536
+
+#define NGX_HTTP_LUA_IO_FS_UNLINK                   1
+#define NGX_HTTP_LUA_IO_FS_RENAME                   2
+#define NGX_HTTP_LUA_IO_FS_MKDIR                    3
+#define NGX_HTTP_LUA_IO_FS_RMDIR                    4
+#define NGX_HTTP_LUA_IO_FS_LINK                     5
+#define NGX_HTTP_LUA_IO_FS_SYMLINK                  6
+
+/* the durability levels of a flush, the stronger one has the larger value */
+#define NGX_HTTP_LUA_IO_SYNC_RANGE                  1
+#define NGX_HTTP_LUA_IO_SYNC_DATA                   2
+#define NGX_HTTP_LUA_IO_SYNC_FULL                   3
+
+
+typedef struct ngx_http_lua_io_op_s  ngx_http_lua_io_op_t;
+typedef struct ngx_http_lua_io_syncer_s  ngx_http_lua_io_syncer_t;
+
 
 typedef struct {
     ngx_fd_t                    fd;
@@ -49,7 +72,35 @@ typedef struct {
 
     ngx_http_lua_co_ctx_t      *coctx;
 
+    ngx_http_lua_io_cached_file_t  *cached_file;
+
+    ngx_str_t                   name;
+    ngx_file_t                 *send_file;
+
+    /* the identity of the opened file, taken by the open task */
+    dev_t                       dev;
+    ngx_file_uniq_t             uniq;
+
+    ngx_uint_t                  ops;
+
+    size_t                      alignment;
+    u_char                     *bounce;
+    size_t                      bounce_size;
+
+    u_char                     *map;
+    size_t                      map_size;
+
+    ngx_http_lua_io_op_t      **ra_ops;
+    ngx_uint_t                  read_ahead;
+    ngx_uint_t                  ra_head;
+    ngx_uint_t                  ra_count;
+    ngx_uint_t                  ra_dropped;
+    size_t                      ra_pos;
+    off_t                       ra_offset;
+    int                         ra_ref;
+
     off_t                       offset;
+    off_t                       read_offset;
 
     int                         whence;
     off_t                       seek_offset;
@@ -57,15 +108,60 @@ typedef struct {
     size_t                      nbytes;
     size_t                      rest;
 
+    ngx_uint_t                  max_lines;
+    size_t                      max_bytes;
+    int                         lines_ref;
+    ngx_uint_t                  lines_next;
+    ngx_uint_t                  lines_n;
+
+    ngx_str_t                   delimiter;
+
+    ngx_connection_t           *notify;
+    ngx_http_lua_co_ctx_t      *growth_coctx;
+    ngx_uint_t                  notify_mask;
+    ngx_int_t                   growth;
+    ngx_http_lua_io_op_t       *growth_op;
+
+    ngx_http_lua_io_syncer_t   *syncer;
+    ngx_queue_t                 sync_queue;
+    ngx_err_t                   sync_err;
+
+    off_t                       dirty_start;
+    off_t                       dirty_end;
+
+    ngx_chain_t                *body_out;
+
     unsigned                    mode;
     unsigned                    ft_type;
 
+    int                         ref;
+
+    unsigned                    cacheable:1;
+    unsigned                    direct:1;
+    unsigned                    mmap:1;
+    unsigned                    nowait:1;
+    unsigned                    opening:1;
     unsigned                    read_waiting:1;
+    unsigned                    growth_checking:1;
+    unsigned                    growth_recheck:1;
+    unsigned                    growth_timedout:1;
+    unsigned                    read_all:1;
+    unsigned                    lines_batch:1;
+    unsigned                    inclusive:1;
+    unsigned                    ra_waiting:1;
+    unsigned                    ra_eof:1;
+    unsigned                    ra_advised:1;
     unsigned                    write_waiting:1;
+    unsigned                    writing_body:1;
     unsigned                    flush_waiting:1;
+    unsigned                    durable:2;
+    unsigned                    syncing:1;
+    unsigned                    sync_failed:1;
     unsigned                    seeking:1;
     unsigned                    closing:1;
     unsigned                    closed:1;
+    unsigned                    osync:1;
+    unsigned                    odsync:1;
     unsigned                    eof:1;
 } ngx_http_lua_io_file_ctx_t;
 
@@ -78,19 +174,148 @@ typedef struct {
 
     u_char                     *buf;
 
+    u_char                     *head;
+    size_t                      head_size;
+
+    u_char                     *path;
+    u_char                     *to;
+    ngx_uint_t                  opcode;
+    ngx_int_t                   mode;
+    ngx_int_t                   create;
+    ngx_uint_t                  access;
+
+    ngx_file_info_t             info;
+    ngx_file_uniq_t             uniq;
+    time_t                      mtime;
+    off_t                       file_size;
+
     ngx_err_t                   err;
     size_t                      nbytes;
     size_t                      size;
+    size_t                      limit;
+
+    ngx_uint_t                  sync_mode;
+    off_t                       sync_size;
 
+    size_t                      alignment;
+    u_char                     *bounce;
+    size_t                      bounce_size;
+
+    u_char                     *map;
+    size_t                      map_size;
+
+    unsigned                    append:1;
+    unsigned                    direct:1;
+    unsigned                    mmap:1;
+    unsigned                    cacheable:1;
+    unsigned                    revalidate:1;
+    unsigned                    valid:1;
+    unsigned                    dont_sync:1;
     unsigned                    flush:1;
     unsigned                    eof:1;
+    unsigned                    overflow:1;
 } ngx_http_lua_io_thread_ctx_t;
 
 
+typedef void (*ngx_http_lua_io_thread_handler_pt)(void *data, ngx_log_t *log);
+typedef int (*ngx_http_lua_io_op_retvals_pt)(ngx_http_request_t *r,
+    ngx_http_lua_io_op_t *op, lua_State *L);
+typedef void (*ngx_http_lua_io_op_release_pt)(ngx_http_lua_io_op_t *op,
+    lua_State *L);
+
+
+/* an operation which owns its thread task and yields the current coroutine */
+
+struct ngx_http_lua_io_op_s {
+    ngx_http_lua_io_thread_ctx_t    thread_ctx;   /* must be the first */
+
+    ngx_thread_task_t              *task;
+    ngx_http_request_t             *request;
+    ngx_http_lua_co_ctx_t          *coctx;
+
+    ngx_http_lua_io_file_ctx_t     *file_ctx;
+    int                             ref;
+    int                             arg_ref;
+
+    ngx_http_lua_io_op_retvals_pt   retvals;
+    ngx_http_lua_io_op_release_pt   release;
+
+    u_char                         *buf;
+    size_t                          buf_size;
+
+    void                           *data;
+
+    unsigned                        ready:1;
+    unsigned                        dropped:1;
+    unsigned                        reading:1;
+    unsigned                        commit:1;
+};
+
+
+/* a range of file:readv(), the data is read into buf */
+
+typedef struct {
+    off_t                       offset;
+    size_t                      size;
+    size_t                      nbytes;
+    u_char                     *buf;
+} ngx_http_lua_io_range_t;
+
+
+/* the same layout as struct linux_dirent64 */
+
+typedef struct {
+    uint64_t                    ino;
+    int64_t                     off;
+    unsigned short              reclen;
+    unsigned char               type;
+    char                        name[1];
+} ngx_http_lua_io_dirent_t;
+
+
+typedef struct {
+    ngx_fd_t                    fd;
+#if !(NGX_LINUX)
+    DIR                        *dir;
+#endif
+
+    u_char                     *path;
+
+    u_char                     *buf;
+    u_char                     *pos;
+    u_char                     *last;
+
+    ngx_http_cleanup_pt        *cleanup;
+
+    unsigned                    busy:1;
+    unsigned                    eof:1;
+} ngx_http_lua_io_dir_t;
+
+
+ngx_int_t ngx_http_lua_io_thread_post_task(ngx_thread_task_t *task,
+    ngx_thread_pool_t *tp, ngx_http_request_t *r);
+ngx_int_t ngx_http_lua_io_thread_post_open_task(
+    ngx_http_lua_io_file_ctx_t *file_ctx, u_char *path, ngx_int_t mode,
+    ngx_int_t create, ngx_uint_t access, ngx_int_t append);
 ngx_int_t ngx_http_lua_io_thread_post_write_task(
     ngx_http_lua_io_file_ctx_t *file_ctx, ngx_chain_t *cl, ngx_int_t flush);
+ngx_int_t ngx_http_lua_io_thread_post_write_body_task(
+    ngx_http_lua_io_file_ctx_t *file_ctx, ngx_chain_t *cl, ngx_int_t append);
 ngx_int_t ngx_http_lua_io_thread_post_read_task(
     ngx_http_lua_io_file_ctx_t *file_ctx, ngx_buf_t *buf);
+ngx_int_t ngx_http_lua_io_thread_post_read_all_task(
+    ngx_http_lua_io_file_ctx_t *file_ctx, ngx_buf_t *buf);
+void ngx_http_lua_io_thread_append(void *data, ngx_log_t *log);
+void ngx_http_lua_io_thread_sync(void *data, ngx_log_t *log);
+void ngx_http_lua_io_thread_read_file(void *data, ngx_log_t *log);
+void ngx_http_lua_io_thread_pwrite(void *data, ngx_log_t *log);
+void ngx_http_lua_io_thread_copy(void *data, ngx_log_t *log);
+void ngx_http_lua_io_thread_readv(void *data, ngx_log_t *log);
+void ngx_http_lua_io_thread_read_backward(void *data, ngx_log_t *log);
+void ngx_http_lua_io_thread_stat(void *data, ngx_log_t *log);
+void ngx_http_lua_io_thread_growth_check(void *data, ngx_log_t *log);
+void ngx_http_lua_io_thread_readdir(void *data, ngx_log_t *log);
+void ngx_http_lua_io_thread_fs(void *data, ngx_log_t *log);
 
 
 #endif /* _NGX_HTTP_LUA_IO_H_INCLUDED_ */
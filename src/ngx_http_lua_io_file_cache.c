@@ -0,0 +1,361 @@
+
+/*
+ * Copyright (C) Alex Zhang
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+#include "ngx_http_lua_io_file_cache.h"
+
+
+static void ngx_http_lua_io_file_cache_cleanup(void *data);
+static void ngx_http_lua_io_file_cache_expire(
+    ngx_http_lua_io_file_cache_t *cache, ngx_uint_t n, ngx_log_t *log);
+static void ngx_http_lua_io_file_cache_remove(
+    ngx_http_lua_io_file_cache_t *cache, ngx_http_lua_io_cached_file_t *file,
+    ngx_log_t *log);
+static void ngx_http_lua_io_file_cache_close(
+    ngx_http_lua_io_cached_file_t *file, ngx_log_t *log);
+static void ngx_http_lua_io_file_cache_rbtree_insert_value(
+    ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node,
+    ngx_rbtree_node_t *sentinel);
+
+
+ngx_http_lua_io_file_cache_t *
+ngx_http_lua_io_file_cache_init(ngx_pool_t *pool, ngx_uint_t max,
+    time_t inactive, time_t valid)
+{
+    ngx_pool_cleanup_t            *cln;
+    ngx_http_lua_io_file_cache_t  *cache;
+
+    cache = ngx_palloc(pool, sizeof(ngx_http_lua_io_file_cache_t));
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    ngx_rbtree_init(&cache->rbtree, &cache->sentinel,
+                    ngx_http_lua_io_file_cache_rbtree_insert_value);
+
+    ngx_queue_init(&cache->expire_queue);
+
+    cache->current = 0;
+    cache->max = max;
+    cache->inactive = inactive;
+    cache->valid = valid;
+
+    cln = ngx_pool_cleanup_add(pool, 0);
+    if (cln == NULL) {
+        return NULL;
+    }
+
+    cln->handler = ngx_http_lua_io_file_cache_cleanup;
+    cln->data = cache;
+
+    return cache;
+}
+
+
+static void
+ngx_http_lua_io_file_cache_cleanup(void *data)
+{
+    ngx_http_lua_io_file_cache_t *cache = data;
+
+    ngx_queue_t                    *q;
+    ngx_http_lua_io_cached_file_t  *file;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_CORE, ngx_cycle->log, 0,
+                   "lua io file cache cleanup");
+
+    for ( ;; ) {
+
+        if (ngx_queue_empty(&cache->expire_queue)) {
+            break;
+        }
+
+        q = ngx_queue_last(&cache->expire_queue);
+        file = ngx_queue_data(q, ngx_http_lua_io_cached_file_t, queue);
+
+        ngx_queue_remove(q);
+        ngx_rbtree_delete(&cache->rbtree, &file->node);
+
+        cache->current--;
+
+        ngx_log_debug1(NGX_LOG_DEBUG_CORE, ngx_cycle->log, 0,
+                       "lua io file cache cleanup: %s", file->name);
+
+        /* the file objects referring this entry have already gone */
+
+        ngx_http_lua_io_file_cache_close(file, ngx_cycle->log);
+    }
+
+    if (cache->current) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                      "%ui items still left in lua io file cache",
+                      cache->current);
+    }
+}
+
+
+ngx_http_lua_io_cached_file_t *
+ngx_http_lua_io_file_cache_lookup(ngx_http_lua_io_file_cache_t *cache,
+    ngx_str_t *name, ngx_log_t *log)
+{
+    ngx_int_t                       rc;
+    uint32_t                        hash;
+    ngx_rbtree_node_t              *node, *sentinel;
+    ngx_http_lua_io_cached_file_t  *file;
+
+    ngx_http_lua_io_file_cache_expire(cache, 1, log);
+
+    hash = ngx_crc32_long(name->data, name->len);
+
+    node = cache->rbtree.root;
+    sentinel = cache->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        file = (ngx_http_lua_io_cached_file_t *) node;
+
+        rc = (name->len == file->len)
+             ? ngx_memcmp(name->data, file->name, name->len)
+             : (ngx_int_t) name->len - (ngx_int_t) file->len;
+
+        if (rc == 0) {
+            file->accessed = ngx_time();
+
+            ngx_queue_remove(&file->queue);
+            ngx_queue_insert_head(&cache->expire_queue, &file->queue);
+
+            ngx_log_debug4(NGX_LOG_DEBUG_CORE, log, 0,
+                           "lua io file cache hit: %s, fd:%d, c:%ui, e:%d",
+                           file->name, file->fd, file->count,
+                           ngx_time() - file->created >= cache->valid);
+
+            return file;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+
+ngx_http_lua_io_cached_file_t *
+ngx_http_lua_io_file_cache_add(ngx_http_lua_io_file_cache_t *cache,
+    ngx_str_t *name, ngx_fd_t fd, ngx_file_info_t *fi, ngx_log_t *log)
+{
+    ngx_http_lua_io_cached_file_t  *file;
+
+    file = ngx_http_lua_io_file_cache_lookup(cache, name, log);
+
+    if (file) {
+
+        if (file->uniq == ngx_file_uniq(fi)
+            && file->mtime == ngx_file_mtime(fi)
+            && file->size == ngx_file_size(fi))
+        {
+            /* the same file was opened by another request meanwhile */
+
+            if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+                ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                              ngx_close_file_n " \"%V\" failed", name);
+            }
+
+            file->created = ngx_time();
+            file->count++;
+
+            return file;
+        }
+
+        ngx_http_lua_io_file_cache_remove(cache, file, log);
+    }
+
+    if (cache->current >= cache->max) {
+        ngx_http_lua_io_file_cache_expire(cache, 0, log);
+    }
+
+    file = ngx_alloc(sizeof(ngx_http_lua_io_cached_file_t) + name->len + 1,
+                     log);
+    if (file == NULL) {
+        return NULL;
+    }
+
+    file->name = (u_char *) file + sizeof(ngx_http_lua_io_cached_file_t);
+    file->len = name->len;
+
+    (void) ngx_cpystrn(file->name, name->data, name->len + 1);
+
+    file->node.key = ngx_crc32_long(name->data, name->len);
+
+    file->fd = fd;
+    file->dev = fi->st_dev;
+    file->uniq = ngx_file_uniq(fi);
+    file->mtime = ngx_file_mtime(fi);
+    file->size = ngx_file_size(fi);
+
+    file->created = ngx_time();
+    file->accessed = file->created;
+
+    file->count = 1;
+    file->close = 0;
+
+    ngx_rbtree_insert(&cache->rbtree, &file->node);
+    ngx_queue_insert_head(&cache->expire_queue, &file->queue);
+
+    cache->current++;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, log, 0,
+                   "lua io file cache add: %s, fd:%d", file->name, fd);
+
+    return file;
+}
+
+
+void
+ngx_http_lua_io_file_cache_release(ngx_http_lua_io_file_cache_t *cache,
+    ngx_http_lua_io_cached_file_t *file, ngx_log_t *log)
+{
+    ngx_log_debug3(NGX_LOG_DEBUG_CORE, log, 0,
+                   "lua io file cache release: %s, fd:%d, c:%ui",
+                   file->name, file->fd, file->count);
+
+    file->count--;
+
+    if (file->count == 0 && file->close) {
+        ngx_http_lua_io_file_cache_close(file, log);
+    }
+}
+
+
+static void
+ngx_http_lua_io_file_cache_expire(ngx_http_lua_io_file_cache_t *cache,
+    ngx_uint_t n, ngx_log_t *log)
+{
+    time_t                          now;
+    ngx_queue_t                    *q;
+    ngx_http_lua_io_cached_file_t  *file;
+
+    now = ngx_time();
+
+    /*
+     * n == 1 deletes one or two inactive files
+     * n == 0 deletes least recently used file by force
+     *        and one or two inactive files
+     */
+
+    while (n < 3) {
+
+        if (ngx_queue_empty(&cache->expire_queue)) {
+            return;
+        }
+
+        q = ngx_queue_last(&cache->expire_queue);
+        file = ngx_queue_data(q, ngx_http_lua_io_cached_file_t, queue);
+
+        if (n++ != 0 && now - file->accessed <= cache->inactive) {
+            return;
+        }
+
+        ngx_log_debug2(NGX_LOG_DEBUG_CORE, log, 0,
+                       "lua io file cache expire: %s, c:%ui",
+                       file->name, file->count);
+
+        ngx_http_lua_io_file_cache_remove(cache, file, log);
+    }
+}
+
+
+static void
+ngx_http_lua_io_file_cache_remove(ngx_http_lua_io_file_cache_t *cache,
+    ngx_http_lua_io_cached_file_t *file, ngx_log_t *log)
+{
+    ngx_queue_remove(&file->queue);
+    ngx_rbtree_delete(&cache->rbtree, &file->node);
+
+    cache->current--;
+
+    if (file->count) {
+
+        /* the descriptor is still used by some file objects */
+
+        file->close = 1;
+        return;
+    }
+
+    ngx_http_lua_io_file_cache_close(file, log);
+}
+
+
+static void
+ngx_http_lua_io_file_cache_close(ngx_http_lua_io_cached_file_t *file,
+    ngx_log_t *log)
+{
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, log, 0,
+                   "lua io file cache close: %s, fd:%d", file->name, file->fd);
+
+    if (ngx_close_file(file->fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", file->name);
+    }
+
+    ngx_free(file);
+}
+
+
+static void
+ngx_http_lua_io_file_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t              **p;
+    ngx_http_lua_io_cached_file_t   *file, *file_temp;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            file = (ngx_http_lua_io_cached_file_t *) node;
+            file_temp = (ngx_http_lua_io_cached_file_t *) temp;
+
+            if (file->len == file_temp->len) {
+                p = (ngx_memcmp(file->name, file_temp->name, file->len) < 0)
+                    ? &temp->left : &temp->right;
+
+            } else {
+                p = (file->len < file_temp->len) ? &temp->left : &temp->right;
+            }
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
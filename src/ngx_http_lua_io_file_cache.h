@@ -0,0 +1,60 @@
+
+/*
+ * Copyright (C) Alex Zhang
+ */
+
+
+#ifndef _NGX_HTTP_LUA_IO_FILE_CACHE_H_INCLUDED_
+#define _NGX_HTTP_LUA_IO_FILE_CACHE_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+typedef struct {
+    ngx_rbtree_node_t           node;
+    ngx_queue_t                 queue;
+
+    u_char                     *name;
+    size_t                      len;
+
+    ngx_fd_t                    fd;
+    dev_t                       dev;
+    ngx_file_uniq_t             uniq;
+    time_t                      mtime;
+    off_t                       size;
+
+    time_t                      created;
+    time_t                      accessed;
+
+    ngx_uint_t                  count;
+
+    unsigned                    close:1;
+} ngx_http_lua_io_cached_file_t;
+
+
+typedef struct {
+    ngx_rbtree_t                rbtree;
+    ngx_rbtree_node_t           sentinel;
+    ngx_queue_t                 expire_queue;
+
+    ngx_uint_t                  current;
+    ngx_uint_t                  max;
+    time_t                      inactive;
+    time_t                      valid;
+} ngx_http_lua_io_file_cache_t;
+
+
+ngx_http_lua_io_file_cache_t *ngx_http_lua_io_file_cache_init(
+    ngx_pool_t *pool, ngx_uint_t max, time_t inactive, time_t valid);
+ngx_http_lua_io_cached_file_t *ngx_http_lua_io_file_cache_lookup(
+    ngx_http_lua_io_file_cache_t *cache, ngx_str_t *name, ngx_log_t *log);
+ngx_http_lua_io_cached_file_t *ngx_http_lua_io_file_cache_add(
+    ngx_http_lua_io_file_cache_t *cache, ngx_str_t *name, ngx_fd_t fd,
+    ngx_file_info_t *fi, ngx_log_t *log);
+void ngx_http_lua_io_file_cache_release(ngx_http_lua_io_file_cache_t *cache,
+    ngx_http_lua_io_cached_file_t *file, ngx_log_t *log);
+
+
+#endif /* _NGX_HTTP_LUA_IO_FILE_CACHE_H_INCLUDED_ */
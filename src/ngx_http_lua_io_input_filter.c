@@ -8,6 +8,136 @@
 #include "ngx_http_lua_io.h"
 #include "ngx_http_lua_io_input_filter.h"
 
+#if ((defined __x86_64__ || defined __i386__) && defined __SSE2__)
+#include <emmintrin.h>
+#define NGX_HTTP_LUA_IO_HAVE_SSE2  1
+#endif
+
+#if (NGX_HTTP_LUA_IO_HAVE_SSE2 && (__GNUC__ >= 5 || defined __clang__))
+#include <immintrin.h>
+#define NGX_HTTP_LUA_IO_HAVE_AVX2  1
+#endif
+
+
+static u_char *ngx_http_lua_io_find_eol_memchr(u_char *p, u_char *last);
+static u_char *ngx_http_lua_io_find_delimiter(u_char *p, u_char *last,
+    u_char *delim, size_t len);
+#if (NGX_HTTP_LUA_IO_HAVE_SSE2)
+static u_char *ngx_http_lua_io_find_eol_sse2(u_char *p, u_char *last);
+#endif
+#if (NGX_HTTP_LUA_IO_HAVE_AVX2)
+static u_char *ngx_http_lua_io_find_eol_avx2(u_char *p, u_char *last)
+    __attribute__((target("avx2")));
+#endif
+
+
+/* finds the first CR or LF in [p, last), returns last if there is none */
+
+u_char *(*ngx_http_lua_io_find_eol)(u_char *p, u_char *last)
+    = ngx_http_lua_io_find_eol_memchr;
+
+
+void
+ngx_http_lua_io_input_filter_init(void)
+{
+#if (NGX_HTTP_LUA_IO_HAVE_AVX2)
+
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2")) {
+        ngx_http_lua_io_find_eol = ngx_http_lua_io_find_eol_avx2;
+        return;
+    }
+
+#endif
+
+#if (NGX_HTTP_LUA_IO_HAVE_SSE2)
+    ngx_http_lua_io_find_eol = ngx_http_lua_io_find_eol_sse2;
+#endif
+}
+
+
+static u_char *
+ngx_http_lua_io_find_eol_memchr(u_char *p, u_char *last)
+{
+    u_char  *lf, *cr;
+
+    lf = memchr(p, '\n', last - p);
+    if (lf == NULL) {
+        lf = last;
+    }
+
+    cr = memchr(p, '\r', lf - p);
+
+    return cr ? cr : lf;
+}
+
+
+#if (NGX_HTTP_LUA_IO_HAVE_SSE2)
+
+static u_char *
+ngx_http_lua_io_find_eol_sse2(u_char *p, u_char *last)
+{
+    int      mask;
+    __m128i  v, lf, cr;
+
+    lf = _mm_set1_epi8('\n');
+    cr = _mm_set1_epi8('\r');
+
+    while (last - p >= 16) {
+        v = _mm_loadu_si128((const __m128i *) p);
+
+        mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, lf),
+                                              _mm_cmpeq_epi8(v, cr)));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+
+        p += 16;
+    }
+
+    while (p < last) {
+        if (*p == '\n' || *p == '\r') {
+            return p;
+        }
+
+        p++;
+    }
+
+    return last;
+}
+
+#endif
+
+
+#if (NGX_HTTP_LUA_IO_HAVE_AVX2)
+
+static u_char *
+ngx_http_lua_io_find_eol_avx2(u_char *p, u_char *last)
+{
+    int      mask;
+    __m256i  v, lf, cr;
+
+    lf = _mm256_set1_epi8('\n');
+    cr = _mm256_set1_epi8('\r');
+
+    while (last - p >= 32) {
+        v = _mm256_loadu_si256((const __m256i *) p);
+
+        mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, lf),
+                                                    _mm256_cmpeq_epi8(v, cr)));
+        if (mask) {
+            return p + __builtin_ctz((unsigned) mask);
+        }
+
+        p += 32;
+    }
+
+    return ngx_http_lua_io_find_eol_sse2(p, last);
+}
+
+#endif
+
 
 ngx_int_t
 ngx_http_lua_io_read_chunk(void *data, ngx_buf_t *buf, size_t size)
@@ -46,7 +176,8 @@ ngx_http_lua_io_read_line(void *data, ngx_buf_t *buf, size_t size)
 {
     ngx_http_lua_io_file_ctx_t *file_ctx = data;
 
-    u_char               c, *dst;
+    u_char               *p, *dst, *last;
+    size_t                n;
 
 #if (NGX_DEBUG)
     ngx_http_request_t  *r;
@@ -54,6 +185,7 @@ ngx_http_lua_io_read_line(void *data, ngx_buf_t *buf, size_t size)
 
 
     dst = file_ctx->buf_in->buf->last;
+    last = buf->pos + size;
 
 #if (NGX_DEBUG)
 
@@ -64,27 +196,40 @@ ngx_http_lua_io_read_line(void *data, ngx_buf_t *buf, size_t size)
 
 #endif
 
-    while (size--) {
+    for ( ;; ) {
+        p = ngx_http_lua_io_find_eol(buf->pos, last);
 
-        c = *buf->pos++;
+        /* the line is compacted in place, CRs are dropped */
 
-        switch (c) {
-        case '\n':
+        n = p - buf->pos;
+
+        if (dst != buf->pos) {
+            ngx_memmove(dst, buf->pos, n);
+        }
+
+        dst += n;
+
+        if (p == last) {
+            buf->pos = last;
+            break;
+        }
+
+        buf->pos = p + 1;
+
+        /* the CRs and the LF are never submitted, but they are read */
+
+        file_ctx->offset++;
+
+        if (*p == '\n') {
             ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                            "lua io read the final linefeed");
 
             file_ctx->buf_in->buf->last = dst;
 
             return NGX_OK;
-
-        case '\r':
-            /* just ignore this CR */
-            break;
-
-        default:
-            *dst++ = c;
-            break;
         }
+
+        /* just ignore this CR */
     }
 
     file_ctx->buf_in->buf->last = dst;
@@ -103,3 +248,100 @@ ngx_http_lua_io_read_all(void *data, ngx_buf_t *buf, size_t size)
 
     return file_ctx->eof ? NGX_OK : NGX_AGAIN;
 }
+
+
+ngx_int_t
+ngx_http_lua_io_read_until(void *data, ngx_buf_t *buf, size_t size)
+{
+    ngx_http_lua_io_file_ctx_t *file_ctx = data;
+
+    u_char  *p, *dst, *last, *delim;
+    size_t   len, n, tail;
+
+    delim = file_ctx->delimiter.data;
+    len = file_ctx->delimiter.len;
+
+    dst = file_ctx->buf_in->buf->last;
+    last = buf->pos + size;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, file_ctx->request->connection->log, 0,
+                   "lua io read until, delimiter len:%uz got:%uz", len, size);
+
+    p = ngx_http_lua_io_find_delimiter(buf->pos, last, delim, len);
+
+    if (p) {
+        n = p - buf->pos;
+
+        if (file_ctx->inclusive) {
+            n += len;
+
+        } else {
+
+            /* the delimiter is never submitted, but it is read */
+
+            file_ctx->offset += len;
+        }
+
+        if (dst != buf->pos) {
+            ngx_memmove(dst, buf->pos, n);
+        }
+
+        file_ctx->buf_in->buf->last = dst + n;
+        buf->pos = p + len;
+
+        return NGX_OK;
+    }
+
+    /*
+     * the longest tail which might be the beginning of the delimiter
+     * is left in the buffer, it is carried to the next buffer by
+     * ngx_http_lua_io_add_input_buffer() if this one is full
+     */
+
+    tail = 0;
+
+    if (!file_ctx->eof) {
+        for (tail = ngx_min(len - 1, size); tail; tail--) {
+            if (ngx_memcmp(last - tail, delim, tail) == 0) {
+                break;
+            }
+        }
+    }
+
+    n = size - tail;
+
+    if (dst != buf->pos) {
+        ngx_memmove(dst, buf->pos, n);
+    }
+
+    file_ctx->buf_in->buf->last = dst + n;
+    buf->pos += n;
+
+    return file_ctx->eof ? NGX_OK : NGX_AGAIN;
+}
+
+
+static u_char *
+ngx_http_lua_io_find_delimiter(u_char *p, u_char *last, u_char *delim,
+    size_t len)
+{
+    /*
+     * scans for the first byte with memchr(), which is vectorized by libc,
+     * and verifies the rest
+     */
+
+    while ((size_t) (last - p) >= len) {
+        p = memchr(p, delim[0], last - p - len + 1);
+        if (p == NULL) {
+            return NULL;
+        }
+
+        if (ngx_memcmp(p + 1, delim + 1, len - 1) == 0) {
+            return p;
+        }
+
+        p++;
+    }
+
+    return NULL;
+}
@@ -8,9 +8,14 @@
 #define _NGX_HTTP_LUA_IO_INPUT_FILTER_H_INCLUDED_
 
 
+void ngx_http_lua_io_input_filter_init(void);
 ngx_int_t ngx_http_lua_io_read_chunk(void *data, ngx_buf_t *buf, size_t size);
 ngx_int_t ngx_http_lua_io_read_line(void *data, ngx_buf_t *buf, size_t size);
 ngx_int_t ngx_http_lua_io_read_all(void *data, ngx_buf_t *buf, size_t size);
+ngx_int_t ngx_http_lua_io_read_until(void *data, ngx_buf_t *buf, size_t size);
+
+
+extern u_char *(*ngx_http_lua_io_find_eol)(u_char *p, u_char *last);
 
 
 #endif /* _NGX_HTTP_LUA_IO_INPUT_FILTER_H_INCLUDED_ */
@@ -14,6 +14,12 @@
 #include "ngx_http_lua_io.h"
 #include "ngx_http_lua_io_input_filter.h"
 
+#if (NGX_HAVE_INOTIFY)
+#include <sys/inotify.h>
+#endif
+
+#include <setjmp.h>
+
 
 #define NGX_HTTP_LUA_IO_FILE_CTX_INDEX              1
 
@@ -22,6 +28,17 @@
 #define NGX_HTTP_LUA_IO_FILE_APPEND_MODE            (1 << 2)
 #define NGX_HTTP_LUA_IO_FILE_CREATE_MODE            (1 << 3)
 
+#define NGX_HTTP_LUA_IO_APPENDER_SIZE               65536
+#define NGX_HTTP_LUA_IO_APPENDER_MAX_PENDING        (64 * 65536)
+
+#define NGX_HTTP_LUA_IO_GROWN                       1
+#define NGX_HTTP_LUA_IO_TRUNCATED                   2
+#define NGX_HTTP_LUA_IO_ROTATED                     3
+#define NGX_HTTP_LUA_IO_GROWTH_TIMEDOUT             4
+
+/* LuaJIT does not expose the cdata type in lua.h */
+#define NGX_HTTP_LUA_IO_LUA_TCDATA                  10
+
 #define ngx_http_lua_io_check_busy_reading(r, ctx, L)                         \
     if ((ctx)->read_waiting) {                                                \
         lua_pushnil(L);                                                       \
@@ -44,71 +61,418 @@
     }
 
 
+typedef struct {
+    ngx_http_lua_io_file_cache_t  *file_cache;
+} ngx_http_lua_io_main_conf_t;
+
+
 typedef struct {
     ngx_flag_t                  log_errors;
+    ngx_flag_t                  try_nowait;
+    ngx_uint_t                  read_ahead;
     size_t                      read_buf_size;
     size_t                      write_buf_size;
     ngx_http_complex_value_t   *thread_pool;
 } ngx_http_lua_io_loc_conf_t;
 
 
+/* a file appended by the writes of all the requests in the worker */
+
+typedef struct {
+    ngx_queue_t                 queue;
+    ngx_str_t                   name;
+
+    ngx_thread_pool_t          *thread_pool;
+    ngx_thread_task_t          *task;
+    ngx_event_t                 event;
+
+    u_char                     *pending;
+    size_t                      size;
+    size_t                      capacity;
+    ngx_queue_t                 waiters;
+
+    u_char                     *busy_buf;
+    size_t                      busy_capacity;
+    ngx_queue_t                 busy_waiters;
+
+    ngx_chain_t                 chain;
+    ngx_buf_t                   buf;
+
+    unsigned                    fsync:1;
+    unsigned                    busy:1;
+    unsigned                    failed:1;
+} ngx_http_lua_io_appender_t;
+
+
+typedef struct ngx_http_lua_io_appender_waiter_s
+    ngx_http_lua_io_appender_waiter_t;
+
+struct ngx_http_lua_io_appender_waiter_s {
+    ngx_queue_t                         queue;
+    ngx_http_lua_io_appender_waiter_t  *next;
+
+    ngx_http_request_t                 *request;
+    ngx_http_lua_co_ctx_t              *coctx;
+
+    size_t                              size;
+    ngx_int_t                           rc;
+    ngx_err_t                           err;
+};
+
+
+/* the durable flushes of a file (inode) done by the requests of the worker */
+
+struct ngx_http_lua_io_syncer_s {
+    ngx_queue_t                 queue;
+
+    dev_t                       dev;
+    ngx_file_uniq_t             uniq;
+    ngx_fd_t                    fd;
+
+    ngx_thread_pool_t          *thread_pool;
+    ngx_thread_task_t          *task;
+    ngx_event_t                 event;
+
+    ngx_queue_t                 waiters;
+    ngx_queue_t                 busy_waiters;
+
+    /* the strongest durability and the union of the ranges of the waiters */
+    ngx_uint_t                  mode;
+    off_t                       start;
+    off_t                       end;
+
+    unsigned                    busy:1;
+    unsigned                    failed:1;
+};
+
+
 typedef struct {
     ngx_chain_t                *free_read_bufs;
     ngx_chain_t                *free_write_bufs;
+    ngx_chain_t                *free_direct_bufs;
+    ngx_chain_t                *free_send_bufs;
+    ngx_chain_t                *busy_send_bufs;
+    ngx_thread_task_t          *free_ops;
+    ngx_http_lua_io_appender_waiter_t  *free_waiters;
 } ngx_http_lua_io_ctx_t;
 
 
 static char  ngx_http_lua_io_metatable_key;
 static char  ngx_http_lua_io_file_ctx_metatable_key;
+static char  ngx_http_lua_io_dir_metatable_key;
+static char  ngx_http_lua_io_appender_metatable_key;
+static char  ngx_http_lua_io_read_into_key;
+
+static ngx_queue_t  ngx_http_lua_io_appenders;
+static ngx_queue_t  ngx_http_lua_io_syncers;
+static ngx_queue_t  ngx_http_lua_io_free_syncers;
 
 static ngx_str_t  ngx_http_lua_io_thread_pool_default = ngx_string("default");
+
+/*
+ * file:read_into() takes the cdata and the string.buffer objects through
+ * this wrapper, which turns them into pointers by FFI, so the C function
+ * never guesses the payload of a cdata; the object itself is passed along
+ * to be anchored until the read is done.
+ */
+
+static const char  ngx_http_lua_io_read_into_wrapper[] =
+    "local read_into, key = ...\n"
+    "local ffi = require \"ffi\"\n"
+    "local type, select, tostring = type, select, tostring\n"
+    "local getmetatable = getmetatable\n"
+    "local cast, typeof = ffi.cast, ffi.typeof\n"
+    "local buffer_mt\n"
+    "local ok, buffer = pcall(require, \"string.buffer\")\n"
+    "if ok then\n"
+    "    buffer_mt = getmetatable(buffer.new())\n"
+    "end\n"
+    "return function (...)\n"
+    "    local self, buf, size = ...\n"
+    "    if select(\"#\", ...) ~= 3 then\n"
+    "        return read_into(...)\n"
+    "    end\n"
+    "    local t = type(buf)\n"
+    "    if t == \"cdata\" then\n"
+    "        if not tostring(typeof(buf)):find(\"[%*%]]>$\") then\n"
+    "            return read_into(self, nil, size)\n"
+    "        end\n"
+    "        return read_into(self, cast(\"uint8_t *\", buf), size, buf, key)\n"
+    "    end\n"
+    "    if t == \"userdata\" and buffer_mt\n"
+    "       and getmetatable(buf) == buffer_mt\n"
+    "    then\n"
+    "        local p\n"
+    "        if type(size) == \"number\" and size >= 1 then\n"
+    "            p = buf:reserve(size)\n"
+    "        end\n"
+    "        return read_into(self, p, size, buf, key)\n"
+    "    end\n"
+    "    return read_into(...)\n"
+    "end\n";
+
+static ngx_uint_t  ngx_http_lua_io_nowait_hits;
+static ngx_uint_t  ngx_http_lua_io_nowait_misses;
+static ngx_uint_t  ngx_http_lua_io_read_ahead_hits;
+static ngx_uint_t  ngx_http_lua_io_read_ahead_waits;
+static ngx_uint_t  ngx_http_lua_io_fsyncs;
+static ngx_uint_t  ngx_http_lua_io_fsync_flushes;
+/* the guard of the copies from the mapped files, see mapped_copy() */
+
+static sigjmp_buf              ngx_http_lua_io_sigbus_env;
+static u_char *volatile        ngx_http_lua_io_sigbus_start;
+static u_char *volatile        ngx_http_lua_io_sigbus_end;
+static struct sigaction        ngx_http_lua_io_sigbus_action;
+static ngx_uint_t              ngx_http_lua_io_sigbus_set;
+
 static const char*  ngx_http_lua_io_seek_list[] = { "set", "cur", "end", NULL };
 static int  ngx_http_lua_io_seek_enum[] = { SEEK_SET, SEEK_CUR, SEEK_END };
+static const char*  ngx_http_lua_io_sync_list[] = { "full", "data", "range",
+                                                     NULL };
+static ngx_uint_t  ngx_http_lua_io_sync_enum[] = {
+    NGX_HTTP_LUA_IO_SYNC_FULL,
+    NGX_HTTP_LUA_IO_SYNC_DATA,
+    NGX_HTTP_LUA_IO_SYNC_RANGE
+};
 
 
 static int ngx_http_lua_io_open(lua_State *L);
+static int ngx_http_lua_io_stat(lua_State *L);
+static int ngx_http_lua_io_file_stat(lua_State *L);
+static int ngx_http_lua_io_stat_retvals(ngx_http_request_t *r,
+    ngx_http_lua_io_op_t *op, lua_State *L);
+static int ngx_http_lua_io_unlink(lua_State *L);
+static int ngx_http_lua_io_rename(lua_State *L);
+static int ngx_http_lua_io_mkdir(lua_State *L);
+static int ngx_http_lua_io_rmdir(lua_State *L);
+static int ngx_http_lua_io_link(lua_State *L);
+static int ngx_http_lua_io_symlink(lua_State *L);
+static int ngx_http_lua_io_fs_op(lua_State *L, ngx_uint_t opcode);
+static int ngx_http_lua_io_unlink_bulk(ngx_http_request_t *r, lua_State *L);
+static int ngx_http_lua_io_fs_retvals(ngx_http_request_t *r,
+    ngx_http_lua_io_op_t *op, lua_State *L);
+static int ngx_http_lua_io_copy(lua_State *L);
+static int ngx_http_lua_io_copy_retvals(ngx_http_request_t *r,
+    ngx_http_lua_io_op_t *op, lua_State *L);
+static int ngx_http_lua_io_stats(lua_State *L);
+static int ngx_http_lua_io_readdir(lua_State *L);
+static int ngx_http_lua_io_readdir_retvals(ngx_http_request_t *r,
+    ngx_http_lua_io_op_t *op, lua_State *L);
+static int ngx_http_lua_io_readdir_iter(lua_State *L);
+static int ngx_http_lua_io_readdir_iter_retvals(ngx_http_request_t *r,
+    ngx_http_lua_io_op_t *op, lua_State *L);
+static int ngx_http_lua_io_readdir_next(lua_State *L,
+    ngx_http_lua_io_dir_t *dir);
+static void ngx_http_lua_io_readdir_release(ngx_http_lua_io_op_t *op,
+    lua_State *L);
+static void ngx_http_lua_io_dir_cleanup(void *data);
+static void ngx_http_lua_io_dir_close(ngx_http_lua_io_dir_t *dir,
+    ngx_log_t *log);
+static int ngx_http_lua_io_dir_destroy(lua_State *L);
 static int ngx_http_lua_io_file_close(lua_State *L);
 static int ngx_http_lua_io_file_read(lua_State *L);
+static int ngx_http_lua_io_file_read_all(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx, lua_State *L);
+static int ngx_http_lua_io_file_read_all_retvals(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx, lua_State *L);
+static int ngx_http_lua_io_file_read_lines(lua_State *L);
+static int ngx_http_lua_io_file_read_into(lua_State *L);
+static int ngx_http_lua_io_read_into_retvals(ngx_http_request_t *r,
+    ngx_http_lua_io_op_t *op, lua_State *L);
+static int ngx_http_lua_io_buffer_commit(lua_State *L, int index,
+    size_t size);
+static int ngx_http_lua_io_file_pread(lua_State *L);
+static int ngx_http_lua_io_pread_retvals(ngx_http_request_t *r,
+    ngx_http_lua_io_op_t *op, lua_State *L);
+static int ngx_http_lua_io_file_pwrite(lua_State *L);
+static int ngx_http_lua_io_pwrite_retvals(ngx_http_request_t *r,
+    ngx_http_lua_io_op_t *op, lua_State *L);
+static int ngx_http_lua_io_file_readv(lua_State *L);
+static int ngx_http_lua_io_readv_retvals(ngx_http_request_t *r,
+    ngx_http_lua_io_op_t *op, lua_State *L);
+static int ngx_http_lua_io_file_tail(lua_State *L);
+static int ngx_http_lua_io_tail_retvals(ngx_http_request_t *r,
+    ngx_http_lua_io_op_t *op, lua_State *L);
+static int ngx_http_lua_io_file_lines_reverse(lua_State *L);
+static int ngx_http_lua_io_file_lines_reverse_iter(lua_State *L);
+static void ngx_http_lua_io_lines_reverse_release(ngx_http_lua_io_op_t *op,
+    lua_State *L);
+static int ngx_http_lua_io_lines_reverse_retvals(ngx_http_request_t *r,
+    ngx_http_lua_io_op_t *op, lua_State *L);
+static int ngx_http_lua_io_push_lines_backward(lua_State *L,
+    ngx_http_lua_io_thread_ctx_t *ctx, size_t max, off_t *next);
+static int ngx_http_lua_io_file_wait_growth(lua_State *L);
+#if (NGX_HAVE_INOTIFY)
+static ngx_int_t ngx_http_lua_io_notify_init(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx);
+static ngx_int_t ngx_http_lua_io_notify_drain(
+    ngx_http_lua_io_file_ctx_t *file_ctx);
+static ngx_int_t ngx_http_lua_io_growth_post(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx);
+static void ngx_http_lua_io_growth_event_handler(ngx_event_t *ev);
+static ngx_int_t ngx_http_lua_io_growth_check(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx, ngx_file_info_t *fi);
+static void ngx_http_lua_io_notify_handler(ngx_event_t *ev);
+static void ngx_http_lua_io_growth_wakeup(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx, ngx_int_t rc);
+static ngx_int_t ngx_http_lua_io_growth_resume(ngx_http_request_t *r);
+static void ngx_http_lua_io_growth_coctx_cleanup(void *data);
+static int ngx_http_lua_io_growth_retvals(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx, lua_State *L, ngx_int_t rc);
+static void ngx_http_lua_io_notify_close(ngx_http_lua_io_file_ctx_t *file_ctx);
+#endif
+static int ngx_http_lua_io_appender(lua_State *L);
+static ngx_http_lua_io_appender_t *ngx_http_lua_io_appender_create(
+    ngx_http_request_t *r, ngx_str_t *path);
+static int ngx_http_lua_io_appender_write(lua_State *L);
+static void ngx_http_lua_io_appender_event_handler(ngx_event_t *ev);
+static void ngx_http_lua_io_appender_flush(
+    ngx_http_lua_io_appender_t *appender);
+static void ngx_http_lua_io_appender_done(ngx_event_t *ev);
+static ngx_int_t ngx_http_lua_io_appender_resume(ngx_http_request_t *r);
+static void ngx_http_lua_io_appender_coctx_cleanup(void *data);
+static void ngx_http_lua_io_appender_cleanup(void *data);
 static int ngx_http_lua_io_file_write(lua_State *L);
+static ngx_chain_t *ngx_http_lua_io_file_write_direct(ngx_http_request_t *r,
+    lua_State *L, ngx_http_lua_io_file_ctx_t *file_ctx, int type, size_t len,
+    size_t size);
+static int ngx_http_lua_io_file_write_request_body(lua_State *L);
+static ngx_chain_t *ngx_http_lua_io_get_buf(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx, ngx_chain_t **free, size_t size);
+static void ngx_http_lua_io_free_bufs(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx, ngx_chain_t **free, ngx_chain_t *in);
+static int ngx_http_lua_io_file_send(lua_State *L);
+static int ngx_http_lua_io_send_retvals(ngx_http_request_t *r,
+    ngx_http_lua_io_op_t *op, lua_State *L);
+static ngx_file_t *ngx_http_lua_io_get_send_file(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx);
 static int ngx_http_lua_io_file_flush(lua_State *L);
+static ngx_uint_t ngx_http_lua_io_get_sync_mode(lua_State *L, int index,
+    ngx_http_lua_io_file_ctx_t *file_ctx);
+static void ngx_http_lua_io_file_dirty(ngx_http_lua_io_file_ctx_t *file_ctx,
+    off_t start, off_t end);
+static ngx_int_t ngx_http_lua_io_sync_join(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx, ngx_uint_t mode);
+static ngx_http_lua_io_syncer_t *ngx_http_lua_io_syncer_get(
+    ngx_http_lua_io_file_ctx_t *file_ctx);
+static void ngx_http_lua_io_sync_event_handler(ngx_event_t *ev);
+static void ngx_http_lua_io_sync_start(ngx_http_lua_io_syncer_t *syncer);
+static void ngx_http_lua_io_sync_done(ngx_event_t *ev);
+static void ngx_http_lua_io_syncer_release(ngx_http_lua_io_syncer_t *syncer);
+static int ngx_http_lua_io_sync_retvals(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx, lua_State *L);
 static int ngx_http_lua_io_file_seek(lua_State *L);
 static int ngx_http_lua_io_file_lines(lua_State *L);
 static int ngx_http_lua_io_file_lines_iter(lua_State *L);
+static int ngx_http_lua_io_file_read_until(lua_State *L);
+static int ngx_http_lua_io_file_read_until_iter(lua_State *L);
 static int ngx_http_lua_io_file_destory(lua_State *L);
 static void ngx_http_lua_io_file_cleanup(void *data);
 static void ngx_http_lua_io_coctx_cleanup(void *data);
 static void ngx_http_lua_io_file_finalize(ngx_http_request_t *r,
     ngx_http_lua_io_file_ctx_t *ctx);
+static void ngx_http_lua_io_file_close_fd(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *ctx);
+static ngx_http_lua_io_op_t *ngx_http_lua_io_op_create(ngx_http_request_t *r);
+static u_char *ngx_http_lua_io_op_get_buf(ngx_http_lua_io_op_t *op,
+    size_t size);
+static void ngx_http_lua_io_op_cleanup(void *data);
+static size_t ngx_http_lua_io_full_name_len(ngx_str_t *name);
+static u_char *ngx_http_lua_io_copy_full_name(u_char *dst, ngx_str_t *name);
+static void ngx_http_lua_io_op_attach_file(ngx_http_lua_io_op_t *op,
+    lua_State *L, ngx_http_lua_io_file_ctx_t *file_ctx);
+static int ngx_http_lua_io_op_post(ngx_http_request_t *r, lua_State *L,
+    ngx_http_lua_io_op_t *op, ngx_http_lua_io_thread_handler_pt handler,
+    ngx_http_lua_io_op_retvals_pt retvals);
+static void ngx_http_lua_io_op_event_handler(ngx_event_t *ev);
+static ngx_int_t ngx_http_lua_io_op_resume(ngx_http_request_t *r);
+static void ngx_http_lua_io_op_done(ngx_http_request_t *r, lua_State *L,
+    ngx_http_lua_io_op_t *op);
+static void ngx_http_lua_io_op_coctx_cleanup(void *data);
 static void ngx_http_lua_io_thread_event_handler(ngx_event_t *ev);
 static void ngx_http_lua_io_content_wev_handler(ngx_http_request_t *r);
+static void ngx_http_lua_io_thread_task_abandon(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx);
+static void ngx_http_lua_io_abandon_wakeup(ngx_http_request_t *r);
 static ngx_int_t ngx_http_lua_io_resume(ngx_http_request_t *r);
+static ngx_int_t ngx_http_lua_io_run_thread(ngx_http_request_t *r,
+    ngx_http_lua_ctx_t *lctx, ngx_int_t n);
 static void ngx_http_lua_io_before_yield(ngx_http_request_t *r,
     ngx_http_lua_io_file_ctx_t *file_ctx);
+static ngx_http_lua_co_ctx_t *ngx_http_lua_io_prepare_yield(
+    ngx_http_request_t *r, ngx_http_cleanup_pt cleanup, void *data);
+static void ngx_http_lua_io_open_cached_file(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx,
+    ngx_http_lua_io_thread_ctx_t *thread_ctx);
 static ngx_int_t ngx_http_lua_io_prepare_retvals(ngx_http_request_t *r,
     ngx_http_lua_io_file_ctx_t *file_ctx, ngx_http_lua_co_ctx_t *coctx);
+static int ngx_http_lua_io_write_body_retvals(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx, lua_State *L);
 static int ngx_http_lua_io_file_read_helper(ngx_http_request_t *r,
     ngx_http_lua_io_file_ctx_t *file_ctx, lua_State *L);
 static int ngx_http_lua_io_submit_input_data(ngx_http_request_t *r,
     ngx_http_lua_io_file_ctx_t *file_ctx, lua_State *L);
+static int ngx_http_lua_io_submit_lines(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx, lua_State *L);
 static ngx_int_t ngx_http_lua_io_file_do_read(ngx_http_request_t *r,
     ngx_http_lua_io_file_ctx_t *file_ctx);
+static ngx_int_t ngx_http_lua_io_file_read_inline(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx);
+static ngx_int_t ngx_http_lua_io_file_read_mapped(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx);
+#if (NGX_LINUX && defined RWF_NOWAIT)
+static ngx_int_t ngx_http_lua_io_file_read_nowait(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx);
+#endif
+static ngx_int_t ngx_http_lua_io_file_read_ahead(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx);
+static void ngx_http_lua_io_read_ahead_post(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx);
+static void ngx_http_lua_io_read_ahead_event_handler(ngx_event_t *ev);
+static void ngx_http_lua_io_read_ahead_anchor(lua_State *L, int index,
+    ngx_http_lua_io_file_ctx_t *file_ctx);
+static void ngx_http_lua_io_read_ahead_drop(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx);
+static void ngx_http_lua_io_file_drop_read_bufs(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx);
+static void ngx_http_lua_io_read_ahead_unref(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx);
+static ngx_int_t ngx_http_lua_io_file_post_read(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx);
+static ngx_int_t ngx_http_lua_io_mapped_resident(u_char *p, size_t size);
+static ngx_int_t ngx_http_lua_io_mapped_copy(ngx_http_request_t *r,
+    u_char *dst, u_char *src, size_t size);
+static void ngx_http_lua_io_sigbus_handler(int signo, siginfo_t *siginfo,
+    void *ucontext);
 static ngx_int_t ngx_http_lua_io_add_input_buffer(ngx_http_request_t *r,
     ngx_http_lua_io_file_ctx_t *file_ctx);
 static int ngx_http_lua_io_file_do_seek(ngx_http_lua_io_file_ctx_t *file_ctx,
     ngx_http_request_t *r, lua_State *L, off_t offset, int whence);
 static int ngx_http_lua_io_create_module(lua_State *L);
+static void *ngx_http_lua_io_create_main_conf(ngx_conf_t *cf);
+static char *ngx_http_lua_io_init_main_conf(ngx_conf_t *cf, void *conf);
 static void *ngx_http_lua_io_create_loc_conf(ngx_conf_t *cf);
 static char *ngx_http_lua_io_merge_loc_conf(ngx_conf_t *cf, void *parent,
     void *child);
 static char *ngx_http_lua_io_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static char *ngx_http_lua_io_open_file_cache(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
 static ngx_int_t ngx_http_lua_io_extract_mode(ngx_http_lua_io_file_ctx_t *ctx,
     ngx_str_t *mode);
+static ngx_int_t ngx_http_lua_io_extract_open_opts(lua_State *L, int index,
+    ngx_http_lua_io_file_ctx_t *ctx);
 static ngx_int_t ngx_http_lua_io_handle_error(lua_State *L,
     ngx_http_request_t *r, ngx_http_lua_io_file_ctx_t *ctx);
+static void ngx_http_lua_io_push_error(lua_State *L, ngx_err_t err);
 static ngx_int_t ngx_http_lua_io_init(ngx_conf_t *cf);
 
 
+static ngx_conf_num_bounds_t  ngx_http_lua_io_read_ahead_bounds = {
+    ngx_conf_check_num_bounds, 0, 64
+};
+
+
 static ngx_command_t  ngx_http_lua_io_commands[] = {
 
     { ngx_string("lua_io_thread_pool"),
@@ -143,6 +507,29 @@ static ngx_command_t  ngx_http_lua_io_commands[] = {
       offsetof(ngx_http_lua_io_loc_conf_t, write_buf_size),
       NULL },
 
+    { ngx_string("lua_io_try_nowait"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF
+      |NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_lua_io_loc_conf_t, try_nowait),
+      NULL },
+
+    { ngx_string("lua_io_read_ahead"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF
+      |NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_lua_io_loc_conf_t, read_ahead),
+      &ngx_http_lua_io_read_ahead_bounds },
+
+    { ngx_string("lua_io_open_file_cache"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE123,
+      ngx_http_lua_io_open_file_cache,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
     ngx_null_command
 };
 
@@ -151,8 +538,8 @@ static ngx_http_module_t  ngx_http_lua_io_module_ctx = {
     NULL,                                   /* preconfiguration */
     ngx_http_lua_io_init,                   /* postconfiguration */
 
-    NULL,                                   /* create main configuration */
-    NULL,                                   /* init main configuration */
+    ngx_http_lua_io_create_main_conf,       /* create main configuration */
+    ngx_http_lua_io_init_main_conf,         /* init main configuration */
 
     NULL,                                   /* create server configuration */
     NULL,                                   /* merge server configuration */
@@ -211,6 +598,128 @@ ngx_http_lua_io_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 }
 
 
+static char *
+ngx_http_lua_io_open_file_cache(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_http_lua_io_main_conf_t  *iomcf = conf;
+
+    time_t       inactive, valid;
+    ngx_str_t   *value, s;
+    ngx_int_t    max;
+    ngx_uint_t   i;
+
+    if (iomcf->file_cache != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    max = 0;
+    inactive = 60;
+    valid = 60;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "max=", 4) == 0) {
+
+            max = ngx_atoi(value[i].data + 4, value[i].len - 4);
+            if (max <= 0) {
+                goto failed;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "inactive=", 9) == 0) {
+
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+
+            inactive = ngx_parse_time(&s, 1);
+            if (inactive == (time_t) NGX_ERROR) {
+                goto failed;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "valid=", 6) == 0) {
+
+            s.len = value[i].len - 6;
+            s.data = value[i].data + 6;
+
+            valid = ngx_parse_time(&s, 1);
+            if (valid == (time_t) NGX_ERROR) {
+                goto failed;
+            }
+
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "off") == 0) {
+
+            iomcf->file_cache = NULL;
+
+            continue;
+        }
+
+    failed:
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid \"lua_io_open_file_cache\" "
+                           "parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (iomcf->file_cache == NULL) {
+        return NGX_CONF_OK;
+    }
+
+    if (max == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                        "\"lua_io_open_file_cache\" must have the \"max\" "
+                        "parameter");
+        return NGX_CONF_ERROR;
+    }
+
+    iomcf->file_cache = ngx_http_lua_io_file_cache_init(cf->pool, max,
+                                                        inactive, valid);
+    if (iomcf->file_cache == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static void *
+ngx_http_lua_io_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_http_lua_io_main_conf_t  *iomcf;
+
+    iomcf = ngx_pcalloc(cf->pool, sizeof(ngx_http_lua_io_main_conf_t));
+    if (iomcf == NULL) {
+        return NULL;
+    }
+
+    iomcf->file_cache = NGX_CONF_UNSET_PTR;
+
+    return iomcf;
+}
+
+
+static char *
+ngx_http_lua_io_init_main_conf(ngx_conf_t *cf, void *conf)
+{
+    ngx_http_lua_io_main_conf_t *iomcf = conf;
+
+    ngx_conf_init_ptr_value(iomcf->file_cache, NULL);
+
+    return NGX_CONF_OK;
+}
+
+
 static void *
 ngx_http_lua_io_create_loc_conf(ngx_conf_t *cf)
 {
@@ -232,6 +741,8 @@ ngx_http_lua_io_create_loc_conf(ngx_conf_t *cf)
     iocf->write_buf_size = NGX_CONF_UNSET_SIZE;
     iocf->read_buf_size = NGX_CONF_UNSET_SIZE;
     iocf->log_errors = NGX_CONF_UNSET;
+    iocf->try_nowait = NGX_CONF_UNSET;
+    iocf->read_ahead = NGX_CONF_UNSET_UINT;
 
     return iocf;
 }
@@ -248,6 +759,8 @@ ngx_http_lua_io_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_size_value(conf->write_buf_size, prev->write_buf_size,
                               ngx_pagesize);
     ngx_conf_merge_value(conf->log_errors, prev->log_errors, 0);
+    ngx_conf_merge_value(conf->try_nowait, prev->try_nowait, 0);
+    ngx_conf_merge_uint_value(conf->read_ahead, prev->read_ahead, 0);
 
     if (conf->thread_pool == NULL) {
         conf->thread_pool = prev->thread_pool;
@@ -278,6 +791,8 @@ ngx_http_lua_io_init(ngx_conf_t *cf)
         return NGX_ERROR;
     }
 
+    ngx_http_lua_io_input_filter_init();
+
     return NGX_OK;
 }
 
@@ -285,14 +800,47 @@ ngx_http_lua_io_init(ngx_conf_t *cf)
 static int
 ngx_http_lua_io_create_module(lua_State *L)
 {
-    lua_createtable(L, 0 /* narr */, 2 /* nrec */);
+    lua_createtable(L, 0 /* narr */, 12 /* nrec */);
 
     lua_pushcfunction(L, ngx_http_lua_io_open);
     lua_setfield(L, -2, "open");
 
+    lua_pushcfunction(L, ngx_http_lua_io_stats);
+    lua_setfield(L, -2, "stats");
+
+    lua_pushcfunction(L, ngx_http_lua_io_stat);
+    lua_setfield(L, -2, "stat");
+
+    lua_pushcfunction(L, ngx_http_lua_io_readdir);
+    lua_setfield(L, -2, "readdir");
+
+    lua_pushcfunction(L, ngx_http_lua_io_unlink);
+    lua_setfield(L, -2, "unlink");
+
+    lua_pushcfunction(L, ngx_http_lua_io_rename);
+    lua_setfield(L, -2, "rename");
+
+    lua_pushcfunction(L, ngx_http_lua_io_mkdir);
+    lua_setfield(L, -2, "mkdir");
+
+    lua_pushcfunction(L, ngx_http_lua_io_rmdir);
+    lua_setfield(L, -2, "rmdir");
+
+    lua_pushcfunction(L, ngx_http_lua_io_link);
+    lua_setfield(L, -2, "link");
+
+    lua_pushcfunction(L, ngx_http_lua_io_symlink);
+    lua_setfield(L, -2, "symlink");
+
+    lua_pushcfunction(L, ngx_http_lua_io_copy);
+    lua_setfield(L, -2, "copy");
+
+    lua_pushcfunction(L, ngx_http_lua_io_appender);
+    lua_setfield(L, -2, "appender");
+
     /* io file object metatable */
     lua_pushlightuserdata(L, &ngx_http_lua_io_metatable_key);
-    lua_createtable(L, 0 /* narr */, 6 /* nrec */);
+    lua_createtable(L, 0 /* narr */, 19 /* nrec */);
 
     lua_pushcfunction(L, ngx_http_lua_io_file_close);
     lua_setfield(L, -2, "close");
@@ -300,18 +848,64 @@ ngx_http_lua_io_create_module(lua_State *L)
     lua_pushcfunction(L, ngx_http_lua_io_file_read);
     lua_setfield(L, -2, "read");
 
+    lua_pushcfunction(L, ngx_http_lua_io_file_read_lines);
+    lua_setfield(L, -2, "read_lines");
+
+    if (luaL_loadbuffer(L, ngx_http_lua_io_read_into_wrapper,
+                        sizeof(ngx_http_lua_io_read_into_wrapper) - 1,
+                        "=ngx.io read_into")
+        != 0)
+    {
+        return lua_error(L);
+    }
+
+    lua_pushcfunction(L, ngx_http_lua_io_file_read_into);
+    lua_pushlightuserdata(L, &ngx_http_lua_io_read_into_key);
+    lua_call(L, 2, 1);
+    lua_setfield(L, -2, "read_into");
+
+    lua_pushcfunction(L, ngx_http_lua_io_file_pread);
+    lua_setfield(L, -2, "pread");
+
+    lua_pushcfunction(L, ngx_http_lua_io_file_readv);
+    lua_setfield(L, -2, "readv");
+
+    lua_pushcfunction(L, ngx_http_lua_io_file_tail);
+    lua_setfield(L, -2, "tail");
+
+    lua_pushcfunction(L, ngx_http_lua_io_file_lines_reverse);
+    lua_setfield(L, -2, "lines_reverse");
+
+    lua_pushcfunction(L, ngx_http_lua_io_file_wait_growth);
+    lua_setfield(L, -2, "wait_growth");
+
     lua_pushcfunction(L, ngx_http_lua_io_file_write);
     lua_setfield(L, -2, "write");
 
+    lua_pushcfunction(L, ngx_http_lua_io_file_pwrite);
+    lua_setfield(L, -2, "pwrite");
+
+    lua_pushcfunction(L, ngx_http_lua_io_file_write_request_body);
+    lua_setfield(L, -2, "write_request_body");
+
     lua_pushcfunction(L, ngx_http_lua_io_file_flush);
     lua_setfield(L, -2, "flush");
 
+    lua_pushcfunction(L, ngx_http_lua_io_file_send);
+    lua_setfield(L, -2, "send");
+
     lua_pushcfunction(L, ngx_http_lua_io_file_seek);
     lua_setfield(L, -2, "seek");
 
     lua_pushcfunction(L, ngx_http_lua_io_file_lines);
     lua_setfield(L, -2, "lines");
 
+    lua_pushcfunction(L, ngx_http_lua_io_file_read_until);
+    lua_setfield(L, -2, "read_until");
+
+    lua_pushcfunction(L, ngx_http_lua_io_file_stat);
+    lua_setfield(L, -2, "stat");
+
     lua_pushvalue(L, -1);
     lua_setfield(L, -2, "__index");
 
@@ -326,6 +920,27 @@ ngx_http_lua_io_create_module(lua_State *L)
 
     lua_rawset(L, LUA_REGISTRYINDEX);
 
+    /* directory iterator state metatable */
+    lua_pushlightuserdata(L, &ngx_http_lua_io_dir_metatable_key);
+    lua_createtable(L, 0 /* narr */, 1 /* nrec */);
+
+    lua_pushcfunction(L, ngx_http_lua_io_dir_destroy);
+    lua_setfield(L, -2, "__gc");
+
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
+    /* appender object metatable */
+    lua_pushlightuserdata(L, &ngx_http_lua_io_appender_metatable_key);
+    lua_createtable(L, 0 /* narr */, 2 /* nrec */);
+
+    lua_pushcfunction(L, ngx_http_lua_io_appender_write);
+    lua_setfield(L, -2, "write");
+
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
     return 1;
 }
 
@@ -398,6 +1013,67 @@ ngx_http_lua_io_extract_mode(ngx_http_lua_io_file_ctx_t *ctx,
 }
 
 
+static ngx_int_t
+ngx_http_lua_io_extract_open_opts(lua_State *L, int index,
+    ngx_http_lua_io_file_ctx_t *ctx)
+{
+    lua_Integer  n;
+    ngx_int_t    flags;
+
+    flags = 0;
+
+    lua_getfield(L, index, "direct");
+    ctx->direct = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    lua_getfield(L, index, "mmap");
+    ctx->mmap = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    lua_getfield(L, index, "read_ahead");
+    if (!lua_isnil(L, -1)) {
+        n = lua_tointeger(L, -1);
+
+        if (!lua_isnumber(L, -1) || n < 0 || n > 64) {
+            return luaL_error(L, "bad \"read_ahead\" option");
+        }
+
+        ctx->read_ahead = (ngx_uint_t) n;
+    }
+    lua_pop(L, 1);
+
+#if (NGX_LINUX && defined O_NOATIME)
+    lua_getfield(L, index, "noatime");
+    if (lua_toboolean(L, -1)) {
+        flags |= O_NOATIME;
+    }
+    lua_pop(L, 1);
+#endif
+
+    lua_getfield(L, index, "sync");
+    if (lua_toboolean(L, -1)) {
+        flags |= O_SYNC;
+        ctx->osync = 1;
+    }
+    lua_pop(L, 1);
+
+#if (defined O_DSYNC)
+    lua_getfield(L, index, "dsync");
+    if (lua_toboolean(L, -1)) {
+        flags |= O_DSYNC;
+        ctx->odsync = 1;
+    }
+    lua_pop(L, 1);
+#endif
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ctx->request->connection->log, 0,
+                   "lua io open opts direct:%d mmap:%d flags:%i",
+                   ctx->direct, ctx->mmap, flags);
+
+    return flags;
+}
+
+
 static ngx_thread_pool_t *
 ngx_http_lua_io_get_thread_pool(ngx_http_request_t *r)
 {
@@ -425,31 +1101,38 @@ ngx_http_lua_io_get_thread_pool(ngx_http_request_t *r)
 static int
 ngx_http_lua_io_open(lua_State *L)
 {
-    off_t                        offset;
-    ngx_str_t                    path, modestr;
-    ngx_int_t                    mode, n, create;
-    ngx_http_request_t          *r;
-    ngx_http_cleanup_t          *cln;
-    ngx_http_lua_ctx_t          *ctx;
-    ngx_http_lua_io_ctx_t       *ioctx;
-    ngx_http_lua_io_file_ctx_t  *file_ctx;
+    u_char                         *name;
+    ngx_str_t                       path, modestr;
+    ngx_int_t                       mode, n, create, append, flags, rc;
+    ngx_http_request_t             *r;
+    ngx_http_cleanup_t             *cln;
+    ngx_http_lua_ctx_t             *ctx;
+    ngx_http_lua_io_ctx_t          *ioctx;
+    ngx_http_lua_io_file_ctx_t     *file_ctx;
+    ngx_http_lua_io_loc_conf_t     *iocf;
+    ngx_http_lua_io_main_conf_t    *iomcf;
+    ngx_http_lua_io_cached_file_t  *cached;
 
     n = lua_gettop(L);
 
-    if (NGX_UNLIKELY(n != 1 && n != 2)) {
-        return luaL_error(L, "expecting 1 or 2 arguments, but got %s", n);
+    if (NGX_UNLIKELY(n < 1 || n > 3)) {
+        return luaL_error(L, "expecting 1, 2 or 3 arguments, but got %d", n);
     }
 
-    if (n == 2) {
-        path.data = (u_char *) luaL_checklstring(L, -2, &path.len);
-        modestr.data = (u_char *) luaL_checklstring(L, -1, &modestr.len);
+    path.data = (u_char *) luaL_checklstring(L, 1, &path.len);
+
+    if (n >= 2 && !lua_isnil(L, 2)) {
+        modestr.data = (u_char *) luaL_checklstring(L, 2, &modestr.len);
 
     } else {
-        path.data = (u_char *) luaL_checklstring(L, 1, &path.len);
         modestr.len = 1;
         modestr.data = (u_char *) "r";
     }
 
+    if (n == 3 && !lua_isnil(L, 3)) {
+        luaL_checktype(L, 3, LUA_TTABLE);
+    }
+
     r = ngx_http_lua_get_request(L);
     if (NGX_UNLIKELY(r == NULL)) {
         return luaL_error(L, "no request found");
@@ -477,6 +1160,8 @@ ngx_http_lua_io_open(lua_State *L)
                                |NGX_HTTP_LUA_CONTEXT_SSL_CERT
                                |NGX_HTTP_LUA_CONTEXT_SSL_SESS_FETCH);
 
+    name = path.data;
+
     if (ngx_get_full_name(r->pool, (ngx_str_t *) &ngx_cycle->prefix, &path)
         != NGX_OK)
     {
@@ -507,8 +1192,14 @@ ngx_http_lua_io_open(lua_State *L)
         return luaL_error(L, "no thread pool found");
     }
 
+    iocf = ngx_http_get_module_loc_conf(r, ngx_http_lua_io_module);
+
     file_ctx->request = r;
     file_ctx->fd = NGX_INVALID_FILE;
+    file_ctx->ref = LUA_NOREF;
+    file_ctx->ra_ref = LUA_NOREF;
+    file_ctx->lines_ref = LUA_NOREF;
+    file_ctx->read_ahead = iocf->read_ahead;
 
     cln = ngx_http_lua_cleanup_add(r, 0);
     if (cln == NULL) {
@@ -530,6 +1221,22 @@ ngx_http_lua_io_open(lua_State *L)
         return 2;
     }
 
+    flags = 0;
+
+    if (n == 3 && !lua_isnil(L, 3)) {
+        flags = ngx_http_lua_io_extract_open_opts(L, 3, file_ctx);
+        mode |= flags;
+
+        if (file_ctx->mmap
+            && (file_ctx->mode != NGX_HTTP_LUA_IO_FILE_READ_MODE
+                || file_ctx->direct))
+        {
+            lua_pushnil(L);
+            lua_pushliteral(L, "mmap requires the read only mode");
+            return 2;
+        }
+    }
+
     create = (file_ctx->mode & NGX_HTTP_LUA_IO_FILE_CREATE_MODE) ? O_CREAT : 0;
 
     ngx_log_debug4(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
@@ -538,116 +1245,171 @@ ngx_http_lua_io_open(lua_State *L)
                    (file_ctx->mode & NGX_HTTP_LUA_IO_FILE_WRITE_MODE) != 0,
                    (file_ctx->mode & NGX_HTTP_LUA_IO_FILE_APPEND_MODE) != 0);
 
-    file_ctx->fd = ngx_open_file(path.data, mode, create, S_IRUSR|S_IWUSR|S_IRGRP
-                                 |S_IWGRP|S_IROTH|S_IWOTH);
+    if (path.data == name) {
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "lua io open fd:%d", file_ctx->fd);
+        /* the Lua string might be collected before the open task is done */
 
-    if (file_ctx->fd == NGX_INVALID_FILE) {
-        file_ctx->error = ngx_errno;
-        return ngx_http_lua_io_handle_error(L, r, file_ctx);
+        path.data = ngx_pnalloc(r->pool, path.len + 1);
+        if (path.data == NULL) {
+            return luaL_error(L, "no memory");
+        }
+
+        (void) ngx_cpystrn(path.data, name, path.len + 1);
     }
 
-    if ((file_ctx->mode & NGX_HTTP_LUA_IO_FILE_APPEND_MODE) != 0) {
+    file_ctx->name = path;
 
-        offset = lseek(file_ctx->fd, 0, SEEK_END);
-        if (NGX_UNLIKELY(offset < 0)) {
-            file_ctx->error = ngx_errno;
-            return ngx_http_lua_io_handle_error(L, r, file_ctx);
-        }
+    if (file_ctx->mode != NGX_HTTP_LUA_IO_FILE_READ_MODE
+        || file_ctx->direct
+        || file_ctx->mmap)
+    {
+        /* only the buffered reading of a read only file is prefetched */
 
-        file_ctx->offset = offset;
+        file_ctx->read_ahead = 0;
     }
 
-    return 1;
-}
+    file_ctx->nowait = iocf->try_nowait && !file_ctx->direct
+                       && !file_ctx->mmap && !file_ctx->read_ahead;
 
+    iomcf = ngx_http_get_module_main_conf(r, ngx_http_lua_io_module);
 
-static int
-ngx_http_lua_io_file_close(lua_State *L)
-{
-    ngx_http_request_t          *r;
-    ngx_http_lua_io_file_ctx_t  *ctx;
+    if (iomcf->file_cache
+        && file_ctx->mode == NGX_HTTP_LUA_IO_FILE_READ_MODE
+        && flags == 0
+        && !file_ctx->direct
+        && !file_ctx->mmap)
+    {
+        file_ctx->cacheable = 1;
 
-    if (NGX_UNLIKELY(lua_gettop(L) != 1)) {
-        return luaL_error(L, "expecting only one argument (the object), "
-                          "but got %d", lua_gettop(L));
+        cached = ngx_http_lua_io_file_cache_lookup(iomcf->file_cache, &path,
+                                                   r->connection->log);
+
+        if (cached) {
+            cached->count++;
+            file_ctx->cached_file = cached;
+
+            if (ngx_time() - cached->created < iomcf->file_cache->valid) {
+                file_ctx->fd = cached->fd;
+                file_ctx->dev = cached->dev;
+                file_ctx->uniq = cached->uniq;
+
+                ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                               "lua io open cached fd:%d", file_ctx->fd);
+
+                return 1;
+            }
+        }
     }
 
-    r = ngx_http_lua_get_request(L);
-    if (NGX_UNLIKELY(r == NULL)) {
-        return luaL_error(L, "no request found");
+    append = file_ctx->mode & NGX_HTTP_LUA_IO_FILE_APPEND_MODE;
+
+    rc = ngx_http_lua_io_thread_post_open_task(file_ctx, path.data, mode,
+                                               create, S_IRUSR|S_IWUSR|S_IRGRP
+                                               |S_IWGRP|S_IROTH|S_IWOTH,
+                                               append);
+
+    if (NGX_UNLIKELY(rc == NGX_ERROR)) {
+        return ngx_http_lua_io_handle_error(L, r, file_ctx);
     }
 
-    luaL_checktype(L, 1, LUA_TTABLE);
+    /* anchor the file object until the open task is done */
 
-    lua_rawgeti(L, 1, NGX_HTTP_LUA_IO_FILE_CTX_INDEX);
-    ctx = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    file_ctx->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    file_ctx->opening = 1;
 
-    if (ctx == NULL || ctx->closed) {
-        lua_pushnil(L);
-        lua_pushliteral(L, "closed");
-        return 2;
+    ngx_http_lua_io_before_yield(r, file_ctx);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io open saved co ctx:%p", file_ctx->coctx);
+
+    return lua_yield(L, 0);
+}
+
+
+static int
+ngx_http_lua_io_stat(lua_State *L)
+{
+    int                    n;
+    u_char                *p;
+    ngx_str_t              path;
+    ngx_http_request_t    *r;
+    ngx_http_lua_ctx_t    *ctx;
+    ngx_http_lua_io_op_t  *op;
+
+    n = lua_gettop(L);
+
+    if (NGX_UNLIKELY(n != 1 && n != 2)) {
+        return luaL_error(L, "expecting 1 or 2 arguments, but got %d", n);
     }
 
-    if (ctx->request != r) {
-        return luaL_error(L, "bad request");
+    path.data = (u_char *) luaL_checklstring(L, 1, &path.len);
+
+    if (n == 2 && !lua_isnil(L, 2)) {
+        luaL_checktype(L, 2, LUA_TTABLE);
     }
 
-    ngx_http_lua_io_check_busy_reading(r, ctx, L);
-    ngx_http_lua_io_check_busy_writing(r, ctx, L);
-    ngx_http_lua_io_check_busy_flushing(r, ctx, L);
+    r = ngx_http_lua_get_request(L);
+    if (NGX_UNLIKELY(r == NULL)) {
+        return luaL_error(L, "no request found");
+    }
 
-    if (!ctx->bufs_out) {
-        ngx_http_lua_io_file_finalize(r, ctx);
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+    if (NGX_UNLIKELY(ctx == NULL)) {
+        return luaL_error(L, "no ctx found");
+    }
 
-        if (ctx->ft_type || ctx->error) {
-            return ngx_http_lua_io_handle_error(L, r, ctx);
-        }
+    ngx_http_lua_check_context(L, ctx, NGX_HTTP_LUA_CONTEXT_REWRITE
+                               |NGX_HTTP_LUA_CONTEXT_ACCESS
+                               |NGX_HTTP_LUA_CONTEXT_CONTENT
+                               |NGX_HTTP_LUA_CONTEXT_TIMER
+                               |NGX_HTTP_LUA_CONTEXT_SSL_CERT
+                               |NGX_HTTP_LUA_CONTEXT_SSL_SESS_FETCH);
 
-        lua_pushinteger(L, 1);
-        return 1;
+    op = ngx_http_lua_io_op_create(r);
+    if (NGX_UNLIKELY(op == NULL)) {
+        return luaL_error(L, "no memory");
     }
 
-    /* flush the legacy buffer */
+    /* the Lua string might be collected before the task is done */
 
-    if (NGX_UNLIKELY(ngx_http_lua_io_thread_post_write_task(ctx, ctx->bufs_out,
-                                                            0)
-                     == NGX_ERROR))
-    {
-        return ngx_http_lua_io_handle_error(L, r, ctx);
+    p = ngx_http_lua_io_op_get_buf(op, ngx_http_lua_io_full_name_len(&path));
+    if (NGX_UNLIKELY(p == NULL)) {
+        ngx_http_lua_io_op_done(r, L, op);
+        return luaL_error(L, "no memory");
     }
 
-    ctx->closing = 1;
-    ctx->bufs_out = NULL;
-    ctx->flush_waiting = 1;
+    op->thread_ctx.path = p;
 
-    ngx_http_lua_io_before_yield(r, ctx);
+    (void) ngx_http_lua_io_copy_full_name(p, &path);
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "lua io close flushing saved co ctx:%p", ctx->coctx);
+    if (n == 2 && !lua_isnil(L, 2)) {
+        lua_getfield(L, 2, "dont_sync");
+        op->thread_ctx.dont_sync = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+    }
 
-    return lua_yield(L, 0);
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io stat \"%s\", dont_sync:%d",
+                   op->thread_ctx.path, op->thread_ctx.dont_sync);
+
+    return ngx_http_lua_io_op_post(r, L, op, ngx_http_lua_io_thread_stat,
+                                   ngx_http_lua_io_stat_retvals);
 }
 
 
 static int
-ngx_http_lua_io_file_read(lua_State *L)
+ngx_http_lua_io_file_stat(lua_State *L)
 {
-    int                          n, type;
-    const char                  *p;
-    lua_Integer                  bytes;
-    ngx_str_t                    pat;
+    int                          n;
     ngx_http_request_t          *r;
+    ngx_http_lua_io_op_t        *op;
     ngx_http_lua_io_file_ctx_t  *file_ctx;
-    ngx_http_lua_io_loc_conf_t  *iocf;
 
     n = lua_gettop(L);
+
     if (NGX_UNLIKELY(n != 1 && n != 2)) {
-        return luaL_error(L, "expecting two arguments (including the object), ",
-                          "but got %d", n);
+        return luaL_error(L, "expecting 1 or 2 arguments "
+                          "(including the object), but got %d", n);
     }
 
     r = ngx_http_lua_get_request(L);
@@ -656,22 +1418,16 @@ ngx_http_lua_io_file_read(lua_State *L)
     }
 
     luaL_checktype(L, 1, LUA_TTABLE);
-    lua_rawgeti(L, 1, NGX_HTTP_LUA_IO_FILE_CTX_INDEX);
 
+    if (n == 2 && !lua_isnil(L, 2)) {
+        luaL_checktype(L, 2, LUA_TTABLE);
+    }
+
+    lua_rawgeti(L, 1, NGX_HTTP_LUA_IO_FILE_CTX_INDEX);
     file_ctx = lua_touserdata(L, -1);
     lua_pop(L, 1);
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "lua io write, ctx:%p", file_ctx);
-
-    iocf = ngx_http_get_module_loc_conf(r, ngx_http_lua_io_module);
-
     if (file_ctx == NULL || file_ctx->closed) {
-        if (iocf->log_errors) {
-            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                          "attempt to read data from a closed file object");
-        }
-
         lua_pushnil(L);
         lua_pushliteral(L, "closed");
         return 2;
@@ -681,509 +1437,577 @@ ngx_http_lua_io_file_read(lua_State *L)
         return luaL_error(L, "bad request");
     }
 
-    ngx_http_lua_io_check_busy_reading(r, file_ctx, L);
-    ngx_http_lua_io_check_busy_writing(r, file_ctx, L);
-    ngx_http_lua_io_check_busy_flushing(r, file_ctx, L);
+    op = ngx_http_lua_io_op_create(r);
+    if (NGX_UNLIKELY(op == NULL)) {
+        return luaL_error(L, "no memory");
+    }
 
-    if (NGX_UNLIKELY(!(file_ctx->mode & NGX_HTTP_LUA_IO_FILE_READ_MODE))) {
-        /* FIXME need to be compatible with libc? */
-        lua_pushnil(L);
-        lua_pushliteral(L, "operation not permitted");
-        return 2;
+    if (n == 2 && !lua_isnil(L, 2)) {
+        lua_getfield(L, 2, "dont_sync");
+        op->thread_ctx.dont_sync = lua_toboolean(L, -1);
+        lua_pop(L, 1);
     }
 
-    if (n > 1) {
+    ngx_http_lua_io_op_attach_file(op, L, file_ctx);
 
-        type = lua_type(L, 2);
-        switch (type) {
-        case LUA_TNUMBER:
-            bytes = lua_tointeger(L, 2);
-            if (NGX_UNLIKELY(bytes < 0)) {
-                return luaL_argerror(L, 2, "bad pattern argument");
-            }
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io file stat fd:%d, dont_sync:%d",
+                   op->thread_ctx.fd, op->thread_ctx.dont_sync);
 
-            if (NGX_UNLIKELY(bytes == 0)) {
-                lua_pushliteral(L, "");
-                return 1;
-            }
+    return ngx_http_lua_io_op_post(r, L, op, ngx_http_lua_io_thread_stat,
+                                   ngx_http_lua_io_stat_retvals);
+}
 
-            file_ctx->input_filter = ngx_http_lua_io_read_chunk;
-            file_ctx->rest = (size_t) bytes;
 
-            break;
+static int
+ngx_http_lua_io_stat_retvals(ngx_http_request_t *r, ngx_http_lua_io_op_t *op,
+    lua_State *L)
+{
+    const char       *type;
+    ngx_file_info_t  *fi;
 
-        case LUA_TSTRING:
-            pat.data = (u_char *) luaL_checklstring(L, 2, &pat.len);
-            if (NGX_UNLIKELY(pat.len != 2 || pat.data[0] != '*')) {
-                p = lua_pushfstring(L, "bad pattern argument: %s", pat.data);
-                return luaL_argerror(L, 2, p);
-            }
+    if (op->thread_ctx.err) {
+        lua_pushnil(L);
+        ngx_http_lua_io_push_error(L, op->thread_ctx.err);
+        return 2;
+    }
 
-            switch (pat.data[1]) {
-            case 'l':
-                file_ctx->input_filter = ngx_http_lua_io_read_line;
-                break;
+    fi = &op->thread_ctx.info;
 
-            case 'a':
-                file_ctx->input_filter = ngx_http_lua_io_read_all;
-                break;
+    if (S_ISREG(fi->st_mode)) {
+        type = "file";
 
-            default:
-                p = lua_pushfstring(L, "bad pattern argument: %s", pat.data);
-                return luaL_argerror(L, 2, p);
-            }
+    } else if (S_ISDIR(fi->st_mode)) {
+        type = "directory";
 
-            file_ctx->rest = 0;
-            break;
+    } else if (S_ISLNK(fi->st_mode)) {
+        type = "link";
 
-        default:
-            return luaL_argerror(L, 2, "bad pattern argument");
-        }
+    } else if (S_ISSOCK(fi->st_mode)) {
+        type = "socket";
+
+    } else if (S_ISFIFO(fi->st_mode)) {
+        type = "fifo";
+
+    } else if (S_ISCHR(fi->st_mode)) {
+        type = "char";
+
+    } else if (S_ISBLK(fi->st_mode)) {
+        type = "block";
 
     } else {
-        file_ctx->input_filter = ngx_http_lua_io_read_line;
-        file_ctx->rest = 0;
+        type = "other";
     }
 
-    return ngx_http_lua_io_file_read_helper(r, file_ctx, L);
-}
+    lua_createtable(L, 0 /* narr */, 13 /* nrec */);
 
+    lua_pushstring(L, type);
+    lua_setfield(L, -2, "type");
 
-static int
-ngx_http_lua_io_file_write(lua_State *L)
-{
-    int                          type;
-    size_t                       len, size;
-    u_char                      *p;
-    const char                  *errmsg;
-    ngx_chain_t                 *cl, *out;
-    ngx_buf_t                   *b;
-    ngx_http_lua_io_loc_conf_t  *iocf;
-    ngx_http_lua_io_ctx_t       *ioctx;
-    ngx_http_lua_io_file_ctx_t  *file_ctx;
-    ngx_http_request_t          *r;
+    lua_pushnumber(L, (lua_Number) fi->st_size);
+    lua_setfield(L, -2, "size");
 
-    if (NGX_UNLIKELY(lua_gettop(L) != 2)) {
-        return luaL_error(L, "expecting two arguments (including the object), ",
-                          "but got %d", lua_gettop(L));
-    }
+    lua_pushnumber(L, (lua_Number) fi->st_mtime);
+    lua_setfield(L, -2, "mtime");
 
-    r = ngx_http_lua_get_request(L);
-    if (NGX_UNLIKELY(r == NULL)) {
-        return luaL_error(L, "no request found");
-    }
+    lua_pushnumber(L, (lua_Number) fi->st_atime);
+    lua_setfield(L, -2, "atime");
 
-    luaL_checktype(L, 1, LUA_TTABLE);
-    lua_rawgeti(L, 1, NGX_HTTP_LUA_IO_FILE_CTX_INDEX);
+    lua_pushnumber(L, (lua_Number) fi->st_ctime);
+    lua_setfield(L, -2, "ctime");
 
-    file_ctx = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    lua_pushnumber(L, (lua_Number) fi->st_ino);
+    lua_setfield(L, -2, "ino");
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "lua io write, ctx:%p", file_ctx);
+    lua_pushnumber(L, (lua_Number) fi->st_dev);
+    lua_setfield(L, -2, "dev");
 
-    iocf = ngx_http_get_module_loc_conf(r, ngx_http_lua_io_module);
+    lua_pushinteger(L, (lua_Integer) (fi->st_mode & 07777));
+    lua_setfield(L, -2, "mode");
 
-    if (file_ctx == NULL || file_ctx->closed) {
-        if (iocf->log_errors) {
-            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                          "attempt to write data on a closed file object");
-        }
+    lua_pushinteger(L, (lua_Integer) fi->st_nlink);
+    lua_setfield(L, -2, "nlink");
 
-        lua_pushnil(L);
-        lua_pushliteral(L, "closed");
-        return 2;
-    }
+    lua_pushinteger(L, (lua_Integer) fi->st_uid);
+    lua_setfield(L, -2, "uid");
 
-    if (NGX_UNLIKELY(file_ctx->request != r)) {
-        return luaL_error(L, "bad request");
-    }
+    lua_pushinteger(L, (lua_Integer) fi->st_gid);
+    lua_setfield(L, -2, "gid");
 
-    ngx_http_lua_io_check_busy_reading(r, file_ctx, L);
-    ngx_http_lua_io_check_busy_writing(r, file_ctx, L);
-    ngx_http_lua_io_check_busy_flushing(r, file_ctx, L);
+    lua_pushinteger(L, (lua_Integer) fi->st_blksize);
+    lua_setfield(L, -2, "blksize");
 
-    if (NGX_UNLIKELY(!(file_ctx->mode & NGX_HTTP_LUA_IO_FILE_WRITE_MODE))) {
+    lua_pushnumber(L, (lua_Number) fi->st_blocks);
+    lua_setfield(L, -2, "blocks");
 
-        /* FIXME need to be compatible with libc? */
-        lua_pushnil(L);
-        lua_pushliteral(L, "operation not permitted");
-        return 2;
+    return 1;
+}
+
+
+static int
+ngx_http_lua_io_stats(lua_State *L)
+{
+    if (NGX_UNLIKELY(lua_gettop(L) != 0)) {
+        return luaL_error(L, "expecting no arguments, but got %d",
+                          lua_gettop(L));
     }
 
-    len = 0;
+    lua_createtable(L, 0 /* narr */, 6 /* nrec */);
 
-    type = lua_type(L, 2);
-    switch (type) {
-    case LUA_TNUMBER:
-        /* fallthrough */
-    case LUA_TSTRING:
-        lua_tolstring(L, 2, &len);
-        break;
+    lua_pushnumber(L, (lua_Number) ngx_http_lua_io_nowait_hits);
+    lua_setfield(L, -2, "nowait_hits");
 
-    case LUA_TTABLE:
-        len = ngx_http_lua_calc_strlen_in_table(L, 2, 2, 1 /* strict */);
-        break;
+    lua_pushnumber(L, (lua_Number) ngx_http_lua_io_nowait_misses);
+    lua_setfield(L, -2, "nowait_misses");
 
-    case LUA_TBOOLEAN:
-        if (lua_toboolean(L, 2)) {
-            len = sizeof("true") - 1;
+    lua_pushnumber(L, (lua_Number) ngx_http_lua_io_read_ahead_hits);
+    lua_setfield(L, -2, "read_ahead_hits");
 
-        } else {
-            len = sizeof("false") - 1;
-        }
+    lua_pushnumber(L, (lua_Number) ngx_http_lua_io_read_ahead_waits);
+    lua_setfield(L, -2, "read_ahead_waits");
 
-        break;
+    lua_pushnumber(L, (lua_Number) ngx_http_lua_io_fsyncs);
+    lua_setfield(L, -2, "fsyncs");
 
-    case LUA_TNIL:
-        len = sizeof("nil") - 1;
-        break;
+    lua_pushnumber(L, (lua_Number) ngx_http_lua_io_fsync_flushes);
+    lua_setfield(L, -2, "fsync_flushes");
 
-    default:
-        errmsg = lua_pushfstring(L, "string, number, boolean, nil"
-                                 " or array table expected, got %s",
-                                 lua_typename(L, type));
+    return 1;
+}
 
-        return luaL_argerror(L, 2, errmsg);
-    }
 
-    if (len == 0) {
-        lua_pushinteger(L, 0);
-        return 1;
-    }
+static int
+ngx_http_lua_io_readdir(lua_State *L)
+{
+    u_char                 *p;
+    ngx_str_t               path;
+    ngx_http_request_t     *r;
+    ngx_http_lua_ctx_t     *ctx;
+    ngx_http_cleanup_t     *cln;
+    ngx_http_lua_io_op_t   *op;
+    ngx_http_lua_io_dir_t  *dir;
 
-    out = NULL;
+    if (NGX_UNLIKELY(lua_gettop(L) != 1)) {
+        return luaL_error(L, "expecting 1 argument, but got %d",
+                          lua_gettop(L));
+    }
 
-    ioctx = ngx_http_get_module_ctx(r, ngx_http_lua_io_module);
-    size = iocf->write_buf_size;
+    path.data = (u_char *) luaL_checklstring(L, 1, &path.len);
 
-    if (size == 0) {
-        cl = ngx_http_lua_chain_get_free_buf(r->connection->log, r->pool,
-                                             &ioctx->free_write_bufs, len);
-        if (NGX_UNLIKELY(cl == NULL)) {
-            return luaL_error(L, "no memory");
-        }
+    r = ngx_http_lua_get_request(L);
+    if (NGX_UNLIKELY(r == NULL)) {
+        return luaL_error(L, "no request found");
+    }
 
-        out = cl;
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+    if (NGX_UNLIKELY(ctx == NULL)) {
+        return luaL_error(L, "no ctx found");
+    }
 
-    } else {
-        cl = file_ctx->bufs_out;
-        if (cl == NULL || (size_t) (cl->buf->end - cl->buf->last) < len) {
+    ngx_http_lua_check_context(L, ctx, NGX_HTTP_LUA_CONTEXT_REWRITE
+                               |NGX_HTTP_LUA_CONTEXT_ACCESS
+                               |NGX_HTTP_LUA_CONTEXT_CONTENT
+                               |NGX_HTTP_LUA_CONTEXT_TIMER
+                               |NGX_HTTP_LUA_CONTEXT_SSL_CERT
+                               |NGX_HTTP_LUA_CONTEXT_SSL_SESS_FETCH);
 
-            cl = ngx_http_lua_chain_get_free_buf(r->connection->log, r->pool,
-                                                 &ioctx->free_write_bufs,
-                                                 size > len ? size : len);
+    dir = lua_newuserdata(L, sizeof(ngx_http_lua_io_dir_t));
+    if (NGX_UNLIKELY(dir == NULL)) {
+        return luaL_error(L, "no memory");
+    }
 
-            if (NGX_UNLIKELY(cl == NULL)) {
-                return luaL_error(L, "no memory");
-            }
+    ngx_memzero(dir, sizeof(ngx_http_lua_io_dir_t));
 
-            if (file_ctx->bufs_out) {
-                out = file_ctx->bufs_out;
-            }
+    dir->fd = NGX_INVALID_FILE;
 
-            if (len > size) {
-                if (out) {
-                    out->next = cl;
+    lua_pushlightuserdata(L, &ngx_http_lua_io_dir_metatable_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_setmetatable(L, -2);
 
-                } else {
-                    out = cl;
-                }
+    dir->buf = ngx_alloc(NGX_HTTP_LUA_IO_READDIR_BUF_SIZE, r->connection->log);
+    if (NGX_UNLIKELY(dir->buf == NULL)) {
+        return luaL_error(L, "no memory");
+    }
 
-                file_ctx->bufs_out = NULL;
+    /* the directory is closed with the request, not by the GC */
 
-            } else {
-                file_ctx->bufs_out = cl;
-            }
-        }
+    cln = ngx_http_lua_cleanup_add(r, 0);
+    if (NGX_UNLIKELY(cln == NULL)) {
+        return luaL_error(L, "no memory");
     }
 
-    b = cl->buf;
+    cln->handler = ngx_http_lua_io_dir_cleanup;
+    cln->data = dir;
 
-    switch (type) {
-    case LUA_TNUMBER:
-        /* fallthrough */
-    case LUA_TSTRING:
-        p = (u_char *) lua_tolstring(L, -1, &len);
-        b->last = ngx_copy(b->last, (u_char *) p, len);
-        break;
+    dir->cleanup = &cln->handler;
 
-    case LUA_TTABLE:
-        b->last = ngx_http_lua_copy_str_in_table(L, -1, b->last);
-        break;
+    op = ngx_http_lua_io_op_create(r);
+    if (NGX_UNLIKELY(op == NULL)) {
+        return luaL_error(L, "no memory");
+    }
 
-    case LUA_TBOOLEAN:
-        if (lua_toboolean(L, 2)) {
-            *b->last++ = 't';
-            *b->last++ = 'r';
-            *b->last++ = 'u';
-            *b->last++ = 'e';
+    p = ngx_http_lua_io_op_get_buf(op, ngx_http_lua_io_full_name_len(&path));
+    if (NGX_UNLIKELY(p == NULL)) {
+        ngx_http_lua_io_op_done(r, L, op);
+        return luaL_error(L, "no memory");
+    }
 
-        } else {
-            *b->last++ = 'f';
-            *b->last++ = 'a';
-            *b->last++ = 'l';
-            *b->last++ = 's';
-            *b->last++ = 'e';
-        }
+    dir->path = p;
 
-        break;
+    (void) ngx_http_lua_io_copy_full_name(p, &path);
 
-    case LUA_TNIL:
-        *b->last++ = 'n';
-        *b->last++ = 'i';
-        *b->last++ = 'l';
-        break;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io readdir \"%s\"", dir->path);
 
-    default:
-        return luaL_error(L, "impossible to reach here");
-    }
+    /* anchor the dir object until the first batch is read */
 
-    if (out == NULL) {
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "lua io write cache");
-        lua_pushinteger(L, len);
-        return 1;
-    }
+    op->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    op->data = dir;
+    op->release = ngx_http_lua_io_readdir_release;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "lua io write through");
+    dir->busy = 1;
 
-    if (NGX_UNLIKELY(ngx_http_lua_io_thread_post_write_task(file_ctx, out, 0)
-                     == NGX_ERROR))
-    {
-        return ngx_http_lua_io_handle_error(L, r, file_ctx);
-    }
+    return ngx_http_lua_io_op_post(r, L, op, ngx_http_lua_io_thread_readdir,
+                                   ngx_http_lua_io_readdir_retvals);
+}
 
-    file_ctx->nbytes = 0;
-    for ( /* void */ ; cl; cl = cl->next) {
-        file_ctx->nbytes += ngx_buf_size(cl->buf);
+
+static int
+ngx_http_lua_io_readdir_retvals(ngx_http_request_t *r,
+    ngx_http_lua_io_op_t *op, lua_State *L)
+{
+    if (op->thread_ctx.err) {
+        lua_pushnil(L);
+        ngx_http_lua_io_push_error(L, op->thread_ctx.err);
+        return 2;
     }
 
-    file_ctx->write_waiting = 1;
+    /* the batch is taken and the dir object is released right now */
 
-    ngx_http_lua_io_before_yield(r, file_ctx);
+    ngx_http_lua_io_readdir_release(op, L);
+    op->release = NULL;
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "lua io write saved co ctx:%p", file_ctx->coctx);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, op->ref);
+    lua_pushcclosure(L, ngx_http_lua_io_readdir_iter, 1);
 
-    return lua_yield(L, 0);
+    return 1;
 }
 
 
 static int
-ngx_http_lua_io_file_flush(lua_State *L)
+ngx_http_lua_io_readdir_iter(lua_State *L)
 {
-    int                          n;
-    ngx_int_t                    full;
-    ngx_http_request_t          *r;
-    ngx_http_lua_io_file_ctx_t  *file_ctx;
-    ngx_http_lua_io_loc_conf_t  *iocf;
-
-    n = lua_gettop(L);
-
-    if (NGX_UNLIKELY(n != 1 && n != 2)) {
-        return luaL_error(L, "expecting one or two arguments, but got %d", n);
-    }
+    int                     n;
+    ngx_http_request_t     *r;
+    ngx_http_lua_io_op_t   *op;
+    ngx_http_lua_io_dir_t  *dir;
 
     r = ngx_http_lua_get_request(L);
     if (NGX_UNLIKELY(r == NULL)) {
         return luaL_error(L, "no request found");
     }
 
-    full = 0;
-    if (n == 2) {
-        full = lua_toboolean(L, 1);
-        lua_pop(L, 1);
-    }
-
-    luaL_checktype(L, 1, LUA_TTABLE);
-    lua_rawgeti(L, 1, NGX_HTTP_LUA_IO_FILE_CTX_INDEX);
-
-    file_ctx = lua_touserdata(L, -1);
-    lua_pop(L, 1);
-
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "lua io flush");
-
-    if (file_ctx == NULL || file_ctx->closed) {
-        iocf = ngx_http_get_module_loc_conf(r, ngx_http_lua_io_module);
-        if (iocf->log_errors) {
-            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                          "attempt to flush data on a closed file object");
-        }
+    dir = lua_touserdata(L, lua_upvalueindex(1));
 
+    if (dir->busy) {
         lua_pushnil(L);
-        lua_pushliteral(L, "closed");
+        lua_pushliteral(L, "io busy reading");
         return 2;
     }
 
-    if (NGX_UNLIKELY(r != file_ctx->request)) {
-        lua_pushnil(L);
-        lua_pushliteral(L, "bad request");
-        return 2;
+    n = ngx_http_lua_io_readdir_next(L, dir);
+    if (n) {
+        return n;
     }
 
-    ngx_http_lua_io_check_busy_reading(r, file_ctx, L);
-    ngx_http_lua_io_check_busy_writing(r, file_ctx, L);
-    ngx_http_lua_io_check_busy_flushing(r, file_ctx, L);
-
-    if (NGX_UNLIKELY(!(file_ctx->mode & NGX_HTTP_LUA_IO_FILE_WRITE_MODE))) {
+    if (dir->eof || dir->fd == NGX_INVALID_FILE) {
+        ngx_http_lua_io_dir_close(dir, r->connection->log);
 
-        /* FIXME need to be compatible with libc? */
         lua_pushnil(L);
-        lua_pushliteral(L, "operation not permitted");
-        return 2;
+        return 1;
     }
 
-    if (NGX_UNLIKELY(ngx_http_lua_io_thread_post_write_task(file_ctx,
-                                                            file_ctx->bufs_out,
-                                                            full)
-                     == NGX_ERROR))
-    {
-        return ngx_http_lua_io_handle_error(L, r, file_ctx);
+    op = ngx_http_lua_io_op_create(r);
+    if (NGX_UNLIKELY(op == NULL)) {
+        return luaL_error(L, "no memory");
     }
 
-    ngx_http_lua_io_before_yield(r, file_ctx);
-
-    file_ctx->flush_waiting = 1;
-    file_ctx->bufs_out = NULL;
+    lua_pushvalue(L, lua_upvalueindex(1));
+    op->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    op->data = dir;
+    op->release = ngx_http_lua_io_readdir_release;
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "lua io flush saved co ctx:%p", file_ctx->coctx);
+    dir->busy = 1;
 
-    return lua_yield(L, 0);
+    return ngx_http_lua_io_op_post(r, L, op, ngx_http_lua_io_thread_readdir,
+                                   ngx_http_lua_io_readdir_iter_retvals);
 }
 
 
 static int
-ngx_http_lua_io_file_seek(lua_State *L)
+ngx_http_lua_io_readdir_iter_retvals(ngx_http_request_t *r,
+    ngx_http_lua_io_op_t *op, lua_State *L)
 {
-    off_t                        offset;
-    int                          n, whence, opt;
-    ngx_chain_t                **ll, *cl;
-    ngx_http_request_t          *r;
-    ngx_http_lua_io_ctx_t       *ioctx;
-    ngx_http_lua_io_loc_conf_t  *iocf;
-    ngx_http_lua_io_file_ctx_t  *file_ctx;
+    int                     n;
+    ngx_http_lua_io_dir_t  *dir;
 
-    n = lua_gettop(L);
+    dir = op->data;
 
-    if (NGX_UNLIKELY(n > 3)) {
-        return luaL_error(L, "expecting one, two or three arguments,"
-                          " but got %d", n);
+    if (op->thread_ctx.err) {
+        ngx_http_lua_io_dir_close(dir, r->connection->log);
+
+        lua_pushnil(L);
+        ngx_http_lua_io_push_error(L, op->thread_ctx.err);
+        return 2;
     }
 
-    r = ngx_http_lua_get_request(L);
-    if (NGX_UNLIKELY(r == NULL)) {
-        return luaL_error(L, "no request found");
+    /* the batch is taken and the dir object is released right now */
+
+    ngx_http_lua_io_readdir_release(op, L);
+    op->release = NULL;
+
+    n = ngx_http_lua_io_readdir_next(L, dir);
+    if (n) {
+        return n;
     }
 
-    luaL_checktype(L, 1, LUA_TTABLE);
-    lua_rawgeti(L, 1, NGX_HTTP_LUA_IO_FILE_CTX_INDEX);
+    ngx_http_lua_io_dir_close(dir, r->connection->log);
 
-    file_ctx = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    lua_pushnil(L);
+    return 1;
+}
 
-    whence = SEEK_CUR;
-    offset = 0;
 
-    if (n >= 2) {
-        opt = luaL_checkoption(L, 2, "cur", ngx_http_lua_io_seek_list);
-        whence = ngx_http_lua_io_seek_enum[opt];
+static int
+ngx_http_lua_io_readdir_next(lua_State *L, ngx_http_lua_io_dir_t *dir)
+{
+    const char                *type;
+    ngx_http_lua_io_dirent_t  *de;
 
-        if (n >= 3) {
-            offset = (off_t) luaL_checkinteger(L, 3);
-        }
-    }
+    while (dir->pos < dir->last) {
+        de = (ngx_http_lua_io_dirent_t *) dir->pos;
+        dir->pos += de->reclen;
 
-    if (file_ctx == NULL || file_ctx->closed) {
-        iocf = ngx_http_get_module_loc_conf(r, ngx_http_lua_io_module);
-        if (iocf->log_errors) {
-            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                          "attempt to flush data on a closed file object");
+        if (de->name[0] == '.'
+            && (de->name[1] == '\0'
+                || (de->name[1] == '.' && de->name[2] == '\0')))
+        {
+            continue;
         }
 
-        lua_pushnil(L);
-        lua_pushliteral(L, "closed");
-        return 2;
-    }
+        switch (de->type) {
 
-    ngx_http_lua_io_check_busy_reading(r, file_ctx, L);
-    ngx_http_lua_io_check_busy_writing(r, file_ctx, L);
-    ngx_http_lua_io_check_busy_flushing(r, file_ctx, L);
+        case DT_REG:
+            type = "file";
+            break;
 
-    if (NGX_UNLIKELY(r != file_ctx->request)) {
-        return luaL_error(L, "bad request");
-    }
+        case DT_DIR:
+            type = "directory";
+            break;
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "lua io seek whence:%d offset:%O", whence, offset);
+        case DT_LNK:
+            type = "link";
+            break;
 
-    if (file_ctx->bufs_in) {
+        case DT_SOCK:
+            type = "socket";
+            break;
 
-        /* FIXME keep these buffers and use them in the proper timing? */
+        case DT_FIFO:
+            type = "fifo";
+            break;
 
-        ioctx = ngx_http_get_module_ctx(r, ngx_http_lua_io_module);
+        case DT_CHR:
+            type = "char";
+            break;
 
-        ll = &file_ctx->bufs_in;
-        for (cl = file_ctx->bufs_in; cl; cl = cl->next) {
-            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                           "lua io seek drain read chain:%p next:%p",
-                           cl, cl->next);
+        case DT_BLK:
+            type = "block";
+            break;
 
-            cl->buf->pos = cl->buf->last;
-            ll = &cl->next;
+        default:
+            type = "unknown";
         }
 
-        *ll = ioctx->free_read_bufs;
-        ioctx->free_read_bufs = file_ctx->bufs_in;
+        lua_pushstring(L, de->name);
+        lua_pushstring(L, type);
+        lua_pushnumber(L, (lua_Number) de->ino);
 
-        file_ctx->bufs_in = NULL;
-        file_ctx->buf_in = NULL;
+        return 3;
+    }
 
-        ngx_memzero(&file_ctx->buffer, sizeof(ngx_buf_t));
+    return 0;
+}
+
+
+static void
+ngx_http_lua_io_readdir_release(ngx_http_lua_io_op_t *op, lua_State *L)
+{
+    ngx_http_lua_io_dir_t *dir = op->data;
+
+    /* the path is in the op buffer */
+
+    dir->busy = 0;
+    dir->path = NULL;
+
+    if (op->thread_ctx.err) {
+        return;
     }
 
-    if (file_ctx->bufs_out == NULL) {
-        goto seek;
+    /*
+     * the kernel directory offset has moved past the batch, so it is kept
+     * even if the light thread is gone, for the next call of the iterator
+     */
+
+    dir->pos = dir->buf;
+    dir->last = dir->buf + op->thread_ctx.nbytes;
+    dir->eof = (op->thread_ctx.nbytes == 0);
+}
+
+
+static void
+ngx_http_lua_io_dir_cleanup(void *data)
+{
+    ngx_http_lua_io_dir_t *dir = data;
+
+    dir->cleanup = NULL;
+
+    ngx_http_lua_io_dir_close(dir, ngx_cycle->log);
+}
+
+
+static void
+ngx_http_lua_io_dir_close(ngx_http_lua_io_dir_t *dir, ngx_log_t *log)
+{
+    dir->pos = dir->last;
+    dir->eof = 1;
+
+    if (dir->fd == NGX_INVALID_FILE) {
+        return;
     }
 
-    if (NGX_UNLIKELY(ngx_http_lua_io_thread_post_write_task(file_ctx,
-                                                            file_ctx->bufs_out,
-                                                            0)
-                     == NGX_ERROR))
-    {
-        return ngx_http_lua_io_handle_error(L, r, file_ctx);
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "lua io readdir close fd:%d", dir->fd);
+
+#if (NGX_LINUX)
+    if (ngx_close_file(dir->fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_file_n " failed");
+    }
+#else
+    if (closedir(dir->dir) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_dir_n " failed");
     }
 
-    file_ctx->write_waiting = 1;
-    file_ctx->seeking = 1;
-    file_ctx->bufs_out = NULL;
-    file_ctx->whence = whence;
-    file_ctx->seek_offset = offset;
+    dir->dir = NULL;
+#endif
 
-    ngx_http_lua_io_before_yield(r, file_ctx);
+    dir->fd = NGX_INVALID_FILE;
+}
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "lua io seek saved co ctx:%p", file_ctx->coctx);
 
-    return lua_yield(L, 0);
+static int
+ngx_http_lua_io_dir_destroy(lua_State *L)
+{
+    ngx_http_lua_io_dir_t  *dir;
 
-seek:
+    dir = lua_touserdata(L, 1);
+    if (dir == NULL) {
+        return 0;
+    }
 
-    return ngx_http_lua_io_file_do_seek(file_ctx, r, L, offset, whence);
+    if (dir->cleanup) {
+        *dir->cleanup = NULL;
+        dir->cleanup = NULL;
+    }
+
+    ngx_http_lua_io_dir_close(dir, ngx_cycle->log);
+
+    if (dir->buf) {
+        ngx_free(dir->buf);
+        dir->buf = NULL;
+    }
+
+    return 0;
 }
 
 
 static int
-ngx_http_lua_io_file_lines(lua_State *L)
+ngx_http_lua_io_unlink(lua_State *L)
 {
-    ngx_http_request_t          *r;
+    return ngx_http_lua_io_fs_op(L, NGX_HTTP_LUA_IO_FS_UNLINK);
+}
 
-    if (NGX_UNLIKELY(lua_gettop(L) > 1)) {
-        return luaL_error(L, "expecting one argument, but got %d",
-                          lua_gettop(L));
+
+static int
+ngx_http_lua_io_rename(lua_State *L)
+{
+    return ngx_http_lua_io_fs_op(L, NGX_HTTP_LUA_IO_FS_RENAME);
+}
+
+
+static int
+ngx_http_lua_io_mkdir(lua_State *L)
+{
+    return ngx_http_lua_io_fs_op(L, NGX_HTTP_LUA_IO_FS_MKDIR);
+}
+
+
+static int
+ngx_http_lua_io_rmdir(lua_State *L)
+{
+    return ngx_http_lua_io_fs_op(L, NGX_HTTP_LUA_IO_FS_RMDIR);
+}
+
+
+static int
+ngx_http_lua_io_link(lua_State *L)
+{
+    return ngx_http_lua_io_fs_op(L, NGX_HTTP_LUA_IO_FS_LINK);
+}
+
+
+static int
+ngx_http_lua_io_symlink(lua_State *L)
+{
+    return ngx_http_lua_io_fs_op(L, NGX_HTTP_LUA_IO_FS_SYMLINK);
+}
+
+
+static int
+ngx_http_lua_io_fs_op(lua_State *L, ngx_uint_t opcode)
+{
+    int                    n, nargs;
+    size_t                 size;
+    u_char                *p;
+    ngx_str_t              path, to;
+    ngx_uint_t             access;
+    ngx_http_request_t    *r;
+    ngx_http_lua_ctx_t    *ctx;
+    ngx_http_lua_io_op_t  *op;
+
+    n = lua_gettop(L);
+
+    switch (opcode) {
+
+    case NGX_HTTP_LUA_IO_FS_RENAME:
+    case NGX_HTTP_LUA_IO_FS_LINK:
+    case NGX_HTTP_LUA_IO_FS_SYMLINK:
+        nargs = 2;
+        break;
+
+    case NGX_HTTP_LUA_IO_FS_MKDIR:
+        nargs = (n == 2) ? 2 : 1;
+        break;
+
+    default:
+        nargs = 1;
+    }
+
+    if (NGX_UNLIKELY(n != nargs)) {
+        return luaL_error(L, "expecting %d argument(s), but got %d", nargs,
+                          n);
     }
 
     r = ngx_http_lua_get_request(L);
@@ -1191,628 +2015,6908 @@ ngx_http_lua_io_file_lines(lua_State *L)
         return luaL_error(L, "no request found");
     }
 
-    luaL_checktype(L, -1, LUA_TTABLE);
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+    if (NGX_UNLIKELY(ctx == NULL)) {
+        return luaL_error(L, "no ctx found");
+    }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "lua io file lines created an iterator");
+    ngx_http_lua_check_context(L, ctx, NGX_HTTP_LUA_CONTEXT_REWRITE
+                               |NGX_HTTP_LUA_CONTEXT_ACCESS
+                               |NGX_HTTP_LUA_CONTEXT_CONTENT
+                               |NGX_HTTP_LUA_CONTEXT_TIMER
+                               |NGX_HTTP_LUA_CONTEXT_SSL_CERT
+                               |NGX_HTTP_LUA_CONTEXT_SSL_SESS_FETCH);
 
-    lua_pushcclosure(L, ngx_http_lua_io_file_lines_iter, 1);
-    return 1;
+    if (opcode == NGX_HTTP_LUA_IO_FS_UNLINK && lua_istable(L, 1)) {
+        return ngx_http_lua_io_unlink_bulk(r, L);
+    }
+
+    path.data = (u_char *) luaL_checklstring(L, 1, &path.len);
+    size = ngx_http_lua_io_full_name_len(&path);
+
+    to.len = 0;
+    to.data = NULL;
+    access = 0;
+
+    switch (opcode) {
+
+    case NGX_HTTP_LUA_IO_FS_RENAME:
+    case NGX_HTTP_LUA_IO_FS_LINK:
+        to.data = (u_char *) luaL_checklstring(L, 2, &to.len);
+        size += ngx_http_lua_io_full_name_len(&to);
+        break;
+
+    case NGX_HTTP_LUA_IO_FS_SYMLINK:
+
+        /* the target is stored as is, the link name is resolved */
+
+        to = path;
+        path.data = (u_char *) luaL_checklstring(L, 2, &path.len);
+        size = ngx_http_lua_io_full_name_len(&path) + to.len + 1;
+        break;
+
+    case NGX_HTTP_LUA_IO_FS_MKDIR:
+        access = (n == 2) ? (ngx_uint_t) luaL_checkinteger(L, 2) : 0777;
+        break;
+
+    default:
+        break;
+    }
+
+    op = ngx_http_lua_io_op_create(r);
+    if (NGX_UNLIKELY(op == NULL)) {
+        return luaL_error(L, "no memory");
+    }
+
+    p = ngx_http_lua_io_op_get_buf(op, size);
+    if (NGX_UNLIKELY(p == NULL)) {
+        ngx_http_lua_io_op_done(r, L, op);
+        return luaL_error(L, "no memory");
+    }
+
+    op->thread_ctx.opcode = opcode;
+    op->thread_ctx.access = access;
+    op->thread_ctx.size = 1;
+
+    op->thread_ctx.path = p;
+    p = ngx_http_lua_io_copy_full_name(p, &path);
+
+    if (opcode == NGX_HTTP_LUA_IO_FS_SYMLINK) {
+        op->thread_ctx.to = p;
+        (void) ngx_cpystrn(p, to.data, to.len + 1);
+
+    } else if (to.data) {
+        op->thread_ctx.to = p;
+        (void) ngx_http_lua_io_copy_full_name(p, &to);
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io fs op:%ui \"%s\"", opcode, op->thread_ctx.path);
+
+    return ngx_http_lua_io_op_post(r, L, op, ngx_http_lua_io_thread_fs,
+                                   ngx_http_lua_io_fs_retvals);
 }
 
 
 static int
-ngx_http_lua_io_file_lines_iter(lua_State *L)
+ngx_http_lua_io_unlink_bulk(ngx_http_request_t *r, lua_State *L)
 {
-    ngx_http_request_t          *r;
-    ngx_http_lua_io_file_ctx_t  *file_ctx;
-    ngx_http_lua_io_loc_conf_t  *iocf;
+    int                    i, nelts;
+    size_t                 size, len;
+    u_char                *p;
+    ngx_str_t              path;
+    ngx_http_lua_io_op_t  *op;
 
-    r = ngx_http_lua_get_request(L);
-    if (NGX_UNLIKELY(r == NULL)) {
-        return luaL_error(L, "no request found");
+    nelts = lua_objlen(L, 1);
+
+    if (nelts == 0) {
+        lua_pushinteger(L, 0);
+        return 1;
     }
 
-    lua_rawgeti(L, lua_upvalueindex(1), NGX_HTTP_LUA_IO_FILE_CTX_INDEX);
-    file_ctx = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    size = nelts * sizeof(ngx_err_t);
 
-    if (file_ctx == NULL || file_ctx->closed) {
-        iocf = ngx_http_get_module_loc_conf(r, ngx_http_lua_io_module);
-        if (iocf->log_errors) {
-            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                          "attempt to read a line from a closed file object");
+    for (i = 1; i <= nelts; i++) {
+        lua_rawgeti(L, 1, i);
+
+        path.data = (u_char *) lua_tolstring(L, -1, &len);
+        path.len = len;
+
+        if (path.data == NULL) {
+            return luaL_error(L, "bad path at index %d", i);
         }
 
-        lua_pushnil(L);
-        lua_pushliteral(L, "closed");
-        return 2;
+        size += ngx_http_lua_io_full_name_len(&path);
+        lua_pop(L, 1);
     }
 
-    if(NGX_UNLIKELY(file_ctx->request != r)) {
-        return luaL_error(L, "bad request");
+    op = ngx_http_lua_io_op_create(r);
+    if (NGX_UNLIKELY(op == NULL)) {
+        return luaL_error(L, "no memory");
     }
 
-    ngx_http_lua_io_check_busy_reading(r, file_ctx, L);
-    ngx_http_lua_io_check_busy_writing(r, file_ctx, L);
-    ngx_http_lua_io_check_busy_flushing(r, file_ctx, L);
+    p = ngx_http_lua_io_op_get_buf(op, size);
+    if (NGX_UNLIKELY(p == NULL)) {
+        ngx_http_lua_io_op_done(r, L, op);
+        return luaL_error(L, "no memory");
+    }
 
-    if (NGX_UNLIKELY(!(file_ctx->mode & NGX_HTTP_LUA_IO_FILE_READ_MODE))) {
+    op->thread_ctx.opcode = NGX_HTTP_LUA_IO_FS_UNLINK;
+    op->thread_ctx.size = nelts;
+    op->thread_ctx.buf = p;
 
-        /* FIXME need to be compatible with libc? */
-        lua_pushnil(L);
-        lua_pushliteral(L, "operation not permitted");
-        return 2;
+    p += nelts * sizeof(ngx_err_t);
+    op->thread_ctx.path = p;
+
+    for (i = 1; i <= nelts; i++) {
+        lua_rawgeti(L, 1, i);
+
+        path.data = (u_char *) lua_tolstring(L, -1, &len);
+        path.len = len;
+
+        p = ngx_http_lua_io_copy_full_name(p, &path);
+        lua_pop(L, 1);
     }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "lua io file line iterator called");
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io unlink %d files", nelts);
 
-    file_ctx->input_filter = ngx_http_lua_io_read_line;
-    file_ctx->rest = 0;
+    /* anchor the list, the failed names are looked up from it */
 
-    return ngx_http_lua_io_file_read_helper(r, file_ctx, L);
+    lua_pushvalue(L, 1);
+    op->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    return ngx_http_lua_io_op_post(r, L, op, ngx_http_lua_io_thread_fs,
+                                   ngx_http_lua_io_fs_retvals);
 }
 
 
-static void
-ngx_http_lua_io_coctx_cleanup(void *data)
+static int
+ngx_http_lua_io_fs_retvals(ngx_http_request_t *r, ngx_http_lua_io_op_t *op,
+    lua_State *L)
 {
-    ngx_http_lua_co_ctx_t *coctx = data;
+    size_t      i;
+    ngx_err_t  *errs;
+
+    if (op->ref == LUA_NOREF) {
+
+        /* a single name */
+
+        if (op->thread_ctx.err) {
+            lua_pushnil(L);
+            ngx_http_lua_io_push_error(L, op->thread_ctx.err);
+            return 2;
+        }
+
+        lua_pushinteger(L, 1);
+        return 1;
+    }
+
+    lua_pushinteger(L, (lua_Integer) op->thread_ctx.nbytes);
+
+    if (op->thread_ctx.err == 0) {
+        return 1;
+    }
+
+    errs = (ngx_err_t *) op->thread_ctx.buf;
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, op->ref);
+    lua_createtable(L, 0 /* narr */, 4 /* nrec */);
+
+    for (i = 0; i < op->thread_ctx.size; i++) {
+        if (errs[i] == 0) {
+            continue;
+        }
+
+        lua_rawgeti(L, -2, i + 1);
+        ngx_http_lua_io_push_error(L, errs[i]);
+        lua_rawset(L, -3);
+    }
+
+    lua_remove(L, -2);
+
+    return 2;
+}
+
+
+static int
+ngx_http_lua_io_copy(lua_State *L)
+{
+    int                    n;
+    off_t                  offset, end;
+    size_t                 size, chunk;
+    u_char                *p;
+    ngx_str_t              path, to;
+    lua_Number             num;
+    ngx_http_request_t    *r;
+    ngx_http_lua_ctx_t    *ctx;
+    ngx_http_lua_io_op_t  *op;
+
+    n = lua_gettop(L);
+
+    if (NGX_UNLIKELY(n < 2 || n > 5)) {
+        return luaL_error(L, "expecting 2 to 5 arguments, but got %d", n);
+    }
+
+    r = ngx_http_lua_get_request(L);
+    if (NGX_UNLIKELY(r == NULL)) {
+        return luaL_error(L, "no request found");
+    }
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+    if (NGX_UNLIKELY(ctx == NULL)) {
+        return luaL_error(L, "no ctx found");
+    }
+
+    ngx_http_lua_check_context(L, ctx, NGX_HTTP_LUA_CONTEXT_REWRITE
+                               |NGX_HTTP_LUA_CONTEXT_ACCESS
+                               |NGX_HTTP_LUA_CONTEXT_CONTENT
+                               |NGX_HTTP_LUA_CONTEXT_TIMER
+                               |NGX_HTTP_LUA_CONTEXT_SSL_CERT
+                               |NGX_HTTP_LUA_CONTEXT_SSL_SESS_FETCH);
+
+    path.data = (u_char *) luaL_checklstring(L, 1, &path.len);
+    to.data = (u_char *) luaL_checklstring(L, 2, &to.len);
+
+    offset = 0;
+    end = -1;
+    chunk = 0;
+
+    if (n >= 3 && !lua_isnil(L, 3)) {
+        num = luaL_checknumber(L, 3);
+
+        if (NGX_UNLIKELY(num < 0 || num > NGX_MAX_OFF_T_VALUE)) {
+            return luaL_argerror(L, 3, "bad offset argument");
+        }
+
+        offset = (off_t) num;
+    }
+
+    if (n >= 4 && !lua_isnil(L, 4)) {
+        num = luaL_checknumber(L, 4);
+
+        if (NGX_UNLIKELY(num < 0 || num > NGX_MAX_OFF_T_VALUE - offset)) {
+            return luaL_argerror(L, 4, "bad len argument");
+        }
+
+        end = offset + (off_t) num;
+    }
+
+    if (n == 5) {
+        luaL_checktype(L, 5, LUA_TTABLE);
+
+        lua_getfield(L, 5, "chunk");
+        if (!lua_isnil(L, -1)) {
+            num = lua_tonumber(L, -1);
+
+            if (!lua_isnumber(L, -1) || num < 1
+                || num > NGX_MAX_SIZE_T_VALUE)
+            {
+                return luaL_error(L, "bad \"chunk\" option");
+            }
+
+            chunk = (size_t) num;
+        }
+        lua_pop(L, 1);
+    }
+
+    size = ngx_http_lua_io_full_name_len(&path)
+           + ngx_http_lua_io_full_name_len(&to);
+
+    op = ngx_http_lua_io_op_create(r);
+    if (NGX_UNLIKELY(op == NULL)) {
+        return luaL_error(L, "no memory");
+    }
+
+    p = ngx_http_lua_io_op_get_buf(op, size);
+    if (NGX_UNLIKELY(p == NULL)) {
+        ngx_http_lua_io_op_done(r, L, op);
+        return luaL_error(L, "no memory");
+    }
+
+    op->thread_ctx.path = p;
+    p = ngx_http_lua_io_copy_full_name(p, &path);
+
+    op->thread_ctx.to = p;
+    (void) ngx_http_lua_io_copy_full_name(p, &to);
+
+    op->thread_ctx.offset = offset;
+    op->thread_ctx.file_size = end;
+    op->thread_ctx.size = chunk;
+    op->thread_ctx.create = 1;
+    op->thread_ctx.access = NGX_FILE_DEFAULT_ACCESS;
+
+    ngx_log_debug5(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io copy \"%s\" to \"%s\" @%O:%O, chunk:%uz",
+                   op->thread_ctx.path, op->thread_ctx.to, offset, end,
+                   chunk);
+
+    return ngx_http_lua_io_op_post(r, L, op, ngx_http_lua_io_thread_copy,
+                                   ngx_http_lua_io_copy_retvals);
+}
+
+
+static int
+ngx_http_lua_io_copy_retvals(ngx_http_request_t *r, ngx_http_lua_io_op_t *op,
+    lua_State *L)
+{
+    ngx_thread_pool_t             *tp;
+    ngx_http_lua_io_thread_ctx_t  *thread_ctx;
+
+    thread_ctx = &op->thread_ctx;
+
+    if (thread_ctx->err) {
+        lua_pushnil(L);
+        ngx_http_lua_io_push_error(L, thread_ctx->err);
+        return 2;
+    }
+
+    if (thread_ctx->eof) {
+        lua_pushinteger(L, (lua_Integer) thread_ctx->nbytes);
+        return 1;
+    }
+
+    /*
+     * the next chunk is copied by a new task, which is queued after
+     * the tasks posted in the meantime
+     */
+
+    tp = ngx_http_lua_io_get_thread_pool(r);
+    if (NGX_UNLIKELY(tp == NULL)) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "no thread pool found");
+        return 2;
+    }
+
+    if (NGX_UNLIKELY(ngx_http_lua_io_thread_post_task(op->task, tp, r)
+                     != NGX_OK))
+    {
+        lua_pushnil(L);
+        lua_pushliteral(L, "task post failed");
+        return 2;
+    }
+
+    return -1;
+}
+
+
+static int
+ngx_http_lua_io_file_close(lua_State *L)
+{
+    int                          n;
+    ngx_int_t                    rc;
+    ngx_uint_t                   mode;
+    ngx_http_request_t          *r;
+    ngx_http_lua_io_file_ctx_t  *ctx;
+
+    n = lua_gettop(L);
+
+    if (NGX_UNLIKELY(n != 1 && n != 2)) {
+        return luaL_error(L, "expecting one or two arguments "
+                          "(including the object), but got %d", n);
+    }
+
+    r = ngx_http_lua_get_request(L);
+    if (NGX_UNLIKELY(r == NULL)) {
+        return luaL_error(L, "no request found");
+    }
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    lua_rawgeti(L, 1, NGX_HTTP_LUA_IO_FILE_CTX_INDEX);
+    ctx = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    if (ctx == NULL || ctx->closed) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "closed");
+        return 2;
+    }
+
+    if (ctx->request != r) {
+        return luaL_error(L, "bad request");
+    }
+
+    ngx_http_lua_io_check_busy_reading(r, ctx, L);
+    ngx_http_lua_io_check_busy_writing(r, ctx, L);
+    ngx_http_lua_io_check_busy_flushing(r, ctx, L);
+
+    mode = 0;
+
+    if (n == 2 && (ctx->mode & NGX_HTTP_LUA_IO_FILE_WRITE_MODE)) {
+        mode = ngx_http_lua_io_get_sync_mode(L, 2, ctx);
+    }
+
+    if (!ctx->bufs_out && mode) {
+        rc = ngx_http_lua_io_sync_join(r, ctx, mode);
+
+        if (NGX_UNLIKELY(rc == NGX_ERROR)) {
+            return ngx_http_lua_io_handle_error(L, r, ctx);
+        }
+
+        if (rc == NGX_OK) {
+
+            /* the file is closed once the sync is done */
+
+            ctx->closing = 1;
+            ctx->flush_waiting = 1;
+
+            ngx_http_lua_io_before_yield(r, ctx);
+
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "lua io close syncing saved co ctx:%p",
+                           ctx->coctx);
+
+            return lua_yield(L, 0);
+        }
+    }
+
+    if (!ctx->bufs_out) {
+        ngx_http_lua_io_file_finalize(r, ctx);
+
+        if (ctx->ft_type || ctx->error) {
+            return ngx_http_lua_io_handle_error(L, r, ctx);
+        }
+
+        lua_pushinteger(L, 1);
+        return 1;
+    }
+
+    /* flush the legacy buffer */
+
+    if (NGX_UNLIKELY(ngx_http_lua_io_thread_post_write_task(ctx, ctx->bufs_out,
+                                                            0)
+                     == NGX_ERROR))
+    {
+        return ngx_http_lua_io_handle_error(L, r, ctx);
+    }
+
+    ctx->closing = 1;
+    ctx->durable = mode;
+    ctx->bufs_out = NULL;
+    ctx->flush_waiting = 1;
+
+    ngx_http_lua_io_before_yield(r, ctx);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io close flushing saved co ctx:%p", ctx->coctx);
+
+    return lua_yield(L, 0);
+}
+
+
+static int
+ngx_http_lua_io_file_read(lua_State *L)
+{
+    int                          n, type;
+    const char                  *p;
+    lua_Integer                  bytes;
+    ngx_str_t                    pat;
+    ngx_http_request_t          *r;
+    ngx_http_lua_io_file_ctx_t  *file_ctx;
+    ngx_http_lua_io_loc_conf_t  *iocf;
+
+    n = lua_gettop(L);
+    if (NGX_UNLIKELY(n != 1 && n != 2)) {
+        return luaL_error(L, "expecting two arguments (including the object), ",
+                          "but got %d", n);
+    }
+
+    r = ngx_http_lua_get_request(L);
+    if (NGX_UNLIKELY(r == NULL)) {
+        return luaL_error(L, "no request found");
+    }
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_rawgeti(L, 1, NGX_HTTP_LUA_IO_FILE_CTX_INDEX);
+
+    file_ctx = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io write, ctx:%p", file_ctx);
+
+    iocf = ngx_http_get_module_loc_conf(r, ngx_http_lua_io_module);
+
+    if (file_ctx == NULL || file_ctx->closed) {
+        if (iocf->log_errors) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "attempt to read data from a closed file object");
+        }
+
+        lua_pushnil(L);
+        lua_pushliteral(L, "closed");
+        return 2;
+    }
+
+    if (NGX_UNLIKELY(file_ctx->request != r)) {
+        return luaL_error(L, "bad request");
+    }
+
+    ngx_http_lua_io_check_busy_reading(r, file_ctx, L);
+    ngx_http_lua_io_check_busy_writing(r, file_ctx, L);
+    ngx_http_lua_io_check_busy_flushing(r, file_ctx, L);
+
+    if (NGX_UNLIKELY(!(file_ctx->mode & NGX_HTTP_LUA_IO_FILE_READ_MODE))) {
+        /* FIXME need to be compatible with libc? */
+        lua_pushnil(L);
+        lua_pushliteral(L, "operation not permitted");
+        return 2;
+    }
+
+    if (n > 1) {
+
+        type = lua_type(L, 2);
+        switch (type) {
+        case LUA_TNUMBER:
+            bytes = lua_tointeger(L, 2);
+            if (NGX_UNLIKELY(bytes < 0)) {
+                return luaL_argerror(L, 2, "bad pattern argument");
+            }
+
+            if (NGX_UNLIKELY(bytes == 0)) {
+                lua_pushliteral(L, "");
+                return 1;
+            }
+
+            file_ctx->input_filter = ngx_http_lua_io_read_chunk;
+            file_ctx->rest = (size_t) bytes;
+
+            break;
+
+        case LUA_TSTRING:
+            pat.data = (u_char *) luaL_checklstring(L, 2, &pat.len);
+            if (NGX_UNLIKELY(pat.len != 2 || pat.data[0] != '*')) {
+                p = lua_pushfstring(L, "bad pattern argument: %s", pat.data);
+                return luaL_argerror(L, 2, p);
+            }
+
+            switch (pat.data[1]) {
+            case 'l':
+                file_ctx->input_filter = ngx_http_lua_io_read_line;
+                break;
+
+            case 'a':
+                if (!file_ctx->mmap && !file_ctx->alignment) {
+                    return ngx_http_lua_io_file_read_all(r, file_ctx, L);
+                }
+
+                file_ctx->input_filter = ngx_http_lua_io_read_all;
+                break;
+
+            default:
+                p = lua_pushfstring(L, "bad pattern argument: %s", pat.data);
+                return luaL_argerror(L, 2, p);
+            }
+
+            file_ctx->rest = 0;
+            break;
+
+        default:
+            return luaL_argerror(L, 2, "bad pattern argument");
+        }
+
+    } else {
+        file_ctx->input_filter = ngx_http_lua_io_read_line;
+        file_ctx->rest = 0;
+    }
+
+    file_ctx->max_lines = 0;
+    file_ctx->lines_batch = 0;
+
+    ngx_http_lua_io_read_ahead_anchor(L, 1, file_ctx);
+
+    return ngx_http_lua_io_file_read_helper(r, file_ctx, L);
+}
+
+
+static int
+ngx_http_lua_io_file_read_all(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx, lua_State *L)
+{
+    ngx_buf_t  *b;
+
+    /*
+     * the rest of the file is read into a single buffer by one task,
+     * which sizes the buffer with fstat()
+     */
+
+    b = &file_ctx->buffer;
+
+    if (file_ctx->eof && b->last == b->pos) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    /* the prefetched data is not consumed yet, so just read it again */
+
+    ngx_http_lua_io_read_ahead_drop(r, file_ctx);
+
+    if (NGX_UNLIKELY(ngx_http_lua_io_thread_post_read_all_task(file_ctx, b)
+                     == NGX_ERROR))
+    {
+        return ngx_http_lua_io_handle_error(L, r, file_ctx);
+    }
+
+    file_ctx->read_waiting = 1;
+    file_ctx->read_all = 1;
+
+    ngx_http_lua_io_before_yield(r, file_ctx);
+
+    return lua_yield(L, 0);
+}
+
+
+static int
+ngx_http_lua_io_file_read_all_retvals(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx, lua_State *L)
+{
+    ngx_buf_t                     *b;
+    ngx_http_lua_io_thread_ctx_t  *thread_ctx;
+
+    thread_ctx = file_ctx->thread_task->ctx;
+
+    file_ctx->read_waiting = 0;
+    file_ctx->read_all = 0;
+
+    if (thread_ctx->err) {
+        file_ctx->error = thread_ctx->err;
+        return ngx_http_lua_io_handle_error(L, r, file_ctx);
+    }
+
+    file_ctx->eof = 1;
+    file_ctx->read_offset += thread_ctx->nbytes;
+
+    if (thread_ctx->size == 0) {
+        lua_pushnil(L);
+
+    } else {
+        file_ctx->offset += thread_ctx->size;
+        lua_pushlstring(L, (char *) thread_ctx->buf, thread_ctx->size);
+    }
+
+    if (thread_ctx->buf) {
+        ngx_free(thread_ctx->buf);
+        thread_ctx->buf = NULL;
+    }
+
+    /* the buffered data has been taken */
+
+    b = &file_ctx->buffer;
+
+    b->pos = b->start;
+    b->last = b->start;
+
+    if (file_ctx->bufs_in) {
+        file_ctx->bufs_in->buf->pos = b->start;
+        file_ctx->bufs_in->buf->last = b->start;
+    }
+
+    return 1;
+}
+
+
+static int
+ngx_http_lua_io_file_read_lines(lua_State *L)
+{
+    int                          n;
+    lua_Integer                  max_lines, max_bytes;
+    ngx_http_request_t          *r;
+    ngx_http_lua_io_file_ctx_t  *file_ctx;
+    ngx_http_lua_io_loc_conf_t  *iocf;
+
+    n = lua_gettop(L);
+    if (NGX_UNLIKELY(n != 2 && n != 3)) {
+        return luaL_error(L, "expecting two or three arguments "
+                          "(including the object), but got %d", n);
+    }
+
+    r = ngx_http_lua_get_request(L);
+    if (NGX_UNLIKELY(r == NULL)) {
+        return luaL_error(L, "no request found");
+    }
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    max_lines = luaL_checkinteger(L, 2);
+    if (NGX_UNLIKELY(max_lines <= 0)) {
+        return luaL_argerror(L, 2, "bad max_lines argument");
+    }
+
+    max_bytes = 0;
+
+    if (n == 3 && !lua_isnil(L, 3)) {
+        max_bytes = luaL_checkinteger(L, 3);
+        if (NGX_UNLIKELY(max_bytes <= 0)) {
+            return luaL_argerror(L, 3, "bad max_bytes argument");
+        }
+    }
+
+    lua_rawgeti(L, 1, NGX_HTTP_LUA_IO_FILE_CTX_INDEX);
+    file_ctx = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    iocf = ngx_http_get_module_loc_conf(r, ngx_http_lua_io_module);
+
+    if (file_ctx == NULL || file_ctx->closed) {
+        if (iocf->log_errors) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "attempt to read lines from a closed file object");
+        }
+
+        lua_pushnil(L);
+        lua_pushliteral(L, "closed");
+        return 2;
+    }
+
+    if (NGX_UNLIKELY(file_ctx->request != r)) {
+        return luaL_error(L, "bad request");
+    }
+
+    ngx_http_lua_io_check_busy_reading(r, file_ctx, L);
+    ngx_http_lua_io_check_busy_writing(r, file_ctx, L);
+    ngx_http_lua_io_check_busy_flushing(r, file_ctx, L);
+
+    if (NGX_UNLIKELY(!(file_ctx->mode & NGX_HTTP_LUA_IO_FILE_READ_MODE))) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "operation not permitted");
+        return 2;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io read lines, max lines:%i, max bytes:%i",
+                   (ngx_int_t) max_lines, (ngx_int_t) max_bytes);
+
+    /* the first line is read as usual, the others are split from the buffer */
+
+    file_ctx->input_filter = ngx_http_lua_io_read_line;
+    file_ctx->rest = 0;
+    file_ctx->max_lines = (ngx_uint_t) max_lines;
+    file_ctx->max_bytes = max_bytes ? (size_t) max_bytes
+                                    : NGX_MAX_SIZE_T_VALUE;
+    file_ctx->lines_batch = 0;
+
+    ngx_http_lua_io_read_ahead_anchor(L, 1, file_ctx);
+
+    return ngx_http_lua_io_file_read_helper(r, file_ctx, L);
+}
+
+
+static int
+ngx_http_lua_io_file_read_into(lua_State *L)
+{
+    int                            n, commit;
+    size_t                         size, copied, rest, a;
+    u_char                        *p, *dst;
+    ngx_uint_t                     wrapped;
+    lua_Integer                    bytes;
+    ngx_buf_t                     *b;
+    ngx_http_request_t            *r;
+    ngx_http_lua_io_op_t          *op;
+    ngx_http_lua_io_file_ctx_t    *file_ctx;
+    ngx_http_lua_io_loc_conf_t    *iocf;
+    ngx_http_lua_io_thread_ctx_t  *thread_ctx;
+
+    n = lua_gettop(L);
+
+    /* (object, pointer cdata, size, cdata or string.buffer, key) */
+
+    wrapped = (n == 5
+               && lua_touserdata(L, 5) == &ngx_http_lua_io_read_into_key);
+
+    if (NGX_UNLIKELY(n != 3 && !wrapped)) {
+        return luaL_error(L, "expecting 3 arguments (including the object), "
+                          "but got %d", n);
+    }
+
+    r = ngx_http_lua_get_request(L);
+    if (NGX_UNLIKELY(r == NULL)) {
+        return luaL_error(L, "no request found");
+    }
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    dst = NULL;
+    commit = 0;
+
+    if (wrapped) {
+
+        /* the pointer made by ffi.cast("uint8_t *", buf) or buf:reserve() */
+
+        if (lua_type(L, 2) == NGX_HTTP_LUA_IO_LUA_TCDATA) {
+            dst = *(u_char **) lua_topointer(L, 2);
+        }
+
+        commit = (lua_type(L, 4) == LUA_TUSERDATA);
+
+    } else if (lua_type(L, 2) == LUA_TLIGHTUSERDATA) {
+        dst = lua_touserdata(L, 2);
+    }
+
+    /* a string.buffer object gets no space for the zero size */
+
+    if (NGX_UNLIKELY(dst == NULL && !commit)) {
+        return luaL_argerror(L, 2, "bad buffer argument");
+    }
+
+    bytes = luaL_checkinteger(L, 3);
+    if (NGX_UNLIKELY(bytes < 0)) {
+        return luaL_argerror(L, 3, "bad size argument");
+    }
+
+    lua_rawgeti(L, 1, NGX_HTTP_LUA_IO_FILE_CTX_INDEX);
+    file_ctx = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    if (file_ctx == NULL || file_ctx->closed) {
+        iocf = ngx_http_get_module_loc_conf(r, ngx_http_lua_io_module);
+
+        if (iocf->log_errors) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "attempt to read data from a closed file object");
+        }
+
+        lua_pushnil(L);
+        lua_pushliteral(L, "closed");
+        return 2;
+    }
+
+    if (NGX_UNLIKELY(file_ctx->request != r)) {
+        return luaL_error(L, "bad request");
+    }
+
+    ngx_http_lua_io_check_busy_reading(r, file_ctx, L);
+    ngx_http_lua_io_check_busy_writing(r, file_ctx, L);
+    ngx_http_lua_io_check_busy_flushing(r, file_ctx, L);
+
+    if (NGX_UNLIKELY(!(file_ctx->mode & NGX_HTTP_LUA_IO_FILE_READ_MODE))) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "operation not permitted");
+        return 2;
+    }
+
+    if (bytes == 0) {
+        lua_pushinteger(L, 0);
+        return 1;
+    }
+
+    b = &file_ctx->buffer;
+
+    if (file_ctx->eof && b->last == b->pos) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    size = (size_t) bytes;
+
+    if (NGX_UNLIKELY(dst == NULL)) {
+        return luaL_argerror(L, 2, "bad buffer argument");
+    }
+
+    /* the data in the read buffer is taken first */
+
+    copied = ngx_min(size, (size_t) (b->last - b->pos));
+
+    if (copied) {
+        ngx_memcpy(dst, b->pos, copied);
+
+        b->pos += copied;
+        file_ctx->offset += copied;
+
+        if (b->pos == b->last) {
+            b->pos = b->start;
+            b->last = b->start;
+        }
+
+        file_ctx->buf_in->buf->pos = b->pos;
+        file_ctx->buf_in->buf->last = b->pos;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io file read into %p, %uz bytes, %uz buffered",
+                   dst, size, copied);
+
+    if (copied == size || file_ctx->eof) {
+        if (commit) {
+            return ngx_http_lua_io_buffer_commit(L, 4, copied);
+        }
+
+        lua_pushinteger(L, (lua_Integer) copied);
+        return 1;
+    }
+
+    /* the rest is read right into the memory by a thread */
+
+    ngx_http_lua_io_read_ahead_drop(r, file_ctx);
+
+    op = ngx_http_lua_io_op_create(r);
+    if (NGX_UNLIKELY(op == NULL)) {
+        return luaL_error(L, "no memory");
+    }
+
+    rest = size - copied;
+    a = file_ctx->alignment;
+
+    thread_ctx = &op->thread_ctx;
+
+    if (a) {
+        p = ngx_http_lua_io_op_get_buf(op, ngx_align(rest, a) + 3 * a);
+        if (NGX_UNLIKELY(p == NULL)) {
+            ngx_http_lua_io_op_done(r, L, op);
+            return luaL_error(L, "no memory");
+        }
+
+        thread_ctx->bounce = ngx_align_ptr(p, a);
+        thread_ctx->bounce_size = ngx_align(rest, a) + 2 * a;
+    }
+
+    ngx_http_lua_io_op_attach_file(op, L, file_ctx);
+
+    if (wrapped) {
+
+        /*
+         * anchor the memory, the pending read still writes to it if the
+         * light thread is killed meanwhile
+         */
+
+        lua_pushvalue(L, 4);
+        op->arg_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        op->commit = commit;
+    }
+
+    thread_ctx->head = dst;
+    thread_ctx->head_size = copied;
+    thread_ctx->buf = dst + copied;
+    thread_ctx->size = rest;
+    thread_ctx->offset = file_ctx->read_offset;
+    thread_ctx->alignment = a;
+
+    op->reading = 1;
+    file_ctx->read_waiting = 1;
+
+    return ngx_http_lua_io_op_post(r, L, op,
+                                   ngx_http_lua_io_thread_read_file,
+                                   ngx_http_lua_io_read_into_retvals);
+}
+
+
+static int
+ngx_http_lua_io_read_into_retvals(ngx_http_request_t *r,
+    ngx_http_lua_io_op_t *op, lua_State *L)
+{
+    int                            n;
+    size_t                         size;
+    ngx_http_lua_io_file_ctx_t    *file_ctx;
+    ngx_http_lua_io_thread_ctx_t  *thread_ctx;
+
+    file_ctx = op->file_ctx;
+    thread_ctx = &op->thread_ctx;
+
+    if (thread_ctx->err) {
+        if (thread_ctx->head_size == 0) {
+            lua_pushnil(L);
+            ngx_http_lua_io_push_error(L, thread_ctx->err);
+            return 2;
+        }
+
+        /*
+         * the buffered data was taken and the file offset was advanced,
+         * return it as a short read, the error shows up on the next read
+         */
+
+        thread_ctx->nbytes = 0;
+        thread_ctx->eof = 0;
+    }
+
+    file_ctx->offset += thread_ctx->nbytes;
+    file_ctx->read_offset += thread_ctx->nbytes;
+
+    if (thread_ctx->eof) {
+        file_ctx->eof = 1;
+    }
+
+    size = thread_ctx->head_size + thread_ctx->nbytes;
+
+    if (size == 0) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    if (!op->commit) {
+        lua_pushinteger(L, (lua_Integer) size);
+        return 1;
+    }
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, op->arg_ref);
+
+    n = ngx_http_lua_io_buffer_commit(L, lua_gettop(L), size);
+
+    lua_remove(L, -n - 1);
+
+    return n;
+}
+
+
+static int
+ngx_http_lua_io_buffer_commit(lua_State *L, int index, size_t size)
+{
+    /*
+     * buf:commit(size) of a LuaJIT string.buffer object, it is called
+     * in protected mode as it may run out of the Lua API call
+     */
+
+    lua_getfield(L, index, "commit");
+    lua_pushvalue(L, index);
+    lua_pushinteger(L, (lua_Integer) size);
+
+    if (lua_pcall(L, 2, 0, 0) != 0) {
+        lua_pushnil(L);
+        lua_insert(L, -2);
+        return 2;
+    }
+
+    lua_pushinteger(L, (lua_Integer) size);
+    return 1;
+}
+
+
+static int
+ngx_http_lua_io_file_pread(lua_State *L)
+{
+    int                            n;
+    size_t                         size, a;
+    u_char                        *p;
+    lua_Number                     offset;
+    lua_Integer                    bytes;
+    ngx_http_request_t            *r;
+    ngx_http_lua_io_op_t          *op;
+    ngx_http_lua_io_file_ctx_t    *file_ctx;
+    ngx_http_lua_io_loc_conf_t    *iocf;
+    ngx_http_lua_io_thread_ctx_t  *thread_ctx;
+
+    n = lua_gettop(L);
+    if (NGX_UNLIKELY(n != 3)) {
+        return luaL_error(L, "expecting 3 arguments (including the object), "
+                          "but got %d", n);
+    }
+
+    r = ngx_http_lua_get_request(L);
+    if (NGX_UNLIKELY(r == NULL)) {
+        return luaL_error(L, "no request found");
+    }
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    offset = luaL_checknumber(L, 2);
+    if (NGX_UNLIKELY(offset < 0 || offset > NGX_MAX_OFF_T_VALUE)) {
+        return luaL_argerror(L, 2, "bad offset argument");
+    }
+
+    bytes = luaL_checkinteger(L, 3);
+    if (NGX_UNLIKELY(bytes < 0)) {
+        return luaL_argerror(L, 3, "bad size argument");
+    }
+
+    lua_rawgeti(L, 1, NGX_HTTP_LUA_IO_FILE_CTX_INDEX);
+    file_ctx = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    if (file_ctx == NULL || file_ctx->closed) {
+        iocf = ngx_http_get_module_loc_conf(r, ngx_http_lua_io_module);
+
+        if (iocf->log_errors) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "attempt to read data from a closed file object");
+        }
+
+        lua_pushnil(L);
+        lua_pushliteral(L, "closed");
+        return 2;
+    }
+
+    if (NGX_UNLIKELY(file_ctx->request != r)) {
+        return luaL_error(L, "bad request");
+    }
+
+    if (NGX_UNLIKELY(!(file_ctx->mode & NGX_HTTP_LUA_IO_FILE_READ_MODE))) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "operation not permitted");
+        return 2;
+    }
+
+    if (bytes == 0) {
+        lua_pushliteral(L, "");
+        return 1;
+    }
+
+    op = ngx_http_lua_io_op_create(r);
+    if (NGX_UNLIKELY(op == NULL)) {
+        return luaL_error(L, "no memory");
+    }
+
+    size = (size_t) bytes;
+    a = file_ctx->alignment;
+
+    /*
+     * in the direct I/O mode the aligned bounce area is placed
+     * right behind the data in the same buffer
+     */
+
+    p = ngx_http_lua_io_op_get_buf(op, a ? size + ngx_align(size, a) + 3 * a
+                                         : size);
+    if (NGX_UNLIKELY(p == NULL)) {
+        ngx_http_lua_io_op_done(r, L, op);
+        return luaL_error(L, "no memory");
+    }
+
+    ngx_http_lua_io_op_attach_file(op, L, file_ctx);
+
+    thread_ctx = &op->thread_ctx;
+
+    thread_ctx->buf = p;
+    thread_ctx->size = size;
+    thread_ctx->offset = (off_t) offset;
+    thread_ctx->alignment = a;
+
+    if (a) {
+        thread_ctx->bounce = ngx_align_ptr(p + size, a);
+        thread_ctx->bounce_size = ngx_align(size, a) + 2 * a;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io file pread fd:%d, %uz @%O",
+                   thread_ctx->fd, size, thread_ctx->offset);
+
+    return ngx_http_lua_io_op_post(r, L, op,
+                                   ngx_http_lua_io_thread_read_file,
+                                   ngx_http_lua_io_pread_retvals);
+}
+
+
+static int
+ngx_http_lua_io_pread_retvals(ngx_http_request_t *r, ngx_http_lua_io_op_t *op,
+    lua_State *L)
+{
+    if (op->thread_ctx.err) {
+        lua_pushnil(L);
+        ngx_http_lua_io_push_error(L, op->thread_ctx.err);
+        return 2;
+    }
+
+    if (op->thread_ctx.nbytes == 0) {
+
+        /* end of file */
+
+        lua_pushnil(L);
+        return 1;
+    }
+
+    lua_pushlstring(L, (char *) op->thread_ctx.buf, op->thread_ctx.nbytes);
+
+    return 1;
+}
+
+
+static int
+ngx_http_lua_io_file_pwrite(lua_State *L)
+{
+    int                            i, n, nelts, type;
+    size_t                         len, size;
+    u_char                        *p;
+    const char                    *data;
+    lua_Number                     offset;
+    ngx_buf_t                     *b;
+    ngx_chain_t                   *cl, *out, **ll;
+    ngx_http_request_t            *r;
+    ngx_http_lua_io_op_t          *op;
+    ngx_http_lua_io_file_ctx_t    *file_ctx;
+    ngx_http_lua_io_loc_conf_t    *iocf;
+    ngx_http_lua_io_thread_ctx_t  *thread_ctx;
+
+    n = lua_gettop(L);
+    if (NGX_UNLIKELY(n != 3)) {
+        return luaL_error(L, "expecting 3 arguments (including the object), "
+                          "but got %d", n);
+    }
+
+    r = ngx_http_lua_get_request(L);
+    if (NGX_UNLIKELY(r == NULL)) {
+        return luaL_error(L, "no request found");
+    }
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    offset = luaL_checknumber(L, 2);
+    if (NGX_UNLIKELY(offset < 0 || offset > NGX_MAX_OFF_T_VALUE)) {
+        return luaL_argerror(L, 2, "bad offset argument");
+    }
+
+    type = lua_type(L, 3);
+    size = 0;
+
+    switch (type) {
+
+    case LUA_TNUMBER:
+    case LUA_TSTRING:
+        nelts = 1;
+        (void) lua_tolstring(L, 3, &size);
+        break;
+
+    case LUA_TTABLE:
+        nelts = (int) lua_objlen(L, 3);
+
+        for (i = 1; i <= nelts; i++) {
+            lua_rawgeti(L, 3, i);
+
+            if (!lua_isstring(L, -1)) {
+                return luaL_argerror(L, 3, "bad data argument");
+            }
+
+            (void) lua_tolstring(L, -1, &len);
+            size += len;
+
+            lua_pop(L, 1);
+        }
+
+        break;
+
+    default:
+        return luaL_argerror(L, 3, "bad data argument");
+    }
+
+    lua_rawgeti(L, 1, NGX_HTTP_LUA_IO_FILE_CTX_INDEX);
+    file_ctx = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    if (file_ctx == NULL || file_ctx->closed) {
+        iocf = ngx_http_get_module_loc_conf(r, ngx_http_lua_io_module);
+
+        if (iocf->log_errors) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "attempt to write data to a closed file object");
+        }
+
+        lua_pushnil(L);
+        lua_pushliteral(L, "closed");
+        return 2;
+    }
+
+    if (NGX_UNLIKELY(file_ctx->request != r)) {
+        return luaL_error(L, "bad request");
+    }
+
+    /* the data of pwrite() is appended to the end of file with O_APPEND */
+
+    if (NGX_UNLIKELY(!(file_ctx->mode & NGX_HTTP_LUA_IO_FILE_WRITE_MODE)
+                     || (file_ctx->mode & NGX_HTTP_LUA_IO_FILE_APPEND_MODE)))
+    {
+        lua_pushnil(L);
+        lua_pushliteral(L, "operation not permitted");
+        return 2;
+    }
+
+    if (NGX_UNLIKELY(file_ctx->alignment)) {
+
+        /* the Lua strings are not aligned for the direct I/O */
+
+        lua_pushnil(L);
+        lua_pushliteral(L, "not supported");
+        return 2;
+    }
+
+    if (size == 0) {
+        lua_pushinteger(L, 0);
+        return 1;
+    }
+
+    op = ngx_http_lua_io_op_create(r);
+    if (NGX_UNLIKELY(op == NULL)) {
+        return luaL_error(L, "no memory");
+    }
+
+    p = ngx_http_lua_io_op_get_buf(op, nelts * (sizeof(ngx_chain_t)
+                                                + sizeof(ngx_buf_t)));
+    if (NGX_UNLIKELY(p == NULL)) {
+        ngx_http_lua_io_op_done(r, L, op);
+        return luaL_error(L, "no memory");
+    }
+
+    /*
+     * the data is written from the Lua strings directly, which are anchored
+     * by a table of our own, as the caller might change its table
+     */
+
+    lua_createtable(L, nelts, 0);
+
+    ll = &out;
+
+    for (i = 1; i <= nelts; i++) {
+        if (type == LUA_TTABLE) {
+            lua_rawgeti(L, 3, i);
+
+        } else {
+            lua_pushvalue(L, 3);
+        }
+
+        data = lua_tolstring(L, -1, &len);
+
+        if (len == 0) {
+            lua_pop(L, 1);
+            continue;
+        }
+
+        lua_rawseti(L, -2, i);
+
+        cl = (ngx_chain_t *) p;
+        b = (ngx_buf_t *) (p + sizeof(ngx_chain_t));
+        p += sizeof(ngx_chain_t) + sizeof(ngx_buf_t);
+
+        ngx_memzero(b, sizeof(ngx_buf_t));
+
+        b->pos = (u_char *) data;
+        b->last = b->pos + len;
+        b->memory = 1;
+
+        cl->buf = b;
+
+        *ll = cl;
+        ll = &cl->next;
+    }
+
+    *ll = NULL;
+
+    op->arg_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    ngx_http_lua_io_op_attach_file(op, L, file_ctx);
+
+    thread_ctx = &op->thread_ctx;
+
+    thread_ctx->chain = out;
+    thread_ctx->offset = (off_t) offset;
+
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io file pwrite fd:%d, %uz bytes in %d piece(s) @%O",
+                   thread_ctx->fd, size, nelts, thread_ctx->offset);
+
+    return ngx_http_lua_io_op_post(r, L, op, ngx_http_lua_io_thread_pwrite,
+                                   ngx_http_lua_io_pwrite_retvals);
+}
+
+
+static int
+ngx_http_lua_io_pwrite_retvals(ngx_http_request_t *r,
+    ngx_http_lua_io_op_t *op, lua_State *L)
+{
+    ngx_http_lua_io_thread_ctx_t  *thread_ctx;
+
+    thread_ctx = &op->thread_ctx;
+
+    /* a durable flush in the "range" mode covers the written region */
+
+    if (!op->file_ctx->closed) {
+        ngx_http_lua_io_file_dirty(op->file_ctx, thread_ctx->offset,
+                                   thread_ctx->offset + thread_ctx->nbytes);
+    }
+
+    if (thread_ctx->err) {
+        lua_pushnil(L);
+        ngx_http_lua_io_push_error(L, thread_ctx->err);
+        return 2;
+    }
+
+    lua_pushinteger(L, (lua_Integer) thread_ctx->nbytes);
+    return 1;
+}
+
+
+static int
+ngx_http_lua_io_file_readv(lua_State *L)
+{
+    int                            i, nelts;
+    size_t                         size, len, max, a;
+    u_char                        *p;
+    lua_Number                     offset, bytes;
+    ngx_http_request_t            *r;
+    ngx_http_lua_io_op_t          *op;
+    ngx_http_lua_io_range_t       *ranges;
+    ngx_http_lua_io_file_ctx_t    *file_ctx;
+    ngx_http_lua_io_loc_conf_t    *iocf;
+    ngx_http_lua_io_thread_ctx_t  *thread_ctx;
+
+    if (NGX_UNLIKELY(lua_gettop(L) != 2)) {
+        return luaL_error(L, "expecting two arguments (including the object), "
+                          "but got %d", lua_gettop(L));
+    }
+
+    r = ngx_http_lua_get_request(L);
+    if (NGX_UNLIKELY(r == NULL)) {
+        return luaL_error(L, "no request found");
+    }
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    luaL_checktype(L, 2, LUA_TTABLE);
+
+    lua_rawgeti(L, 1, NGX_HTTP_LUA_IO_FILE_CTX_INDEX);
+    file_ctx = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    if (file_ctx == NULL || file_ctx->closed) {
+        iocf = ngx_http_get_module_loc_conf(r, ngx_http_lua_io_module);
+
+        if (iocf->log_errors) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "attempt to read data from a closed file object");
+        }
+
+        lua_pushnil(L);
+        lua_pushliteral(L, "closed");
+        return 2;
+    }
+
+    if (NGX_UNLIKELY(file_ctx->request != r)) {
+        return luaL_error(L, "bad request");
+    }
+
+    if (NGX_UNLIKELY(!(file_ctx->mode & NGX_HTTP_LUA_IO_FILE_READ_MODE))) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "operation not permitted");
+        return 2;
+    }
+
+    nelts = lua_objlen(L, 2);
+
+    if (nelts == 0) {
+        lua_createtable(L, 0 /* narr */, 0 /* nrec */);
+        return 1;
+    }
+
+    size = 0;
+    max = 0;
+
+    for (i = 1; i <= nelts; i++) {
+        lua_rawgeti(L, 2, i);
+
+        if (lua_type(L, -1) != LUA_TTABLE) {
+            return luaL_error(L, "bad range at index %d", i);
+        }
+
+        lua_rawgeti(L, -1, 1);
+        lua_rawgeti(L, -2, 2);
+
+        if (lua_type(L, -2) != LUA_TNUMBER || lua_type(L, -1) != LUA_TNUMBER) {
+            return luaL_error(L, "bad range at index %d", i);
+        }
+
+        offset = lua_tonumber(L, -2);
+        bytes = lua_tonumber(L, -1);
+
+        /* validated as numbers, before being cast to off_t and size_t */
+
+        if (offset < 0 || offset > NGX_MAX_OFF_T_VALUE || bytes < 0
+            || bytes > (lua_Number) (NGX_MAX_SIZE_T_VALUE / 2 - size))
+        {
+            return luaL_error(L, "bad range at index %d", i);
+        }
+
+        size += (size_t) bytes;
+        max = ngx_max(max, (size_t) bytes);
+
+        lua_pop(L, 3);
+    }
+
+    op = ngx_http_lua_io_op_create(r);
+    if (NGX_UNLIKELY(op == NULL)) {
+        return luaL_error(L, "no memory");
+    }
+
+    a = file_ctx->alignment;
+
+    /*
+     * the ranges, the data and the bounce area for the direct I/O mode
+     * are placed in the same buffer
+     */
+
+    len = nelts * sizeof(ngx_http_lua_io_range_t) + size;
+
+    p = ngx_http_lua_io_op_get_buf(op, a ? len + ngx_align(max, a) + 3 * a
+                                         : len);
+    if (NGX_UNLIKELY(p == NULL)) {
+        ngx_http_lua_io_op_done(r, L, op);
+        return luaL_error(L, "no memory");
+    }
+
+    ranges = (ngx_http_lua_io_range_t *) p;
+    p += nelts * sizeof(ngx_http_lua_io_range_t);
+
+    for (i = 0; i < nelts; i++) {
+        lua_rawgeti(L, 2, i + 1);
+        lua_rawgeti(L, -1, 1);
+        lua_rawgeti(L, -2, 2);
+
+        ranges[i].offset = (off_t) lua_tonumber(L, -2);
+        ranges[i].size = (size_t) lua_tonumber(L, -1);
+        ranges[i].nbytes = 0;
+        ranges[i].buf = p;
+
+        p += ranges[i].size;
+
+        lua_pop(L, 3);
+    }
+
+    ngx_http_lua_io_op_attach_file(op, L, file_ctx);
+
+    thread_ctx = &op->thread_ctx;
+
+    thread_ctx->head = (u_char *) ranges;
+    thread_ctx->head_size = nelts;
+    thread_ctx->alignment = a;
+
+    if (a) {
+        thread_ctx->bounce = ngx_align_ptr(p, a);
+        thread_ctx->bounce_size = ngx_align(max, a) + 2 * a;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io file readv fd:%d, %d ranges, %uz bytes",
+                   thread_ctx->fd, nelts, size);
+
+    return ngx_http_lua_io_op_post(r, L, op, ngx_http_lua_io_thread_readv,
+                                   ngx_http_lua_io_readv_retvals);
+}
+
+
+static int
+ngx_http_lua_io_readv_retvals(ngx_http_request_t *r, ngx_http_lua_io_op_t *op,
+    lua_State *L)
+{
+    size_t                    i;
+    ngx_http_lua_io_range_t  *ranges;
+
+    if (op->thread_ctx.err) {
+        lua_pushnil(L);
+        ngx_http_lua_io_push_error(L, op->thread_ctx.err);
+        return 2;
+    }
+
+    ranges = (ngx_http_lua_io_range_t *) op->thread_ctx.head;
+
+    lua_createtable(L, (int) op->thread_ctx.head_size /* narr */,
+                    0 /* nrec */);
+
+    for (i = 0; i < op->thread_ctx.head_size; i++) {
+        lua_pushlstring(L, (char *) ranges[i].buf, ranges[i].nbytes);
+        lua_rawseti(L, -2, (int) i + 1);
+    }
+
+    return 1;
+}
+
+
+static int
+ngx_http_lua_io_file_tail(lua_State *L)
+{
+    int                            n;
+    lua_Integer                    lines;
+    ngx_http_request_t            *r;
+    ngx_http_lua_io_op_t          *op;
+    ngx_http_lua_io_file_ctx_t    *file_ctx;
+    ngx_http_lua_io_loc_conf_t    *iocf;
+
+    n = lua_gettop(L);
+    if (NGX_UNLIKELY(n != 2)) {
+        return luaL_error(L, "expecting two arguments (including the object), "
+                          "but got %d", n);
+    }
+
+    r = ngx_http_lua_get_request(L);
+    if (NGX_UNLIKELY(r == NULL)) {
+        return luaL_error(L, "no request found");
+    }
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    lines = luaL_checkinteger(L, 2);
+    if (NGX_UNLIKELY(lines <= 0)) {
+        return luaL_argerror(L, 2, "bad lines argument");
+    }
+
+    lua_rawgeti(L, 1, NGX_HTTP_LUA_IO_FILE_CTX_INDEX);
+    file_ctx = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    if (file_ctx == NULL || file_ctx->closed) {
+        iocf = ngx_http_get_module_loc_conf(r, ngx_http_lua_io_module);
+
+        if (iocf->log_errors) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "attempt to read lines from a closed file object");
+        }
+
+        lua_pushnil(L);
+        lua_pushliteral(L, "closed");
+        return 2;
+    }
+
+    if (NGX_UNLIKELY(file_ctx->request != r)) {
+        return luaL_error(L, "bad request");
+    }
+
+    if (NGX_UNLIKELY(!(file_ctx->mode & NGX_HTTP_LUA_IO_FILE_READ_MODE))) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "operation not permitted");
+        return 2;
+    }
+
+    op = ngx_http_lua_io_op_create(r);
+    if (NGX_UNLIKELY(op == NULL)) {
+        return luaL_error(L, "no memory");
+    }
+
+    ngx_http_lua_io_op_attach_file(op, L, file_ctx);
+
+    op->thread_ctx.offset = -1;
+    op->thread_ctx.size = (size_t) lines;
+    op->thread_ctx.alignment = file_ctx->alignment;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io file tail fd:%d, %uz lines",
+                   op->thread_ctx.fd, op->thread_ctx.size);
+
+    return ngx_http_lua_io_op_post(r, L, op,
+                                   ngx_http_lua_io_thread_read_backward,
+                                   ngx_http_lua_io_tail_retvals);
+}
+
+
+static int
+ngx_http_lua_io_tail_retvals(ngx_http_request_t *r, ngx_http_lua_io_op_t *op,
+    lua_State *L)
+{
+    int     i, n;
+    off_t   next;
+
+    if (op->thread_ctx.err) {
+        lua_pushnil(L);
+        ngx_http_lua_io_push_error(L, op->thread_ctx.err);
+        return 2;
+    }
+
+    lua_createtable(L, (int) ngx_min(op->thread_ctx.size, 64) /* narr */,
+                    0 /* nrec */);
+
+    n = ngx_http_lua_io_push_lines_backward(L, &op->thread_ctx,
+                                            op->thread_ctx.size, &next);
+
+    /* the lines are pushed from the last one, put them in the file order */
+
+    for (i = 1; i <= n / 2; i++) {
+        lua_rawgeti(L, -1, i);
+        lua_rawgeti(L, -2, n + 1 - i);
+        lua_rawseti(L, -3, i);
+        lua_rawseti(L, -2, n + 1 - i);
+    }
+
+    return 1;
+}
+
+
+static int
+ngx_http_lua_io_file_lines_reverse(lua_State *L)
+{
+    ngx_http_request_t  *r;
+
+    if (NGX_UNLIKELY(lua_gettop(L) != 1)) {
+        return luaL_error(L, "expecting only one argument (the object), "
+                          "but got %d", lua_gettop(L));
+    }
+
+    r = ngx_http_lua_get_request(L);
+    if (NGX_UNLIKELY(r == NULL)) {
+        return luaL_error(L, "no request found");
+    }
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io file lines reverse created an iterator");
+
+    /*
+     * the state keeps the lines of the last region in the returning order,
+     * and the offset where the next region ends, -1 means the end of file
+     */
+
+    lua_createtable(L, 0 /* narr */, 4 /* nrec */);
+
+    lua_pushinteger(L, -1);
+    lua_setfield(L, -2, "offset");
+
+    lua_pushinteger(L, 0);
+    lua_setfield(L, -2, "n");
+
+    lua_pushinteger(L, 1);
+    lua_setfield(L, -2, "i");
+
+    lua_pushcclosure(L, ngx_http_lua_io_file_lines_reverse_iter, 2);
+    return 1;
+}
+
+
+static int
+ngx_http_lua_io_file_lines_reverse_iter(lua_State *L)
+{
+    lua_Integer                  i, n;
+    lua_Number                   offset;
+    ngx_http_request_t          *r;
+    ngx_http_lua_io_op_t        *op;
+    ngx_http_lua_io_file_ctx_t  *file_ctx;
+    ngx_http_lua_io_loc_conf_t  *iocf;
+
+    r = ngx_http_lua_get_request(L);
+    if (NGX_UNLIKELY(r == NULL)) {
+        return luaL_error(L, "no request found");
+    }
+
+    lua_rawgeti(L, lua_upvalueindex(1), NGX_HTTP_LUA_IO_FILE_CTX_INDEX);
+    file_ctx = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    if (file_ctx == NULL || file_ctx->closed) {
+        iocf = ngx_http_get_module_loc_conf(r, ngx_http_lua_io_module);
+        if (iocf->log_errors) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "attempt to read a line from a closed file object");
+        }
+
+        lua_pushnil(L);
+        lua_pushliteral(L, "closed");
+        return 2;
+    }
+
+    if (NGX_UNLIKELY(file_ctx->request != r)) {
+        return luaL_error(L, "bad request");
+    }
+
+    if (NGX_UNLIKELY(!(file_ctx->mode & NGX_HTTP_LUA_IO_FILE_READ_MODE))) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "operation not permitted");
+        return 2;
+    }
+
+    lua_settop(L, 0);
+
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_pushvalue(L, lua_upvalueindex(2));
+
+    lua_getfield(L, 2, "busy");
+
+    if (lua_toboolean(L, -1)) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "io busy reading");
+        return 2;
+    }
+
+    lua_getfield(L, 2, "i");
+    lua_getfield(L, 2, "n");
+
+    i = lua_tointeger(L, -2);
+    n = lua_tointeger(L, -1);
+
+    lua_pop(L, 3);
+
+    if (i <= n) {
+
+        /* hand out the lines of the current region */
+
+        lua_pushinteger(L, i + 1);
+        lua_setfield(L, 2, "i");
+
+        lua_rawgeti(L, 2, (int) i);
+
+        lua_pushnil(L);
+        lua_rawseti(L, 2, (int) i);
+
+        return 1;
+    }
+
+    lua_getfield(L, 2, "offset");
+    offset = lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    if (offset == 0) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    op = ngx_http_lua_io_op_create(r);
+    if (NGX_UNLIKELY(op == NULL)) {
+        return luaL_error(L, "no memory");
+    }
+
+    ngx_http_lua_io_op_attach_file(op, L, file_ctx);
+
+    /* anchor the state, the lines are saved into it */
+
+    lua_pushvalue(L, 2);
+    op->arg_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    lua_pushboolean(L, 1);
+    lua_setfield(L, 2, "busy");
+
+    op->release = ngx_http_lua_io_lines_reverse_release;
+
+    op->thread_ctx.offset = (off_t) offset;
+    op->thread_ctx.size = 1;
+    op->thread_ctx.limit = NGX_HTTP_LUA_IO_BACKWARD_LINE_MAX;
+    op->thread_ctx.alignment = file_ctx->alignment;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io file lines reverse fd:%d, before @%O",
+                   op->thread_ctx.fd, op->thread_ctx.offset);
+
+    return ngx_http_lua_io_op_post(r, L, op,
+                                   ngx_http_lua_io_thread_read_backward,
+                                   ngx_http_lua_io_lines_reverse_retvals);
+}
+
+
+static int
+ngx_http_lua_io_lines_reverse_retvals(ngx_http_request_t *r,
+    ngx_http_lua_io_op_t *op, lua_State *L)
+{
+    int    n;
+    off_t  next;
+
+    if (op->thread_ctx.err) {
+        lua_pushnil(L);
+        ngx_http_lua_io_push_error(L, op->thread_ctx.err);
+        return 2;
+    }
+
+    if (op->thread_ctx.overflow) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "line too long");
+        return 2;
+    }
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, op->arg_ref);
+
+    n = ngx_http_lua_io_push_lines_backward(L, &op->thread_ctx,
+                                            NGX_MAX_INT32_VALUE, &next);
+
+    lua_pushinteger(L, n);
+    lua_setfield(L, -2, "n");
+
+    lua_pushinteger(L, 2);
+    lua_setfield(L, -2, "i");
+
+    lua_pushnumber(L, (lua_Number) next);
+    lua_setfield(L, -2, "offset");
+
+    /* the first line is returned right now */
+
+    lua_rawgeti(L, -1, 1);
+
+    lua_pushnil(L);
+    lua_rawseti(L, -3, 1);
+
+    lua_remove(L, -2);
+
+    return 1;
+}
+
+
+static void
+ngx_http_lua_io_lines_reverse_release(ngx_http_lua_io_op_t *op, lua_State *L)
+{
+    /* the state is still anchored, the op may be abandoned */
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, op->arg_ref);
+
+    lua_pushnil(L);
+    lua_setfield(L, -2, "busy");
+
+    lua_pop(L, 1);
+}
+
+
+static int
+ngx_http_lua_io_push_lines_backward(lua_State *L,
+    ngx_http_lua_io_thread_ctx_t *ctx, size_t max, off_t *next)
+{
+    int      n;
+    u_char  *p, *b, *e, *lf, *last;
+
+    /*
+     * splits the region read by ngx_http_lua_io_thread_read_backward()
+     * into lines from the last one, and saves up to max lines into
+     * the table on the top of the stack; the first bytes of a region which
+     * does not start the file might be a part of a line, they are left to
+     * the next region, which ends at *next
+     */
+
+    p = ctx->head;
+    last = p + ctx->head_size;
+
+    n = 0;
+    *next = 0;
+
+    if (p == last) {
+        return 0;
+    }
+
+    if (last[-1] == LF) {
+        last--;
+    }
+
+    e = last;
+
+    while ((size_t) n < max) {
+        for (lf = e; lf > p && lf[-1] != LF; lf--) { /* void */ }
+
+        if (lf == p && ctx->offset > 0) {
+            *next = ctx->offset + (e - p) + 1;
+            break;
+        }
+
+        b = lf;
+
+        if (e > b && e[-1] == CR) {
+            lua_pushlstring(L, (char *) b, e - b - 1);
+
+        } else {
+            lua_pushlstring(L, (char *) b, e - b);
+        }
+
+        lua_rawseti(L, -2, ++n);
+
+        if (lf == p) {
+            break;
+        }
+
+        e = lf - 1;
+    }
+
+    return n;
+}
+
+
+static int
+ngx_http_lua_io_appender(lua_State *L)
+{
+    int                           n, fsync;
+    ngx_str_t                     path;
+    ngx_queue_t                  *q;
+    lua_Integer                   threshold;
+    ngx_http_request_t           *r;
+    ngx_http_lua_io_appender_t   *appender;
+
+    n = lua_gettop(L);
+
+    if (NGX_UNLIKELY(n != 1 && n != 2)) {
+        return luaL_error(L, "expecting one or two arguments, but got %d", n);
+    }
+
+    r = ngx_http_lua_get_request(L);
+    if (NGX_UNLIKELY(r == NULL)) {
+        return luaL_error(L, "no request found");
+    }
+
+    path.data = (u_char *) luaL_checklstring(L, 1, &path.len);
+
+    fsync = 0;
+    threshold = NGX_HTTP_LUA_IO_APPENDER_SIZE;
+
+    if (n == 2 && !lua_isnil(L, 2)) {
+        luaL_checktype(L, 2, LUA_TTABLE);
+
+        lua_getfield(L, 2, "fsync");
+
+        switch (lua_type(L, -1)) {
+        case LUA_TNIL:
+            break;
+
+        case LUA_TBOOLEAN:
+            fsync = lua_toboolean(L, -1);
+            break;
+
+        default:
+            return luaL_error(L, "bad \"fsync\" option");
+        }
+
+        lua_getfield(L, 2, "threshold");
+
+        switch (lua_type(L, -1)) {
+        case LUA_TNIL:
+            break;
+
+        case LUA_TNUMBER:
+            threshold = lua_tointeger(L, -1);
+            if (threshold > 0) {
+                break;
+            }
+
+            /* fall through */
+
+        default:
+            return luaL_error(L, "bad \"threshold\" option");
+        }
+
+        lua_pop(L, 2);
+    }
+
+    if (ngx_get_full_name(r->pool, (ngx_str_t *) &ngx_cycle->prefix, &path)
+        != NGX_OK)
+    {
+        return luaL_error(L, "no memory");
+    }
+
+    if (ngx_http_lua_io_appenders.next == NULL) {
+        ngx_queue_init(&ngx_http_lua_io_appenders);
+    }
+
+    appender = NULL;
+
+    for (q = ngx_queue_head(&ngx_http_lua_io_appenders);
+         q != ngx_queue_sentinel(&ngx_http_lua_io_appenders);
+         q = ngx_queue_next(q))
+    {
+        appender = ngx_queue_data(q, ngx_http_lua_io_appender_t, queue);
+
+        if (appender->name.len == path.len
+            && ngx_strncmp(appender->name.data, path.data, path.len) == 0)
+        {
+            break;
+        }
+
+        appender = NULL;
+    }
+
+    if (appender == NULL) {
+        appender = ngx_http_lua_io_appender_create(r, &path);
+        if (NGX_UNLIKELY(appender == NULL)) {
+            return luaL_error(L, "no memory");
+        }
+    }
+
+    /*
+     * the appender is shared by the whole worker, the object only keeps
+     * the options of the caller
+     */
+
+    lua_createtable(L, 3 /* narr */, 0 /* nrec */);
+
+    lua_pushlightuserdata(L, &ngx_http_lua_io_appender_metatable_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_setmetatable(L, -2);
+
+    lua_pushlightuserdata(L, appender);
+    lua_rawseti(L, -2, 1);
+
+    lua_pushboolean(L, fsync);
+    lua_rawseti(L, -2, 2);
+
+    lua_pushinteger(L, threshold);
+    lua_rawseti(L, -2, 3);
+
+    return 1;
+}
+
+
+static ngx_http_lua_io_appender_t *
+ngx_http_lua_io_appender_create(ngx_http_request_t *r, ngx_str_t *path)
+{
+    ngx_pool_t                    *pool;
+    ngx_thread_task_t             *task;
+    ngx_pool_cleanup_t            *cln;
+    ngx_thread_pool_t             *tp;
+    ngx_http_lua_io_appender_t    *appender;
+    ngx_http_lua_io_thread_ctx_t  *thread_ctx;
+
+    tp = ngx_http_lua_io_get_thread_pool(r);
+    if (tp == NULL) {
+        return NULL;
+    }
+
+    /* the appender lives until the worker exits */
+
+    pool = ngx_cycle->pool;
+
+    appender = ngx_pcalloc(pool, sizeof(ngx_http_lua_io_appender_t));
+    if (appender == NULL) {
+        return NULL;
+    }
+
+    appender->name.data = ngx_pnalloc(pool, path->len + 1);
+    if (appender->name.data == NULL) {
+        return NULL;
+    }
+
+    (void) ngx_cpystrn(appender->name.data, path->data, path->len + 1);
+    appender->name.len = path->len;
+
+    task = ngx_thread_task_alloc(pool, sizeof(ngx_http_lua_io_thread_ctx_t));
+    if (task == NULL) {
+        return NULL;
+    }
+
+    cln = ngx_pool_cleanup_add(pool, 0);
+    if (cln == NULL) {
+        return NULL;
+    }
+
+    cln->handler = ngx_http_lua_io_appender_cleanup;
+    cln->data = appender;
+
+    thread_ctx = task->ctx;
+
+    thread_ctx->fd = NGX_INVALID_FILE;
+    thread_ctx->path = appender->name.data;
+    thread_ctx->access = NGX_FILE_DEFAULT_ACCESS;
+    thread_ctx->chain = &appender->chain;
+
+    task->handler = ngx_http_lua_io_thread_append;
+    task->event.data = appender;
+    task->event.handler = ngx_http_lua_io_appender_done;
+
+    appender->task = task;
+    appender->thread_pool = tp;
+
+    appender->chain.buf = &appender->buf;
+    appender->chain.next = NULL;
+    appender->buf.memory = 1;
+
+    appender->event.data = appender;
+    appender->event.handler = ngx_http_lua_io_appender_event_handler;
+    appender->event.log = ngx_cycle->log;
+
+    ngx_queue_init(&appender->waiters);
+    ngx_queue_init(&appender->busy_waiters);
+
+    ngx_queue_insert_tail(&ngx_http_lua_io_appenders, &appender->queue);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io appender \"%V\" created", &appender->name);
+
+    return appender;
+}
+
+
+static int
+ngx_http_lua_io_appender_write(lua_State *L)
+{
+    size_t                              len, size, threshold;
+    u_char                             *p;
+    const char                         *data;
+    ngx_http_request_t                 *r;
+    ngx_http_lua_ctx_t                 *ctx;
+    ngx_http_lua_io_ctx_t              *ioctx;
+    ngx_http_lua_io_appender_t         *appender;
+    ngx_http_lua_io_appender_waiter_t  *waiter;
+
+    if (NGX_UNLIKELY(lua_gettop(L) != 2)) {
+        return luaL_error(L, "expecting two arguments (including the object), "
+                          "but got %d", lua_gettop(L));
+    }
+
+    r = ngx_http_lua_get_request(L);
+    if (NGX_UNLIKELY(r == NULL)) {
+        return luaL_error(L, "no request found");
+    }
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+    if (NGX_UNLIKELY(ctx == NULL)) {
+        return luaL_error(L, "no ctx found");
+    }
+
+    ngx_http_lua_check_context(L, ctx, NGX_HTTP_LUA_CONTEXT_REWRITE
+                               |NGX_HTTP_LUA_CONTEXT_ACCESS
+                               |NGX_HTTP_LUA_CONTEXT_CONTENT
+                               |NGX_HTTP_LUA_CONTEXT_TIMER
+                               |NGX_HTTP_LUA_CONTEXT_SSL_CERT
+                               |NGX_HTTP_LUA_CONTEXT_SSL_SESS_FETCH);
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    data = luaL_checklstring(L, 2, &len);
+
+    lua_rawgeti(L, 1, 1);
+    appender = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    if (NGX_UNLIKELY(appender == NULL)) {
+        return luaL_error(L, "bad appender object");
+    }
+
+    if (len == 0) {
+        lua_pushinteger(L, 0);
+        return 1;
+    }
+
+    /*
+     * the data piles up while the previous batch is being written,
+     * the writers fail instead of growing it without a limit
+     */
+
+    if (appender->size
+        && appender->size + len > NGX_HTTP_LUA_IO_APPENDER_MAX_PENDING)
+    {
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "lua io appender write %uz, pending:%uz is full",
+                       len, appender->size);
+
+        lua_pushnil(L);
+        lua_pushliteral(L, "too much pending data");
+        return 2;
+    }
+
+    ioctx = ngx_http_get_module_ctx(r, ngx_http_lua_io_module);
+    if (ioctx == NULL) {
+        ioctx = ngx_pcalloc(r->pool, sizeof(ngx_http_lua_io_ctx_t));
+        if (ioctx == NULL) {
+            return luaL_error(L, "no memory");
+        }
+
+        ngx_http_set_ctx(r, ioctx, ngx_http_lua_io_module);
+    }
+
+    /* the data is copied to the pending buffer of the appender */
+
+    if (appender->size + len > appender->capacity) {
+        size = ngx_max(appender->capacity * 2, appender->size + len);
+        size = ngx_max(size, NGX_HTTP_LUA_IO_APPENDER_SIZE);
+
+        p = ngx_alloc(size, r->connection->log);
+        if (NGX_UNLIKELY(p == NULL)) {
+            return luaL_error(L, "no memory");
+        }
+
+        if (appender->pending) {
+            ngx_memcpy(p, appender->pending, appender->size);
+            ngx_free(appender->pending);
+        }
+
+        appender->pending = p;
+        appender->capacity = size;
+    }
+
+    waiter = ioctx->free_waiters;
+
+    if (waiter) {
+        ioctx->free_waiters = waiter->next;
+
+    } else {
+        waiter = ngx_palloc(r->pool,
+                            sizeof(ngx_http_lua_io_appender_waiter_t));
+        if (NGX_UNLIKELY(waiter == NULL)) {
+            return luaL_error(L, "no memory");
+        }
+    }
+
+    ngx_memcpy(appender->pending + appender->size, data, len);
+    appender->size += len;
+
+    lua_rawgeti(L, 1, 2);
+    lua_rawgeti(L, 1, 3);
+
+    if (lua_toboolean(L, -2)) {
+        appender->fsync = 1;
+    }
+
+    threshold = (size_t) lua_tointeger(L, -1);
+
+    lua_pop(L, 2);
+
+    waiter->request = r;
+    waiter->size = len;
+    waiter->err = 0;
+    waiter->next = NULL;
+
+    ngx_queue_insert_tail(&appender->waiters, &waiter->queue);
+
+    waiter->coctx = ngx_http_lua_io_prepare_yield(r,
+                                    ngx_http_lua_io_appender_coctx_cleanup,
+                                    waiter);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io appender write %uz, pending:%uz busy:%d",
+                   len, appender->size, appender->busy);
+
+    /*
+     * the writes of the current event loop iteration are gathered,
+     * unless the threshold is reached
+     */
+
+    if (!appender->busy) {
+        if (appender->size >= threshold) {
+            ngx_http_lua_io_appender_flush(appender);
+
+        } else {
+            ngx_post_event(&appender->event, &ngx_posted_events);
+        }
+    }
+
+    return lua_yield(L, 0);
+}
+
+
+static void
+ngx_http_lua_io_appender_event_handler(ngx_event_t *ev)
+{
+    ngx_http_lua_io_appender_t *appender = ev->data;
+
+    if (!appender->busy && appender->size) {
+        ngx_http_lua_io_appender_flush(appender);
+    }
+}
+
+
+static void
+ngx_http_lua_io_appender_flush(ngx_http_lua_io_appender_t *appender)
+{
+    u_char                        *p;
+    size_t                         size;
+    ngx_http_lua_io_thread_ctx_t  *thread_ctx;
+
+    if (appender->event.posted) {
+        ngx_delete_posted_event(&appender->event);
+    }
+
+    /* the pending buffer is swapped with the one written last time */
+
+    p = appender->busy_buf;
+    size = appender->busy_capacity;
+
+    appender->busy_buf = appender->pending;
+    appender->busy_capacity = appender->capacity;
+
+    appender->buf.pos = appender->busy_buf;
+    appender->buf.last = appender->busy_buf + appender->size;
+
+    appender->pending = p;
+    appender->capacity = size;
+    appender->size = 0;
+
+    if (!ngx_queue_empty(&appender->waiters)) {
+        ngx_queue_add(&appender->busy_waiters, &appender->waiters);
+        ngx_queue_init(&appender->waiters);
+    }
+
+    thread_ctx = appender->task->ctx;
+
+    thread_ctx->flush = appender->fsync;
+
+    appender->fsync = 0;
+    appender->busy = 1;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "lua io appender \"%V\" flush %uz bytes, fsync:%d",
+                   &appender->name, appender->buf.last - appender->buf.pos,
+                   thread_ctx->flush);
+
+    if (ngx_thread_task_post(appender->thread_pool, appender->task)
+        == NGX_OK)
+    {
+        appender->failed = 0;
+        return;
+    }
+
+    /*
+     * this might be called by a writer which has not yielded yet,
+     * so the writers are woken up later
+     */
+
+    appender->failed = 1;
+
+    ngx_post_event(&appender->task->event, &ngx_posted_events);
+}
+
+
+static void
+ngx_http_lua_io_appender_done(ngx_event_t *ev)
+{
+    ngx_http_lua_io_appender_t *appender = ev->data;
+
+    ngx_err_t                           err;
+    ngx_int_t                           rc;
+    ngx_queue_t                        *q, done;
+    ngx_connection_t                   *c;
+    ngx_http_request_t                 *r;
+    ngx_http_lua_ctx_t                 *lctx;
+    ngx_http_lua_io_thread_ctx_t       *thread_ctx;
+    ngx_http_lua_io_appender_waiter_t  *waiter;
+
+    ev->complete = 0;
+
+    thread_ctx = appender->task->ctx;
+
+    rc = NGX_OK;
+    err = 0;
+
+    if (appender->failed) {
+        rc = NGX_DECLINED;
+
+    } else if (thread_ctx->err
+               || thread_ctx->nbytes
+                  != (size_t) (appender->buf.last - appender->buf.pos))
+    {
+        rc = NGX_ERROR;
+        err = thread_ctx->err;
+
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, err,
+                      "lua io appender \"%V\" write failed", &appender->name);
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "lua io appender \"%V\" done, rc:%i",
+                   &appender->name, rc);
+
+    appender->busy = 0;
+    appender->failed = 0;
+
+    ngx_queue_init(&done);
+
+    if (!ngx_queue_empty(&appender->busy_waiters)) {
+        ngx_queue_add(&done, &appender->busy_waiters);
+        ngx_queue_init(&appender->busy_waiters);
+    }
+
+    /* the next batch goes on while the writers of this one are resumed */
+
+    if (appender->size) {
+        ngx_http_lua_io_appender_flush(appender);
+    }
+
+    while (!ngx_queue_empty(&done)) {
+        q = ngx_queue_head(&done);
+        ngx_queue_remove(q);
+
+        waiter = ngx_queue_data(q, ngx_http_lua_io_appender_waiter_t, queue);
+
+        waiter->rc = rc;
+        waiter->err = err;
+
+        r = waiter->request;
+        c = r->connection;
+
+        lctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+
+        lctx->resume_handler = ngx_http_lua_io_appender_resume;
+        lctx->cur_co_ctx = waiter->coctx;
+
+        r->write_event_handler(r);
+        ngx_http_run_posted_requests(c);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_lua_io_appender_resume(ngx_http_request_t *r)
+{
+    int                                 n;
+    lua_State                          *L;
+    ngx_http_lua_ctx_t                 *lctx;
+    ngx_http_lua_co_ctx_t              *coctx;
+    ngx_http_lua_io_ctx_t              *ioctx;
+    ngx_http_lua_io_appender_waiter_t  *waiter;
+
+    lctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+    if (lctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    lctx->resume_handler = ngx_http_lua_wev_handler;
+
+    coctx = lctx->cur_co_ctx;
+    coctx->cleanup = NULL;
+
+    waiter = coctx->data;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io appender write done and resume, rc:%i",
+                   waiter->rc);
+
+    L = coctx->co;
+
+    switch (waiter->rc) {
+
+    case NGX_OK:
+        lua_pushinteger(L, (lua_Integer) waiter->size);
+        n = 1;
+        break;
+
+    case NGX_DECLINED:
+        lua_pushnil(L);
+        lua_pushliteral(L, "task post failed");
+        n = 2;
+        break;
+
+    default:
+        lua_pushnil(L);
+        ngx_http_lua_io_push_error(L, waiter->err);
+        n = 2;
+    }
+
+    ioctx = ngx_http_get_module_ctx(r, ngx_http_lua_io_module);
+
+    waiter->next = ioctx->free_waiters;
+    ioctx->free_waiters = waiter;
+
+    return ngx_http_lua_io_run_thread(r, lctx, n);
+}
+
+
+static void
+ngx_http_lua_io_appender_coctx_cleanup(void *data)
+{
+    ngx_http_lua_co_ctx_t *coctx = data;
+
+    ngx_http_lua_io_ctx_t              *ioctx;
+    ngx_http_lua_io_appender_waiter_t  *waiter;
+
+    waiter = coctx->data;
+    if (waiter == NULL) {
+        return;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, waiter->request->connection->log, 0,
+                   "lua io appender coctx cleanup");
+
+    /* the data is still written, but nobody is waiting for it */
+
+    ngx_queue_remove(&waiter->queue);
+
+    ioctx = ngx_http_get_module_ctx(waiter->request, ngx_http_lua_io_module);
+
+    waiter->next = ioctx->free_waiters;
+    ioctx->free_waiters = waiter;
+}
+
+
+static void
+ngx_http_lua_io_appender_cleanup(void *data)
+{
+    ngx_http_lua_io_appender_t *appender = data;
+
+    ngx_http_lua_io_thread_ctx_t  *thread_ctx;
+
+    if (appender->busy) {
+
+        /* the task still uses the descriptor and the buffer */
+
+        return;
+    }
+
+    thread_ctx = appender->task->ctx;
+
+    if (thread_ctx->fd != NGX_INVALID_FILE
+        && ngx_close_file(thread_ctx->fd) == NGX_FILE_ERROR)
+    {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%V\" failed", &appender->name);
+    }
+
+    thread_ctx->fd = NGX_INVALID_FILE;
+
+    if (appender->pending) {
+        ngx_free(appender->pending);
+        appender->pending = NULL;
+    }
+
+    if (appender->busy_buf) {
+        ngx_free(appender->busy_buf);
+        appender->busy_buf = NULL;
+    }
+}
+
+
+static int
+ngx_http_lua_io_file_write(lua_State *L)
+{
+    int                          type;
+    size_t                       len, size;
+    u_char                      *p;
+    const char                  *errmsg;
+    ngx_chain_t                 *cl, *out;
+    ngx_buf_t                   *b;
+    ngx_http_lua_io_loc_conf_t  *iocf;
+    ngx_http_lua_io_ctx_t       *ioctx;
+    ngx_http_lua_io_file_ctx_t  *file_ctx;
+    ngx_http_request_t          *r;
+
+    if (NGX_UNLIKELY(lua_gettop(L) != 2)) {
+        return luaL_error(L, "expecting two arguments (including the object), ",
+                          "but got %d", lua_gettop(L));
+    }
+
+    r = ngx_http_lua_get_request(L);
+    if (NGX_UNLIKELY(r == NULL)) {
+        return luaL_error(L, "no request found");
+    }
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_rawgeti(L, 1, NGX_HTTP_LUA_IO_FILE_CTX_INDEX);
+
+    file_ctx = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io write, ctx:%p", file_ctx);
+
+    iocf = ngx_http_get_module_loc_conf(r, ngx_http_lua_io_module);
+
+    if (file_ctx == NULL || file_ctx->closed) {
+        if (iocf->log_errors) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "attempt to write data on a closed file object");
+        }
+
+        lua_pushnil(L);
+        lua_pushliteral(L, "closed");
+        return 2;
+    }
+
+    if (NGX_UNLIKELY(file_ctx->request != r)) {
+        return luaL_error(L, "bad request");
+    }
+
+    ngx_http_lua_io_check_busy_reading(r, file_ctx, L);
+    ngx_http_lua_io_check_busy_writing(r, file_ctx, L);
+    ngx_http_lua_io_check_busy_flushing(r, file_ctx, L);
+
+    if (NGX_UNLIKELY(!(file_ctx->mode & NGX_HTTP_LUA_IO_FILE_WRITE_MODE))) {
+
+        /* FIXME need to be compatible with libc? */
+        lua_pushnil(L);
+        lua_pushliteral(L, "operation not permitted");
+        return 2;
+    }
+
+    len = 0;
+
+    type = lua_type(L, 2);
+    switch (type) {
+    case LUA_TNUMBER:
+        /* fallthrough */
+    case LUA_TSTRING:
+        lua_tolstring(L, 2, &len);
+        break;
+
+    case LUA_TTABLE:
+        len = ngx_http_lua_calc_strlen_in_table(L, 2, 2, 1 /* strict */);
+        break;
+
+    case LUA_TBOOLEAN:
+        if (lua_toboolean(L, 2)) {
+            len = sizeof("true") - 1;
+
+        } else {
+            len = sizeof("false") - 1;
+        }
+
+        break;
+
+    case LUA_TNIL:
+        len = sizeof("nil") - 1;
+        break;
+
+    default:
+        errmsg = lua_pushfstring(L, "string, number, boolean, nil"
+                                 " or array table expected, got %s",
+                                 lua_typename(L, type));
+
+        return luaL_argerror(L, 2, errmsg);
+    }
+
+    if (len == 0) {
+        lua_pushinteger(L, 0);
+        return 1;
+    }
+
+    ngx_http_lua_io_file_drop_read_bufs(r, file_ctx);
+
+    out = NULL;
+
+    ioctx = ngx_http_get_module_ctx(r, ngx_http_lua_io_module);
+    size = iocf->write_buf_size;
+
+    if (file_ctx->alignment) {
+        out = ngx_http_lua_io_file_write_direct(r, L, file_ctx, type, len,
+                                                size);
+        goto post;
+    }
+
+    if (size == 0) {
+        cl = ngx_http_lua_io_get_buf(r, file_ctx, &ioctx->free_write_bufs,
+                                     len);
+        if (NGX_UNLIKELY(cl == NULL)) {
+            return luaL_error(L, "no memory");
+        }
+
+        out = cl;
+
+    } else {
+        cl = file_ctx->bufs_out;
+        if (cl == NULL || (size_t) (cl->buf->end - cl->buf->last) < len) {
+
+            cl = ngx_http_lua_io_get_buf(r, file_ctx, &ioctx->free_write_bufs,
+                                         size > len ? size : len);
+
+            if (NGX_UNLIKELY(cl == NULL)) {
+                return luaL_error(L, "no memory");
+            }
+
+            if (file_ctx->bufs_out) {
+                out = file_ctx->bufs_out;
+            }
+
+            if (len > size) {
+                if (out) {
+                    out->next = cl;
+
+                } else {
+                    out = cl;
+                }
+
+                file_ctx->bufs_out = NULL;
+
+            } else {
+                file_ctx->bufs_out = cl;
+            }
+        }
+    }
+
+    b = cl->buf;
+
+    switch (type) {
+    case LUA_TNUMBER:
+        /* fallthrough */
+    case LUA_TSTRING:
+        p = (u_char *) lua_tolstring(L, -1, &len);
+        b->last = ngx_copy(b->last, (u_char *) p, len);
+        break;
+
+    case LUA_TTABLE:
+        b->last = ngx_http_lua_copy_str_in_table(L, -1, b->last);
+        break;
+
+    case LUA_TBOOLEAN:
+        if (lua_toboolean(L, 2)) {
+            *b->last++ = 't';
+            *b->last++ = 'r';
+            *b->last++ = 'u';
+            *b->last++ = 'e';
+
+        } else {
+            *b->last++ = 'f';
+            *b->last++ = 'a';
+            *b->last++ = 'l';
+            *b->last++ = 's';
+            *b->last++ = 'e';
+        }
+
+        break;
+
+    case LUA_TNIL:
+        *b->last++ = 'n';
+        *b->last++ = 'i';
+        *b->last++ = 'l';
+        break;
+
+    default:
+        return luaL_error(L, "impossible to reach here");
+    }
+
+post:
+
+    if (out == NULL) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "lua io write cache");
+        lua_pushinteger(L, len);
+        return 1;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io write through");
+
+    if (NGX_UNLIKELY(ngx_http_lua_io_thread_post_write_task(file_ctx, out, 0)
+                     == NGX_ERROR))
+    {
+        return ngx_http_lua_io_handle_error(L, r, file_ctx);
+    }
+
+    file_ctx->nbytes = len;
+
+    file_ctx->write_waiting = 1;
+
+    ngx_http_lua_io_before_yield(r, file_ctx);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io write saved co ctx:%p", file_ctx->coctx);
+
+    return lua_yield(L, 0);
+}
+
+
+static int
+ngx_http_lua_io_file_write_request_body(lua_State *L)
+{
+    int                          n;
+    off_t                        size;
+    ngx_uint_t                   mode;
+    ngx_buf_t                   *b;
+    ngx_chain_t                 *cl, *in, *out, *body, **ll;
+    ngx_http_request_t          *r;
+    ngx_http_request_body_t     *rb;
+    ngx_http_lua_io_loc_conf_t  *iocf;
+    ngx_http_lua_io_file_ctx_t  *file_ctx;
+
+    n = lua_gettop(L);
+
+    if (NGX_UNLIKELY(n != 1 && n != 2)) {
+        return luaL_error(L, "expecting one or two arguments "
+                          "(including the object), but got %d", n);
+    }
+
+    r = ngx_http_lua_get_request(L);
+    if (NGX_UNLIKELY(r == NULL)) {
+        return luaL_error(L, "no request found");
+    }
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    if (n == 2) {
+        luaL_checktype(L, 2, LUA_TTABLE);
+    }
+
+    lua_rawgeti(L, 1, NGX_HTTP_LUA_IO_FILE_CTX_INDEX);
+    file_ctx = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    if (file_ctx == NULL || file_ctx->closed) {
+        iocf = ngx_http_get_module_loc_conf(r, ngx_http_lua_io_module);
+
+        if (iocf->log_errors) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "attempt to write data on a closed file object");
+        }
+
+        lua_pushnil(L);
+        lua_pushliteral(L, "closed");
+        return 2;
+    }
+
+    if (NGX_UNLIKELY(file_ctx->request != r)) {
+        return luaL_error(L, "bad request");
+    }
+
+    ngx_http_lua_io_check_busy_reading(r, file_ctx, L);
+    ngx_http_lua_io_check_busy_writing(r, file_ctx, L);
+    ngx_http_lua_io_check_busy_flushing(r, file_ctx, L);
+
+    if (NGX_UNLIKELY(!(file_ctx->mode & NGX_HTTP_LUA_IO_FILE_WRITE_MODE))) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "operation not permitted");
+        return 2;
+    }
+
+    mode = 0;
+
+    if (n == 2) {
+
+        /* the option takes the place of the table, as file:flush(sync) */
+
+        lua_getfield(L, 2, "sync");
+        lua_replace(L, 2);
+
+        mode = ngx_http_lua_io_get_sync_mode(L, 2, file_ctx);
+    }
+
+    rb = r->request_body;
+
+    /* the bufs only hold a part of the body which is still being read */
+
+    if (rb == NULL || rb->rest > 0 || r->reading_body) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "request body not read");
+        return 2;
+    }
+
+    size = 0;
+
+    for (in = rb->bufs; in; in = in->next) {
+        if (!ngx_buf_special(in->buf)) {
+            size += ngx_buf_size(in->buf);
+        }
+    }
+
+    if (size == 0) {
+        lua_pushinteger(L, 0);
+        return 1;
+    }
+
+    /*
+     * the shadows of the request body bufs are written, as the task adjusts
+     * the bufs on the short writes
+     */
+
+    ll = &body;
+
+    for (in = rb->bufs; in; in = in->next) {
+        if (ngx_buf_special(in->buf) || ngx_buf_size(in->buf) == 0) {
+            continue;
+        }
+
+        cl = ngx_alloc_chain_link(r->pool);
+        if (NGX_UNLIKELY(cl == NULL)) {
+            return luaL_error(L, "no memory");
+        }
+
+        b = ngx_calloc_buf(r->pool);
+        if (NGX_UNLIKELY(b == NULL)) {
+            return luaL_error(L, "no memory");
+        }
+
+        *b = *in->buf;
+        b->shadow = in->buf;
+
+        cl->buf = b;
+
+        *ll = cl;
+        ll = &cl->next;
+    }
+
+    *ll = NULL;
+
+    ngx_http_lua_io_file_drop_read_bufs(r, file_ctx);
+
+    /* the data in the write buffer goes first */
+
+    out = body;
+
+    if (file_ctx->bufs_out) {
+        for (cl = file_ctx->bufs_out; cl->next; cl = cl->next) {
+            /* void */
+        }
+
+        cl->next = body;
+        out = file_ctx->bufs_out;
+        file_ctx->bufs_out = NULL;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io write request body %O bytes, in file:%d",
+                   size, rb->temp_file ? 1 : 0);
+
+    if (NGX_UNLIKELY(ngx_http_lua_io_thread_post_write_body_task(file_ctx, out,
+                        file_ctx->mode & NGX_HTTP_LUA_IO_FILE_APPEND_MODE)
+                     == NGX_ERROR))
+    {
+        return ngx_http_lua_io_handle_error(L, r, file_ctx);
+    }
+
+    file_ctx->nbytes = (size_t) size;
+    file_ctx->body_out = body;
+    file_ctx->durable = mode;
+
+    file_ctx->write_waiting = 1;
+    file_ctx->writing_body = 1;
+
+    ngx_http_lua_io_before_yield(r, file_ctx);
+
+    return lua_yield(L, 0);
+}
+
+
+static ngx_chain_t *
+ngx_http_lua_io_file_write_direct(ngx_http_request_t *r, lua_State *L,
+    ngx_http_lua_io_file_ctx_t *file_ctx, int type, size_t len, size_t size)
+{
+    size_t                  n;
+    u_char                 *p;
+    ngx_buf_t              *b;
+    ngx_chain_t            *cl, *out, **ll;
+    ngx_http_lua_io_ctx_t  *ioctx;
+
+    switch (type) {
+    case LUA_TNUMBER:
+        /* fallthrough */
+    case LUA_TSTRING:
+        p = (u_char *) lua_tolstring(L, 2, &len);
+        break;
+
+    case LUA_TTABLE:
+        p = lua_newuserdata(L, len);
+        (void) ngx_http_lua_copy_str_in_table(L, 2, p);
+        break;
+
+    case LUA_TBOOLEAN:
+        p = (u_char *) (lua_toboolean(L, 2) ? "true" : "false");
+        break;
+
+    default: /* LUA_TNIL */
+        p = (u_char *) "nil";
+        break;
+    }
+
+    ioctx = ngx_http_get_module_ctx(r, ngx_http_lua_io_module);
+
+    if (size == 0) {
+        cl = ngx_http_lua_io_get_buf(r, file_ctx, &ioctx->free_write_bufs,
+                                     len);
+        if (NGX_UNLIKELY(cl == NULL)) {
+            luaL_error(L, "no memory");
+            return NULL;
+        }
+
+        cl->buf->last = ngx_cpymem(cl->buf->last, p, len);
+
+        return cl;
+    }
+
+    /*
+     * the buffers are filled up before they are written out, so that
+     * the lengths and the file offsets meet the alignment of direct I/O
+     */
+
+    out = NULL;
+    ll = &out;
+
+    while (len) {
+        cl = file_ctx->bufs_out;
+
+        if (cl == NULL) {
+            cl = ngx_http_lua_io_get_buf(r, file_ctx, &ioctx->free_write_bufs,
+                                         size);
+            if (NGX_UNLIKELY(cl == NULL)) {
+                luaL_error(L, "no memory");
+                return NULL;
+            }
+
+            file_ctx->bufs_out = cl;
+        }
+
+        b = cl->buf;
+
+        n = ngx_min((size_t) (b->end - b->last), len);
+        b->last = ngx_cpymem(b->last, p, n);
+
+        p += n;
+        len -= n;
+
+        if (b->last == b->end) {
+            *ll = cl;
+            ll = &cl->next;
+
+            file_ctx->bufs_out = NULL;
+        }
+    }
+
+    return out;
+}
+
+
+static ngx_chain_t *
+ngx_http_lua_io_get_buf(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx, ngx_chain_t **free, size_t size)
+{
+    size_t                  alignment;
+    u_char                 *p;
+    ngx_buf_t              *b;
+    ngx_chain_t            *cl;
+    ngx_http_lua_io_ctx_t  *ioctx;
+
+    alignment = file_ctx->alignment;
+
+    if (alignment == 0) {
+        return ngx_http_lua_chain_get_free_buf(r->connection->log, r->pool,
+                                               free, size);
+    }
+
+    /* the memory and the size of buffers for direct I/O are aligned */
+
+    ioctx = ngx_http_get_module_ctx(r, ngx_http_lua_io_module);
+
+    size = ngx_align(size, alignment);
+
+    cl = ioctx->free_direct_bufs;
+
+    if (cl) {
+        b = cl->buf;
+
+        if ((size_t) (b->end - b->start) >= size
+            && ((uintptr_t) b->start & (alignment - 1)) == 0)
+        {
+            ioctx->free_direct_bufs = cl->next;
+            cl->next = NULL;
+
+            b->pos = b->start;
+            b->last = b->start;
+
+            return cl;
+        }
+    }
+
+    p = ngx_pmemalign(r->pool, size, alignment);
+    if (p == NULL) {
+        return NULL;
+    }
+
+    cl = ngx_alloc_chain_link(r->pool);
+    if (cl == NULL) {
+        return NULL;
+    }
+
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
+        return NULL;
+    }
+
+    b->start = p;
+    b->pos = p;
+    b->last = p;
+    b->end = p + size;
+    b->temporary = 1;
+    b->tag = (ngx_buf_tag_t) &ngx_http_lua_io_module;
+
+    cl->buf = b;
+    cl->next = NULL;
+
+    return cl;
+}
+
+
+static void
+ngx_http_lua_io_free_bufs(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx, ngx_chain_t **free, ngx_chain_t *in)
+{
+    ngx_chain_t            *cl;
+    ngx_http_lua_io_ctx_t  *ioctx;
+
+    if (in == NULL) {
+        return;
+    }
+
+    if (file_ctx->alignment) {
+        ioctx = ngx_http_get_module_ctx(r, ngx_http_lua_io_module);
+        free = &ioctx->free_direct_bufs;
+    }
+
+    for (cl = in; /* void */ ; cl = cl->next) {
+        cl->buf->pos = cl->buf->last;
+
+        if (cl->next == NULL) {
+            break;
+        }
+    }
+
+    cl->next = *free;
+    *free = in;
+}
+
+
+static int
+ngx_http_lua_io_file_flush(lua_State *L)
+{
+    int                          n;
+    ngx_int_t                    rc;
+    ngx_uint_t                   mode;
+    ngx_http_request_t          *r;
+    ngx_http_lua_io_file_ctx_t  *file_ctx;
+    ngx_http_lua_io_loc_conf_t  *iocf;
+
+    n = lua_gettop(L);
+
+    if (NGX_UNLIKELY(n != 1 && n != 2)) {
+        return luaL_error(L, "expecting one or two arguments, but got %d", n);
+    }
+
+    r = ngx_http_lua_get_request(L);
+    if (NGX_UNLIKELY(r == NULL)) {
+        return luaL_error(L, "no request found");
+    }
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_rawgeti(L, 1, NGX_HTTP_LUA_IO_FILE_CTX_INDEX);
+
+    file_ctx = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io flush");
+
+    if (file_ctx == NULL || file_ctx->closed) {
+        iocf = ngx_http_get_module_loc_conf(r, ngx_http_lua_io_module);
+        if (iocf->log_errors) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "attempt to flush data on a closed file object");
+        }
+
+        lua_pushnil(L);
+        lua_pushliteral(L, "closed");
+        return 2;
+    }
+
+    if (NGX_UNLIKELY(r != file_ctx->request)) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "bad request");
+        return 2;
+    }
+
+    ngx_http_lua_io_check_busy_reading(r, file_ctx, L);
+    ngx_http_lua_io_check_busy_writing(r, file_ctx, L);
+    ngx_http_lua_io_check_busy_flushing(r, file_ctx, L);
+
+    if (NGX_UNLIKELY(!(file_ctx->mode & NGX_HTTP_LUA_IO_FILE_WRITE_MODE))) {
+
+        /* FIXME need to be compatible with libc? */
+        lua_pushnil(L);
+        lua_pushliteral(L, "operation not permitted");
+        return 2;
+    }
+
+    mode = (n == 2) ? ngx_http_lua_io_get_sync_mode(L, 2, file_ctx) : 0;
+
+    /*
+     * the sync is not done by the write task, the concurrent durable
+     * flushes of the same file are coalesced into one sync call
+     */
+
+    if (mode && file_ctx->bufs_out == NULL) {
+        rc = ngx_http_lua_io_sync_join(r, file_ctx, mode);
+
+        if (NGX_UNLIKELY(rc == NGX_ERROR)) {
+            return ngx_http_lua_io_handle_error(L, r, file_ctx);
+        }
+
+        if (rc == NGX_DECLINED) {
+            lua_pushinteger(L, 1);
+            return 1;
+        }
+
+    } else {
+        if (NGX_UNLIKELY(ngx_http_lua_io_thread_post_write_task(file_ctx,
+                                                        file_ctx->bufs_out, 0)
+                         == NGX_ERROR))
+        {
+            return ngx_http_lua_io_handle_error(L, r, file_ctx);
+        }
+
+        file_ctx->durable = mode;
+    }
+
+    ngx_http_lua_io_before_yield(r, file_ctx);
+
+    file_ctx->flush_waiting = 1;
+    file_ctx->bufs_out = NULL;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io flush saved co ctx:%p", file_ctx->coctx);
+
+    return lua_yield(L, 0);
+}
+
+
+static ngx_uint_t
+ngx_http_lua_io_get_sync_mode(lua_State *L, int index,
+    ngx_http_lua_io_file_ctx_t *file_ctx)
+{
+    ngx_uint_t  mode;
+
+    if (lua_type(L, index) == LUA_TSTRING) {
+        mode = ngx_http_lua_io_sync_enum[luaL_checkoption(L, index, NULL,
+                                                ngx_http_lua_io_sync_list)];
+
+    } else {
+        mode = lua_toboolean(L, index) ? NGX_HTTP_LUA_IO_SYNC_FULL : 0;
+    }
+
+#if !(NGX_HAVE_SYNC_FILE_RANGE)
+    if (mode == NGX_HTTP_LUA_IO_SYNC_RANGE) {
+        mode = NGX_HTTP_LUA_IO_SYNC_DATA;
+    }
+#endif
+
+    /* each write of the files opened with O_SYNC or O_DSYNC is durable */
+
+    if (file_ctx->osync
+        || (file_ctx->odsync && mode != NGX_HTTP_LUA_IO_SYNC_FULL))
+    {
+        return 0;
+    }
+
+    return mode;
+}
+
+
+static void
+ngx_http_lua_io_file_dirty(ngx_http_lua_io_file_ctx_t *file_ctx, off_t start,
+    off_t end)
+{
+    if (start >= end) {
+        return;
+    }
+
+    if (file_ctx->dirty_start >= file_ctx->dirty_end) {
+        file_ctx->dirty_start = start;
+        file_ctx->dirty_end = end;
+        return;
+    }
+
+    if (start < file_ctx->dirty_start) {
+        file_ctx->dirty_start = start;
+    }
+
+    if (end > file_ctx->dirty_end) {
+        file_ctx->dirty_end = end;
+    }
+}
+
+
+static ngx_int_t
+ngx_http_lua_io_sync_join(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx, ngx_uint_t mode)
+{
+    off_t                      start, end;
+    ngx_http_lua_io_syncer_t  *syncer;
+
+    start = 0;
+    end = NGX_MAX_OFF_T_VALUE;
+
+    if (mode == NGX_HTTP_LUA_IO_SYNC_RANGE) {
+        if (file_ctx->dirty_start >= file_ctx->dirty_end) {
+
+            /* nothing was written since the last durable flush */
+
+            return NGX_DECLINED;
+        }
+
+        start = file_ctx->dirty_start;
+
+        /* the appended data might be beyond the offset known by us */
+
+        if (!(file_ctx->mode & NGX_HTTP_LUA_IO_FILE_APPEND_MODE)) {
+            end = file_ctx->dirty_end;
+        }
+    }
+
+    /* the file identity was taken by the open task, off the event loop */
+
+    syncer = ngx_http_lua_io_syncer_get(file_ctx);
+    if (syncer == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_queue_empty(&syncer->waiters)) {
+        syncer->mode = mode;
+        syncer->start = start;
+        syncer->end = end;
+
+    } else {
+        if (mode > syncer->mode) {
+            syncer->mode = mode;
+        }
+
+        if (start < syncer->start) {
+            syncer->start = start;
+        }
+
+        if (end > syncer->end) {
+            syncer->end = end;
+        }
+    }
+
+    ngx_queue_insert_tail(&syncer->waiters, &file_ctx->sync_queue);
+
+    file_ctx->dirty_start = 0;
+    file_ctx->dirty_end = 0;
+
+    file_ctx->syncer = syncer;
+    file_ctx->syncing = 1;
+    file_ctx->sync_failed = 0;
+    file_ctx->sync_err = 0;
+
+    ngx_http_lua_io_fsync_flushes++;
+
+    ngx_log_debug5(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io sync join fd:%d mode:%ui @%O-%O, busy:%d",
+                   syncer->fd, mode, start, end, syncer->busy);
+
+    /*
+     * the flushes done in the same event loop iteration share one sync,
+     * the ones done while it is running share the next one
+     */
+
+    if (!syncer->busy && !syncer->event.posted) {
+        ngx_post_event(&syncer->event, &ngx_posted_events);
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_http_lua_io_syncer_t *
+ngx_http_lua_io_syncer_get(ngx_http_lua_io_file_ctx_t *file_ctx)
+{
+    ngx_fd_t                   fd;
+    ngx_queue_t               *q;
+    ngx_thread_task_t         *task;
+    ngx_http_lua_io_syncer_t  *syncer;
+
+    if (ngx_http_lua_io_syncers.next == NULL) {
+        ngx_queue_init(&ngx_http_lua_io_syncers);
+        ngx_queue_init(&ngx_http_lua_io_free_syncers);
+    }
+
+    for (q = ngx_queue_head(&ngx_http_lua_io_syncers);
+         q != ngx_queue_sentinel(&ngx_http_lua_io_syncers);
+         q = ngx_queue_next(q))
+    {
+        syncer = ngx_queue_data(q, ngx_http_lua_io_syncer_t, queue);
+
+        if (syncer->uniq == file_ctx->uniq && syncer->dev == file_ctx->dev) {
+            return syncer;
+        }
+    }
+
+    /* the file object might be closed while the fsync is in progress */
+
+    fd = dup(file_ctx->fd);
+    if (fd == NGX_INVALID_FILE) {
+        file_ctx->error = ngx_errno;
+        return NULL;
+    }
+
+    if (!ngx_queue_empty(&ngx_http_lua_io_free_syncers)) {
+        q = ngx_queue_head(&ngx_http_lua_io_free_syncers);
+        ngx_queue_remove(q);
+
+        syncer = ngx_queue_data(q, ngx_http_lua_io_syncer_t, queue);
+
+    } else {
+
+        /* the syncers are reused until the worker exits */
+
+        task = NULL;
+
+        syncer = ngx_pcalloc(ngx_cycle->pool,
+                             sizeof(ngx_http_lua_io_syncer_t));
+        if (syncer) {
+            task = ngx_thread_task_alloc(ngx_cycle->pool,
+                                         sizeof(ngx_http_lua_io_thread_ctx_t));
+        }
+
+        if (task == NULL) {
+            if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+                ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                              ngx_close_file_n " \"%V\" failed",
+                              &file_ctx->name);
+            }
+
+            file_ctx->ft_type |= NGX_HTTP_LUA_IO_FT_NO_MEMORY;
+            return NULL;
+        }
+
+        task->handler = ngx_http_lua_io_thread_sync;
+        task->event.data = syncer;
+        task->event.handler = ngx_http_lua_io_sync_done;
+
+        syncer->task = task;
+
+        syncer->event.data = syncer;
+        syncer->event.handler = ngx_http_lua_io_sync_event_handler;
+        syncer->event.log = ngx_cycle->log;
+
+        ngx_queue_init(&syncer->waiters);
+        ngx_queue_init(&syncer->busy_waiters);
+    }
+
+    syncer->dev = file_ctx->dev;
+    syncer->uniq = file_ctx->uniq;
+    syncer->fd = fd;
+    syncer->thread_pool = file_ctx->thread_pool;
+
+    ngx_queue_insert_tail(&ngx_http_lua_io_syncers, &syncer->queue);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "lua io syncer of \"%V\" created, fd:%d",
+                   &file_ctx->name, fd);
+
+    return syncer;
+}
+
+
+static void
+ngx_http_lua_io_sync_event_handler(ngx_event_t *ev)
+{
+    ngx_http_lua_io_syncer_t *syncer = ev->data;
+
+    if (!syncer->busy && !ngx_queue_empty(&syncer->waiters)) {
+        ngx_http_lua_io_sync_start(syncer);
+    }
+}
+
+
+static void
+ngx_http_lua_io_sync_start(ngx_http_lua_io_syncer_t *syncer)
+{
+    ngx_http_lua_io_thread_ctx_t  *thread_ctx;
+
+    if (syncer->event.posted) {
+        ngx_delete_posted_event(&syncer->event);
+    }
+
+    ngx_queue_add(&syncer->busy_waiters, &syncer->waiters);
+    ngx_queue_init(&syncer->waiters);
+
+    thread_ctx = syncer->task->ctx;
+    thread_ctx->fd = syncer->fd;
+    thread_ctx->sync_mode = syncer->mode;
+    thread_ctx->offset = syncer->start;
+    thread_ctx->sync_size = (syncer->end == NGX_MAX_OFF_T_VALUE)
+                            ? 0 : syncer->end - syncer->start;
+
+    syncer->busy = 1;
+
+    ngx_http_lua_io_fsyncs++;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "lua io sync start fd:%d mode:%ui",
+                   syncer->fd, syncer->mode);
+
+    if (ngx_thread_task_post(syncer->thread_pool, syncer->task) == NGX_OK) {
+        syncer->failed = 0;
+        return;
+    }
+
+    /* the waiters are woken up later, like the appender does */
+
+    syncer->failed = 1;
+
+    ngx_post_event(&syncer->task->event, &ngx_posted_events);
+}
+
+
+static void
+ngx_http_lua_io_sync_done(ngx_event_t *ev)
+{
+    ngx_http_lua_io_syncer_t *syncer = ev->data;
+
+    ngx_err_t                      err;
+    ngx_uint_t                     failed;
+    ngx_queue_t                   *q, done;
+    ngx_connection_t              *c;
+    ngx_http_request_t            *r;
+    ngx_http_lua_ctx_t            *lctx;
+    ngx_http_lua_io_file_ctx_t    *file_ctx;
+    ngx_http_lua_io_thread_ctx_t  *thread_ctx;
+
+    ev->complete = 0;
+
+    thread_ctx = syncer->task->ctx;
+
+    failed = syncer->failed;
+    err = failed ? 0 : thread_ctx->err;
+
+    if (err) {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, err,
+                      "lua io sync fd:%d mode:%ui failed",
+                      syncer->fd, thread_ctx->sync_mode);
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "lua io sync done fd:%d, failed:%ui", syncer->fd, failed);
+
+    syncer->busy = 0;
+    syncer->failed = 0;
+
+    ngx_queue_init(&done);
+
+    if (!ngx_queue_empty(&syncer->busy_waiters)) {
+        ngx_queue_add(&done, &syncer->busy_waiters);
+        ngx_queue_init(&syncer->busy_waiters);
+    }
+
+    /* the flushes which joined during this fsync go on */
+
+    if (!ngx_queue_empty(&syncer->waiters)) {
+        ngx_http_lua_io_sync_start(syncer);
+    }
+
+    while (!ngx_queue_empty(&done)) {
+        q = ngx_queue_head(&done);
+        ngx_queue_remove(q);
+
+        file_ctx = ngx_queue_data(q, ngx_http_lua_io_file_ctx_t, sync_queue);
+
+        file_ctx->syncing = 0;
+        file_ctx->sync_failed = failed;
+        file_ctx->sync_err = err;
+
+        r = file_ctx->request;
+        c = r->connection;
+
+        lctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+
+        lctx->resume_handler = ngx_http_lua_io_resume;
+        lctx->cur_co_ctx = file_ctx->coctx;
+
+        r->write_event_handler(r);
+        ngx_http_run_posted_requests(c);
+    }
+
+    ngx_http_lua_io_syncer_release(syncer);
+}
+
+
+static void
+ngx_http_lua_io_syncer_release(ngx_http_lua_io_syncer_t *syncer)
+{
+    if (syncer->busy
+        || syncer->fd == NGX_INVALID_FILE
+        || !ngx_queue_empty(&syncer->waiters))
+    {
+        return;
+    }
+
+    /* nobody waits for the fsync of the file any more */
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "lua io syncer release fd:%d", syncer->fd);
+
+    if (syncer->event.posted) {
+        ngx_delete_posted_event(&syncer->event);
+    }
+
+    if (ngx_close_file(syncer->fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " failed");
+    }
+
+    syncer->fd = NGX_INVALID_FILE;
+
+    ngx_queue_remove(&syncer->queue);
+    ngx_queue_insert_head(&ngx_http_lua_io_free_syncers, &syncer->queue);
+}
+
+
+static int
+ngx_http_lua_io_sync_retvals(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx, lua_State *L)
+{
+    ngx_err_t   err;
+    ngx_uint_t  failed, body;
+
+    err = file_ctx->sync_err;
+    failed = file_ctx->sync_failed;
+    body = file_ctx->writing_body;
+
+    file_ctx->syncer = NULL;
+    file_ctx->sync_err = 0;
+    file_ctx->sync_failed = 0;
+    file_ctx->flush_waiting = 0;
+    file_ctx->writing_body = 0;
+
+    if (file_ctx->closing) {
+        file_ctx->closing = 0;
+        ngx_http_lua_io_file_finalize(r, file_ctx);
+
+        if (!failed && !err && (file_ctx->ft_type || file_ctx->error)) {
+            return ngx_http_lua_io_handle_error(L, r, file_ctx);
+        }
+    }
+
+    if (failed) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "task post failed");
+        return 2;
+    }
+
+    if (err) {
+        file_ctx->error = err;
+        return ngx_http_lua_io_handle_error(L, r, file_ctx);
+    }
+
+    /* file:write_request_body() returns the size of the body */
+
+    lua_pushinteger(L, body ? file_ctx->nbytes : 1);
+    return 1;
+}
+
+
+static int
+ngx_http_lua_io_file_send(lua_State *L)
+{
+    int                          n;
+    off_t                        offset, len;
+    ngx_file_t                  *file;
+    ngx_http_request_t          *r;
+    ngx_http_lua_ctx_t          *ctx;
+    ngx_http_lua_io_op_t        *op;
+    ngx_http_lua_io_file_ctx_t  *file_ctx;
+    ngx_http_lua_io_loc_conf_t  *iocf;
+
+    n = lua_gettop(L);
+    if (NGX_UNLIKELY(n < 1 || n > 3)) {
+        return luaL_error(L, "expecting 1 to 3 arguments "
+                          "(including the object), but got %d", n);
+    }
+
+    r = ngx_http_lua_get_request(L);
+    if (NGX_UNLIKELY(r == NULL)) {
+        return luaL_error(L, "no request found");
+    }
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+    if (NGX_UNLIKELY(ctx == NULL)) {
+        return luaL_error(L, "no ctx found");
+    }
+
+    ngx_http_lua_check_context(L, ctx, NGX_HTTP_LUA_CONTEXT_REWRITE
+                               |NGX_HTTP_LUA_CONTEXT_ACCESS
+                               |NGX_HTTP_LUA_CONTEXT_CONTENT);
+
+    if (NGX_UNLIKELY(ctx->acquired_raw_req_socket)) {
+        return luaL_error(L, "raw request socket acquired");
+    }
+
+    if (NGX_UNLIKELY(ctx->eof)) {
+        return luaL_error(L, "seen eof");
+    }
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    offset = 0;
+    len = -1;
+
+    if (n > 1 && !lua_isnil(L, 2)) {
+        offset = (off_t) luaL_checknumber(L, 2);
+        if (NGX_UNLIKELY(offset < 0)) {
+            return luaL_argerror(L, 2, "bad offset argument");
+        }
+    }
+
+    if (n > 2 && !lua_isnil(L, 3)) {
+        len = (off_t) luaL_checknumber(L, 3);
+        if (NGX_UNLIKELY(len < 0)) {
+            return luaL_argerror(L, 3, "bad length argument");
+        }
+    }
+
+    lua_rawgeti(L, 1, NGX_HTTP_LUA_IO_FILE_CTX_INDEX);
+    file_ctx = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    if (file_ctx == NULL || file_ctx->closed) {
+        iocf = ngx_http_get_module_loc_conf(r, ngx_http_lua_io_module);
+
+        if (iocf->log_errors) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "attempt to send data from a closed file object");
+        }
+
+        lua_pushnil(L);
+        lua_pushliteral(L, "closed");
+        return 2;
+    }
+
+    if (NGX_UNLIKELY(file_ctx->request != r)) {
+        return luaL_error(L, "bad request");
+    }
+
+    if (NGX_UNLIKELY(!(file_ctx->mode & NGX_HTTP_LUA_IO_FILE_READ_MODE))) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "operation not permitted");
+        return 2;
+    }
+
+    if (r->header_only || len == 0) {
+        lua_pushinteger(L, 0);
+        return 1;
+    }
+
+    file = ngx_http_lua_io_get_send_file(r, file_ctx);
+    if (NGX_UNLIKELY(file == NULL)) {
+        lua_pushnil(L);
+        ngx_http_lua_io_push_error(L, ngx_errno);
+        return 2;
+    }
+
+    op = ngx_http_lua_io_op_create(r);
+    if (NGX_UNLIKELY(op == NULL)) {
+        return luaL_error(L, "no memory");
+    }
+
+    ngx_http_lua_io_op_attach_file(op, L, file_ctx);
+
+    /*
+     * the file size is taken in the thread pool, since fstat() can block
+     * on the network file systems (e.g. NFS and FUSE) as well
+     */
+
+    op->data = file;
+    op->thread_ctx.fd = file->fd;
+    op->thread_ctx.offset = offset;
+    op->thread_ctx.file_size = len;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io file send fd:%d, %O @%O", file->fd, len, offset);
+
+    return ngx_http_lua_io_op_post(r, L, op, ngx_http_lua_io_thread_stat,
+                                   ngx_http_lua_io_send_retvals);
+}
+
+
+static int
+ngx_http_lua_io_send_retvals(ngx_http_request_t *r, ngx_http_lua_io_op_t *op,
+    lua_State *L)
+{
+    off_t                   size, offset, len;
+    ngx_int_t               rc;
+    ngx_buf_t              *b;
+    ngx_file_t             *file;
+    ngx_chain_t            *cl;
+    ngx_http_lua_ctx_t     *ctx;
+    ngx_http_lua_io_ctx_t  *ioctx;
+
+    if (op->thread_ctx.err) {
+        lua_pushnil(L);
+        ngx_http_lua_io_push_error(L, op->thread_ctx.err);
+        return 2;
+    }
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+    if (NGX_UNLIKELY(ctx == NULL)) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "no ctx found");
+        return 2;
+    }
+
+    /* another light thread might have finished the response meanwhile */
+
+    if (NGX_UNLIKELY(ctx->eof)) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "seen eof");
+        return 2;
+    }
+
+    file = op->data;
+    offset = op->thread_ctx.offset;
+    len = op->thread_ctx.file_size;
+    size = ngx_file_size(&op->thread_ctx.info);
+
+    if (offset >= size) {
+        lua_pushinteger(L, 0);
+        return 1;
+    }
+
+    if (len == -1 || len > size - offset) {
+        len = size - offset;
+    }
+
+    ioctx = ngx_http_get_module_ctx(r, ngx_http_lua_io_module);
+
+    cl = ngx_chain_get_free_buf(r->pool, &ioctx->free_send_bufs);
+    if (NGX_UNLIKELY(cl == NULL)) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "no memory");
+        return 2;
+    }
+
+    b = cl->buf;
+
+    ngx_memzero(b, sizeof(ngx_buf_t));
+
+    b->in_file = 1;
+    b->file = file;
+    b->file_pos = offset;
+    b->file_last = offset + len;
+    b->tag = (ngx_buf_tag_t) &ngx_http_lua_io_module;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io file send queued fd:%d, %O @%O",
+                   file->fd, len, offset);
+
+    rc = ngx_http_lua_send_chain_link(r, ctx, cl);
+
+    ngx_chain_update_chains(r->pool, &ioctx->free_send_bufs,
+                            &ioctx->busy_send_bufs, &cl,
+                            (ngx_buf_tag_t) &ngx_http_lua_io_module);
+
+    if (NGX_UNLIKELY(rc == NGX_ERROR)) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "nginx output filter error");
+        return 2;
+    }
+
+    lua_pushnumber(L, (lua_Number) len);
+    return 1;
+}
+
+
+static ngx_file_t *
+ngx_http_lua_io_get_send_file(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx)
+{
+    ngx_fd_t                  fd;
+    ngx_file_t               *file;
+    ngx_pool_cleanup_t       *cln;
+    ngx_pool_cleanup_file_t  *clnf;
+
+    if (file_ctx->send_file) {
+        return file_ctx->send_file;
+    }
+
+    /*
+     * the sent buffers can stay in the output chain after the file object
+     * is closed, so they refer to a duplicate of the descriptor, which lives
+     * as long as the request
+     */
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_pool_cleanup_file_t));
+    if (cln == NULL) {
+        ngx_set_errno(NGX_ENOMEM);
+        return NULL;
+    }
+
+    file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
+    if (file == NULL) {
+        ngx_set_errno(NGX_ENOMEM);
+        return NULL;
+    }
+
+    fd = dup(file_ctx->fd);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    file->fd = fd;
+    file->name = file_ctx->name;
+    file->log = r->connection->log;
+    file->directio = file_ctx->direct;
+
+    cln->handler = ngx_pool_cleanup_file;
+    clnf = cln->data;
+
+    clnf->fd = fd;
+    clnf->name = file_ctx->name.data;
+    clnf->log = r->connection->log;
+
+    file_ctx->send_file = file;
+
+    return file;
+}
+
+
+static int
+ngx_http_lua_io_file_seek(lua_State *L)
+{
+    off_t                        offset;
+    int                          n, whence, opt;
+    ngx_http_request_t          *r;
+    ngx_http_lua_io_ctx_t       *ioctx;
+    ngx_http_lua_io_loc_conf_t  *iocf;
+    ngx_http_lua_io_file_ctx_t  *file_ctx;
+
+    n = lua_gettop(L);
+
+    if (NGX_UNLIKELY(n > 3)) {
+        return luaL_error(L, "expecting one, two or three arguments,"
+                          " but got %d", n);
+    }
+
+    r = ngx_http_lua_get_request(L);
+    if (NGX_UNLIKELY(r == NULL)) {
+        return luaL_error(L, "no request found");
+    }
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_rawgeti(L, 1, NGX_HTTP_LUA_IO_FILE_CTX_INDEX);
+
+    file_ctx = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    whence = SEEK_CUR;
+    offset = 0;
+
+    if (n >= 2) {
+        opt = luaL_checkoption(L, 2, "cur", ngx_http_lua_io_seek_list);
+        whence = ngx_http_lua_io_seek_enum[opt];
+
+        if (n >= 3) {
+            offset = (off_t) luaL_checkinteger(L, 3);
+        }
+    }
+
+    if (file_ctx == NULL || file_ctx->closed) {
+        iocf = ngx_http_get_module_loc_conf(r, ngx_http_lua_io_module);
+        if (iocf->log_errors) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "attempt to flush data on a closed file object");
+        }
+
+        lua_pushnil(L);
+        lua_pushliteral(L, "closed");
+        return 2;
+    }
+
+    ngx_http_lua_io_check_busy_reading(r, file_ctx, L);
+    ngx_http_lua_io_check_busy_writing(r, file_ctx, L);
+    ngx_http_lua_io_check_busy_flushing(r, file_ctx, L);
+
+    if (NGX_UNLIKELY(r != file_ctx->request)) {
+        return luaL_error(L, "bad request");
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io seek whence:%d offset:%O", whence, offset);
+
+    ngx_http_lua_io_read_ahead_drop(r, file_ctx);
+
+    file_ctx->lines_next = 0;
+    file_ctx->lines_n = 0;
+
+    if (file_ctx->bufs_in) {
+
+        /* FIXME keep these buffers and use them in the proper timing? */
+
+        ioctx = ngx_http_get_module_ctx(r, ngx_http_lua_io_module);
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "lua io seek drain read chain:%p", file_ctx->bufs_in);
+
+        ngx_http_lua_io_free_bufs(r, file_ctx, &ioctx->free_read_bufs,
+                                  file_ctx->bufs_in);
+
+        file_ctx->bufs_in = NULL;
+        file_ctx->buf_in = NULL;
+
+        ngx_memzero(&file_ctx->buffer, sizeof(ngx_buf_t));
+    }
+
+    if (file_ctx->bufs_out == NULL) {
+        goto seek;
+    }
+
+    if (NGX_UNLIKELY(ngx_http_lua_io_thread_post_write_task(file_ctx,
+                                                            file_ctx->bufs_out,
+                                                            0)
+                     == NGX_ERROR))
+    {
+        return ngx_http_lua_io_handle_error(L, r, file_ctx);
+    }
+
+    file_ctx->write_waiting = 1;
+    file_ctx->seeking = 1;
+    file_ctx->bufs_out = NULL;
+    file_ctx->whence = whence;
+    file_ctx->seek_offset = offset;
+
+    ngx_http_lua_io_before_yield(r, file_ctx);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io seek saved co ctx:%p", file_ctx->coctx);
+
+    return lua_yield(L, 0);
+
+seek:
+
+    return ngx_http_lua_io_file_do_seek(file_ctx, r, L, offset, whence);
+}
+
+
+static int
+ngx_http_lua_io_file_lines(lua_State *L)
+{
+    int                          n;
+    lua_Integer                  batch;
+    ngx_http_request_t          *r;
+
+    n = lua_gettop(L);
+
+    if (NGX_UNLIKELY(n > 2)) {
+        return luaL_error(L, "expecting one or two arguments, but got %d", n);
+    }
+
+    r = ngx_http_lua_get_request(L);
+    if (NGX_UNLIKELY(r == NULL)) {
+        return luaL_error(L, "no request found");
+    }
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    batch = 0;
+
+    if (n == 2 && !lua_isnil(L, 2)) {
+        batch = luaL_checkinteger(L, 2);
+        if (NGX_UNLIKELY(batch <= 0)) {
+            return luaL_argerror(L, 2, "bad batch argument");
+        }
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io file lines created an iterator, batch:%i",
+                   (ngx_int_t) batch);
+
+    lua_settop(L, 1);
+    lua_pushinteger(L, batch);
+
+    lua_pushcclosure(L, ngx_http_lua_io_file_lines_iter, 2);
+    return 1;
+}
+
+
+static int
+ngx_http_lua_io_file_lines_iter(lua_State *L)
+{
+    lua_Integer                  batch;
+    ngx_http_request_t          *r;
+    ngx_http_lua_io_file_ctx_t  *file_ctx;
+    ngx_http_lua_io_loc_conf_t  *iocf;
+
+    r = ngx_http_lua_get_request(L);
+    if (NGX_UNLIKELY(r == NULL)) {
+        return luaL_error(L, "no request found");
+    }
+
+    lua_rawgeti(L, lua_upvalueindex(1), NGX_HTTP_LUA_IO_FILE_CTX_INDEX);
+    file_ctx = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    if (file_ctx == NULL || file_ctx->closed) {
+        iocf = ngx_http_get_module_loc_conf(r, ngx_http_lua_io_module);
+        if (iocf->log_errors) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "attempt to read a line from a closed file object");
+        }
+
+        lua_pushnil(L);
+        lua_pushliteral(L, "closed");
+        return 2;
+    }
+
+    if(NGX_UNLIKELY(file_ctx->request != r)) {
+        return luaL_error(L, "bad request");
+    }
+
+    ngx_http_lua_io_check_busy_reading(r, file_ctx, L);
+    ngx_http_lua_io_check_busy_writing(r, file_ctx, L);
+    ngx_http_lua_io_check_busy_flushing(r, file_ctx, L);
+
+    if (NGX_UNLIKELY(!(file_ctx->mode & NGX_HTTP_LUA_IO_FILE_READ_MODE))) {
+
+        /* FIXME need to be compatible with libc? */
+        lua_pushnil(L);
+        lua_pushliteral(L, "operation not permitted");
+        return 2;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io file line iterator called");
+
+    batch = lua_tointeger(L, lua_upvalueindex(2));
+
+    if (batch && file_ctx->lines_next < file_ctx->lines_n) {
+
+        /* hand out the lines of the current batch */
+
+        lua_rawgeti(L, LUA_REGISTRYINDEX, file_ctx->lines_ref);
+        lua_rawgeti(L, -1, (int) ++file_ctx->lines_next);
+        return 1;
+    }
+
+    file_ctx->input_filter = ngx_http_lua_io_read_line;
+    file_ctx->rest = 0;
+    file_ctx->max_lines = (ngx_uint_t) batch;
+    file_ctx->max_bytes = NGX_MAX_SIZE_T_VALUE;
+    file_ctx->lines_batch = (batch != 0);
+
+    ngx_http_lua_io_read_ahead_anchor(L, lua_upvalueindex(1), file_ctx);
+
+    return ngx_http_lua_io_file_read_helper(r, file_ctx, L);
+}
+
+
+static int
+ngx_http_lua_io_file_read_until(lua_State *L)
+{
+    int                          n, inclusive;
+    size_t                       len;
+    ngx_http_request_t          *r;
+    ngx_http_lua_io_loc_conf_t  *iocf;
+
+    n = lua_gettop(L);
+
+    if (NGX_UNLIKELY(n != 2 && n != 3)) {
+        return luaL_error(L, "expecting two or three arguments "
+                          "(including the object), but got %d", n);
+    }
+
+    r = ngx_http_lua_get_request(L);
+    if (NGX_UNLIKELY(r == NULL)) {
+        return luaL_error(L, "no request found");
+    }
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    (void) luaL_checklstring(L, 2, &len);
+
+    iocf = ngx_http_get_module_loc_conf(r, ngx_http_lua_io_module);
+
+    /* a partial delimiter must fit in the read buffer */
+
+    if (NGX_UNLIKELY(len == 0 || len >= iocf->read_buf_size)) {
+        return luaL_argerror(L, 2, "bad delimiter argument");
+    }
+
+    inclusive = 0;
+
+    if (n == 3 && !lua_isnil(L, 3)) {
+        luaL_checktype(L, 3, LUA_TTABLE);
+
+        lua_getfield(L, 3, "inclusive");
+
+        switch (lua_type(L, -1)) {
+        case LUA_TNIL:
+            break;
+
+        case LUA_TBOOLEAN:
+            inclusive = lua_toboolean(L, -1);
+            break;
+
+        default:
+            return luaL_error(L, "bad \"inclusive\" option");
+        }
+
+        lua_pop(L, 1);
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io file read until created an iterator, "
+                   "delimiter len:%uz inclusive:%d", len, inclusive);
+
+    lua_settop(L, 2);
+    lua_pushboolean(L, inclusive);
+
+    lua_pushcclosure(L, ngx_http_lua_io_file_read_until_iter, 3);
+    return 1;
+}
+
+
+static int
+ngx_http_lua_io_file_read_until_iter(lua_State *L)
+{
+    size_t                       len;
+    const char                  *p;
+    ngx_http_request_t          *r;
+    ngx_http_lua_io_file_ctx_t  *file_ctx;
+    ngx_http_lua_io_loc_conf_t  *iocf;
+
+    r = ngx_http_lua_get_request(L);
+    if (NGX_UNLIKELY(r == NULL)) {
+        return luaL_error(L, "no request found");
+    }
+
+    lua_rawgeti(L, lua_upvalueindex(1), NGX_HTTP_LUA_IO_FILE_CTX_INDEX);
+    file_ctx = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    if (file_ctx == NULL || file_ctx->closed) {
+        iocf = ngx_http_get_module_loc_conf(r, ngx_http_lua_io_module);
+        if (iocf->log_errors) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "attempt to read data from a closed file object");
+        }
+
+        lua_pushnil(L);
+        lua_pushliteral(L, "closed");
+        return 2;
+    }
+
+    if (NGX_UNLIKELY(file_ctx->request != r)) {
+        return luaL_error(L, "bad request");
+    }
+
+    ngx_http_lua_io_check_busy_reading(r, file_ctx, L);
+    ngx_http_lua_io_check_busy_writing(r, file_ctx, L);
+    ngx_http_lua_io_check_busy_flushing(r, file_ctx, L);
+
+    if (NGX_UNLIKELY(!(file_ctx->mode & NGX_HTTP_LUA_IO_FILE_READ_MODE))) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "operation not permitted");
+        return 2;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io file read until iterator called");
+
+    /*
+     * the delimiter string is kept by the closure,
+     * which is alive until the read is done
+     */
+
+    p = lua_tolstring(L, lua_upvalueindex(2), &len);
+
+    file_ctx->delimiter.data = (u_char *) p;
+    file_ctx->delimiter.len = len;
+    file_ctx->inclusive = lua_toboolean(L, lua_upvalueindex(3));
+
+    file_ctx->input_filter = ngx_http_lua_io_read_until;
+    file_ctx->rest = 0;
+    file_ctx->max_lines = 0;
+    file_ctx->lines_batch = 0;
+
+    ngx_http_lua_io_read_ahead_anchor(L, lua_upvalueindex(1), file_ctx);
+
+    return ngx_http_lua_io_file_read_helper(r, file_ctx, L);
+}
+
+
+static int
+ngx_http_lua_io_file_wait_growth(lua_State *L)
+{
+    int                          n;
+    ngx_msec_t                   timeout;
+    lua_Number                   sec;
+    ngx_http_request_t          *r;
+    ngx_http_lua_io_op_t        *op;
+    ngx_http_lua_io_file_ctx_t  *file_ctx;
+    ngx_http_lua_io_loc_conf_t  *iocf;
+
+    n = lua_gettop(L);
+
+    if (NGX_UNLIKELY(n != 1 && n != 2)) {
+        return luaL_error(L, "expecting one or two arguments "
+                          "(including the object), but got %d", n);
+    }
+
+    r = ngx_http_lua_get_request(L);
+    if (NGX_UNLIKELY(r == NULL)) {
+        return luaL_error(L, "no request found");
+    }
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    timeout = 0;
+
+    if (n == 2 && !lua_isnil(L, 2)) {
+        sec = luaL_checknumber(L, 2);
+
+        if (NGX_UNLIKELY(sec < 0 || sec > NGX_MAX_INT32_VALUE / 1000)) {
+            return luaL_argerror(L, 2, "bad timeout argument");
+        }
+
+        timeout = (ngx_msec_t) (sec * 1000);
+    }
+
+    lua_rawgeti(L, 1, NGX_HTTP_LUA_IO_FILE_CTX_INDEX);
+    file_ctx = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    if (file_ctx == NULL || file_ctx->closed) {
+        iocf = ngx_http_get_module_loc_conf(r, ngx_http_lua_io_module);
+
+        if (iocf->log_errors) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "attempt to wait on a closed file object");
+        }
+
+        lua_pushnil(L);
+        lua_pushliteral(L, "closed");
+        return 2;
+    }
+
+    if (NGX_UNLIKELY(file_ctx->request != r)) {
+        return luaL_error(L, "bad request");
+    }
+
+    ngx_http_lua_io_check_busy_reading(r, file_ctx, L);
+    ngx_http_lua_io_check_busy_writing(r, file_ctx, L);
+    ngx_http_lua_io_check_busy_flushing(r, file_ctx, L);
+
+    if (NGX_UNLIKELY(!(file_ctx->mode & NGX_HTTP_LUA_IO_FILE_READ_MODE))) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "operation not permitted");
+        return 2;
+    }
+
+#if (NGX_HAVE_INOTIFY)
+
+    /*
+     * the watch is added before the file is checked,
+     * so no change is missed between the check and the wait
+     */
+
+    if (file_ctx->notify == NULL
+        && ngx_http_lua_io_notify_init(r, file_ctx) != NGX_OK)
+    {
+        return ngx_http_lua_io_handle_error(L, r, file_ctx);
+    }
+
+    if (ngx_http_lua_io_notify_drain(file_ctx) == NGX_ERROR) {
+        return ngx_http_lua_io_handle_error(L, r, file_ctx);
+    }
+
+    /* the file is checked by a task, it's posted again on every change */
+
+    op = ngx_http_lua_io_op_create(r);
+    if (NGX_UNLIKELY(op == NULL)) {
+        return luaL_error(L, "no memory");
+    }
+
+    ngx_http_lua_io_op_attach_file(op, L, file_ctx);
+
+    op->thread_ctx.path = file_ctx->name.data;
+
+    file_ctx->growth_op = op;
+    file_ctx->growth = NGX_DECLINED;
+    file_ctx->growth_recheck = 0;
+    file_ctx->growth_timedout = 0;
+
+    if (NGX_UNLIKELY(ngx_http_lua_io_growth_post(r, file_ctx) != NGX_OK)) {
+        file_ctx->growth_op = NULL;
+        ngx_http_lua_io_op_done(r, L, op);
+
+        lua_pushnil(L);
+        lua_pushliteral(L, "task post failed");
+        return 2;
+    }
+
+    if (timeout) {
+        ngx_add_timer(file_ctx->notify->read, timeout);
+    }
+
+    file_ctx->read_waiting = 1;
+    file_ctx->growth_coctx = ngx_http_lua_io_prepare_yield(r,
+                                        ngx_http_lua_io_growth_coctx_cleanup,
+                                        file_ctx);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io file wait growth @%O, timeout:%M",
+                   file_ctx->read_offset, timeout);
+
+    return lua_yield(L, 0);
+
+#else
+
+    (void) op;
+    (void) timeout;
+
+    lua_pushnil(L);
+    lua_pushliteral(L, "not supported");
+    return 2;
+
+#endif
+}
+
+
+#if (NGX_HAVE_INOTIFY)
+
+static ngx_int_t
+ngx_http_lua_io_notify_init(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx)
+{
+    int                fd;
+    uint32_t           mask;
+    ngx_connection_t  *c;
+    u_char             path[sizeof("/proc/self/fd/") + NGX_INT_T_LEN];
+
+    fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+    if (fd == -1) {
+        file_ctx->error = ngx_errno;
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, ngx_errno,
+                      "inotify_init1() failed");
+        return NGX_ERROR;
+    }
+
+    mask = IN_MODIFY|IN_ATTRIB|IN_MOVE_SELF|IN_DELETE_SELF;
+
+    /*
+     * the name may refer to another file already, the descriptor link
+     * resolves to the inode which is actually read
+     */
+
+    (void) ngx_sprintf(path, "/proc/self/fd/%d%Z", file_ctx->fd);
+
+    if (inotify_add_watch(fd, (char *) path, mask) == -1) {
+
+        /* no procfs, the name is watched instead */
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, ngx_errno,
+                       "inotify_add_watch(\"%s\") failed", path);
+
+        if (inotify_add_watch(fd, (char *) file_ctx->name.data, mask) == -1) {
+            file_ctx->error = ngx_errno;
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, ngx_errno,
+                          "inotify_add_watch(\"%V\") failed",
+                          &file_ctx->name);
+            goto failed;
+        }
+    }
+
+    c = ngx_get_connection(fd, r->connection->log);
+    if (c == NULL) {
+        file_ctx->ft_type |= NGX_HTTP_LUA_IO_FT_NO_MEMORY;
+        goto failed;
+    }
+
+    c->data = file_ctx;
+
+    c->read->handler = ngx_http_lua_io_notify_handler;
+    c->read->log = r->connection->log;
+    c->write->log = r->connection->log;
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        ngx_close_connection(c);
+        file_ctx->ft_type |= NGX_HTTP_LUA_IO_FT_NO_MEMORY;
+        return NGX_ERROR;
+    }
+
+    file_ctx->notify = c;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io file \"%V\" watched, inotify fd:%d",
+                   &file_ctx->name, fd);
+
+    return NGX_OK;
+
+failed:
+
+    if (close(fd) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
+                      "inotify close() failed");
+    }
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_lua_io_notify_drain(ngx_http_lua_io_file_ctx_t *file_ctx)
+{
+    u_char                *p, *last;
+    ssize_t                n;
+    struct inotify_event  *ev;
+
+    union {
+        struct inotify_event  ev;
+        u_char                data[4096];
+    } buf;
+
+    /* the event is edge triggered, the descriptor must be drained */
+
+    for ( ;; ) {
+        n = read(file_ctx->notify->fd, buf.data, sizeof(buf.data));
+
+        if (n == -1) {
+            if (ngx_errno == NGX_EAGAIN) {
+                return NGX_OK;
+            }
+
+            if (ngx_errno == NGX_EINTR) {
+                continue;
+            }
+
+            file_ctx->error = ngx_errno;
+            return NGX_ERROR;
+        }
+
+        if (n == 0) {
+            return NGX_OK;
+        }
+
+        p = buf.data;
+        last = buf.data + n;
+
+        while (p < last) {
+            ev = (struct inotify_event *) p;
+            file_ctx->notify_mask |= ev->mask;
+
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+}
+
+
+static ngx_int_t
+ngx_http_lua_io_growth_post(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx)
+{
+    ngx_thread_task_t     *task;
+    ngx_http_lua_io_op_t  *op;
+
+    op = file_ctx->growth_op;
+    task = op->task;
+
+    task->handler = ngx_http_lua_io_thread_growth_check;
+    task->event.data = op;
+    task->event.handler = ngx_http_lua_io_growth_event_handler;
+
+    if (ngx_http_lua_io_thread_post_task(task, file_ctx->thread_pool, r)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    file_ctx->growth_checking = 1;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io file growth check posted, task #%ui", task->id);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_lua_io_growth_event_handler(ngx_event_t *ev)
+{
+    ngx_http_lua_io_op_t *op = ev->data;
+
+    ngx_int_t                     rc;
+    ngx_connection_t             *c;
+    ngx_http_request_t           *r;
+    ngx_http_lua_io_file_ctx_t   *file_ctx;
+    ngx_http_lua_io_thread_ctx_t *thread_ctx;
+
+    r = op->request;
+    c = r->connection;
+    file_ctx = op->file_ctx;
+    thread_ctx = &op->thread_ctx;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "lua io file growth event handler, task #%ui",
+                   op->task->id);
+
+    ev->complete = 0;
+
+    r->main->blocked--;
+    r->aio = 0;
+
+    file_ctx->growth_checking = 0;
+
+    if (file_ctx->growth_coctx == NULL) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "lua io file growth check abandoned");
+
+        file_ctx->growth_op = NULL;
+
+        ngx_http_lua_io_op_done(r, ngx_http_lua_get_lua_vm(r, NULL), op);
+        ngx_http_lua_io_abandon_wakeup(r);
+        ngx_http_run_posted_requests(c);
+        return;
+    }
+
+    if (thread_ctx->err) {
+        file_ctx->error = thread_ctx->err;
+        rc = NGX_ERROR;
+
+    } else {
+        if (!thread_ctx->valid) {
+
+            /* the name is not the opened file anymore */
+
+            file_ctx->notify_mask |= IN_MOVE_SELF;
+        }
+
+        rc = ngx_http_lua_io_growth_check(r, file_ctx, &thread_ctx->info);
+
+        if (rc == NGX_DECLINED) {
+
+            if (file_ctx->growth == NGX_ERROR) {
+                rc = NGX_ERROR;
+
+            } else if (file_ctx->growth_recheck) {
+
+                /* the file was changed while it was being checked */
+
+                file_ctx->growth_recheck = 0;
+
+                if (ngx_http_lua_io_growth_post(r, file_ctx) == NGX_OK) {
+                    return;
+                }
+
+                file_ctx->ft_type |= NGX_HTTP_LUA_IO_FT_TASK_POST_ERROR;
+                rc = NGX_ERROR;
+
+            } else if (file_ctx->growth_timedout) {
+                rc = NGX_HTTP_LUA_IO_GROWTH_TIMEDOUT;
+
+            } else {
+                return;
+            }
+        }
+    }
+
+    ngx_http_lua_io_growth_wakeup(r, file_ctx, rc);
+}
+
+
+static ngx_int_t
+ngx_http_lua_io_growth_check(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx, ngx_file_info_t *fi)
+{
+    off_t  size;
+
+    size = ngx_file_size(fi);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io file growth check size:%O @%O, mask:%ui",
+                   size, file_ctx->read_offset, file_ctx->notify_mask);
+
+    /* the data left in a rotated file is still worth reading */
+
+    if (size > file_ctx->read_offset) {
+
+        /* the next read goes on from the saved position */
+
+        file_ctx->eof = 0;
+
+        ngx_http_lua_io_read_ahead_drop(r, file_ctx);
+
+        if (file_ctx->map && (size_t) size > file_ctx->map_size) {
+
+            /* the mapping does not cover the new data, read it instead */
+
+            if (munmap(file_ctx->map, file_ctx->map_size) == -1) {
+                ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
+                              "munmap(%uz) \"%V\" failed",
+                              file_ctx->map_size, &file_ctx->name);
+            }
+
+            file_ctx->map = NULL;
+            file_ctx->map_size = 0;
+            file_ctx->mmap = 0;
+        }
+
+        return NGX_HTTP_LUA_IO_GROWN;
+    }
+
+    if (size < file_ctx->read_offset) {
+        return NGX_HTTP_LUA_IO_TRUNCATED;
+    }
+
+    if (fi->st_nlink == 0
+        || (file_ctx->notify_mask & (IN_MOVE_SELF|IN_DELETE_SELF|IN_IGNORED)))
+    {
+        return NGX_HTTP_LUA_IO_ROTATED;
+    }
+
+    return NGX_DECLINED;
+}
+
+
+static void
+ngx_http_lua_io_notify_handler(ngx_event_t *ev)
+{
+    ngx_int_t                    rc;
+    ngx_connection_t            *c;
+    ngx_http_request_t          *r;
+    ngx_http_lua_io_file_ctx_t  *file_ctx;
+
+    c = ev->data;
+    file_ctx = c->data;
+    r = file_ctx->request;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io notify handler, timedout:%d", ev->timedout);
+
+    if (ev->timedout) {
+        ev->timedout = 0;
+
+        if (file_ctx->growth_coctx == NULL) {
+            return;
+        }
+
+        if (file_ctx->growth_checking) {
+
+            /* the change being checked is still reported */
+
+            file_ctx->growth_timedout = 1;
+            return;
+        }
+
+        ngx_http_lua_io_growth_wakeup(r, file_ctx,
+                                      NGX_HTTP_LUA_IO_GROWTH_TIMEDOUT);
+        return;
+    }
+
+    rc = ngx_http_lua_io_notify_drain(file_ctx);
+
+    if (file_ctx->growth_coctx == NULL) {
+
+        /* nobody is waiting, the changes are checked on the next wait */
+
+        return;
+    }
+
+    if (rc == NGX_OK) {
+
+        if (file_ctx->growth_checking) {
+            file_ctx->growth_recheck = 1;
+            return;
+        }
+
+        if (ngx_http_lua_io_growth_post(r, file_ctx) == NGX_OK) {
+            return;
+        }
+
+        file_ctx->ft_type |= NGX_HTTP_LUA_IO_FT_TASK_POST_ERROR;
+        rc = NGX_ERROR;
+
+    } else if (file_ctx->growth_checking) {
+
+        /* the error is reported when the pending check is done */
+
+        file_ctx->growth = NGX_ERROR;
+        return;
+    }
+
+    ngx_http_lua_io_growth_wakeup(r, file_ctx, rc);
+}
+
+
+static void
+ngx_http_lua_io_growth_wakeup(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx, ngx_int_t rc)
+{
+    ngx_http_lua_ctx_t  *lctx;
+
+    if (file_ctx->notify && file_ctx->notify->read->timer_set) {
+        ngx_del_timer(file_ctx->notify->read);
+    }
+
+    file_ctx->growth = rc;
+
+    lctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+
+    lctx->resume_handler = ngx_http_lua_io_growth_resume;
+    lctx->cur_co_ctx = file_ctx->growth_coctx;
+
+    r->write_event_handler(r);
+    ngx_http_run_posted_requests(r->connection);
+}
+
+
+static ngx_int_t
+ngx_http_lua_io_growth_resume(ngx_http_request_t *r)
+{
+    ngx_int_t                    n;
+    ngx_http_lua_ctx_t          *lctx;
+    ngx_http_lua_io_op_t        *op;
+    ngx_http_lua_co_ctx_t       *coctx;
+    ngx_http_lua_io_file_ctx_t  *file_ctx;
+
+    lctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+    if (lctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    lctx->resume_handler = ngx_http_lua_wev_handler;
+
+    coctx = lctx->cur_co_ctx;
+    coctx->cleanup = NULL;
+
+    file_ctx = coctx->data;
+
+    file_ctx->growth_coctx = NULL;
+    file_ctx->read_waiting = 0;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io file growth %i and resume", file_ctx->growth);
+
+    n = ngx_http_lua_io_growth_retvals(r, file_ctx, coctx->co,
+                                       file_ctx->growth);
+
+    /* no check is pending once the waiter is woken up */
+
+    op = file_ctx->growth_op;
+    file_ctx->growth_op = NULL;
+
+    ngx_http_lua_io_op_done(r, coctx->co, op);
+
+    return ngx_http_lua_io_run_thread(r, lctx, n);
+}
+
+
+static void
+ngx_http_lua_io_growth_coctx_cleanup(void *data)
+{
+    ngx_http_lua_co_ctx_t *coctx = data;
+
+    ngx_http_lua_io_op_t        *op;
+    ngx_http_lua_io_file_ctx_t  *file_ctx;
+
+    file_ctx = coctx->data;
+    if (file_ctx == NULL) {
+        return;
+    }
+
+    file_ctx->growth_coctx = NULL;
+    file_ctx->read_waiting = 0;
+
+    if (file_ctx->notify && file_ctx->notify->read->timer_set) {
+        ngx_del_timer(file_ctx->notify->read);
+    }
+
+    op = file_ctx->growth_op;
+
+    if (op == NULL || file_ctx->growth_checking) {
+
+        /* the pending check will be abandoned when it is done */
+
+        return;
+    }
+
+    file_ctx->growth_op = NULL;
+
+    ngx_http_lua_io_op_done(op->request,
+                            ngx_http_lua_get_lua_vm(op->request, NULL), op);
+}
+
+
+static int
+ngx_http_lua_io_growth_retvals(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx, lua_State *L, ngx_int_t rc)
+{
+    switch (rc) {
+
+    case NGX_HTTP_LUA_IO_GROWN:
+        lua_pushliteral(L, "grown");
+        return 1;
+
+    case NGX_HTTP_LUA_IO_TRUNCATED:
+        lua_pushliteral(L, "truncated");
+        return 1;
+
+    case NGX_HTTP_LUA_IO_ROTATED:
+        lua_pushliteral(L, "rotated");
+        return 1;
+
+    case NGX_HTTP_LUA_IO_GROWTH_TIMEDOUT:
+        lua_pushnil(L);
+        lua_pushliteral(L, "timeout");
+        return 2;
+
+    default:
+        return ngx_http_lua_io_handle_error(L, r, file_ctx);
+    }
+}
+
+
+static void
+ngx_http_lua_io_notify_close(ngx_http_lua_io_file_ctx_t *file_ctx)
+{
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, file_ctx->notify->log, 0,
+                   "lua io notify close fd:%d", file_ctx->notify->fd);
+
+    ngx_close_connection(file_ctx->notify);
+    file_ctx->notify = NULL;
+}
+
+#endif
+
+
+static void
+ngx_http_lua_io_coctx_cleanup(void *data)
+{
+    ngx_http_lua_co_ctx_t *coctx = data;
+
+    ngx_http_lua_io_file_ctx_t  *file_ctx;
+    ngx_http_request_t          *r;
+
+    file_ctx = coctx->data;
+    if (file_ctx == NULL || file_ctx->request == NULL) {
+        return;
+    }
+
+    /* the pending task (if any) will be abandoned when it is done */
+
+    file_ctx->coctx = NULL;
+
+    if (file_ctx->closed) {
+        return;
+    }
+
+    r = file_ctx->request;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io coctx cleanup");
+
+    ngx_http_lua_io_file_finalize(r, file_ctx);
+}
+
+
+static void
+ngx_http_lua_io_content_wev_handler(ngx_http_request_t *r)
+{
+    ngx_http_lua_ctx_t  *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+    if (ctx == NULL) {
+        return;
+    }
+
+    (void) ctx->resume_handler(r);
+}
+
+
+static void
+ngx_http_lua_io_thread_event_handler(ngx_event_t *ev)
+{
+    ngx_http_lua_io_file_ctx_t *file_ctx = ev->data;
+
+    ngx_connection_t    *c;
+    ngx_http_request_t  *r;
+    ngx_http_lua_ctx_t  *lctx;
+
+    r = file_ctx->request;
+    c = r->connection;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io thread event handler");
+
+    ev->complete = 0;
+
+    r->main->blocked--;
+    r->aio = 0;
+
+    if (file_ctx->coctx == NULL) {
+        ngx_http_lua_io_thread_task_abandon(r, file_ctx);
+        ngx_http_run_posted_requests(c);
+        return;
+    }
+
+    lctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+
+    lctx->resume_handler = ngx_http_lua_io_resume;
+    lctx->cur_co_ctx = file_ctx->coctx;
+
+    r->write_event_handler(r);
+    ngx_http_run_posted_requests(c);
+
+    return;
+}
+
+
+static void
+ngx_http_lua_io_thread_task_abandon(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx)
+{
+    lua_State                     *L;
+    ngx_http_lua_io_thread_ctx_t  *thread_ctx;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io thread task abandoned");
+
+    thread_ctx = file_ctx->thread_task->ctx;
+
+    if (file_ctx->opening) {
+        file_ctx->opening = 0;
+
+        L = ngx_http_lua_get_lua_vm(r, NULL);
+        luaL_unref(L, LUA_REGISTRYINDEX, file_ctx->ref);
+        file_ctx->ref = LUA_NOREF;
+
+        if (thread_ctx->fd != NGX_INVALID_FILE
+            && ngx_close_file(thread_ctx->fd) == NGX_FILE_ERROR)
+        {
+            ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
+                          ngx_close_file_n " \"%s\" failed",
+                          thread_ctx->path);
+        }
+
+        if (thread_ctx->map
+            && munmap(thread_ctx->map, thread_ctx->map_size) == -1)
+        {
+            ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
+                          "munmap(%uz) \"%s\" failed",
+                          thread_ctx->map_size, thread_ctx->path);
+        }
+    }
+
+    if (file_ctx->read_all && thread_ctx->buf) {
+        ngx_free(thread_ctx->buf);
+        thread_ctx->buf = NULL;
+    }
+
+    file_ctx->read_waiting = 0;
+    file_ctx->read_all = 0;
+    file_ctx->write_waiting = 0;
+    file_ctx->writing_body = 0;
+    file_ctx->body_out = NULL;
+    file_ctx->flush_waiting = 0;
+    file_ctx->durable = 0;
+    file_ctx->seeking = 0;
+    file_ctx->closing = 0;
+
+    ngx_http_lua_io_abandon_wakeup(r);
+}
+
+
+static void
+ngx_http_lua_io_abandon_wakeup(ngx_http_request_t *r)
+{
+    /*
+     * the request might be terminated while the task was in progress,
+     * run the saved handler as nginx waits for the blocked counter.
+     */
+
+    if (r->write_event_handler != ngx_http_lua_io_content_wev_handler
+        && r->write_event_handler != ngx_http_core_run_phases)
+    {
+        r->write_event_handler(r);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_lua_io_resume(ngx_http_request_t *r)
+{
+    ngx_int_t                      n;
+    ngx_http_lua_ctx_t            *lctx;
+    ngx_http_lua_co_ctx_t         *coctx;
+    ngx_http_lua_io_file_ctx_t    *file_ctx;
+
+#if (NGX_DEBUG)
+    const char                    *action;
+#endif
+
+    lctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+    if (lctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    lctx->resume_handler = ngx_http_lua_wev_handler;
+
+    coctx = lctx->cur_co_ctx;
+    coctx->cleanup = NULL;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io resume cur_co_ctx:%p", coctx);
+
+    file_ctx = coctx->data;
+
+#if (NGX_DEBUG)
+
+    if (file_ctx->opening) {
+        action = "open";
+
+    } else if (file_ctx->write_waiting) {
+        action = "write";
+
+    } else if (file_ctx->read_waiting) {
+        action = "read";
+
+    } else {
+        action = "flush";
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io %s done and resume", action);
+
+#endif
+
+    n = ngx_http_lua_io_prepare_retvals(r, file_ctx, coctx);
+
+    if (n < 0) {
+        /* still have to stuck in here */
+        coctx->cleanup = ngx_http_lua_io_coctx_cleanup;
+        return NGX_DONE;
+    }
+
+    return ngx_http_lua_io_run_thread(r, lctx, n);
+}
+
+
+static ngx_int_t
+ngx_http_lua_io_run_thread(ngx_http_request_t *r, ngx_http_lua_ctx_t *lctx,
+    ngx_int_t n)
+{
+    ngx_int_t          rc;
+    ngx_uint_t         nreqs;
+    lua_State         *L;
+    ngx_connection_t  *c;
+
+    L = ngx_http_lua_get_lua_vm(r, lctx);
+
+    c = r->connection;
+    nreqs = c->requests;
+
+    rc = ngx_http_lua_run_thread(L, r, lctx, n);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua run thread returned %d", rc);
+
+    if (rc == NGX_AGAIN) {
+        return ngx_http_lua_run_posted_threads(c, L, r, lctx, nreqs);
+    }
+
+    if (rc == NGX_DONE) {
+        ngx_http_lua_finalize_request(r, NGX_DONE);
+        return ngx_http_lua_run_posted_threads(c, L, r, lctx, nreqs);
+    }
+
+    if (lctx->entered_content_phase) {
+        ngx_http_lua_finalize_request(r, rc);
+        return NGX_DONE;
+    }
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_http_lua_io_handle_error(lua_State *L, ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *ctx)
+{
+    lua_pop(L, lua_gettop(L));
+
+    lua_pushnil(L);
+
+    if (ctx->ft_type & NGX_HTTP_LUA_IO_FT_CLOSE) {
+        lua_pushliteral(L, "closed");
+
+    } else if (ctx->ft_type & NGX_HTTP_LUA_IO_FT_TASK_POST_ERROR) {
+        lua_pushliteral(L, "task post failed");
+
+    } else if (ctx->ft_type & NGX_HTTP_LUA_IO_FT_NO_MEMORY) {
+        lua_pushliteral(L, "no memory");
+
+    } else {
+        ngx_http_lua_io_push_error(L, ctx->error);
+    }
+
+    return 2;
+}
+
+
+static void
+ngx_http_lua_io_push_error(lua_State *L, ngx_err_t err)
+{
+    u_char   errstr[NGX_MAX_ERROR_STR];
+    u_char  *p;
+
+    if (err == 0) {
+        lua_pushliteral(L, "error");
+        return;
+    }
+
+    p = ngx_strerror(err, errstr, sizeof(errstr));
+    ngx_strlow(errstr, errstr, p - errstr);
+    lua_pushlstring(L, (char *) errstr, p - errstr);
+}
+
+
+static int
+ngx_http_lua_io_file_destory(lua_State *L)
+{
+    ngx_http_lua_io_file_ctx_t  *ctx;
+
+    ctx = lua_touserdata(L, 1);
+    if (ctx == NULL) {
+        return 0;
+    }
+
+    if (ctx->cleanup) {
+        ngx_http_lua_io_file_finalize(ctx->request, ctx);
+    }
+
+    return 0;
+}
+
+
+static void
+ngx_http_lua_io_file_cleanup(void *data)
+{
+    ngx_http_lua_io_file_ctx_t *ctx = data;
+
+    ngx_http_request_t  *r;
+
+    r = ctx->request;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io file ctx cleanup");
+
+    ngx_http_lua_io_file_finalize(r, ctx);
+}
+
+
+static void
+ngx_http_lua_io_file_finalize(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *ctx)
+{
+    ngx_http_lua_io_ctx_t  *ioctx;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io file ctx finalize, r:%p", r);
+
+    if (ctx->cleanup) {
+        *ctx->cleanup = NULL;
+        ngx_http_lua_cleanup_free(r, ctx->cleanup);
+        ctx->cleanup = NULL;
+    }
+
+    ioctx = ngx_http_get_module_ctx(r, ngx_http_lua_io_module);
+
+    if (ctx->bufs_in) {
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "lua io file ctx finalize read chain:%p",
+                       ctx->bufs_in);
+
+        ngx_http_lua_io_free_bufs(r, ctx, &ioctx->free_read_bufs,
+                                  ctx->bufs_in);
+
+        ctx->bufs_in = NULL;
+        ctx->buf_in = NULL;
+
+        ngx_memzero(&ctx->buffer, sizeof(ngx_buf_t));
+    }
+
+    if (ctx->bufs_out) {
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "lua io file ctx finalize write chain:%p",
+                       ctx->bufs_out);
+
+        ngx_http_lua_io_free_bufs(r, ctx, &ioctx->free_write_bufs,
+                                  ctx->bufs_out);
+
+        ctx->bufs_out = NULL;
+    }
+
+    ngx_http_lua_io_read_ahead_drop(r, ctx);
+
+    if (ctx->lines_ref != LUA_NOREF) {
+        luaL_unref(ngx_http_lua_get_lua_vm(r, NULL), LUA_REGISTRYINDEX,
+                   ctx->lines_ref);
+        ctx->lines_ref = LUA_NOREF;
+    }
+
+    ctx->lines_next = 0;
+    ctx->lines_n = 0;
+
+    ctx->error = 0;
+    ctx->ft_type = 0;
+    ctx->closed = 1;
+
+    ngx_http_lua_io_read_ahead_unref(r, ctx);
+
+    if (ctx->syncing) {
+        ngx_queue_remove(&ctx->sync_queue);
+        ctx->syncing = 0;
+
+        ngx_http_lua_io_syncer_release(ctx->syncer);
+    }
+
+    ctx->syncer = NULL;
+
+#if (NGX_HAVE_INOTIFY)
+    if (ctx->notify) {
+        ngx_http_lua_io_notify_close(ctx);
+    }
+#endif
+
+    if (ctx->ops) {
+
+        /* the descriptor is still used by some pending operations */
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "lua io file ctx finalize delayed, ops:%ui", ctx->ops);
+        return;
+    }
+
+    ngx_http_lua_io_file_close_fd(r, ctx);
+}
+
+
+static void
+ngx_http_lua_io_file_close_fd(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *ctx)
+{
+    ngx_http_lua_io_main_conf_t  *iomcf;
+
+    if (ctx->map) {
+        if (munmap(ctx->map, ctx->map_size) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
+                          "munmap(%uz) \"%V\" failed",
+                          ctx->map_size, &ctx->name);
+        }
+
+        ctx->map = NULL;
+        ctx->map_size = 0;
+    }
+
+    if (ctx->cached_file) {
+        iomcf = ngx_http_get_module_main_conf(r, ngx_http_lua_io_module);
+
+        ngx_http_lua_io_file_cache_release(iomcf->file_cache, ctx->cached_file,
+                                           r->connection->log);
+
+        ctx->cached_file = NULL;
+        ctx->fd = NGX_INVALID_FILE;
+        return;
+    }
+
+    if (ctx->fd != NGX_INVALID_FILE && ngx_close_file(ctx->fd) < 0) {
+        ctx->error = ngx_errno;
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, ngx_errno,
+                      ngx_close_file_n " failed");
+    }
+
+    ctx->fd = NGX_INVALID_FILE;
+}
+
+
+static ngx_http_lua_io_op_t *
+ngx_http_lua_io_op_create(ngx_http_request_t *r)
+{
+    ngx_thread_task_t      *task;
+    ngx_pool_cleanup_t     *cln;
+    ngx_http_lua_io_op_t   *op;
+    ngx_http_lua_io_ctx_t  *ioctx;
+
+    ioctx = ngx_http_get_module_ctx(r, ngx_http_lua_io_module);
+    if (ioctx == NULL) {
+        ioctx = ngx_pcalloc(r->pool, sizeof(ngx_http_lua_io_ctx_t));
+        if (ioctx == NULL) {
+            return NULL;
+        }
+
+        ngx_http_set_ctx(r, ioctx, ngx_http_lua_io_module);
+    }
+
+    task = ioctx->free_ops;
+
+    if (task) {
+        ioctx->free_ops = task->next;
+        op = task->ctx;
+
+    } else {
+        task = ngx_thread_task_alloc(r->pool, sizeof(ngx_http_lua_io_op_t));
+        if (task == NULL) {
+            return NULL;
+        }
+
+        cln = ngx_pool_cleanup_add(r->pool, 0);
+        if (cln == NULL) {
+            return NULL;
+        }
+
+        op = task->ctx;
+
+        op->task = task;
+        op->request = r;
+        op->buf = NULL;
+        op->buf_size = 0;
+
+        cln->handler = ngx_http_lua_io_op_cleanup;
+        cln->data = op;
+    }
+
+    task->next = NULL;
+
+    ngx_memzero(&op->thread_ctx, sizeof(ngx_http_lua_io_thread_ctx_t));
+
+    op->thread_ctx.fd = NGX_INVALID_FILE;
+    op->coctx = NULL;
+    op->file_ctx = NULL;
+    op->ref = LUA_NOREF;
+    op->arg_ref = LUA_NOREF;
+    op->retvals = NULL;
+    op->release = NULL;
+    op->data = NULL;
+    op->ready = 0;
+    op->dropped = 0;
+    op->reading = 0;
+    op->commit = 0;
+
+    return op;
+}
+
+
+static u_char *
+ngx_http_lua_io_op_get_buf(ngx_http_lua_io_op_t *op, size_t size)
+{
+    if (op->buf_size >= size) {
+        return op->buf;
+    }
+
+    if (op->buf) {
+        ngx_free(op->buf);
+        op->buf_size = 0;
+    }
+
+    op->buf = ngx_alloc(size, op->request->connection->log);
+    if (op->buf == NULL) {
+        return NULL;
+    }
+
+    op->buf_size = size;
+
+    return op->buf;
+}
+
+
+static void
+ngx_http_lua_io_op_cleanup(void *data)
+{
+    ngx_http_lua_io_op_t *op = data;
+
+    if (op->buf) {
+        ngx_free(op->buf);
+        op->buf = NULL;
+    }
+}
+
+
+static size_t
+ngx_http_lua_io_full_name_len(ngx_str_t *name)
+{
+    if (name->len && name->data[0] == '/') {
+        return name->len + 1;
+    }
+
+    return ngx_cycle->prefix.len + name->len + 1;
+}
+
+
+static u_char *
+ngx_http_lua_io_copy_full_name(u_char *dst, ngx_str_t *name)
+{
+    /* the nginx prefix is placed in front of a relative name */
+
+    if (name->len == 0 || name->data[0] != '/') {
+        dst = ngx_cpymem(dst, ngx_cycle->prefix.data, ngx_cycle->prefix.len);
+    }
+
+    dst = ngx_cpymem(dst, name->data, name->len);
+    *dst++ = '\0';
+
+    return dst;
+}
+
+
+static void
+ngx_http_lua_io_op_attach_file(ngx_http_lua_io_op_t *op, lua_State *L,
+    ngx_http_lua_io_file_ctx_t *file_ctx)
+{
+    /* anchor the file object until the operation is done */
+
+    lua_pushvalue(L, 1);
+    op->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    op->file_ctx = file_ctx;
+    op->thread_ctx.fd = file_ctx->fd;
+
+    file_ctx->ops++;
+}
+
+
+static int
+ngx_http_lua_io_op_post(ngx_http_request_t *r, lua_State *L,
+    ngx_http_lua_io_op_t *op, ngx_http_lua_io_thread_handler_pt handler,
+    ngx_http_lua_io_op_retvals_pt retvals)
+{
+    ngx_thread_pool_t  *tp;
+    ngx_thread_task_t  *task;
+
+    if (op->file_ctx) {
+        tp = op->file_ctx->thread_pool;
+
+    } else {
+        tp = ngx_http_lua_io_get_thread_pool(r);
+        if (NGX_UNLIKELY(tp == NULL)) {
+            ngx_http_lua_io_op_done(r, L, op);
+            return luaL_error(L, "no thread pool found");
+        }
+    }
+
+    task = op->task;
+
+    task->handler = handler;
+    task->event.data = op;
+    task->event.handler = ngx_http_lua_io_op_event_handler;
+
+    op->retvals = retvals;
+
+    if (NGX_UNLIKELY(ngx_http_lua_io_thread_post_task(task, tp, r)
+                     != NGX_OK))
+    {
+        ngx_http_lua_io_op_done(r, L, op);
+
+        lua_pushnil(L);
+        lua_pushliteral(L, "task post failed");
+        return 2;
+    }
+
+    op->coctx = ngx_http_lua_io_prepare_yield(r,
+                                              ngx_http_lua_io_op_coctx_cleanup,
+                                              op);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io op posted, task #%ui saved co ctx:%p",
+                   task->id, op->coctx);
+
+    return lua_yield(L, 0);
+}
+
+
+static void
+ngx_http_lua_io_op_event_handler(ngx_event_t *ev)
+{
+    ngx_http_lua_io_op_t *op = ev->data;
+
+    ngx_connection_t    *c;
+    ngx_http_request_t  *r;
+    ngx_http_lua_ctx_t  *lctx;
+
+    r = op->request;
+    c = r->connection;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "lua io op event handler, task #%ui", op->task->id);
+
+    ev->complete = 0;
+
+    r->main->blocked--;
+    r->aio = 0;
+
+    if (op->coctx == NULL) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "lua io op abandoned");
+
+        ngx_http_lua_io_op_done(r, ngx_http_lua_get_lua_vm(r, NULL), op);
+        ngx_http_lua_io_abandon_wakeup(r);
+        ngx_http_run_posted_requests(c);
+        return;
+    }
+
+    lctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+
+    lctx->resume_handler = ngx_http_lua_io_op_resume;
+    lctx->cur_co_ctx = op->coctx;
+
+    r->write_event_handler(r);
+    ngx_http_run_posted_requests(c);
+}
+
+
+static ngx_int_t
+ngx_http_lua_io_op_resume(ngx_http_request_t *r)
+{
+    ngx_int_t                n;
+    lua_State               *L;
+    ngx_http_lua_ctx_t      *lctx;
+    ngx_http_lua_co_ctx_t   *coctx;
+    ngx_http_lua_io_op_t    *op;
+
+    lctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+    if (lctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    lctx->resume_handler = ngx_http_lua_wev_handler;
+
+    coctx = lctx->cur_co_ctx;
+    coctx->cleanup = NULL;
+
+    op = coctx->data;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io op done and resume cur_co_ctx:%p", coctx);
+
+    L = coctx->co;
+
+    n = op->retvals(r, op, L);
+
+    if (n < 0) {
+
+        /* the operation has been reposted, keep on waiting */
+
+        coctx->cleanup = ngx_http_lua_io_op_coctx_cleanup;
+        return NGX_DONE;
+    }
+
+    op->coctx = NULL;
+
+    ngx_http_lua_io_op_done(r, L, op);
+
+    return ngx_http_lua_io_run_thread(r, lctx, n);
+}
+
+
+static void
+ngx_http_lua_io_op_done(ngx_http_request_t *r, lua_State *L,
+    ngx_http_lua_io_op_t *op)
+{
+    ngx_http_lua_io_ctx_t       *ioctx;
+    ngx_http_lua_io_file_ctx_t  *file_ctx;
+
+    if (op->release) {
+
+        /* it's also the only chance to reset the state when abandoned */
+
+        op->release(op, L);
+        op->release = NULL;
+    }
+
+    file_ctx = op->file_ctx;
+
+    if (file_ctx) {
+        file_ctx->ops--;
+
+        if (op->reading) {
+            file_ctx->read_waiting = 0;
+        }
+
+        if (file_ctx->closed && file_ctx->ops == 0) {
+            ngx_http_lua_io_file_close_fd(r, file_ctx);
+        }
+
+        op->file_ctx = NULL;
+    }
+
+    if (op->ref != LUA_NOREF) {
+        luaL_unref(L, LUA_REGISTRYINDEX, op->ref);
+        op->ref = LUA_NOREF;
+    }
+
+    if (op->arg_ref != LUA_NOREF) {
+        luaL_unref(L, LUA_REGISTRYINDEX, op->arg_ref);
+        op->arg_ref = LUA_NOREF;
+    }
+
+    ioctx = ngx_http_get_module_ctx(r, ngx_http_lua_io_module);
+
+    op->task->next = ioctx->free_ops;
+    ioctx->free_ops = op->task;
+}
+
+
+static void
+ngx_http_lua_io_op_coctx_cleanup(void *data)
+{
+    ngx_http_lua_co_ctx_t *coctx = data;
+
+    ngx_http_lua_io_op_t  *op;
+
+    op = coctx->data;
+    if (op == NULL) {
+        return;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, op->request->connection->log, 0,
+                   "lua io op coctx cleanup");
+
+    /* the pending task will be abandoned when it is done */
+
+    op->coctx = NULL;
+}
+
+
+static void
+ngx_http_lua_io_before_yield(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx)
+{
+    file_ctx->coctx = ngx_http_lua_io_prepare_yield(r,
+                                                ngx_http_lua_io_coctx_cleanup,
+                                                file_ctx);
+}
+
+
+static ngx_http_lua_co_ctx_t *
+ngx_http_lua_io_prepare_yield(ngx_http_request_t *r,
+    ngx_http_cleanup_pt cleanup, void *data)
+{
+    ngx_http_lua_ctx_t     *lctx;
+    ngx_http_lua_co_ctx_t  *coctx;
+
+    lctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+    coctx = lctx->cur_co_ctx;
+
+    ngx_http_lua_cleanup_pending_operation(coctx);
+    coctx->cleanup = cleanup;
+    coctx->data = data;
+
+    if (lctx->entered_content_phase) {
+        r->write_event_handler = ngx_http_lua_io_content_wev_handler;
+
+    } else {
+        r->write_event_handler = ngx_http_core_run_phases;
+    }
+
+    return coctx;
+}
+
+
+static void
+ngx_http_lua_io_open_cached_file(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx,
+    ngx_http_lua_io_thread_ctx_t *thread_ctx)
+{
+    ngx_str_t                       name;
+    ngx_http_lua_io_main_conf_t    *iomcf;
+    ngx_http_lua_io_cached_file_t  *file;
+
+    iomcf = ngx_http_get_module_main_conf(r, ngx_http_lua_io_module);
+
+    file = file_ctx->cached_file;
+
+    if (thread_ctx->valid) {
+
+        /* the cached descriptor still refers to the same file */
+
+        if (!file->close) {
+            file->created = ngx_time();
+        }
+
+        file_ctx->fd = file->fd;
+        return;
+    }
+
+    if (file) {
+        ngx_http_lua_io_file_cache_release(iomcf->file_cache, file,
+                                           r->connection->log);
+        file_ctx->cached_file = NULL;
+    }
+
+    if (thread_ctx->err) {
+        return;
+    }
+
+    name.data = thread_ctx->path;
+    name.len = ngx_strlen(name.data);
+
+    file = ngx_http_lua_io_file_cache_add(iomcf->file_cache, &name,
+                                          thread_ctx->fd, &thread_ctx->info,
+                                          r->connection->log);
+
+    if (file == NULL) {
+
+        /* no memory, just use the descriptor exclusively */
+
+        file_ctx->fd = thread_ctx->fd;
+        return;
+    }
+
+    file_ctx->cached_file = file;
+    file_ctx->fd = file->fd;
+}
+
+
+static ngx_int_t
+ngx_http_lua_io_prepare_retvals(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx, ngx_http_lua_co_ctx_t *coctx)
+{
+    ngx_int_t                      rc;
+    ngx_chain_t                  **ll;
+    ngx_http_lua_io_ctx_t         *ioctx;
+    ngx_http_lua_io_thread_ctx_t  *thread_ctx;
+
+    if (file_ctx->ra_waiting) {
+
+        /* the prefetched buffer which the reader waited for is ready */
+
+        file_ctx->ra_waiting = 0;
+        file_ctx->read_waiting = 0;
+
+        rc = ngx_http_lua_io_file_read_inline(r, file_ctx);
+        goto read;
+    }
+
+    if (file_ctx->syncer) {
+
+        /* the fsync shared with the other durable flushes is done */
+
+        return ngx_http_lua_io_sync_retvals(r, file_ctx, coctx->co);
+    }
+
+    thread_ctx = file_ctx->thread_task->ctx;
+
+    if (file_ctx->opening) {
+        file_ctx->opening = 0;
+
+        lua_rawgeti(coctx->co, LUA_REGISTRYINDEX, file_ctx->ref);
+        luaL_unref(coctx->co, LUA_REGISTRYINDEX, file_ctx->ref);
+        file_ctx->ref = LUA_NOREF;
+
+        if (file_ctx->cacheable) {
+            ngx_http_lua_io_open_cached_file(r, file_ctx, thread_ctx);
+
+        } else {
+            file_ctx->fd = thread_ctx->fd;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "lua io open fd:%d", file_ctx->fd);
+
+        if (thread_ctx->err) {
+            file_ctx->error = thread_ctx->err;
+            return ngx_http_lua_io_handle_error(coctx->co, r, file_ctx);
+        }
+
+        file_ctx->offset = thread_ctx->offset;
+        file_ctx->read_offset = thread_ctx->offset;
+        file_ctx->alignment = thread_ctx->alignment;
+
+        file_ctx->dev = thread_ctx->info.st_dev;
+        file_ctx->uniq = ngx_file_uniq(&thread_ctx->info);
+
+        file_ctx->mmap = thread_ctx->mmap;
+        file_ctx->map = thread_ctx->map;
+        file_ctx->map_size = thread_ctx->map_size;
+
+        return 1;
+    }
+
+    if (file_ctx->read_all) {
+        return ngx_http_lua_io_file_read_all_retvals(r, file_ctx, coctx->co);
+    }
+
+    if (thread_ctx->err) {
+        file_ctx->error = thread_ctx->err;
+
+        if (file_ctx->writing_body) {
+            file_ctx->write_waiting = 0;
+            file_ctx->writing_body = 0;
+            file_ctx->body_out = NULL;
+            file_ctx->durable = 0;
+        }
+
+        return ngx_http_lua_io_handle_error(coctx->co, r, file_ctx);
+    }
+
+    ioctx = ngx_http_get_module_ctx(r, ngx_http_lua_io_module);
+
+    if (file_ctx->write_waiting) {
+        ngx_http_lua_io_file_dirty(file_ctx, thread_ctx->offset,
+                                   thread_ctx->offset + thread_ctx->nbytes);
+
+        file_ctx->offset += thread_ctx->nbytes;
+        file_ctx->read_offset += thread_ctx->nbytes;
+        file_ctx->write_waiting = 0;
+
+        if (file_ctx->body_out) {
+
+            /* the request body bufs are not ours, cut them off the chain */
+
+            for (ll = &thread_ctx->chain; *ll != file_ctx->body_out;
+                 ll = &(*ll)->next)
+            {
+                /* void */
+            }
+
+            *ll = NULL;
+            file_ctx->body_out = NULL;
+        }
+
+        ngx_http_lua_io_free_bufs(r, file_ctx, &ioctx->free_write_bufs,
+                                  thread_ctx->chain);
+
+        thread_ctx->chain = NULL;
+
+        if (file_ctx->writing_body) {
+            return ngx_http_lua_io_write_body_retvals(r, file_ctx, coctx->co);
+        }
+
+        if (file_ctx->seeking) {
+            file_ctx->seeking = 0;
+
+            return ngx_http_lua_io_file_do_seek(file_ctx, r, coctx->co,
+                                                file_ctx->seek_offset,
+                                                file_ctx->whence);
+        }
+
+        lua_pushinteger(coctx->co, file_ctx->nbytes);
+        return 1;
+    }
+
+    if (file_ctx->flush_waiting) {
+        ngx_http_lua_io_file_dirty(file_ctx, thread_ctx->offset,
+                                   thread_ctx->offset + thread_ctx->nbytes);
+
+        file_ctx->offset += thread_ctx->nbytes;
+        file_ctx->read_offset += thread_ctx->nbytes;
+
+        ngx_http_lua_io_free_bufs(r, file_ctx, &ioctx->free_write_bufs,
+                                  thread_ctx->chain);
+
+        thread_ctx->chain = NULL;
+
+        if (file_ctx->durable) {
+            rc = ngx_http_lua_io_sync_join(r, file_ctx, file_ctx->durable);
+
+            file_ctx->durable = 0;
+
+            /* the data was written, then wait for the sync */
+
+            if (rc == NGX_OK) {
+                return -1;
+            }
+
+            if (rc == NGX_ERROR) {
+                file_ctx->flush_waiting = 0;
+                file_ctx->closing = 0;
+                return ngx_http_lua_io_handle_error(coctx->co, r, file_ctx);
+            }
+        }
+
+        file_ctx->flush_waiting = 0;
+
+        if (file_ctx->closing) {
+            file_ctx->closing = 0;
+            ngx_http_lua_io_file_finalize(r, file_ctx);
+
+            if (file_ctx->ft_type || file_ctx->error) {
+                return ngx_http_lua_io_handle_error(coctx->co, r, file_ctx);
+            }
+        }
+
+        lua_pushinteger(coctx->co, 1);
+        return 1;
+    }
+
+    /* file_ctx->read_waiting == 1 */
+
+    file_ctx->eof = thread_ctx->eof;
+    file_ctx->read_waiting = 0;
+    file_ctx->buffer.last += thread_ctx->nbytes;
+    file_ctx->read_offset += thread_ctx->nbytes;
+
+    if (file_ctx->eof) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "lua io read eof");
+    }
+
+    rc = ngx_http_lua_io_file_do_read(r, file_ctx);
+
+    if (rc == NGX_AGAIN) {
+        rc = ngx_http_lua_io_file_read_inline(r, file_ctx);
+    }
+
+read:
+
+    if (rc == NGX_AGAIN) {
+        if (NGX_UNLIKELY(ngx_http_lua_io_file_post_read(r, file_ctx)
+                         == NGX_ERROR))
+        {
+            return ngx_http_lua_io_handle_error(coctx->co, r, file_ctx);
+        }
+
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "lua io read need one more try");
+
+        file_ctx->read_waiting = 1;
+        return -1;
+    }
+
+    if (rc == NGX_ERROR) {
+        return ngx_http_lua_io_handle_error(coctx->co, r, file_ctx);
+    }
+
+    /* rc == NGX_OK */
+
+    if (file_ctx->max_lines) {
+        return ngx_http_lua_io_submit_lines(r, file_ctx, coctx->co);
+    }
+
+    return ngx_http_lua_io_submit_input_data(r, file_ctx, coctx->co);
+}
+
+
+static int
+ngx_http_lua_io_write_body_retvals(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx, lua_State *L)
+{
+    ngx_int_t  rc;
+
+    if (file_ctx->durable) {
+        rc = ngx_http_lua_io_sync_join(r, file_ctx, file_ctx->durable);
+
+        file_ctx->durable = 0;
+
+        /* the body was written, then wait for the sync like a flush */
+
+        if (rc == NGX_OK) {
+            file_ctx->flush_waiting = 1;
+            return -1;
+        }
+
+        if (rc == NGX_ERROR) {
+            file_ctx->writing_body = 0;
+            return ngx_http_lua_io_handle_error(L, r, file_ctx);
+        }
+    }
+
+    file_ctx->writing_body = 0;
+
+    lua_pushinteger(L, file_ctx->nbytes);
+    return 1;
+}
+
+
+static int
+ngx_http_lua_io_file_do_seek(ngx_http_lua_io_file_ctx_t *file_ctx,
+    ngx_http_request_t *r, lua_State *L, off_t offset, int whence)
+{
+
+    if (whence == SEEK_CUR) {
+
+        /*
+         * due to the buffered reading mechanism,
+         * we rebuild the seek offset, to the correct position.
+         */
+
+        whence = SEEK_SET;
+        offset = file_ctx->offset + offset;
+    }
+
+    offset = lseek(file_ctx->fd, offset, whence);
+
+    if (offset < 0) {
+        file_ctx->error = ngx_errno;
+        return ngx_http_lua_io_handle_error(L, r, file_ctx);
+    }
+
+    file_ctx->eof = 0;
+    file_ctx->offset = offset;
+    file_ctx->read_offset = offset;
+
+    lua_pushinteger(L, offset);
+    return 1;
+}
+
+
+/*
+ * the data is written at the file position, so the read data which is
+ * buffered beyond it (or being prefetched) is dropped before writing,
+ * then the following reads go on right after the written data
+ */
+
+static void
+ngx_http_lua_io_file_drop_read_bufs(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx)
+{
+    ngx_http_lua_io_ctx_t  *ioctx;
+
+    if (file_ctx->bufs_in == NULL && file_ctx->ra_count == 0
+        && file_ctx->read_offset == file_ctx->offset)
+    {
+        return;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io write drain read chain:%p @%O",
+                   file_ctx->bufs_in, file_ctx->offset);
+
+    ngx_http_lua_io_read_ahead_drop(r, file_ctx);
+
+    file_ctx->lines_next = 0;
+    file_ctx->lines_n = 0;
+
+    if (file_ctx->bufs_in) {
+        ioctx = ngx_http_get_module_ctx(r, ngx_http_lua_io_module);
+
+        ngx_http_lua_io_free_bufs(r, file_ctx, &ioctx->free_read_bufs,
+                                  file_ctx->bufs_in);
+
+        file_ctx->bufs_in = NULL;
+        file_ctx->buf_in = NULL;
+
+        ngx_memzero(&file_ctx->buffer, sizeof(ngx_buf_t));
+    }
+
+    file_ctx->read_offset = file_ctx->offset;
+    file_ctx->eof = 0;
+}
+
+
+static int
+ngx_http_lua_io_file_read_helper(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx, lua_State *L)
+{
+    ngx_int_t                    rc;
+    ngx_http_lua_io_loc_conf_t  *iocf;
+    ngx_http_lua_io_ctx_t       *ioctx;
+
+
+    if (file_ctx->bufs_in == NULL) {
+        ioctx = ngx_http_get_module_ctx(r, ngx_http_lua_io_module);
+        iocf = ngx_http_get_module_loc_conf(r, ngx_http_lua_io_module);
+
+        file_ctx->bufs_in = ngx_http_lua_io_get_buf(r, file_ctx,
+                                                    &ioctx->free_read_bufs,
+                                                    iocf->read_buf_size);
+
+        if (NGX_UNLIKELY(file_ctx->bufs_in == NULL)) {
+            return luaL_error(L, "no memory");
+        }
+
+        file_ctx->buf_in = file_ctx->bufs_in;
+        file_ctx->buffer = *file_ctx->buf_in->buf;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io read, bufs_in:%p buf_in:%p",
+                   file_ctx->bufs_in, file_ctx->buf_in);
+
+    file_ctx->read_waiting = 0;
+    file_ctx->coctx = NULL;
+
+    rc = ngx_http_lua_io_file_do_read(r, file_ctx);
+
+    if (rc == NGX_AGAIN) {
+        rc = ngx_http_lua_io_file_read_inline(r, file_ctx);
+    }
+
+    if (rc == NGX_ERROR) {
+        return ngx_http_lua_io_handle_error(L, r, file_ctx);
+    }
+
+    if (rc == NGX_OK) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "lua io read done just in one round");
+
+        if (file_ctx->max_lines) {
+            return ngx_http_lua_io_submit_lines(r, file_ctx, L);
+        }
+
+        return ngx_http_lua_io_submit_input_data(r, file_ctx, L);
+    }
+
+    /* rc == NGX_AGAIN */
+
+    if (NGX_UNLIKELY(ngx_http_lua_io_file_post_read(r, file_ctx)
+                     == NGX_ERROR))
+    {
+        return ngx_http_lua_io_handle_error(L, r, file_ctx);
+    }
+
+    file_ctx->read_waiting = 1;
+
+    ngx_http_lua_io_before_yield(r, file_ctx);
+
+    return lua_yield(L, 0);
+}
+
+
+static ngx_int_t
+ngx_http_lua_io_file_do_read(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx)
+{
+
+    size_t      size;
+    ngx_buf_t  *b;
+    ngx_int_t   rc;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io do read, waiting:%d", file_ctx->read_waiting);
+
+    b = &file_ctx->buffer;
+
+    for ( ;; ) {
+
+        size = b->last - b->pos;
+
+        if (size == 0 && !file_ctx->eof) {
+            break;
+        }
+
+        rc = file_ctx->input_filter(file_ctx, b, size);
+        if (rc == NGX_OK) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "lua io read done, waiting:%d",
+                           file_ctx->read_waiting);
+
+            return NGX_OK;
+        }
+
+        if (rc == NGX_AGAIN) {
+            break;
+        }
+    }
+
+    if (file_ctx->eof) {
+        return NGX_OK;
+    }
+
+    size = b->end - b->last;
+    if (size == 0) {
+        rc = ngx_http_lua_io_add_input_buffer(r, file_ctx);
+
+        if (NGX_UNLIKELY(rc == NGX_ERROR)) {
+            file_ctx->ft_type |= NGX_HTTP_LUA_IO_FT_NO_MEMORY;
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_AGAIN;
+}
+
+
+static ngx_int_t
+ngx_http_lua_io_file_read_inline(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx)
+{
+    /*
+     * tries to fill the read buffer without a thread,
+     * NGX_AGAIN means a read task is still needed
+     */
 
-    ngx_http_lua_io_file_ctx_t  *file_ctx;
-    ngx_http_request_t          *r;
+    if (file_ctx->mmap) {
+        return ngx_http_lua_io_file_read_mapped(r, file_ctx);
+    }
 
-    file_ctx = coctx->data;
-    if (file_ctx == NULL || file_ctx->closed || file_ctx->request == NULL) {
-        return;
+    if (file_ctx->read_ahead) {
+        return ngx_http_lua_io_file_read_ahead(r, file_ctx);
     }
 
-    r = file_ctx->request;
+#if (NGX_LINUX && defined RWF_NOWAIT)
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "lua io coctx cleanup");
+    if (file_ctx->nowait) {
+        return ngx_http_lua_io_file_read_nowait(r, file_ctx);
+    }
 
-    ngx_http_lua_io_file_finalize(r, file_ctx);
+#endif
+
+    return NGX_AGAIN;
 }
 
 
-static void
-ngx_http_lua_io_content_wev_handler(ngx_http_request_t *r)
+static ngx_int_t
+ngx_http_lua_io_file_read_mapped(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx)
 {
-    ngx_http_lua_ctx_t  *ctx;
+    u_char     *p;
+    size_t      size, rest;
+    ngx_int_t   rc;
+    ngx_buf_t  *b;
 
-    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
-    if (ctx == NULL) {
-        return;
-    }
+    b = &file_ctx->buffer;
 
-    (void) ctx->resume_handler(r);
-}
+    do {
+        size = b->end - b->last;
+        rest = 0;
+        p = NULL;
 
+        if ((size_t) file_ctx->read_offset < file_ctx->map_size) {
+            rest = file_ctx->map_size - (size_t) file_ctx->read_offset;
+            p = file_ctx->map + file_ctx->read_offset;
+        }
 
-static void
-ngx_http_lua_io_thread_event_handler(ngx_event_t *ev)
-{
-    ngx_http_lua_io_file_ctx_t *file_ctx = ev->data;
+        if (rest && !ngx_http_lua_io_mapped_resident(p, ngx_min(size, rest))) {
 
-    ngx_connection_t    *c;
-    ngx_http_request_t  *r;
-    ngx_http_lua_ctx_t  *lctx;
+            /* let a thread take the major page faults */
 
-    r = file_ctx->request;
-    c = r->connection;
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "lua io read mapped %uz @%O not resident",
+                           ngx_min(size, rest), file_ctx->read_offset);
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "lua io thread event handler");
+            return NGX_AGAIN;
+        }
 
-    ev->complete = 0;
+        file_ctx->eof = (rest < size);
 
-    r->main->blocked--;
-    r->aio = 0;
+        size = ngx_min(size, rest);
 
-    lctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "lua io read mapped %uz @%O, eof:%d",
+                       size, file_ctx->read_offset, file_ctx->eof);
 
-    lctx->resume_handler = ngx_http_lua_io_resume;
-    lctx->cur_co_ctx = file_ctx->coctx;
+        if (size) {
+            if (ngx_http_lua_io_mapped_copy(r, b->last, p, size) != NGX_OK) {
 
-    r->write_event_handler(r);
-    ngx_http_run_posted_requests(c);
+                /*
+                 * the file was truncated under the mapping, the data is
+                 * read by a thread from now on
+                 */
 
-    return;
-}
+                ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                              "mapped file \"%V\" was truncated, "
+                              "fall back to reading", &file_ctx->name);
 
+                file_ctx->mmap = 0;
+                file_ctx->eof = 0;
 
-static ngx_int_t
-ngx_http_lua_io_resume(ngx_http_request_t *r)
-{
-    ngx_int_t                      rc, n;
-    ngx_uint_t                     nreqs;
-    lua_State                     *L;
-    ngx_connection_t              *c;
-    ngx_http_lua_ctx_t            *lctx;
-    ngx_http_lua_co_ctx_t         *coctx;
-    ngx_http_lua_io_file_ctx_t    *file_ctx;
+                return NGX_AGAIN;
+            }
 
-#if (NGX_DEBUG)
-    const char                    *action;
-#endif
+            b->last += size;
+            file_ctx->read_offset += size;
+        }
 
-    lctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
-    if (lctx == NULL) {
-        return NGX_ERROR;
-    }
+        rc = ngx_http_lua_io_file_do_read(r, file_ctx);
 
-    lctx->resume_handler = ngx_http_lua_wev_handler;
+    } while (rc == NGX_AGAIN);
 
-    coctx = lctx->cur_co_ctx;
-    coctx->cleanup = NULL;
+    return rc;
+}
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "lua io resume cur_co_ctx:%p", coctx);
 
-    file_ctx = coctx->data;
+#if (NGX_LINUX && defined RWF_NOWAIT)
 
-#if (NGX_DEBUG)
+static ngx_int_t
+ngx_http_lua_io_file_read_nowait(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx)
+{
+    ssize_t        n;
+    ngx_err_t      err;
+    ngx_int_t      rc;
+    ngx_buf_t     *b;
+    struct iovec   iov;
 
-    if (file_ctx->write_waiting) {
-        action = "write";
+    b = &file_ctx->buffer;
 
-    } else if (file_ctx->read_waiting) {
-        action = "read";
+    do {
+        iov.iov_base = b->last;
+        iov.iov_len = b->end - b->last;
 
-    } else {
-        action = "flush";
-    }
+        n = preadv2(file_ctx->fd, &iov, 1, file_ctx->read_offset, RWF_NOWAIT);
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "lua io %s done and resume", action);
+        if (n == -1) {
+            err = ngx_errno;
 
-#endif
+            ngx_http_lua_io_nowait_misses++;
 
-    n = ngx_http_lua_io_prepare_retvals(r, file_ctx, coctx);
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, err,
+                           "lua io read nowait %uz @%O failed",
+                           iov.iov_len, file_ctx->read_offset);
 
-    if (n < 0) {
-        /* still have to stuck in here */
-        return NGX_DONE;
-    }
+            if (err != NGX_EAGAIN) {
 
-    L = ngx_http_lua_get_lua_vm(r, lctx);
+                /*
+                 * not supported by the kernel or the filesystem,
+                 * other errors will be reported by the read task
+                 */
 
-    c = r->connection;
-    nreqs = c->requests;
+                file_ctx->nowait = 0;
+            }
 
-    rc = ngx_http_lua_run_thread(L, r, lctx, n);
+            return NGX_AGAIN;
+        }
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "lua run thread returned %d", rc);
+        ngx_http_lua_io_nowait_hits++;
 
-    if (rc == NGX_AGAIN) {
-        return ngx_http_lua_run_posted_threads(c, L, r, lctx, nreqs);
-    }
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "lua io read nowait %z of %uz @%O",
+                       n, iov.iov_len, file_ctx->read_offset);
 
-    if (rc == NGX_DONE) {
-        ngx_http_lua_finalize_request(r, NGX_DONE);
-        return ngx_http_lua_run_posted_threads(c, L, r, lctx, nreqs);
-    }
+        /*
+         * a short read might only mean that the rest of the data
+         * is not cached, the end of file is detected by reading zero bytes
+         */
 
-    if (lctx->entered_content_phase) {
-        ngx_http_lua_finalize_request(r, rc);
-        return NGX_DONE;
-    }
+        file_ctx->eof = (n == 0);
+
+        b->last += n;
+        file_ctx->read_offset += n;
+
+        rc = ngx_http_lua_io_file_do_read(r, file_ctx);
+
+    } while (rc == NGX_AGAIN);
 
     return rc;
 }
 
+#endif
+
 
 static ngx_int_t
-ngx_http_lua_io_handle_error(lua_State *L, ngx_http_request_t *r,
-    ngx_http_lua_io_file_ctx_t *ctx)
+ngx_http_lua_io_file_read_ahead(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx)
 {
-    u_char   errstr[NGX_MAX_ERROR_STR];
-    u_char  *p;
+    size_t                         size;
+    ngx_int_t                      rc;
+    ngx_buf_t                     *b;
+    ngx_http_lua_io_op_t          *op;
+    ngx_http_lua_io_thread_ctx_t  *ctx;
 
-    lua_pop(L, lua_gettop(L));
+    b = &file_ctx->buffer;
 
-    lua_pushnil(L);
+    for ( ;; ) {
 
-    if (ctx->ft_type & NGX_HTTP_LUA_IO_FT_CLOSE) {
-        lua_pushliteral(L, "closed");
+        /* keep the ring full, the buffers are consumed in order */
 
-    } else if (ctx->ft_type & NGX_HTTP_LUA_IO_FT_TASK_POST_ERROR) {
-        lua_pushliteral(L, "task post failed");
+        ngx_http_lua_io_read_ahead_post(r, file_ctx);
 
-    } else if (ctx->ft_type & NGX_HTTP_LUA_IO_FT_NO_MEMORY) {
-        lua_pushliteral(L, "no memory");
+        if (file_ctx->ra_count == 0) {
+            return NGX_AGAIN;
+        }
 
-    } else {
-        if (ctx->error != 0) {
-            p = ngx_strerror(ctx->error, errstr, sizeof(errstr));
-            ngx_strlow(errstr, errstr, p - errstr);
-            lua_pushlstring(L, (char *) errstr, p - errstr);
+        op = file_ctx->ra_ops[file_ctx->ra_head];
+        ctx = &op->thread_ctx;
 
-        } else {
-            lua_pushliteral(L, "error");
+        if (!op->ready) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "lua io read ahead @%O not ready", ctx->offset);
+
+            return NGX_AGAIN;
         }
-    }
 
-    return 2;
-}
+        if (ctx->err) {
 
+            /* let the read task report the error */
 
-static int
-ngx_http_lua_io_file_destory(lua_State *L)
-{
-    ngx_http_lua_io_file_ctx_t  *ctx;
+            ngx_http_lua_io_read_ahead_drop(r, file_ctx);
+            file_ctx->read_ahead = 0;
 
-    ctx = lua_touserdata(L, 1);
-    if (ctx == NULL) {
-        return 0;
-    }
+            return NGX_AGAIN;
+        }
 
-    if (ctx->cleanup) {
-        ngx_http_lua_io_file_finalize(ctx->request, ctx);
-    }
+        size = ngx_min((size_t) (b->end - b->last),
+                       ctx->nbytes - file_ctx->ra_pos);
 
-    return 0;
-}
+        if (size) {
+            b->last = ngx_cpymem(b->last, op->buf + file_ctx->ra_pos, size);
+            file_ctx->ra_pos += size;
+            file_ctx->read_offset += size;
+        }
 
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "lua io read ahead %uz of %uz @%O",
+                       size, ctx->nbytes, ctx->offset);
 
-static void
-ngx_http_lua_io_file_cleanup(void *data)
-{
-    ngx_http_lua_io_file_ctx_t *ctx = data;
+        if (file_ctx->ra_pos == ctx->nbytes) {
+            file_ctx->eof = ctx->eof;
+            file_ctx->ra_pos = 0;
+            file_ctx->ra_head = (file_ctx->ra_head + 1) % file_ctx->read_ahead;
+            file_ctx->ra_count--;
 
-    ngx_http_request_t  *r;
+            ngx_http_lua_io_read_ahead_hits++;
 
-    r = ctx->request;
+            ngx_http_lua_io_op_done(r, ngx_http_lua_get_lua_vm(r, NULL), op);
+        }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "lua io file ctx cleanup");
+        rc = ngx_http_lua_io_file_do_read(r, file_ctx);
 
-    ngx_http_lua_io_file_finalize(r, ctx);
+        if (rc != NGX_AGAIN) {
+            return rc;
+        }
+    }
 }
 
 
 static void
-ngx_http_lua_io_file_finalize(ngx_http_request_t *r,
-    ngx_http_lua_io_file_ctx_t *ctx)
+ngx_http_lua_io_read_ahead_post(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx)
 {
-    ngx_chain_t            *cl, **ll;
-    ngx_http_lua_io_ctx_t  *ioctx;
-
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "lua io file ctx finalize, r:%p", r);
+    size_t                       size;
+    ngx_uint_t                   i;
+    ngx_thread_task_t           *task;
+    ngx_http_lua_io_op_t        *op;
+    ngx_http_lua_io_loc_conf_t  *iocf;
 
-    if (ctx->cleanup) {
-        *ctx->cleanup = NULL;
-        ngx_http_lua_cleanup_free(r, ctx->cleanup);
-        ctx->cleanup = NULL;
+    iocf = ngx_http_get_module_loc_conf(r, ngx_http_lua_io_module);
+    size = iocf->read_buf_size;
+
+    if (file_ctx->ra_ops == NULL) {
+        file_ctx->ra_ops = ngx_palloc(r->pool, file_ctx->read_ahead
+                                      * sizeof(ngx_http_lua_io_op_t *));
+        if (file_ctx->ra_ops == NULL) {
+            file_ctx->read_ahead = 0;
+            return;
+        }
     }
 
-    ioctx = ngx_http_get_module_ctx(r, ngx_http_lua_io_module);
-
-    if (ctx->bufs_in) {
+    if (!file_ctx->ra_advised) {
+        file_ctx->ra_advised = 1;
 
-        ll = &ctx->bufs_in;
-        for (cl = ctx->bufs_in; cl; cl = cl->next) {
-            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                           "lua io file ctx finalize read chain:%p, next:%p",
-                           cl, cl->next);
+        /* let the kernel read ahead more aggressively as well */
 
-            cl->buf->pos = cl->buf->last;
-            ll = &cl->next;
+        if (ngx_read_ahead(file_ctx->fd, size * file_ctx->read_ahead)
+            == NGX_FILE_ERROR)
+        {
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                          ngx_read_ahead_n " \"%V\" failed", &file_ctx->name);
         }
-
-        *ll = ioctx->free_read_bufs;
-        ioctx->free_read_bufs = ctx->bufs_in;
-
-        ctx->bufs_in = NULL;
-        ctx->buf_in = NULL;
-
-        ngx_memzero(&ctx->buffer, sizeof(ngx_buf_t));
     }
 
-    if (ctx->bufs_out) {
+    if (file_ctx->ra_count == 0) {
+        file_ctx->ra_offset = file_ctx->read_offset;
+    }
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "lua io file ctx finalize write chain:%p",
-                       ctx->bufs_out);
+    while (file_ctx->ra_count < file_ctx->read_ahead && !file_ctx->ra_eof) {
 
-        ctx->bufs_out->buf->pos = ctx->bufs_out->buf->last;
+        op = ngx_http_lua_io_op_create(r);
+        if (op == NULL) {
+            return;
+        }
 
-        ctx->bufs_out->next = ioctx->free_write_bufs;
-        ioctx->free_write_bufs = ctx->bufs_out;
+        if (ngx_http_lua_io_op_get_buf(op, size) == NULL) {
+            ngx_http_lua_io_op_done(r, ngx_http_lua_get_lua_vm(r, NULL), op);
+            return;
+        }
 
-        ctx->bufs_out = NULL;
-    }
+        op->file_ctx = file_ctx;
+        file_ctx->ops++;
 
-    ctx->error = 0;
-    ctx->ft_type = 0;
-    ctx->closed = 1;
+        op->thread_ctx.fd = file_ctx->fd;
+        op->thread_ctx.buf = op->buf;
+        op->thread_ctx.size = size;
+        op->thread_ctx.offset = file_ctx->ra_offset;
 
-    if (ctx->fd != NGX_INVALID_FILE && ngx_close_file(ctx->fd) < 0) {
-        ctx->error = ngx_errno;
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, ngx_errno,
-                      ngx_close_file_n " failed");
-    }
-}
+        task = op->task;
 
+        task->handler = ngx_http_lua_io_thread_read_file;
+        task->event.data = op;
+        task->event.handler = ngx_http_lua_io_read_ahead_event_handler;
 
-static void
-ngx_http_lua_io_before_yield(ngx_http_request_t *r,
-    ngx_http_lua_io_file_ctx_t *file_ctx)
-{
-    ngx_http_lua_ctx_t     *lctx;
-    ngx_http_lua_co_ctx_t  *coctx;
+        if (ngx_thread_task_post(file_ctx->thread_pool, task) != NGX_OK) {
+            ngx_http_lua_io_op_done(r, ngx_http_lua_get_lua_vm(r, NULL), op);
+            return;
+        }
 
-    lctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
-    coctx = lctx->cur_co_ctx;
+        /*
+         * r->aio is left alone, the Lua code keeps on running
+         * (and sending the output) while the task is in flight
+         */
 
-    ngx_http_lua_cleanup_pending_operation(coctx);
-    coctx->cleanup = ngx_http_lua_io_coctx_cleanup;
-    coctx->data = file_ctx;
+        r->main->blocked++;
 
-    file_ctx->coctx = coctx;
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "lua io read ahead task #%ui posted, %uz @%O",
+                       task->id, size, file_ctx->ra_offset);
 
-    if (lctx->entered_content_phase) {
-        r->write_event_handler = ngx_http_lua_io_content_wev_handler;
+        i = (file_ctx->ra_head + file_ctx->ra_count) % file_ctx->read_ahead;
 
-    } else {
-        r->write_event_handler = ngx_http_core_run_phases;
+        file_ctx->ra_ops[i] = op;
+        file_ctx->ra_count++;
+        file_ctx->ra_offset += size;
     }
 }
 
 
-static ngx_int_t
-ngx_http_lua_io_prepare_retvals(ngx_http_request_t *r,
-    ngx_http_lua_io_file_ctx_t *file_ctx, ngx_http_lua_co_ctx_t *coctx)
+static void
+ngx_http_lua_io_read_ahead_event_handler(ngx_event_t *ev)
 {
-    ngx_int_t                      rc;
-    ngx_buf_t                     *b;
-    ngx_http_lua_io_ctx_t         *ioctx;
-    ngx_http_lua_io_thread_ctx_t  *thread_ctx;
-
-    thread_ctx = file_ctx->thread_task->ctx;
-    if (thread_ctx->err) {
-        file_ctx->error = thread_ctx->err;
-        return ngx_http_lua_io_handle_error(coctx->co, r, file_ctx);
-    }
-
-    ioctx = ngx_http_get_module_ctx(r, ngx_http_lua_io_module);
-
-    if (file_ctx->write_waiting) {
-        file_ctx->offset += thread_ctx->nbytes;
-        file_ctx->write_waiting = 0;
-
-        thread_ctx->chain->buf->pos = thread_ctx->chain->buf->last;
+    ngx_http_lua_io_op_t *op = ev->data;
 
-        thread_ctx->chain->next = ioctx->free_write_bufs;
-        ioctx->free_write_bufs = thread_ctx->chain;
+    ngx_connection_t            *c;
+    ngx_http_request_t          *r;
+    ngx_http_lua_ctx_t          *lctx;
+    ngx_http_lua_io_file_ctx_t  *file_ctx;
 
-        thread_ctx->chain = NULL;
+    r = op->request;
+    c = r->connection;
 
-        if (file_ctx->seeking) {
-            file_ctx->seeking = 0;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "lua io read ahead handler, task #%ui", op->task->id);
 
-            return ngx_http_lua_io_file_do_seek(file_ctx, r, coctx->co,
-                                                file_ctx->seek_offset,
-                                                file_ctx->whence);
-        }
+    ev->complete = 0;
 
-        lua_pushinteger(coctx->co, file_ctx->nbytes);
-        return 1;
-    }
+    r->main->blocked--;
 
-    if (file_ctx->flush_waiting) {
-        file_ctx->offset += thread_ctx->nbytes;
-        file_ctx->flush_waiting = 0;
+    op->ready = 1;
+    file_ctx = op->file_ctx;
 
-        if (thread_ctx->chain) {
-            thread_ctx->chain->buf->pos = thread_ctx->chain->buf->last;
+    if (op->dropped) {
+        file_ctx->ra_dropped--;
 
-            thread_ctx->chain->next = ioctx->free_write_bufs;
-            ioctx->free_write_bufs = thread_ctx->chain;
+        ngx_http_lua_io_op_done(r, ngx_http_lua_get_lua_vm(r, NULL), op);
 
-            thread_ctx->chain = NULL;
+        if (file_ctx->closed) {
+            ngx_http_lua_io_read_ahead_unref(r, file_ctx);
         }
 
-        if (file_ctx->closing) {
-            file_ctx->closing = 0;
-            ngx_http_lua_io_file_finalize(r, file_ctx);
+        goto wakeup;
+    }
 
-            if (file_ctx->ft_type || file_ctx->error) {
-                return ngx_http_lua_io_handle_error(coctx->co, r, file_ctx);
-            }
-        }
+    if (op->thread_ctx.err || op->thread_ctx.eof) {
+        file_ctx->ra_eof = 1;
+    }
 
-        lua_pushinteger(coctx->co, 1);
-        return 1;
+    if (!file_ctx->ra_waiting || file_ctx->ra_ops[file_ctx->ra_head] != op) {
+        goto wakeup;
     }
 
-    /* file_ctx->read_waiting == 1 */
+    if (file_ctx->coctx == NULL) {
+        file_ctx->ra_waiting = 0;
+        file_ctx->read_waiting = 0;
+        goto wakeup;
+    }
 
-    file_ctx->eof = thread_ctx->eof;
-    file_ctx->read_waiting = 0;
-    file_ctx->buffer.last += thread_ctx->nbytes;
+    lctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
 
-    if (file_ctx->eof) {
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "lua io read eof");
-    }
+    lctx->resume_handler = ngx_http_lua_io_resume;
+    lctx->cur_co_ctx = file_ctx->coctx;
 
-    rc = ngx_http_lua_io_file_do_read(r, file_ctx);
+    r->write_event_handler(r);
+    ngx_http_run_posted_requests(c);
 
-    if (rc == NGX_AGAIN) {
-        b = &file_ctx->buffer;
-        if (NGX_UNLIKELY(ngx_http_lua_io_thread_post_read_task(file_ctx, b)
-                         == NGX_ERROR))
-        {
-            return ngx_http_lua_io_handle_error(coctx->co, r, file_ctx);
-        }
+    return;
 
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "lua io read need one more try");
+wakeup:
 
-        file_ctx->read_waiting = 1;
-        return -1;
+    if (r->main->blocked == 0) {
+        ngx_http_lua_io_abandon_wakeup(r);
     }
 
-    if (rc == NGX_ERROR) {
-        return ngx_http_lua_io_handle_error(coctx->co, r, file_ctx);
-    }
+    ngx_http_run_posted_requests(c);
+}
 
-    /* rc == NGX_OK */
 
-    return ngx_http_lua_io_submit_input_data(r, file_ctx, coctx->co);
+static void
+ngx_http_lua_io_read_ahead_anchor(lua_State *L, int index,
+    ngx_http_lua_io_file_ctx_t *file_ctx)
+{
+    /* anchor the file object while the prefetching tasks are in flight */
+
+    if (file_ctx->read_ahead && file_ctx->ra_ref == LUA_NOREF) {
+        lua_pushvalue(L, index);
+        file_ctx->ra_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
 }
 
 
-static int
-ngx_http_lua_io_file_do_seek(ngx_http_lua_io_file_ctx_t *file_ctx,
-    ngx_http_request_t *r, lua_State *L, off_t offset, int whence)
+static void
+ngx_http_lua_io_read_ahead_drop(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx)
 {
+    ngx_http_lua_io_op_t  *op;
 
-    if (whence == SEEK_CUR) {
+    while (file_ctx->ra_count) {
+        op = file_ctx->ra_ops[file_ctx->ra_head];
 
-        /*
-         * due to the buffered reading mechanism,
-         * we rebuild the seek offset, to the correct position.
-         */
+        file_ctx->ra_head = (file_ctx->ra_head + 1) % file_ctx->read_ahead;
+        file_ctx->ra_count--;
 
-        whence = SEEK_SET;
-        offset = file_ctx->offset + offset;
-    }
+        if (op->ready) {
+            ngx_http_lua_io_op_done(r, ngx_http_lua_get_lua_vm(r, NULL), op);
+            continue;
+        }
 
-    offset = lseek(file_ctx->fd, offset, whence);
+        /* released by ngx_http_lua_io_read_ahead_event_handler() */
 
-    if (offset < 0) {
-        file_ctx->error = ngx_errno;
-        return ngx_http_lua_io_handle_error(L, r, file_ctx);
+        op->dropped = 1;
+        file_ctx->ra_dropped++;
     }
 
-    file_ctx->eof = 0;
-    file_ctx->offset = offset;
+    if (file_ctx->ra_waiting) {
+        file_ctx->ra_waiting = 0;
+        file_ctx->read_waiting = 0;
+    }
 
-    lua_pushinteger(L, offset);
-    return 1;
+    file_ctx->ra_head = 0;
+    file_ctx->ra_pos = 0;
+    file_ctx->ra_eof = 0;
 }
 
 
-static int
-ngx_http_lua_io_file_read_helper(ngx_http_request_t *r,
-    ngx_http_lua_io_file_ctx_t *file_ctx, lua_State *L)
+static void
+ngx_http_lua_io_read_ahead_unref(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx)
 {
-    ngx_int_t                    rc;
-    ngx_http_lua_io_loc_conf_t  *iocf;
-    ngx_http_lua_io_ctx_t       *ioctx;
+    lua_State  *L;
 
+    if (file_ctx->ra_ref == LUA_NOREF || file_ctx->ra_dropped) {
+        return;
+    }
 
-    if (file_ctx->bufs_in == NULL) {
-        ioctx = ngx_http_get_module_ctx(r, ngx_http_lua_io_module);
-        iocf = ngx_http_get_module_loc_conf(r, ngx_http_lua_io_module);
+    L = ngx_http_lua_get_lua_vm(r, NULL);
 
-        file_ctx->bufs_in = ngx_http_lua_chain_get_free_buf(r->connection->log,
-                                                            r->pool,
-                                                            &ioctx->free_read_bufs,
-                                                            iocf->read_buf_size);
+    luaL_unref(L, LUA_REGISTRYINDEX, file_ctx->ra_ref);
+    file_ctx->ra_ref = LUA_NOREF;
+}
 
-        if (NGX_UNLIKELY(file_ctx->bufs_in == NULL)) {
-            return luaL_error(L, "no memory");
-        }
 
-        file_ctx->buf_in = file_ctx->bufs_in;
-        file_ctx->buffer = *file_ctx->buf_in->buf;
-    }
+static ngx_int_t
+ngx_http_lua_io_file_post_read(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx)
+{
+    if (file_ctx->ra_count) {
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "lua io read, bufs_in:%p buf_in:%p",
-                   file_ctx->bufs_in, file_ctx->buf_in);
+        /* the next buffer is being prefetched, just wait for it */
 
-    file_ctx->read_waiting = 0;
-    file_ctx->coctx = NULL;
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "lua io read wait for read ahead");
 
-    rc = ngx_http_lua_io_file_do_read(r, file_ctx);
+        ngx_http_lua_io_read_ahead_waits++;
 
-    if (rc == NGX_ERROR) {
-        return ngx_http_lua_io_handle_error(L, r, file_ctx);
+        file_ctx->ra_waiting = 1;
+        return NGX_OK;
     }
 
-    if (rc == NGX_OK) {
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "lua io read done just in one round");
+    return ngx_http_lua_io_thread_post_read_task(file_ctx, &file_ctx->buffer);
+}
 
-        return ngx_http_lua_io_submit_input_data(r, file_ctx, L);
-    }
 
-    /* rc == NGX_AGAIN */
+static ngx_int_t
+ngx_http_lua_io_mapped_resident(u_char *p, size_t size)
+{
+    u_char     *start, *end, vec[64];
+    size_t      len;
+    ngx_uint_t  i, n;
 
-    if (NGX_UNLIKELY(ngx_http_lua_io_thread_post_read_task(file_ctx,
-                                                           &file_ctx->buffer)
-                     == NGX_ERROR))
-    {
-        return ngx_http_lua_io_handle_error(L, r, file_ctx);
-    }
+    start = (u_char *) ((uintptr_t) p & ~((uintptr_t) ngx_pagesize - 1));
+    end = p + size;
 
-    file_ctx->read_waiting = 1;
+    while (start < end) {
+        len = ngx_min((size_t) (end - start), 64 * ngx_pagesize);
 
-    ngx_http_lua_io_before_yield(r, file_ctx);
+        if (mincore((void *) start, len, (void *) vec) == -1) {
+            return 0;
+        }
 
-    return lua_yield(L, 0);
+        n = (len + ngx_pagesize - 1) / ngx_pagesize;
+
+        for (i = 0; i < n; i++) {
+            if (!(vec[i] & 1)) {
+                return 0;
+            }
+        }
+
+        start += len;
+    }
+
+    return 1;
 }
 
 
 static ngx_int_t
-ngx_http_lua_io_file_do_read(ngx_http_request_t *r,
-    ngx_http_lua_io_file_ctx_t *file_ctx)
+ngx_http_lua_io_mapped_copy(ngx_http_request_t *r, u_char *dst, u_char *src,
+    size_t size)
 {
+    struct sigaction  sa;
 
-    size_t      size;
-    ngx_buf_t  *b;
-    ngx_int_t   rc;
+    /*
+     * a page of a MAP_SHARED mapping beyond the end of a truncated file
+     * raises SIGBUS on access, the copy jumps back here from the handler
+     * instead of killing the worker
+     */
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "lua io do read, waiting:%d", file_ctx->read_waiting);
+    if (!ngx_http_lua_io_sigbus_set) {
+        ngx_memzero(&sa, sizeof(struct sigaction));
+        sa.sa_sigaction = ngx_http_lua_io_sigbus_handler;
+        sa.sa_flags = SA_SIGINFO|SA_NODEFER;
+        sigemptyset(&sa.sa_mask);
 
-    b = &file_ctx->buffer;
+        if (sigaction(SIGBUS, &sa, &ngx_http_lua_io_sigbus_action) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
+                          "sigaction(SIGBUS) failed");
+            return NGX_ERROR;
+        }
 
-    for ( ;; ) {
+        ngx_http_lua_io_sigbus_set = 1;
+    }
 
-        size = b->last - b->pos;
+    if (sigsetjmp(ngx_http_lua_io_sigbus_env, 0) != 0) {
+        ngx_http_lua_io_sigbus_start = NULL;
+        ngx_http_lua_io_sigbus_end = NULL;
+        return NGX_ERROR;
+    }
 
-        if (size == 0 && !file_ctx->eof) {
-            break;
-        }
+    ngx_http_lua_io_sigbus_start = src;
+    ngx_http_lua_io_sigbus_end = src + size;
 
-        rc = file_ctx->input_filter(file_ctx, b, size);
-        if (rc == NGX_OK) {
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                           "lua io read done, waiting:%d",
-                           file_ctx->read_waiting);
+    ngx_memcpy(dst, src, size);
 
-            return NGX_OK;
-        }
+    ngx_http_lua_io_sigbus_start = NULL;
+    ngx_http_lua_io_sigbus_end = NULL;
 
-        if (rc == NGX_AGAIN) {
-            break;
-        }
-    }
+    return NGX_OK;
+}
 
-    if (file_ctx->eof) {
-        return NGX_OK;
-    }
 
-    size = b->end - b->last;
-    if (size == 0) {
-        rc = ngx_http_lua_io_add_input_buffer(r, file_ctx);
+static void
+ngx_http_lua_io_sigbus_handler(int signo, siginfo_t *siginfo, void *ucontext)
+{
+    u_char  *addr;
 
-        if (NGX_UNLIKELY(rc == NGX_ERROR)) {
-            file_ctx->ft_type |= NGX_HTTP_LUA_IO_FT_NO_MEMORY;
-            return NGX_ERROR;
-        }
+    addr = siginfo->si_addr;
+
+    if (addr >= ngx_http_lua_io_sigbus_start
+        && addr < ngx_http_lua_io_sigbus_end)
+    {
+        siglongjmp(ngx_http_lua_io_sigbus_env, 1);
     }
 
-    return NGX_AGAIN;
+    /*
+     * not ours, the fault is raised again on return and handled
+     * as it was before
+     */
+
+    (void) sigaction(SIGBUS, &ngx_http_lua_io_sigbus_action, NULL);
+    ngx_http_lua_io_sigbus_set = 0;
 }
 
 
@@ -1820,24 +8924,37 @@ static ngx_int_t
 ngx_http_lua_io_add_input_buffer(ngx_http_request_t *r,
     ngx_http_lua_io_file_ctx_t *file_ctx)
 {
+    size_t                       size;
     ngx_chain_t                 *cl;
+    ngx_buf_t                   *b;
     ngx_http_lua_io_loc_conf_t  *iocf;
     ngx_http_lua_io_ctx_t       *ioctx;
 
     ioctx = ngx_http_get_module_ctx(r, ngx_http_lua_io_module);
     iocf = ngx_http_get_module_loc_conf(r, ngx_http_lua_io_module);
 
-    cl = ngx_http_lua_chain_get_free_buf(r->connection->log, r->pool,
-                                         &ioctx->free_read_bufs,
-                                         iocf->read_buf_size);
+    cl = ngx_http_lua_io_get_buf(r, file_ctx, &ioctx->free_read_bufs,
+                                 iocf->read_buf_size);
 
     if (cl == NULL) {
         return NGX_ERROR;
     }
 
+    b = &file_ctx->buffer;
+
+    /* the data left by the input filter (a partial delimiter) is carried */
+
+    size = b->last - b->pos;
+
     file_ctx->buf_in->next = cl;
     file_ctx->buf_in = cl;
+
+    if (size) {
+        ngx_memcpy(cl->buf->start, b->pos, size);
+    }
+
     file_ctx->buffer = *cl->buf;
+    file_ctx->buffer.last += size;
 
     return NGX_OK;
 }
@@ -1849,7 +8966,7 @@ ngx_http_lua_io_submit_input_data(ngx_http_request_t *r,
 {
     luaL_Buffer             luabuf;
     ngx_int_t               nbufs, eof;
-    ngx_chain_t            *cl, **ll;
+    ngx_chain_t            *cl, **ll, **free;
     ngx_buf_t              *b;
     size_t                  size;
     off_t                   offset;
@@ -1894,8 +9011,11 @@ ngx_http_lua_io_submit_input_data(ngx_http_request_t *r,
     if (nbufs > 1 && ll) {
         ioctx = ngx_http_get_module_ctx(r, ngx_http_lua_io_module);
 
-        *ll = ioctx->free_read_bufs;
-        ioctx->free_read_bufs = file_ctx->bufs_in;
+        free = file_ctx->alignment ? &ioctx->free_direct_bufs
+                                   : &ioctx->free_read_bufs;
+
+        *ll = *free;
+        *free = file_ctx->bufs_in;
         file_ctx->bufs_in = file_ctx->buf_in;
     }
 
@@ -1913,3 +9033,97 @@ ngx_http_lua_io_submit_input_data(ngx_http_request_t *r,
 
     return 1;
 }
+
+
+static int
+ngx_http_lua_io_submit_lines(ngx_http_request_t *r,
+    ngx_http_lua_io_file_ctx_t *file_ctx, lua_State *L)
+{
+    u_char      *lf;
+    size_t       len, bytes;
+    ngx_buf_t   *b, *out;
+    ngx_uint_t   n;
+
+    b = &file_ctx->buffer;
+
+    if (file_ctx->lines_batch && file_ctx->lines_ref != LUA_NOREF) {
+
+        /* the table of the previous batch is reused by the iterator */
+
+        lua_rawgeti(L, LUA_REGISTRYINDEX, file_ctx->lines_ref);
+
+    } else {
+        n = ngx_min(file_ctx->max_lines,
+                    (ngx_uint_t) (b->last - b->pos) / 16 + 1);
+
+        lua_createtable(L, (int) n /* narr */, 0 /* nrec */);
+    }
+
+    (void) ngx_http_lua_io_submit_input_data(r, file_ctx, L);
+
+    if (lua_isnil(L, -1)) {
+        lua_remove(L, -2);
+        return 1;
+    }
+
+    bytes = lua_objlen(L, -1);
+    lua_rawseti(L, -2, 1);
+
+    /*
+     * the buffer has been collapsed by ngx_http_lua_io_submit_input_data(),
+     * the complete lines in it are split one by one in place
+     */
+
+    out = file_ctx->buf_in->buf;
+    n = 1;
+
+    while (n < file_ctx->max_lines && bytes < file_ctx->max_bytes) {
+        lf = memchr(b->pos, LF, b->last - b->pos);
+        if (lf == NULL) {
+            break;
+        }
+
+        (void) ngx_http_lua_io_read_line(file_ctx, b, lf + 1 - b->pos);
+
+        len = out->last - out->pos;
+
+        lua_pushlstring(L, (char *) out->pos, len);
+        lua_rawseti(L, -2, (int) ++n);
+
+        file_ctx->offset += len;
+        bytes += len;
+
+        out->pos = b->pos;
+        out->last = b->pos;
+    }
+
+    if (b->pos == b->last) {
+        b->pos = b->start;
+        b->last = b->start;
+
+        out->pos = b->start;
+        out->last = b->start;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua io submit %ui lines, %uz bytes", n, bytes);
+
+    if (!file_ctx->lines_batch) {
+        return 1;
+    }
+
+    /* the iterator returns the first line and keeps the others */
+
+    if (file_ctx->lines_ref == LUA_NOREF) {
+        lua_pushvalue(L, -1);
+        file_ctx->lines_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+
+    file_ctx->lines_next = 1;
+    file_ctx->lines_n = n;
+
+    lua_rawgeti(L, -1, 1);
+    lua_remove(L, -2);
+
+    return 1;
+}
@@ -2,7 +2,7 @@ use Test::Nginx::Socket::Lua;
 
 repeat_each(3);
 
-plan tests => repeat_each() * 4 * 13;
+plan tests => repeat_each() * 4 * 14;
 
 log_level 'debug';
 
@@ -471,3 +471,42 @@ lua io file ctx finalize
 [error]
 --- no_error_log
 lua io file ctx cleanup
+
+
+
+=== TEST 14: open is offloaded to the thread pool, appending starts at the end of file
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local io = require "ngx.io"
+            local name = ngx.config.prefix() .. "/conf/test.txt"
+            local f = assert(_G.io.open(name, "w"))
+            f:write("Hello")
+            f:close()
+
+            local file, err = io.open("conf/test.txt", "a")
+            assert(type(file) == "table")
+            assert(err == nil)
+
+            ngx.say(file:seek())
+
+            local ok, err = file:close()
+            assert(ok)
+            assert(err == nil)
+
+            os.execute("rm -f " .. name)
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+5
+--- grep_error_log: lua io open saved co ctx
+--- grep_error_log_out
+lua io open saved co ctx
+--- no_error_log
+[error]
@@ -2,7 +2,7 @@ use Test::Nginx::Socket::Lua;
 
 repeat_each(3);
 
-plan tests => repeat_each() * (6 * 3 + 5 * 14);
+plan tests => repeat_each() * (6 * 3 + 5 * 15 + 3);
 
 log_level 'debug';
 
@@ -1014,3 +1014,99 @@ GET /t
 lua io seek drain read chain
 --- no_error_log eval
 ["error", "crit"]
+
+
+
+=== TEST 18: mix read with write (without calling seek)
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        lua_io_write_buffer_size 100;
+        lua_io_read_buffer_size 256;
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            local f = assert(io.open(prefix .. "/conf/test.txt", "w"))
+            f:write("0123456789abcdef")
+            f:close()
+
+            local file = assert(ngx_io.open("conf/test.txt", "r+"))
+
+            ngx.say(file:read(2))
+
+            -- written at the file position, not after the buffered data
+            assert(file:write("XY"))
+            assert(file:flush())
+
+            ngx.say(file:read(2))
+
+            assert(file:seek("set", 0))
+            ngx.say(file:read("*a"))
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+01
+45
+01XY456789abcdef
+--- grep_error_log: lua io write drain read chain
+--- grep_error_log_out
+lua io write drain read chain
+--- no_error_log eval
+["error", "crit"]
+
+
+
+=== TEST 19: write after reading lines (the line terminators are counted)
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            local f = assert(io.open(prefix .. "/conf/test.txt", "w"))
+            f:write("ab\r\ncd\nef\ngh\n")
+            f:close()
+
+            local file = assert(ngx_io.open("conf/test.txt", "r+"))
+
+            ngx.say(file:read("*l"))
+            ngx.say(file:seek())
+            ngx.say(file:read("*l"))
+
+            assert(file:write("EF\n"))
+            assert(file:flush())
+
+            ngx.say(file:read("*l"))
+            ngx.say(file:seek())
+            assert(file:close())
+
+            f = assert(io.open(prefix .. "/conf/test.txt"))
+            local data = f:read("*a")
+            f:close()
+
+            data = data:gsub("\r", "\\r"):gsub("\n", "\\n")
+            ngx.say(data)
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+ab
+4
+cd
+gh
+13
+ab\r\ncd\nEF\ngh\n
+--- no_error_log
+[error]
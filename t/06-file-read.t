@@ -2,7 +2,7 @@ use Test::Nginx::Socket::Lua;
 
 repeat_each(3);
 
-plan tests => repeat_each() * (5 * 5 + 7 * 4);
+plan tests => repeat_each() * (5 * 5 + 7 * 4 + 3 * 2);
 
 log_level 'debug';
 
@@ -541,3 +541,95 @@ GET /t
 --- response_body: data ok
 --- no_error_log eval
 ["crit", "error"]
+
+
+
+=== TEST 13: read the rest of a large file after some lines
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    lua_io_read_buffer_size 100;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            local lines = {}
+            for i = 1, 10000 do
+                lines[i] = "line " .. i
+            end
+
+            local data = table.concat(lines, "\n") .. "\n"
+
+            local f = assert(io.open(prefix .. "/conf/large.txt", "w"))
+            f:write(data)
+            f:close()
+
+            local file = assert(ngx_io.open("conf/large.txt"))
+
+            ngx.say(file:read("*l"))
+            ngx.say(file:read(7))
+
+            local rest = file:read("*a")
+            ngx.say(rest == string.sub(data, 15))
+            ngx.say(file:read("*a"))
+            ngx.say(file:seek())
+
+            assert(file:seek("set", 0))
+            ngx.say(file:read("*a") == data)
+            assert(file:close())
+
+            -- the linefeeds are counted in the position as well
+
+            file = assert(ngx_io.open("conf/large.txt"))
+            assert(file:read("*l"))
+            assert(file:read("*l"))
+            ngx.say(file:seek())
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+line 1
+line 2
+
+true
+nil
+98894
+true
+14
+--- no_error_log
+[error]
+
+
+
+=== TEST 14: read all from an empty file
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            local f = assert(io.open(prefix .. "/conf/empty.txt", "w"))
+            f:close()
+
+            local file = assert(ngx_io.open("conf/empty.txt"))
+            ngx.say(file:read("*a"))
+            ngx.say(file:read("*l"))
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+nil
+nil
+--- no_error_log
+[error]
@@ -2,7 +2,7 @@ use Test::Nginx::Socket::Lua;
 
 repeat_each(3);
 
-plan tests => repeat_each() * (4 * 6);
+plan tests => repeat_each() * (4 * 8);
 
 log_level 'debug';
 
@@ -286,3 +286,195 @@ GET /t
 --- response_body: operation not permitted
 --- no_error_log eval
 ["crit", "error"]
+
+
+
+=== TEST 7: long lines with the terminators around the 64 byte buffer ends
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        lua_io_read_buffer_size 64;
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local path = ngx.config.prefix() .. "/conf/test.txt"
+
+            -- the CRs are inside lines longer than 64 bytes, at the block
+            -- edges of the scanner, and both terminators hit buffer ends
+            local crs = { 15, 16, 31, 32, 63, 64, 127, 200, 255,
+                          272, 273, 288, 289, 320, 321, 447, 639 }
+            local lfs = { 100, 143, 144, 159, 160, 256, 383, 384,
+                          511, 575, 640, 767, 768 }
+
+            local bytes = {}
+            for i = 0, 899 do
+                bytes[i + 1] = string.char(97 + i % 26)
+            end
+
+            for _, i in ipairs(crs) do
+                bytes[i + 1] = "\r"
+            end
+
+            for _, i in ipairs(lfs) do
+                bytes[i + 1] = "\n"
+            end
+
+            local data = table.concat(bytes)
+
+            local f = assert(io.open(path, "w"))
+            f:write(data)
+            f:close()
+
+            -- the byte loop: a CR is dropped anywhere, a LF ends the line
+            local expected = {}
+            local line = {}
+            for i = 1, #data do
+                local c = string.sub(data, i, i)
+                if c == "\n" then
+                    expected[#expected + 1] = table.concat(line)
+                    line = {}
+
+                elseif c ~= "\r" then
+                    line[#line + 1] = c
+                end
+            end
+            expected[#expected + 1] = table.concat(line)
+
+            local function check(got)
+                assert(#got == #expected, #got .. " lines")
+                for i = 1, #expected do
+                    assert(got[i] == expected[i], "line " .. i)
+                end
+            end
+
+            local file = assert(ngx_io.open("conf/test.txt", "r"))
+            local t = {}
+            while true do
+                local line, err = file:read("*l")
+                if line == nil then
+                    assert(err == nil)
+                    break
+                end
+                t[#t + 1] = line
+            end
+
+            check(t)
+            ngx.say(#t, " ", file:seek("cur"))
+            assert(file:close())
+
+            file = assert(ngx_io.open("conf/test.txt", "r"))
+            t = {}
+            for line in file:lines() do
+                t[#t + 1] = line
+            end
+
+            check(t)
+            ngx.say(#t, " ", file:seek("cur"))
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+14 900
+14 900
+--- no_error_log eval
+["crit", "error"]
+
+
+
+=== TEST 8: long lines with the terminators around the 128 byte buffer ends
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        lua_io_read_buffer_size 128;
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local path = ngx.config.prefix() .. "/conf/test.txt"
+
+            -- the CRs are inside lines longer than 64 bytes, at the block
+            -- edges of the scanner, and both terminators hit buffer ends
+            local crs = { 15, 16, 31, 32, 63, 64, 127, 200, 255,
+                          272, 273, 288, 289, 320, 321, 447, 639 }
+            local lfs = { 100, 143, 144, 159, 160, 256, 383, 384,
+                          511, 575, 640, 767, 768 }
+
+            local bytes = {}
+            for i = 0, 899 do
+                bytes[i + 1] = string.char(97 + i % 26)
+            end
+
+            for _, i in ipairs(crs) do
+                bytes[i + 1] = "\r"
+            end
+
+            for _, i in ipairs(lfs) do
+                bytes[i + 1] = "\n"
+            end
+
+            local data = table.concat(bytes)
+
+            local f = assert(io.open(path, "w"))
+            f:write(data)
+            f:close()
+
+            -- the byte loop: a CR is dropped anywhere, a LF ends the line
+            local expected = {}
+            local line = {}
+            for i = 1, #data do
+                local c = string.sub(data, i, i)
+                if c == "\n" then
+                    expected[#expected + 1] = table.concat(line)
+                    line = {}
+
+                elseif c ~= "\r" then
+                    line[#line + 1] = c
+                end
+            end
+            expected[#expected + 1] = table.concat(line)
+
+            local function check(got)
+                assert(#got == #expected, #got .. " lines")
+                for i = 1, #expected do
+                    assert(got[i] == expected[i], "line " .. i)
+                end
+            end
+
+            local file = assert(ngx_io.open("conf/test.txt", "r"))
+            local t = {}
+            while true do
+                local line, err = file:read("*l")
+                if line == nil then
+                    assert(err == nil)
+                    break
+                end
+                t[#t + 1] = line
+            end
+
+            check(t)
+            ngx.say(#t, " ", file:seek("cur"))
+            assert(file:close())
+
+            file = assert(ngx_io.open("conf/test.txt", "r"))
+            t = {}
+            for line in file:lines() do
+                t[#t + 1] = line
+            end
+
+            check(t)
+            ngx.say(#t, " ", file:seek("cur"))
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+14 900
+14 900
+--- no_error_log eval
+["crit", "error"]
@@ -0,0 +1,126 @@
+use Test::Nginx::Socket::Lua;
+
+repeat_each(3);
+
+plan tests => repeat_each() * (4 * 3);
+
+log_level 'debug';
+
+no_long_string();
+run_tests();
+
+__DATA__
+
+=== TEST 1: reuse the cached descriptor for the read only mode
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- http_config
+    lua_io_open_file_cache max=10 inactive=60s valid=60s;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+
+            for i = 1, 2 do
+                local file, err = ngx_io.open("conf/nginx.conf", "r")
+                assert(type(file) == "table")
+                assert(err == nil)
+
+                local data, err = file:read(6)
+                assert(err == nil)
+                ngx.say(#data)
+
+                local ok, err = file:close()
+                assert(ok)
+                assert(err == nil)
+            end
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+6
+6
+--- error_log
+lua io open cached fd:
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: the cached descriptor is revalidated with stat
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- http_config
+    lua_io_open_file_cache max=10 valid=0s;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+            local name = prefix .. "/conf/test.txt"
+
+            local function replace(data)
+                local f = assert(io.open(name .. ".tmp", "w"))
+                f:write(data)
+                f:close()
+                assert(os.rename(name .. ".tmp", name))
+            end
+
+            replace("foo")
+
+            local file = assert(ngx_io.open("conf/test.txt"))
+            ngx.say(file:read("*a"))
+            assert(file:close())
+
+            replace("hello")
+
+            local file = assert(ngx_io.open("conf/test.txt"))
+            ngx.say(file:read("*a"))
+            assert(file:close())
+
+            os.remove(name)
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+foo
+hello
+--- error_log
+lua io file cache add
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: the write modes bypass the cache
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- http_config
+    lua_io_open_file_cache max=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+
+            local file = assert(ngx_io.open("conf/test.txt", "w+"))
+            assert(file:write("data"))
+            assert(file:close())
+
+            os.remove(ngx.config.prefix() .. "/conf/test.txt")
+            ngx.print("OK")
+        }
+    }
+
+--- request
+GET /t
+--- response_body: OK
+--- no_error_log
+lua io file cache add
+[error]
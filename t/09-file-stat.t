@@ -0,0 +1,176 @@
+use Test::Nginx::Socket::Lua;
+
+repeat_each(3);
+
+plan tests => repeat_each() * (3 * 5);
+
+log_level 'debug';
+
+no_long_string();
+run_tests();
+
+__DATA__
+
+=== TEST 1: stat a regular file
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            local f = assert(io.open(prefix .. "/conf/test.txt", "w"))
+            f:write("hello world")
+            f:close()
+
+            local info, err = ngx_io.stat("conf/test.txt")
+            assert(err == nil)
+
+            ngx.say(info.type)
+            ngx.say(info.size)
+            ngx.say(info.nlink)
+            ngx.say(info.ino > 0)
+            ngx.say(info.mtime > 0)
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+file
+11
+1
+true
+true
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: stat a nonexistent file
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+
+            local info, err = ngx_io.stat("conf/nonexistent.txt")
+            ngx.say(info)
+            ngx.say(err)
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+nil
+no such file or directory
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: stat a directory with dont_sync
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+
+            local info, err = ngx_io.stat(ngx.config.prefix() .. "/conf",
+                                          { dont_sync = true })
+            assert(err == nil)
+
+            ngx.say(info.type)
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+directory
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: stat an opened file
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+
+            local file = assert(ngx_io.open("conf/test.txt", "w"))
+
+            local info, err = file:stat()
+            assert(err == nil)
+            ngx.say(info.type, " ", info.size)
+
+            assert(file:write("hello"))
+            assert(file:flush())
+
+            info, err = file:stat()
+            assert(err == nil)
+            ngx.say(info.type, " ", info.size)
+
+            assert(file:close())
+
+            info, err = file:stat()
+            ngx.say(info, " ", err)
+
+            local st = assert(ngx_io.stat("conf/test.txt"))
+            ngx.say(st.size)
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+file 0
+file 5
+nil closed
+5
+--- no_error_log
+[error]
+
+
+
+=== TEST 5: stat while another light thread is reading
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+
+            local file = assert(ngx_io.open("conf/nginx.conf"))
+
+            local co = ngx.thread.spawn(function ()
+                return file:read("*a")
+            end)
+
+            local info = assert(file:stat())
+            local ok, data = ngx.thread.wait(co)
+            assert(ok)
+
+            ngx.say(info.size == #data)
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+true
+--- no_error_log
+[error]
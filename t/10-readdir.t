@@ -0,0 +1,198 @@
+use Test::Nginx::Socket::Lua;
+
+repeat_each(3);
+
+plan tests => repeat_each() * (3 * 4);
+
+log_level 'debug';
+
+no_long_string();
+run_tests();
+
+__DATA__
+
+=== TEST 1: iterate a directory
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            os.execute("rm -rf " .. prefix .. "/html/dir")
+            os.execute("mkdir -p " .. prefix .. "/html/dir/sub")
+
+            for i = 1, 3 do
+                local f = assert(io.open(prefix .. "/html/dir/" .. i, "w"))
+                f:close()
+            end
+
+            local iter, err = ngx_io.readdir("html/dir")
+            assert(err == nil)
+
+            local entries = {}
+            for name, typ, ino in iter do
+                assert(ino > 0)
+                entries[#entries + 1] = name .. " " .. typ
+            end
+
+            table.sort(entries)
+
+            for _, e in ipairs(entries) do
+                ngx.say(e)
+            end
+
+            ngx.say(iter())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+1 file
+2 file
+3 file
+sub directory
+nil
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: read a directory with multiple batches
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            os.execute("rm -rf " .. prefix .. "/html/dir")
+            os.execute("mkdir -p " .. prefix .. "/html/dir")
+
+            local name = string.rep("a", 200)
+
+            for i = 1, 1000 do
+                local f = assert(io.open(prefix .. "/html/dir/" .. name .. i,
+                                         "w"))
+                f:close()
+            end
+
+            local n = 0
+            for entry in assert(ngx_io.readdir(prefix .. "/html/dir")) do
+                n = n + 1
+            end
+
+            ngx.say(n)
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+1000
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: nonexistent directory
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+
+            ngx.say(ngx_io.readdir("html/nonexistent"))
+            ngx.say(ngx_io.readdir("conf/nginx.conf"))
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+nilno such file or directory
+nilnot a directory
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: iterate on after a killed light thread
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            os.execute("rm -rf " .. prefix .. "/html/dir")
+            os.execute("mkdir -p " .. prefix .. "/html/dir")
+
+            local name = string.rep("a", 200)
+
+            for i = 1, 1000 do
+                local f = assert(io.open(prefix .. "/html/dir/" .. name .. i,
+                                         "w"))
+                f:close()
+            end
+
+            local iter = assert(ngx_io.readdir(prefix .. "/html/dir"))
+
+            local seen, n = {}, 0
+
+            local function add(entry)
+                if not seen[entry] then
+                    seen[entry] = true
+                    n = n + 1
+                end
+            end
+
+            -- the first batch is consumed, then the next one is in flight
+
+            local t = ngx.thread.spawn(function ()
+                for entry in iter do
+                    add(entry)
+                end
+            end)
+
+            ngx.thread.kill(t)
+            ngx.sleep(0.1)
+
+            local entry, err = iter()
+            ngx.say(entry ~= nil, " ", err)
+
+            add(entry)
+
+            for entry in iter do
+                add(entry)
+            end
+
+            -- no entry of the batch read by the killed thread is skipped
+
+            ngx.say(n)
+
+            t = ngx.thread.spawn(ngx_io.readdir, prefix .. "/html/dir")
+            ngx.thread.kill(t)
+            ngx.sleep(0.1)
+
+            ngx.say("ok")
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+true nil
+1000
+ok
+--- no_error_log
+[error]
@@ -0,0 +1,162 @@
+use Test::Nginx::Socket::Lua;
+
+repeat_each(3);
+
+plan tests => repeat_each() * (3 * 4);
+
+log_level 'debug';
+
+no_long_string();
+run_tests();
+
+__DATA__
+
+=== TEST 1: mkdir, rename, rmdir
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            os.execute("rm -rf " .. prefix .. "/html/a " .. prefix .. "/html/b")
+
+            ngx.say(ngx_io.mkdir("html/a", tonumber("755", 8)))
+            ngx.say(ngx_io.mkdir("html/a"))
+            ngx.say(ngx_io.rename("html/a", prefix .. "/html/b"))
+            ngx.say(ngx_io.stat("html/b").type)
+            ngx.say(ngx_io.rmdir("html/b"))
+            ngx.say(ngx_io.rmdir("html/b"))
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+1
+nilfile exists
+1
+directory
+1
+nilno such file or directory
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: link and symlink
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            os.remove(prefix .. "/html/hard")
+            os.remove(prefix .. "/html/soft")
+
+            local f = assert(io.open(prefix .. "/html/orig", "w"))
+            f:write("hello")
+            f:close()
+
+            ngx.say(ngx_io.link("html/orig", "html/hard"))
+            ngx.say(ngx_io.stat("html/orig").nlink)
+
+            ngx.say(ngx_io.symlink("orig", "html/soft"))
+
+            local file = assert(ngx_io.open("html/soft"))
+            ngx.say(file:read("*a"))
+            assert(file:close())
+
+            ngx.say(ngx_io.unlink("html/hard"))
+            ngx.say(ngx_io.unlink("html/soft"))
+            ngx.say(ngx_io.unlink("html/soft"))
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+1
+2
+1
+hello
+1
+1
+nilno such file or directory
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: bulk unlink
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            local names = {}
+
+            for i = 1, 100 do
+                local name = "html/bulk" .. i
+                local f = assert(io.open(prefix .. "/" .. name, "w"))
+                f:close()
+                names[i] = name
+            end
+
+            names[#names + 1] = "html/nonexistent"
+
+            local n, errs = ngx_io.unlink(names)
+            ngx.say(n)
+
+            for name, err in pairs(errs) do
+                ngx.say(name, ": ", err)
+            end
+
+            ngx.say(ngx_io.unlink({}))
+            ngx.say(ngx_io.unlink({ "html/bulk1" }))
+        }
+    }
+
+--- request
+GET /t
+--- response_body_like
+^100
+html/nonexistent: no such file or directory
+0
+0table: 0x[0-9a-f]+
+$
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: bad arguments
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+
+            ngx.say(pcall(ngx_io.rename, "foo"))
+            ngx.say(pcall(ngx_io.unlink, { "foo", {} }))
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+falseexpecting 2 argument(s), but got 1
+falsebad path at index 2
+--- no_error_log
+[error]
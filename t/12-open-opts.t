@@ -0,0 +1,145 @@
+use Test::Nginx::Socket::Lua;
+
+repeat_each(3);
+
+plan tests => repeat_each() * (3 * 4);
+
+log_level 'debug';
+
+no_long_string();
+run_tests();
+
+__DATA__
+
+=== TEST 1: direct I/O write and read back
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+
+            local file, err = ngx_io.open("conf/direct.txt", "w",
+                                          { direct = true })
+            assert(file, err)
+
+            local line = string.rep("a", 99) .. "\n"
+
+            for i = 1, 100 do
+                assert(file:write(line))
+            end
+
+            assert(file:write("tail"))
+            assert(file:close())
+
+            file = assert(ngx_io.open("conf/direct.txt", nil,
+                                      { direct = true }))
+
+            local n = 0
+            for l in file:lines() do
+                n = n + 1
+                if n == 101 then
+                    ngx.say(l)
+                end
+            end
+
+            ngx.say(n)
+
+            assert(file:seek("set", 150))
+            ngx.say(#file:read("*a"))
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+tail
+101
+9854
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: direct I/O with the write through mode
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    lua_io_write_buffer_size 0;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+
+            local file = assert(ngx_io.open("conf/direct.txt", "w+",
+                                            { direct = true }))
+
+            assert(file:write(string.rep("b", 4096)))
+            assert(file:write("hello"))
+
+            assert(file:seek("set", 4090))
+            ngx.say(file:read(11))
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+bbbbbbhello
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: noatime, sync and dsync
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+
+            local file = assert(ngx_io.open("conf/sync.txt", "w",
+                                            { sync = true, dsync = true }))
+            assert(file:write("hello"))
+            assert(file:close())
+
+            file = assert(ngx_io.open("conf/sync.txt", nil,
+                                      { noatime = true }))
+            ngx.say(file:read("*a"))
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+hello
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: bad option table
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+
+            ngx.say(pcall(ngx_io.open, "conf/nginx.conf", "r", "direct"))
+        }
+    }
+
+--- request
+GET /t
+--- response_body_like
+^false.*table expected, got string
+--- no_error_log
+[error]
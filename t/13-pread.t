@@ -0,0 +1,176 @@
+use Test::Nginx::Socket::Lua;
+
+repeat_each(3);
+
+plan tests => repeat_each() * (3 * 4);
+
+log_level 'debug';
+
+no_long_string();
+run_tests();
+
+__DATA__
+
+=== TEST 1: positional reads
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            local f = assert(io.open(prefix .. "/conf/test.txt", "w"))
+            f:write("0123456789abcdef")
+            f:close()
+
+            local file = assert(ngx_io.open("conf/test.txt"))
+
+            ngx.say(file:pread(10, 3))
+            ngx.say(file:pread(0, 4))
+            ngx.say(file:pread(14, 100))
+            ngx.say(file:pread(16, 1))
+            ngx.say(file:pread(100, 1))
+            ngx.say(file:pread(3, 0) == "")
+
+            -- the file position is untouched
+            ngx.say(file:read(5))
+
+            assert(file:close())
+            ngx.say(file:pread(0, 1))
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+abc
+0123
+ef
+nil
+nil
+true
+01234
+nilclosed
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: concurrent reads on one file object
+--- main_config
+thread_pool default threads=4 max_queue=100;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            local f = assert(io.open(prefix .. "/conf/index.txt", "w"))
+            for i = 0, 999 do
+                f:write(string.format("%07d\n", i))
+            end
+            f:close()
+
+            local file = assert(ngx_io.open("conf/index.txt"))
+
+            local threads = {}
+
+            for i = 1, 50 do
+                threads[i] = ngx.thread.spawn(function (n)
+                    return file:pread(n * 8, 7)
+                end, i * 17)
+            end
+
+            -- the buffered read is allowed meanwhile
+            local line = file:read("*l")
+
+            local bad = 0
+
+            for i = 1, 50 do
+                local ok, data = ngx.thread.wait(threads[i])
+                if not ok or tonumber(data) ~= i * 17 then
+                    bad = bad + 1
+                end
+            end
+
+            ngx.say(line)
+            ngx.say(bad)
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+0000000
+0
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: close while reads are in flight
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+
+            local file = assert(ngx_io.open("conf/index.txt"))
+
+            local co = ngx.thread.spawn(function ()
+                return file:pread(8, 7)
+            end)
+
+            assert(file:close())
+
+            ngx.say(ngx.thread.wait(co))
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+true0000001
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: bad arguments
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+
+            local file = assert(ngx_io.open("conf/nginx.conf"))
+
+            ngx.say(pcall(file.pread, file, 0))
+            ngx.say(pcall(file.pread, file, -1, 1))
+            ngx.say(pcall(file.pread, file, 0, -1))
+
+            assert(file:close())
+
+            file = assert(ngx_io.open("conf/test.txt", "a"))
+            ngx.say(file:pread(0, 1))
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+falseexpecting 3 arguments (including the object), but got 2
+falsebad argument #2 to '?' (bad offset argument)
+falsebad argument #3 to '?' (bad size argument)
+niloperation not permitted
+--- no_error_log
+[error]
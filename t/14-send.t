@@ -0,0 +1,186 @@
+use Test::Nginx::Socket::Lua;
+
+repeat_each(3);
+
+plan tests => repeat_each() * (3 * 5);
+
+log_level 'debug';
+
+no_long_string();
+run_tests();
+
+__DATA__
+
+=== TEST 1: send the whole file and a region
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            local f = assert(io.open(prefix .. "/conf/test.txt", "w"))
+            f:write("0123456789\n")
+            f:close()
+
+            local file = assert(ngx_io.open("conf/test.txt"))
+
+            ngx.say(file:send())
+            ngx.say(file:send(3, 4))
+            ngx.say(file:send(8, 100))
+            ngx.say(file:send(100))
+
+            ngx.say(file:read("*l"))
+            assert(file:close())
+
+            ngx.say(file:send())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+0123456789
+11
+34564
+89
+3
+0
+0123456789
+nilclosed
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: send a large file in chunks with backpressure
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    sendfile on;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            local f = assert(io.open(prefix .. "/html/large.txt", "w"))
+            local line = string.rep("x", 1023) .. "\n"
+            for i = 1, 4096 do
+                f:write(line)
+            end
+            f:close()
+
+            local file = assert(ngx_io.open("html/large.txt"))
+            local info = assert(file:stat())
+
+            local chunk = 65536
+            local offset = 0
+
+            while offset < info.size do
+                local n = assert(file:send(offset, chunk))
+                offset = offset + n
+                assert(ngx.flush(true))
+            end
+
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body eval
+("x" x 1023 . "\n") x 4096
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: close the file object before the data is sent
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    sendfile off;
+    output_buffers 1 4k;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+
+            local file = assert(ngx_io.open("html/large.txt"))
+            ngx.say(file:send(0, 10000) == 10000)
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body eval
+"true\n" . ("x" x 1023 . "\n") x 9 . "x" x 784
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: send from a write-only file
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+
+            local file = assert(ngx_io.open("conf/test.txt", "w"))
+            ngx.say(file:send())
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+niloperation not permitted
+--- no_error_log
+[error]
+
+
+
+=== TEST 5: the file size is taken when sending
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+
+            local file = assert(ngx_io.open("conf/test.txt", "w+"))
+
+            assert(file:write("hello\n"))
+            assert(file:flush())
+            ngx.say(file:send())
+
+            assert(file:write("world\n"))
+            ngx.say(file:send(6))
+
+            assert(file:flush())
+            ngx.say(file:send(6, 0))
+            ngx.say(file:send(6))
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+hello
+6
+0
+0
+world
+6
+--- no_error_log
+[error]
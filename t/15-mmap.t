@@ -0,0 +1,195 @@
+use Test::Nginx::Socket::Lua;
+
+repeat_each(3);
+
+plan tests => repeat_each() * (3 * 5);
+
+log_level 'debug';
+
+no_long_string();
+run_tests();
+
+__DATA__
+
+=== TEST 1: read lines and chunks from a mapped file
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    lua_io_read_buffer_size 16;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            local f = assert(io.open(prefix .. "/conf/test.txt", "w"))
+            for i = 1, 10 do
+                f:write("line ", i, " ", string.rep("x", i * 3), "\r\n")
+            end
+            f:close()
+
+            local file = assert(ngx_io.open("conf/test.txt", "r",
+                                            { mmap = true }))
+
+            ngx.say(file:read("*l"))
+            ngx.say(file:read(10))
+
+            local n = 0
+            for line in file:lines() do
+                n = n + 1
+            end
+
+            ngx.say(n)
+            ngx.say(file:read("*l"))
+
+            assert(file:seek("set", 0))
+            ngx.say(#file:read("*a"))
+            ngx.say(file:read("*a"))
+
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+line 1 xxx
+line 2 xxx
+9
+nil
+256
+nil
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: a mapped file which is larger than the read buffer
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            local data = string.rep("abcdefghijklmnopqrstuvwxyz", 40000)
+
+            local f = assert(io.open(prefix .. "/html/large.txt", "w"))
+            f:write(data)
+            f:close()
+
+            local file = assert(ngx_io.open("html/large.txt", nil,
+                                            { mmap = true }))
+
+            ngx.say(file:read("*a") == data)
+
+            assert(file:seek("set", 500000))
+            ngx.say(file:read(5))
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+true
+uvwxy
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: map an empty file
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            local f = assert(io.open(prefix .. "/conf/empty.txt", "w"))
+            f:close()
+
+            local file = assert(ngx_io.open("conf/empty.txt", "r",
+                                            { mmap = true }))
+
+            ngx.say(file:read("*l"))
+            ngx.say(file:read("*a"))
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+nil
+nil
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: mmap with a writable mode
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+
+            ngx.say(ngx_io.open("conf/test.txt", "r+", { mmap = true }))
+            ngx.say(ngx_io.open("conf/test.txt", "r",
+                                { mmap = true, direct = true }))
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+nilmmap requires the read only mode
+nilmmap requires the read only mode
+--- no_error_log
+[error]
+
+
+
+=== TEST 5: a mapped file truncated while it's read
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    lua_io_read_buffer_size 16;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            local f = assert(io.open(prefix .. "/conf/test.txt", "w"))
+            f:write(string.rep("0123456789", 10000))
+            f:close()
+
+            local file = assert(ngx_io.open("conf/test.txt", "r",
+                                            { mmap = true }))
+
+            ngx.say(file:read(10))
+
+            f = assert(io.open(prefix .. "/conf/test.txt", "w"))
+            f:close()
+
+            ngx.say(file:read("*a"))
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+0123456789
+012345
+--- no_error_log
+[error]
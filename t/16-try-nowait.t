@@ -0,0 +1,137 @@
+use Test::Nginx::Socket::Lua;
+
+repeat_each(3);
+
+plan tests => repeat_each() * (3 * 3);
+
+log_level 'debug';
+
+no_long_string();
+run_tests();
+
+__DATA__
+
+=== TEST 1: read cached data in the event loop
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    lua_io_try_nowait on;
+    lua_io_read_buffer_size 64;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            local f = assert(io.open(prefix .. "/conf/test.txt", "w"))
+            for i = 1, 100 do
+                f:write("line ", i, "\n")
+            end
+            f:close()
+
+            local before = ngx_io.stats()
+
+            local file = assert(ngx_io.open("conf/test.txt"))
+
+            ngx.say(file:read("*l"))
+            ngx.say(file:read(7))
+
+            local n = 0
+            for line in file:lines() do
+                n = n + 1
+            end
+
+            ngx.say(n)
+            ngx.say(file:read("*a"))
+
+            local after = ngx_io.stats()
+            ngx.say(after.nowait_hits + after.nowait_misses
+                    > before.nowait_hits + before.nowait_misses)
+
+            -- the data is in the page cache now
+
+            before = after
+
+            assert(file:seek("set", 0))
+            ngx.say(#file:read("*a"))
+            assert(file:close())
+
+            after = ngx_io.stats()
+            ngx.say(after.nowait_hits > before.nowait_hits)
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+line 1
+line 2
+
+98
+nil
+true
+792
+true
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: the fast path is off by default
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            local f = assert(io.open(prefix .. "/conf/test.txt", "w"))
+            for i = 1, 100 do
+                f:write("line ", i, "\n")
+            end
+            f:close()
+
+            local before = ngx_io.stats()
+
+            local file = assert(ngx_io.open("conf/test.txt"))
+            ngx.say(#file:read("*a"))
+            assert(file:close())
+
+            local after = ngx_io.stats()
+            ngx.say(after.nowait_hits - before.nowait_hits)
+            ngx.say(after.nowait_misses - before.nowait_misses)
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+792
+0
+0
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: bad arguments
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+
+            ngx.say(pcall(ngx_io.stats, 1))
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+falseexpecting no arguments, but got 1
+--- no_error_log
+[error]
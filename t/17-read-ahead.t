@@ -0,0 +1,214 @@
+use Test::Nginx::Socket::Lua;
+
+repeat_each(3);
+
+plan tests => repeat_each() * (3 * 5);
+
+log_level 'debug';
+
+no_long_string();
+run_tests();
+
+__DATA__
+
+=== TEST 1: read lines with the prefetched buffers
+--- main_config
+thread_pool default threads=4 max_queue=16;
+--- config
+    server_tokens off;
+    lua_io_read_ahead 4;
+    lua_io_read_buffer_size 256;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            local f = assert(io.open(prefix .. "/conf/test.txt", "w"))
+            for i = 1, 10000 do
+                f:write("line ", i, "\n")
+            end
+            f:close()
+
+            local before = ngx_io.stats()
+
+            local file = assert(ngx_io.open("conf/test.txt"))
+
+            local n, size = 0, 0
+            for line in file:lines() do
+                n = n + 1
+                size = size + #line
+                assert(line == "line " .. n)
+            end
+
+            ngx.say(n, " ", size)
+            ngx.say(file:read("*l"))
+            assert(file:close())
+
+            local after = ngx_io.stats()
+            ngx.say(after.read_ahead_hits - before.read_ahead_hits >= 300)
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+10000 88894
+nil
+true
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: seek drops the prefetched buffers
+--- main_config
+thread_pool default threads=4 max_queue=16;
+--- config
+    server_tokens off;
+    lua_io_read_buffer_size 100;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            local f = assert(io.open(prefix .. "/conf/test.txt", "w"))
+            f:write(string.rep("0123456789", 100))
+            f:close()
+
+            local file = assert(ngx_io.open("conf/test.txt", "r",
+                                            { read_ahead = 3 }))
+
+            ngx.say(file:read(15))
+            ngx.say(file:seek("set", 995))
+            ngx.say(file:read(10))
+            ngx.say(file:seek("set", 333))
+            ngx.say(#file:read("*a"))
+            ngx.say(file:seek("cur", -7))
+            ngx.say(file:read(100))
+            ngx.say(file:read(1))
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+012345678901234
+995
+56789
+333
+667
+993
+3456789
+nil
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: read ahead is only for the read only mode
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    lua_io_read_ahead 4;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            local f = assert(io.open(prefix .. "/conf/test.txt", "w"))
+            f:write("hello\nworld\n")
+            f:close()
+
+            local before = ngx_io.stats()
+
+            local file = assert(ngx_io.open("conf/test.txt", "r+"))
+            ngx.say(file:read("*l"))
+            ngx.say(file:read("*l"))
+            assert(file:close())
+
+            file = assert(ngx_io.open("conf/test.txt", "r",
+                                      { read_ahead = 0 }))
+            ngx.say(file:read("*l"))
+            assert(file:close())
+
+            local after = ngx_io.stats()
+            ngx.say(after.read_ahead_hits == before.read_ahead_hits)
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+hello
+world
+hello
+true
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: leave the file while the prefetching is in flight
+--- main_config
+thread_pool default threads=4 max_queue=16;
+--- config
+    server_tokens off;
+    lua_io_read_ahead 8;
+    lua_io_read_buffer_size 128;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            local f = assert(io.open(prefix .. "/conf/test.txt", "w"))
+            for i = 1, 1000 do
+                f:write("line ", i, "\n")
+            end
+            f:close()
+
+            local file = assert(ngx_io.open("conf/test.txt"))
+            ngx.say(file:read("*l"))
+            assert(file:close())
+
+            file = assert(ngx_io.open("conf/test.txt"))
+            ngx.say(file:read("*l"))
+            ngx.say(file:read(4))
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+line 1
+line 1
+line
+--- no_error_log
+[error]
+
+
+
+=== TEST 5: bad read_ahead option
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+
+            ngx.say(pcall(ngx_io.open, "conf/nginx.conf", "r",
+                          { read_ahead = -1 }))
+            ngx.say(pcall(ngx_io.open, "conf/nginx.conf", "r",
+                          { read_ahead = "foo" }))
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+falsebad "read_ahead" option
+falsebad "read_ahead" option
+--- no_error_log
+[error]
@@ -0,0 +1,218 @@
+use Test::Nginx::Socket::Lua;
+
+repeat_each(3);
+
+plan tests => repeat_each() * (3 * 5);
+
+log_level 'debug';
+
+no_long_string();
+run_tests();
+
+__DATA__
+
+=== TEST 1: read lines in batches
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            local f = assert(io.open(prefix .. "/conf/test.txt", "w"))
+            f:write("a\nb\r\nc\n\nlast")
+            f:close()
+
+            local file = assert(ngx_io.open("conf/test.txt"))
+
+            ngx.say(table.concat(file:read_lines(2), "|"))
+            ngx.say(table.concat(file:read_lines(10), "|"))
+            ngx.say(table.concat(file:read_lines(10), "|"))
+            ngx.say(file:read_lines(10))
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+a|b
+c|
+last
+nil
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: read lines across the read buffers
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    lua_io_read_buffer_size 256;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            local f = assert(io.open(prefix .. "/conf/test.txt", "w"))
+            for i = 1, 10000 do
+                f:write("line ", i, "\n")
+            end
+            f:close()
+
+            local file = assert(ngx_io.open("conf/test.txt"))
+
+            local n, calls, mixed = 0, 0, false
+            while true do
+                local lines = file:read_lines(100)
+                if not lines then
+                    break
+                end
+
+                calls = calls + 1
+                assert(#lines <= 100)
+
+                for _, line in ipairs(lines) do
+                    n = n + 1
+                    assert(line == "line " .. n)
+                end
+
+                if not mixed and n >= 5000 then
+                    n = n + 1
+                    mixed = file:read("*l") == "line " .. n
+                end
+            end
+
+            ngx.say(n, " ", mixed, " ", calls < 10000)
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+10000 true true
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: max_bytes
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            local f = assert(io.open(prefix .. "/conf/test.txt", "w"))
+            f:write(string.rep("aaaa\n", 10))
+            f:close()
+
+            local file = assert(ngx_io.open("conf/test.txt"))
+
+            ngx.say(#file:read_lines(100, 10))
+            ngx.say(#file:read_lines(100, 1))
+            ngx.say(#file:read_lines(100))
+            ngx.say(file:read_lines(100))
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+3
+1
+6
+nil
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: batched lines iterator
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    lua_io_read_buffer_size 128;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            local f = assert(io.open(prefix .. "/conf/test.txt", "w"))
+            for i = 1, 1000 do
+                f:write("line ", i, "\n")
+            end
+            f:close()
+
+            local file = assert(ngx_io.open("conf/test.txt"))
+
+            local n = 0
+            for line in file:lines(64) do
+                n = n + 1
+                assert(line == "line " .. n)
+            end
+
+            ngx.say(n)
+            ngx.say(file:seek("set", 0))
+            ngx.say(file:lines(3)())
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+1000
+0
+line 1
+--- no_error_log
+[error]
+
+
+
+=== TEST 5: bad arguments
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+
+            local file = assert(ngx_io.open("conf/nginx.conf"))
+
+            ngx.say(pcall(file.read_lines, file))
+            ngx.say(pcall(file.read_lines, file, 0))
+            ngx.say(pcall(file.read_lines, file, 1, -1))
+            ngx.say(pcall(file.lines, file, 0))
+
+            assert(file:close())
+            ngx.say(file:read_lines(1))
+
+            file = assert(ngx_io.open("conf/test.txt", "a"))
+            ngx.say(file:read_lines(1))
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+falseexpecting two or three arguments (including the object), but got 1
+falsebad argument #2 to '?' (bad max_lines argument)
+falsebad argument #3 to '?' (bad max_bytes argument)
+falsebad argument #2 to '?' (bad batch argument)
+nilclosed
+niloperation not permitted
+--- no_error_log
+[error]
@@ -0,0 +1,261 @@
+use Test::Nginx::Socket::Lua;
+
+repeat_each(3);
+
+plan tests => repeat_each() * (3 * 5);
+
+log_level 'debug';
+
+no_long_string();
+run_tests();
+
+__DATA__
+
+=== TEST 1: read into a pointer
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    lua_io_read_buffer_size 64;
+    location /t {
+        content_by_lua_block {
+            local ffi = require "ffi"
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            local data = string.rep("0123456789", 100)
+
+            local f = assert(io.open(prefix .. "/conf/test.txt", "w"))
+            f:write(data)
+            f:close()
+
+            local mem = ffi.new("uint8_t[?]", 2000)
+            local ptr = ffi.cast("uint8_t *", mem)
+
+            local file = assert(ngx_io.open("conf/test.txt"))
+
+            ngx.say(file:read(5))
+
+            local n = file:read_into(ptr, 100)
+            ngx.say(n, " ", ffi.string(ptr, n) == data:sub(6, 105))
+
+            ngx.say(file:read(5))
+            ngx.say(file:seek())
+
+            n = file:read_into(ptr, 2000)
+            ngx.say(n, " ", ffi.string(ptr, n) == data:sub(111))
+
+            ngx.say(file:read_into(ptr, 10))
+            ngx.say(file:read_into(ptr, 0))
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+01234
+100 true
+56789
+110
+890 true
+nil
+0
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: read into a string.buffer
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local buffer = require "string.buffer"
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            local f = assert(io.open(prefix .. "/conf/test.txt", "w"))
+            for i = 1, 10000 do
+                f:write("line ", i, "\n")
+            end
+            f:close()
+
+            local buf = buffer.new()
+
+            local file = assert(ngx_io.open("conf/test.txt"))
+            ngx.say(file:read("*l"))
+
+            while true do
+                local n, err = file:read_into(buf, 1000)
+                if not n then
+                    assert(err == nil)
+                    break
+                end
+
+                assert(n <= 1000)
+            end
+
+            assert(file:close())
+
+            local data = buf:tostring()
+
+            f = assert(io.open(prefix .. "/conf/test.txt"))
+            f:read("*l")
+            ngx.say(#data, " ", data == f:read("*a"))
+            f:close()
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+line 1
+98887 true
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: read into with the read ahead mode
+--- main_config
+thread_pool default threads=4 max_queue=16;
+--- config
+    server_tokens off;
+    lua_io_read_ahead 4;
+    lua_io_read_buffer_size 128;
+    location /t {
+        content_by_lua_block {
+            local ffi = require "ffi"
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            local f = assert(io.open(prefix .. "/conf/test.txt", "w"))
+            for i = 1, 1000 do
+                f:write("line ", i, "\n")
+            end
+            f:close()
+
+            local mem = ffi.new("uint8_t[?]", 4096)
+            local ptr = ffi.cast("uint8_t *", mem)
+
+            local file = assert(ngx_io.open("conf/test.txt"))
+
+            for i = 1, 100 do
+                assert(file:read("*l") == "line " .. i)
+            end
+
+            local n = assert(file:read_into(ptr, 4096))
+            local lines = ffi.string(ptr, n)
+            ngx.say(lines:sub(1, 9))
+
+            local last = lines:match("\n([^\n]*)$")
+            ngx.say(file:read("*l"), " ", #last)
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+line 101
+ine 556 1
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: bad arguments
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ffi = require "ffi"
+            local ngx_io = require "ngx.io"
+
+            local ptr = ffi.cast("uint8_t *", ffi.new("uint8_t[16]"))
+
+            local file = assert(ngx_io.open("conf/nginx.conf"))
+
+            ngx.say(pcall(file.read_into, file, ptr))
+            ngx.say(pcall(file.read_into, file, "foo", 1))
+            ngx.say(pcall(file.read_into, file, ffi.cast("uint8_t *", nil), 1))
+            ngx.say(pcall(file.read_into, file, ptr, -1))
+
+            assert(file:close())
+            ngx.say(file:read_into(ptr, 1))
+
+            file = assert(ngx_io.open("conf/test.txt", "a"))
+            ngx.say(file:read_into(ptr, 1))
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+falseexpecting 3 arguments (including the object), but got 2
+falsebad argument #2 to '?' (bad buffer argument)
+falsebad argument #2 to '?' (bad buffer argument)
+falsebad argument #3 to '?' (bad size argument)
+nilclosed
+niloperation not permitted
+--- no_error_log
+[error]
+
+
+
+=== TEST 5: read into an array and a killed light thread
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    lua_io_read_buffer_size 64;
+    location /t {
+        content_by_lua_block {
+            local ffi = require "ffi"
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            local data = string.rep("0123456789", 1000)
+
+            local f = assert(io.open(prefix .. "/conf/test.txt", "w"))
+            f:write(data)
+            f:close()
+
+            local file = assert(ngx_io.open("conf/test.txt"))
+
+            local mem = ffi.new("uint8_t[?]", 100)
+            local n = file:read_into(mem, 100)
+            ngx.say(n, " ", ffi.string(mem, n) == data:sub(1, 100))
+
+            ngx.say(pcall(file.read_into, file, ffi.new("struct { int a; }"),
+                          1))
+
+            local t = ngx.thread.spawn(function ()
+                return file:read_into(ffi.new("uint8_t[?]", 5000), 5000)
+            end)
+
+            ngx.thread.kill(t)
+            collectgarbage()
+            collectgarbage()
+
+            ngx.sleep(0.1)
+
+            ngx.say(file:read(10))
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+100 true
+falsebad argument #2 to '?' (bad buffer argument)
+0123456789
+--- no_error_log
+[error]
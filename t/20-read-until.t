@@ -0,0 +1,182 @@
+use Test::Nginx::Socket::Lua;
+
+repeat_each(3);
+
+plan tests => repeat_each() * (3 * 4);
+
+log_level 'debug';
+
+no_long_string();
+run_tests();
+
+__DATA__
+
+=== TEST 1: NUL separated records
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            local f = assert(io.open(prefix .. "/conf/test.txt", "w"))
+            f:write("a\0bb\0\0ccc")
+            f:close()
+
+            local file = assert(ngx_io.open("conf/test.txt"))
+
+            local iter = file:read_until("\0")
+
+            for i = 1, 5 do
+                ngx.say("[", iter(), "]")
+            end
+
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+[a]
+[bb]
+[]
+[ccc]
+[nil]
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: delimiter spans the read buffers
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    lua_io_read_buffer_size 64;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            local delim = "\r\n--boundary\r\n"
+
+            local function record(i)
+                return "\r\n--bou" .. string.rep("x", i % 97) .. i
+            end
+
+            local f = assert(io.open(prefix .. "/conf/test.txt", "w"))
+            for i = 1, 500 do
+                f:write(record(i), delim)
+            end
+            f:close()
+
+            local file = assert(ngx_io.open("conf/test.txt"))
+
+            local n, pos = 0, 0
+            for data in file:read_until(delim) do
+                n = n + 1
+                assert(data == record(n))
+
+                pos = pos + #data + #delim
+
+                if n % 50 == 0 then
+                    assert(file:seek() == pos)
+                end
+            end
+
+            ngx.say(n, " ", pos == ngx_io.stat("conf/test.txt").size)
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+500 true
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: inclusive option and mixed reads
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            local f = assert(io.open(prefix .. "/conf/test.txt", "w"))
+            f:write("header\nfoo;bar;baz")
+            f:close()
+
+            local file = assert(ngx_io.open("conf/test.txt"))
+
+            local iter = file:read_until(";", { inclusive = true })
+
+            ngx.say(file:read("*l"))
+            ngx.say(iter())
+            ngx.say(file:read(3))
+            ngx.say(iter())
+            ngx.say(iter())
+            ngx.say(iter())
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+header
+foo;
+bar
+;
+baz
+nil
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: bad arguments
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+
+            local file = assert(ngx_io.open("conf/nginx.conf"))
+
+            ngx.say(pcall(file.read_until, file))
+            ngx.say(pcall(file.read_until, file, ""))
+            ngx.say(pcall(file.read_until, file, string.rep("x", 4096)))
+            ngx.say(pcall(file.read_until, file, ";", { inclusive = 1 }))
+
+            local iter = file:read_until(";")
+            assert(file:close())
+            ngx.say(iter())
+
+            file = assert(ngx_io.open("conf/test.txt", "a"))
+            ngx.say(file:read_until(";")())
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+falseexpecting two or three arguments (including the object), but got 1
+falsebad argument #2 to '?' (bad delimiter argument)
+falsebad argument #2 to '?' (bad delimiter argument)
+falsebad "inclusive" option
+nilclosed
+niloperation not permitted
+--- no_error_log
+[error]
@@ -0,0 +1,186 @@
+use Test::Nginx::Socket::Lua;
+
+repeat_each(3);
+
+plan tests => repeat_each() * (3 * 4);
+
+log_level 'debug';
+
+no_long_string();
+run_tests();
+
+__DATA__
+
+=== TEST 1: read multiple ranges
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            local f = assert(io.open(prefix .. "/conf/test.txt", "w"))
+            f:write(string.rep("0123456789", 100))
+            f:close()
+
+            local file = assert(ngx_io.open("conf/test.txt"))
+
+            local res = assert(file:readv({
+                { 0, 5 }, { 5, 5 }, { 995, 10 }, { 2000, 3 }, { 100, 0 },
+                { 10, 10 },
+            }))
+
+            ngx.say(#res)
+            ngx.say(table.concat(res, "|"))
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+6
+01234|56789|56789|||0123456789
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: many adjacent and scattered ranges
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            local data = {}
+            for i = 1, 10000 do
+                data[i] = string.format("%07d\n", i)
+            end
+            data = table.concat(data)
+
+            local f = assert(io.open(prefix .. "/conf/test.txt", "w"))
+            f:write(data)
+            f:close()
+
+            local file = assert(ngx_io.open("conf/test.txt"))
+
+            local ranges = {}
+            for i = 0, 99 do
+                ranges[#ranges + 1] = { i * 3, 3 }
+            end
+
+            for i = 1, 50 do
+                local off = (i * 7919) % #data
+                ranges[#ranges + 1] = { off, i }
+            end
+
+            local res = assert(file:readv(ranges))
+
+            ngx.say(table.concat(res, "", 1, 100) == data:sub(1, 300))
+
+            local ok = true
+            for i = 101, 150 do
+                local off, len = ranges[i][1], ranges[i][2]
+                ok = ok and res[i] == data:sub(off + 1, off + len)
+            end
+
+            ngx.say(#res, " ", ok)
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+true
+150 true
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: the file position is not changed
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            local f = assert(io.open(prefix .. "/conf/test.txt", "w"))
+            f:write(string.rep("0123456789", 100))
+            f:close()
+
+            local file = assert(ngx_io.open("conf/test.txt"))
+
+            ngx.say(file:read(3))
+
+            local res = assert(file:readv({ { 500, 2 }, { 8, 4 } }))
+            ngx.say(res[1], " ", res[2])
+
+            ngx.say(file:read(3))
+            ngx.say(file:seek())
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+012
+01 8901
+345
+6
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: bad arguments
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+
+            local file = assert(ngx_io.open("conf/nginx.conf"))
+
+            ngx.say(pcall(file.readv, file))
+            ngx.say(pcall(file.readv, file, { { -1, 1 } }))
+            ngx.say(pcall(file.readv, file, { { 0, 1 }, "foo" }))
+            ngx.say(pcall(file.readv, file, { { 0, 1 }, { 2^64, 1 } }))
+            ngx.say(pcall(file.readv, file, { { 0, 2^64 } }))
+            ngx.say(#file:readv({}))
+
+            assert(file:close())
+            ngx.say(file:readv({ { 0, 1 } }))
+
+            file = assert(ngx_io.open("conf/test.txt", "a"))
+            ngx.say(file:readv({ { 0, 1 } }))
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+falseexpecting two arguments (including the object), but got 1
+falsebad range at index 1
+falsebad range at index 2
+falsebad range at index 2
+falsebad range at index 1
+0
+nilclosed
+niloperation not permitted
+--- no_error_log
+[error]
@@ -0,0 +1,229 @@
+use Test::Nginx::Socket::Lua;
+
+repeat_each(3);
+
+plan tests => repeat_each() * (3 * 5);
+
+log_level 'debug';
+
+no_long_string();
+run_tests();
+
+__DATA__
+
+=== TEST 1: tail a large file
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            local f = assert(io.open(prefix .. "/conf/test.txt", "w"))
+            for i = 1, 100000 do
+                f:write("line ", i, "\n")
+            end
+            f:close()
+
+            local file = assert(ngx_io.open("conf/test.txt"))
+
+            ngx.say(table.concat(assert(file:tail(3)), "|"))
+            ngx.say(table.concat(assert(file:tail(1)), "|"))
+
+            local lines = assert(file:tail(200000))
+            ngx.say(#lines, " ", lines[1], " ", lines[#lines])
+
+            ngx.say(file:read("*l"))
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+line 99998|line 99999|line 100000
+line 100000
+100000 line 1 line 100000
+line 1
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: end of lines
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            local function tail(data, n)
+                local f = assert(io.open(prefix .. "/conf/test.txt", "w"))
+                f:write(data)
+                f:close()
+
+                local file = assert(ngx_io.open("conf/test.txt"))
+                local lines = assert(file:tail(n))
+                assert(file:close())
+
+                return #lines .. ":" .. table.concat(lines, "|")
+            end
+
+            ngx.say(tail("a\r\nb\n\nc", 10))
+            ngx.say(tail("a\r\nb\n\nc", 2))
+            ngx.say(tail("x\ny\n", 5))
+            ngx.say(tail("\n", 1))
+            ngx.say(tail("", 3))
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+4:a|b||c
+2:|c
+2:x|y
+1:
+0:
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: read lines backwards across the blocks
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            local function line(i)
+                if i % 1000 == 0 then
+                    return i .. string.rep("y", 100000)
+                end
+
+                return i .. string.rep("x", i * 37 % 200)
+            end
+
+            local f = assert(io.open(prefix .. "/conf/test.txt", "w"))
+            for i = 1, 3000 do
+                f:write(line(i), "\n")
+            end
+            f:close()
+
+            local file = assert(ngx_io.open("conf/test.txt"))
+
+            local n = 3000
+            for l in file:lines_reverse() do
+                assert(l == line(n))
+                n = n - 1
+            end
+
+            ngx.say(n)
+            ngx.say(file:read(4))
+
+            local iter = file:lines_reverse()
+            ngx.say(iter() == line(3000), " ", iter() == line(2999))
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+0
+1xxx
+true true
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: bad arguments
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+
+            local file = assert(ngx_io.open("conf/nginx.conf"))
+
+            ngx.say(pcall(file.tail, file))
+            ngx.say(pcall(file.tail, file, 0))
+            ngx.say(pcall(file.lines_reverse, file, 1))
+
+            local iter = file:lines_reverse()
+            assert(file:close())
+            ngx.say(file:tail(1))
+            ngx.say(iter())
+
+            file = assert(ngx_io.open("conf/test.txt", "a"))
+            ngx.say(file:tail(1))
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+falseexpecting two arguments (including the object), but got 1
+falsebad argument #2 to '?' (bad lines argument)
+falseexpecting only one argument (the object), but got 2
+nilclosed
+nilclosed
+niloperation not permitted
+--- no_error_log
+[error]
+
+
+
+=== TEST 5: a too long line and a killed light thread
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            local f = assert(io.open(prefix .. "/conf/test.txt", "w"))
+            f:write("first\n", string.rep("x", 2 * 1024 * 1024), "\n")
+            f:write("last\n")
+            f:close()
+
+            local file = assert(ngx_io.open("conf/test.txt"))
+
+            local iter = file:lines_reverse()
+            ngx.say(iter())
+            ngx.say(iter())
+
+            iter = file:lines_reverse()
+
+            local t = ngx.thread.spawn(iter)
+            ngx.thread.kill(t)
+            ngx.sleep(0.1)
+
+            ngx.say(iter())
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+last
+nilline too long
+last
+--- no_error_log
+[error]
@@ -0,0 +1,258 @@
+use Test::Nginx::Socket::Lua;
+
+repeat_each(3);
+
+plan tests => repeat_each() * (3 * 5);
+
+log_level 'debug';
+
+no_long_string();
+run_tests();
+
+__DATA__
+
+=== TEST 1: follow a growing file
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local path = ngx.config.prefix() .. "/conf/test.txt"
+
+            local f = assert(io.open(path, "w"))
+            f:write("line 1\n")
+            f:close()
+
+            local file = assert(ngx_io.open("conf/test.txt"))
+
+            ngx.say(file:read("*l"))
+            ngx.say(file:read("*l"))
+
+            assert(ngx.timer.at(0.1, function()
+                local f = assert(io.open(path, "a"))
+                f:write("line 2\nline 3\n")
+                f:close()
+            end))
+
+            ngx.say(file:wait_growth(3))
+            ngx.say(file:read("*l"))
+            ngx.say(file:read("*l"))
+            ngx.say(file:read("*l"))
+
+            ngx.say(file:wait_growth(0.1))
+
+            f = assert(io.open(path, "a"))
+            f:write("line 4\n")
+            f:close()
+
+            ngx.say(file:wait_growth(0.1))
+            ngx.say(file:read("*l"))
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+line 1
+nil
+grown
+line 2
+line 3
+nil
+niltimeout
+grown
+line 4
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: truncated and rotated
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local path = ngx.config.prefix() .. "/conf/test.txt"
+
+            local f = assert(io.open(path, "w"))
+            f:write("abc\n")
+            f:close()
+
+            local file = assert(ngx_io.open("conf/test.txt"))
+            ngx.say(file:read("*a"))
+
+            f = assert(io.open(path, "w"))
+            f:close()
+
+            ngx.say(file:wait_growth(1))
+            ngx.say(file:seek("set", 0))
+
+            assert(ngx.timer.at(0.1, function()
+                assert(os.rename(path, path .. ".1"))
+            end))
+
+            ngx.say(file:wait_growth(3))
+            ngx.say(file:wait_growth(3))
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+abc
+
+truncated
+0
+rotated
+rotated
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: bad arguments and busy waiting
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local path = ngx.config.prefix() .. "/conf/test.txt"
+
+            local f = assert(io.open(path, "w"))
+            f:close()
+
+            local file = assert(ngx_io.open("conf/test.txt"))
+
+            ngx.say(pcall(file.wait_growth, file, -1))
+            ngx.say(pcall(file.wait_growth, file, 1, 2))
+
+            local th = ngx.thread.spawn(function()
+                return file:wait_growth(0.1)
+            end)
+
+            ngx.say(file:read("*l"))
+            ngx.say(file:close())
+            ngx.say(ngx.thread.wait(th))
+
+            th = ngx.thread.spawn(function()
+                return file:wait_growth()
+            end)
+
+            ngx.thread.kill(th)
+            ngx.say(file:close())
+            ngx.say(file:wait_growth())
+
+            file = assert(ngx_io.open("conf/test.txt", "a"))
+            ngx.say(file:wait_growth())
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+falsebad argument #2 to '?' (bad timeout argument)
+falseexpecting one or two arguments (including the object), but got 3
+nilio busy reading
+nilio busy reading
+trueniltimeout
+1
+nilclosed
+niloperation not permitted
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: rotated before the first wait
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local path = ngx.config.prefix() .. "/conf/test.txt"
+
+            local f = assert(io.open(path, "w"))
+            f:write("abc\n")
+            f:close()
+
+            local file = assert(ngx_io.open("conf/test.txt"))
+            ngx.say(file:read("*l"))
+
+            assert(os.rename(path, path .. ".1"))
+
+            f = assert(io.open(path, "w"))
+            f:write("new file\n")
+            f:close()
+
+            ngx.say(file:wait_growth(1))
+            ngx.say(file:read("*l"))
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+abc
+rotated
+nil
+--- no_error_log
+[error]
+
+
+
+=== TEST 5: killed while waiting
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local path = ngx.config.prefix() .. "/conf/test.txt"
+
+            local f = assert(io.open(path, "w"))
+            f:write("abc\n")
+            f:close()
+
+            local file = assert(ngx_io.open("conf/test.txt"))
+            ngx.say(file:read("*l"))
+
+            local th = ngx.thread.spawn(function()
+                return file:wait_growth()
+            end)
+
+            ngx.sleep(0.01)
+            ngx.say(ngx.thread.kill(th))
+
+            f = assert(io.open(path, "a"))
+            f:write("def\n")
+            f:close()
+
+            ngx.say(file:wait_growth(1))
+            ngx.say(file:read("*l"))
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+abc
+true
+grown
+def
+--- no_error_log
+[error]
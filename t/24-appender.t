@@ -0,0 +1,241 @@
+use Test::Nginx::Socket::Lua;
+
+repeat_each(3);
+
+plan tests => repeat_each() * (3 * 5);
+
+log_level 'debug';
+
+no_long_string();
+run_tests();
+
+__DATA__
+
+=== TEST 1: concurrent writes in one request
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            os.remove(prefix .. "/conf/audit.log")
+
+            local log = ngx_io.appender("conf/audit.log")
+
+            local threads = {}
+            for i = 1, 100 do
+                threads[i] = ngx.thread.spawn(function()
+                    return log:write("record " .. i .. "\n")
+                end)
+            end
+
+            local total = 0
+            for i = 1, 100 do
+                local ok, n = ngx.thread.wait(threads[i])
+                assert(ok and n == #("record " .. i .. "\n"))
+                total = total + n
+            end
+
+            local seen = {}
+            for line in io.lines(prefix .. "/conf/audit.log") do
+                seen[#seen + 1] = line
+            end
+
+            table.sort(seen)
+            ngx.say(total, " ", #seen, " ", seen[1], " ", seen[100])
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+992 100 record 1 record 99
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: writes from many requests
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /w {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+
+            local log = ngx_io.appender("conf/audit.log", { fsync = true })
+
+            for i = 1, 10 do
+                assert(log:write(ngx.var.arg_id .. "-" .. i .. "\n"))
+            end
+
+            ngx.print("ok")
+        }
+    }
+
+    location /t {
+        content_by_lua_block {
+            local prefix = ngx.config.prefix()
+
+            os.remove(prefix .. "/conf/audit.log")
+
+            local reqs = {}
+            for i = 1, 20 do
+                reqs[i] = { "/w", { args = { id = i } } }
+            end
+
+            local res = { ngx.location.capture_multi(reqs) }
+
+            for i = 1, 20 do
+                assert(res[i].status == 200 and res[i].body == "ok")
+            end
+
+            local n, last = 0, {}
+            for line in io.lines(prefix .. "/conf/audit.log") do
+                local id, i = line:match("^(%d+)-(%d+)$")
+                id, i = tonumber(id), tonumber(i)
+
+                -- the records of one request keep the order
+                assert(i == (last[id] or 0) + 1)
+                last[id] = i
+                n = n + 1
+            end
+
+            ngx.say(n)
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+200
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: threshold
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            os.remove(prefix .. "/conf/big.log")
+
+            local log = ngx_io.appender("conf/big.log", { threshold = 1024 })
+
+            local data = string.rep("x", 4095) .. "\n"
+
+            local threads = {}
+            for i = 1, 10 do
+                threads[i] = ngx.thread.spawn(log.write, log, data)
+            end
+
+            for i = 1, 10 do
+                assert(select(2, ngx.thread.wait(threads[i])) == 4096)
+            end
+
+            ngx.say(log:write(""))
+            ngx.say(ngx_io.stat("conf/big.log").size)
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+0
+40960
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: bad arguments and write failure
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+
+            ngx.say(pcall(ngx_io.appender))
+            ngx.say(pcall(ngx_io.appender, "conf/a.log", { fsync = 1 }))
+            ngx.say(pcall(ngx_io.appender, "conf/a.log", { threshold = 0 }))
+
+            local log = ngx_io.appender("conf/a.log")
+            ngx.say(pcall(log.write, log))
+
+            log = ngx_io.appender("no/such/dir/a.log")
+            ngx.say(log:write("foo"))
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+falseexpecting one or two arguments, but got 0
+falsebad "fsync" option
+falsebad "threshold" option
+falseexpecting two arguments (including the object), but got 1
+nilno such file or directory
+--- error_log
+write failed
+
+
+
+=== TEST 5: too much pending data
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            os.remove(prefix .. "/conf/big.log")
+
+            local log = ngx_io.appender("conf/big.log")
+
+            local data = string.rep("x", 1024 * 1024)
+
+            local threads = {}
+            for i = 1, 7 do
+                threads[i] = ngx.thread.spawn(log.write, log, data)
+            end
+
+            local ok, failed = 0, 0
+            for i = 1, 7 do
+                local _, n, err = ngx.thread.wait(threads[i])
+                if n then
+                    ok = ok + 1
+
+                else
+                    failed = failed + 1
+                    ngx.say(err)
+                end
+            end
+
+            ngx.say(ok, " ", failed)
+            ngx.say(ngx_io.stat("conf/big.log").size == ok * #data)
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+too much pending data
+too much pending data
+5 2
+true
+--- no_error_log
+[error]
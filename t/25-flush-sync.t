@@ -0,0 +1,192 @@
+use Test::Nginx::Socket::Lua;
+
+repeat_each(3);
+
+plan tests => repeat_each() * (3 * 4);
+
+log_level 'debug';
+
+no_long_string();
+run_tests();
+
+__DATA__
+
+=== TEST 1: durable flush with and without the buffered data
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+
+            local before = ngx_io.stats()
+
+            local file = assert(ngx_io.open("conf/test.txt", "w"))
+
+            assert(file:write("hello"))
+            ngx.say(file:flush(true))
+            ngx.say(file:flush(true))
+            assert(file:write(", world"))
+            ngx.say(file:flush())
+            assert(file:close())
+
+            local after = ngx_io.stats()
+
+            ngx.say(after.fsync_flushes - before.fsync_flushes, " ",
+                    after.fsyncs - before.fsyncs)
+
+            file = assert(ngx_io.open("conf/test.txt"))
+            ngx.say(file:read("*a"))
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+1
+1
+1
+2 2
+hello, world
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: concurrent durable flushes of one file share the fsync
+--- main_config
+thread_pool default threads=1 max_queue=100;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            os.remove(prefix .. "/conf/test.txt")
+
+            local before = ngx_io.stats()
+
+            local function append(i)
+                local file = assert(ngx_io.open("conf/test.txt", "a"))
+                assert(file:write(string.format("record %02d\n", i)))
+
+                local ok, err = file:flush(true)
+                assert(file:close())
+
+                return ok, err
+            end
+
+            local threads = {}
+            for i = 1, 20 do
+                threads[i] = ngx.thread.spawn(append, i)
+            end
+
+            local n = 0
+            for i = 1, 20 do
+                local _, ok = ngx.thread.wait(threads[i])
+                if ok == 1 then
+                    n = n + 1
+                end
+            end
+
+            local after = ngx_io.stats()
+
+            ngx.say(n, " ", after.fsync_flushes - before.fsync_flushes)
+            ngx.say(after.fsyncs - before.fsyncs <= 2)
+
+            local size = ngx_io.stat("conf/test.txt").size
+            ngx.say(size == 20 * #"record 00\n")
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+20 20
+true
+true
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: the fsync is not shared by different files
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+
+            local before = ngx_io.stats()
+
+            local function flush(name)
+                local file = assert(ngx_io.open(name, "w"))
+                assert(file:write(name))
+
+                local ok, err = file:flush(true)
+                assert(file:close())
+
+                return ok, err
+            end
+
+            local t1 = ngx.thread.spawn(flush, "conf/a.txt")
+            local t2 = ngx.thread.spawn(flush, "conf/b.txt")
+
+            ngx.say(select(2, ngx.thread.wait(t1)))
+            ngx.say(select(2, ngx.thread.wait(t2)))
+
+            local after = ngx_io.stats()
+
+            ngx.say(after.fsyncs - before.fsyncs)
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+1
+1
+2
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: a durable flush of a file being closed by another thread
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+
+            local file = assert(ngx_io.open("conf/test.txt", "w"))
+            assert(file:write("data"))
+
+            local t = ngx.thread.spawn(function ()
+                return file:flush(true)
+            end)
+
+            ngx.say(file:close())
+            ngx.say(select(2, ngx.thread.wait(t)))
+
+            ngx.say(file:close())
+            ngx.say(file:flush(true))
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+nilio busy flushing
+1
+1
+nilclosed
+--- no_error_log
+[error]
@@ -0,0 +1,185 @@
+use Test::Nginx::Socket::Lua;
+
+repeat_each(3);
+
+plan tests => repeat_each() * (3 * 4);
+
+log_level 'debug';
+
+no_long_string();
+run_tests();
+
+__DATA__
+
+=== TEST 1: data, range and full flushes
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+
+            local before = ngx_io.stats()
+
+            local file = assert(ngx_io.open("conf/test.txt", "w"))
+
+            assert(file:write("hello"))
+            ngx.say(file:flush("data"))
+            assert(file:write(", world"))
+            ngx.say(file:flush("range"))
+            ngx.say(file:flush("range"))
+            ngx.say(file:flush("full"))
+            assert(file:close())
+
+            local after = ngx_io.stats()
+
+            ngx.say(after.fsync_flushes - before.fsync_flushes, " ",
+                    after.fsyncs - before.fsyncs)
+
+            file = assert(ngx_io.open("conf/test.txt"))
+            ngx.say(file:read("*a"))
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+1
+1
+1
+1
+3 3
+hello, world
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: durable close
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+
+            local before = ngx_io.stats()
+
+            local file = assert(ngx_io.open("conf/test.txt", "w"))
+            assert(file:write("buffered"))
+            ngx.say(file:close("data"))
+            ngx.say(file:close("data"))
+
+            file = assert(ngx_io.open("conf/test.txt", "a"))
+            ngx.say(file:close(true))
+
+            file = assert(ngx_io.open("conf/test.txt"))
+            ngx.say(file:read("*a"))
+            ngx.say(file:close(true))
+
+            local after = ngx_io.stats()
+
+            ngx.say(after.fsyncs - before.fsyncs)
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+1
+nilclosed
+1
+buffered
+1
+2
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: the files opened with O_SYNC or O_DSYNC
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+
+            local before = ngx_io.stats()
+
+            local file = assert(ngx_io.open("conf/test.txt", "w",
+                                            { dsync = true }))
+            assert(file:write("foo"))
+            ngx.say(file:flush("data"))
+            assert(file:write("bar"))
+            ngx.say(file:flush("range"))
+
+            local after = ngx_io.stats()
+            ngx.say(after.fsyncs - before.fsyncs)
+
+            ngx.say(file:flush(true))
+            assert(file:close())
+
+            before = after
+            after = ngx_io.stats()
+            ngx.say(after.fsyncs - before.fsyncs)
+
+            file = assert(ngx_io.open("conf/test.txt", "a", { sync = true }))
+            assert(file:write("baz"))
+            ngx.say(file:close(true))
+
+            before = after
+            after = ngx_io.stats()
+            ngx.say(after.fsyncs - before.fsyncs)
+
+            ngx.say(ngx_io.stat("conf/test.txt").size)
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+1
+1
+0
+1
+1
+1
+0
+9
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: bad arguments
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+
+            local file = assert(ngx_io.open("conf/test.txt", "w"))
+
+            ngx.say(pcall(file.flush, file, "foo"))
+            ngx.say(pcall(file.close, file, "data", 1))
+            ngx.say(pcall(file.close, file, "foo"))
+            ngx.say(file:close("range"))
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+falsebad argument #2 to '?' (invalid option 'foo')
+falseexpecting one or two arguments (including the object), but got 3
+falsebad argument #2 to '?' (invalid option 'foo')
+1
+--- no_error_log
+[error]
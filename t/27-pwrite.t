@@ -0,0 +1,187 @@
+use Test::Nginx::Socket::Lua;
+
+repeat_each(3);
+
+plan tests => repeat_each() * (3 * 4);
+
+log_level 'debug';
+
+no_long_string();
+run_tests();
+
+__DATA__
+
+=== TEST 1: write at the given offsets
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            local f = assert(io.open(prefix .. "/conf/test.txt", "w"))
+            f:write(string.rep(".", 20))
+            f:close()
+
+            local file = assert(ngx_io.open("conf/test.txt", "r+"))
+
+            ngx.say(file:read(2))
+            ngx.say(file:pwrite(10, "hello"))
+            ngx.say(file:pwrite(0, "ab"))
+            ngx.say(file:pwrite(18, "world"))
+            ngx.say(file:seek())
+            assert(file:close())
+
+            file = assert(ngx_io.open("conf/test.txt"))
+            ngx.say(file:read("*a"))
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+..
+5
+2
+5
+2
+ab........hello...world
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: concurrent writes on the same file object
+--- main_config
+thread_pool default threads=4 max_queue=100;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+
+            local file = assert(ngx_io.open("conf/test.txt", "w"))
+
+            local function write(i)
+                local slot = string.format("slot %02d\n", i)
+                return file:pwrite((i - 1) * #slot, slot)
+            end
+
+            local threads = {}
+            for i = 1, 10 do
+                threads[i] = ngx.thread.spawn(write, i)
+            end
+
+            local n = 0
+            for i = 1, 10 do
+                local _, bytes = ngx.thread.wait(threads[i])
+                n = n + bytes
+            end
+
+            ngx.say(n)
+            assert(file:close())
+
+            file = assert(ngx_io.open("conf/test.txt"))
+
+            local ok = true
+            local i = 0
+            for line in file:lines() do
+                i = i + 1
+                ok = ok and line == string.format("slot %02d", i)
+            end
+
+            ngx.say(i, " ", ok)
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+80
+10 true
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: write a table of strings
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+
+            local file = assert(ngx_io.open("conf/test.txt", "w"))
+
+            ngx.say(file:pwrite(3, { "foo", "", 42, "bar" }))
+            ngx.say(file:pwrite(0, { "abc" }))
+            ngx.say(file:pwrite(100, ""))
+            ngx.say(file:pwrite(100, { "", "" }))
+            assert(file:close())
+
+            file = assert(ngx_io.open("conf/test.txt"))
+            ngx.say(file:read("*a"))
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+8
+3
+0
+0
+abcfoo42bar
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: bad arguments
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+
+            local file = assert(ngx_io.open("conf/test.txt", "w"))
+
+            ngx.say(pcall(file.pwrite, file, 0))
+            ngx.say(pcall(file.pwrite, file, -1, "foo"))
+            ngx.say(pcall(file.pwrite, file, 0, { "foo", true }))
+            ngx.say(pcall(file.pwrite, file, 0, true))
+
+            assert(file:close())
+            ngx.say(file:pwrite(0, "foo"))
+
+            file = assert(ngx_io.open("conf/test.txt"))
+            ngx.say(file:pwrite(0, "foo"))
+            assert(file:close())
+
+            file = assert(ngx_io.open("conf/test.txt", "a"))
+            ngx.say(file:pwrite(0, "foo"))
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+falseexpecting 3 arguments (including the object), but got 2
+falsebad argument #2 to '?' (bad offset argument)
+falsebad argument #3 to '?' (bad data argument)
+falsebad argument #3 to '?' (bad data argument)
+nilclosed
+niloperation not permitted
+niloperation not permitted
+--- no_error_log
+[error]
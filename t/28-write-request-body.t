@@ -0,0 +1,170 @@
+use Test::Nginx::Socket::Lua;
+
+repeat_each(3);
+
+plan tests => repeat_each() * (3 * 4);
+
+log_level 'debug';
+
+no_long_string();
+run_tests();
+
+__DATA__
+
+=== TEST 1: write the request body in memory
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+
+            ngx.req.read_body()
+
+            local file = assert(ngx_io.open("conf/test.txt", "w"))
+
+            assert(file:write("head:"))
+            ngx.say(file:write_request_body())
+            assert(file:write(":tail"))
+            assert(file:close())
+
+            file = assert(ngx_io.open("conf/test.txt"))
+            ngx.say(file:read("*a"))
+            assert(file:close())
+        }
+    }
+
+--- request
+POST /t
+hello, world
+--- response_body
+12
+head:hello, world:tail
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: write the request body spooled to the temporary file
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        client_body_buffer_size 1k;
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+
+            ngx.req.read_body()
+            ngx.say(ngx.req.get_body_file() ~= nil)
+
+            local file = assert(ngx_io.open("conf/test.txt", "w"))
+
+            assert(file:write("head:"))
+            ngx.say(file:write_request_body())
+            ngx.say(file:seek())
+            assert(file:close())
+
+            file = assert(ngx_io.open("conf/test.txt"))
+            local data = file:read("*a")
+            assert(file:close())
+
+            ngx.say(data == "head:" .. string.rep("0123456789", 10000))
+        }
+    }
+
+--- request eval
+"POST /t\n" . ("0123456789" x 10000)
+--- response_body
+true
+100000
+100005
+true
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: append the request body and sync it
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        client_body_buffer_size 1k;
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            os.remove(prefix .. "/conf/test.txt")
+
+            ngx.req.read_body()
+
+            local before = ngx_io.stats()
+
+            local file = assert(ngx_io.open("conf/test.txt", "a"))
+            ngx.say(file:write_request_body({ sync = "data" }))
+            ngx.say(file:write_request_body({ sync = true }))
+            assert(file:close())
+
+            local after = ngx_io.stats()
+            ngx.say(after.fsyncs - before.fsyncs)
+
+            ngx.say(ngx_io.stat("conf/test.txt").size)
+        }
+    }
+
+--- request eval
+"POST /t\n" . ("a" x 4096)
+--- response_body
+4096
+4096
+2
+8192
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: bad arguments and missing body
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+
+            local file = assert(ngx_io.open("conf/test.txt", "w"))
+
+            ngx.say(file:write_request_body())
+
+            ngx.req.read_body()
+
+            ngx.say(file:write_request_body())
+            ngx.say(pcall(file.write_request_body, file, 1))
+            ngx.say(pcall(file.write_request_body, file, { sync = "foo" }))
+            ngx.say(pcall(file.write_request_body, file, {}, 1))
+
+            assert(file:close())
+            ngx.say(file:write_request_body())
+
+            file = assert(ngx_io.open("conf/test.txt"))
+            ngx.say(file:write_request_body())
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+nilrequest body not read
+0
+falsebad argument #2 to '?' (table expected, got number)
+falsebad argument #2 to '?' (invalid option 'foo')
+falseexpecting one or two arguments (including the object), but got 3
+nilclosed
+niloperation not permitted
+--- no_error_log
+[error]
@@ -0,0 +1,194 @@
+use Test::Nginx::Socket::Lua;
+
+repeat_each(3);
+
+plan tests => repeat_each() * (3 * 4);
+
+log_level 'debug';
+
+no_long_string();
+run_tests();
+
+__DATA__
+
+=== TEST 1: copy a whole file
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            local data = string.rep("0123456789", 10000)
+
+            local f = assert(io.open(prefix .. "/conf/a.txt", "w"))
+            f:write(data)
+            f:close()
+
+            f = assert(io.open(prefix .. "/conf/b.txt", "w"))
+            f:write(string.rep("x", 200000))
+            f:close()
+
+            ngx.say(ngx_io.copy("conf/a.txt", "conf/b.txt"))
+
+            local file = assert(ngx_io.open("conf/b.txt"))
+            ngx.say(file:read("*a") == data)
+            assert(file:close())
+
+            ngx.say(ngx_io.copy("conf/a.txt", prefix .. "/conf/c.txt"))
+            ngx.say(ngx_io.stat("conf/c.txt").size)
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+100000
+true
+100000
+100000
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: copy a range
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            local f = assert(io.open(prefix .. "/conf/a.txt", "w"))
+            f:write(string.rep("0123456789", 100))
+            f:close()
+
+            local function cat(name)
+                local file = assert(ngx_io.open(name))
+                local data = file:read("*a")
+                assert(file:close())
+                return data
+            end
+
+            ngx.say(ngx_io.copy("conf/a.txt", "conf/b.txt", 5, 10))
+            ngx.say(cat("conf/b.txt"))
+
+            ngx.say(ngx_io.copy("conf/a.txt", "conf/b.txt", 995))
+            ngx.say(cat("conf/b.txt"))
+
+            ngx.say(ngx_io.copy("conf/a.txt", "conf/b.txt", 990, 100))
+            ngx.say(cat("conf/b.txt"))
+
+            ngx.say(ngx_io.copy("conf/a.txt", "conf/b.txt", 2000))
+            ngx.say(ngx_io.stat("conf/b.txt").size)
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+10
+5678901234
+5
+56789
+10
+0123456789
+0
+0
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: copy in chunks
+--- main_config
+thread_pool default threads=1 max_queue=100;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            local data = {}
+            for i = 1, 10000 do
+                data[i] = string.format("%07d\n", i)
+            end
+            data = table.concat(data)
+
+            local f = assert(io.open(prefix .. "/conf/a.txt", "w"))
+            f:write(data)
+            f:close()
+
+            local t = ngx.thread.spawn(function ()
+                return ngx_io.copy("conf/a.txt", "conf/b.txt", 8, nil,
+                                   { chunk = 4096 })
+            end)
+
+            -- the other operations are served between the chunks
+            ngx.say(ngx_io.stat("conf/a.txt").size)
+
+            ngx.say(select(2, ngx.thread.wait(t)))
+
+            local file = assert(ngx_io.open("conf/b.txt"))
+            ngx.say(file:read("*a") == data:sub(9))
+            assert(file:close())
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+80000
+79992
+true
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: bad arguments and failures
+--- main_config
+thread_pool default threads=2 max_queue=10;
+--- config
+    server_tokens off;
+    location /t {
+        content_by_lua_block {
+            local ngx_io = require "ngx.io"
+            local prefix = ngx.config.prefix()
+
+            local f = assert(io.open(prefix .. "/conf/a.txt", "w"))
+            f:write("hello")
+            f:close()
+
+            ngx.say(pcall(ngx_io.copy, "conf/a.txt"))
+            ngx.say(pcall(ngx_io.copy, "conf/a.txt", "conf/b.txt", -1))
+            ngx.say(pcall(ngx_io.copy, "conf/a.txt", "conf/b.txt", 0, -1))
+            ngx.say(pcall(ngx_io.copy, "conf/a.txt", "conf/b.txt", 0, 1,
+                          { chunk = 0 }))
+
+            ngx.say(ngx_io.copy("conf/nonexistent.txt", "conf/b.txt"))
+            ngx.say(ngx_io.copy("conf/a.txt", "conf/a.txt"))
+            ngx.say(ngx_io.copy("conf/a.txt", "conf/nonexistent/b.txt"))
+            ngx.say(ngx_io.stat("conf/a.txt").size)
+        }
+    }
+
+--- request
+GET /t
+--- response_body
+falseexpecting 2 to 5 arguments, but got 1
+falsebad argument #3 to '?' (bad offset argument)
+falsebad argument #4 to '?' (bad len argument)
+falsebad "chunk" option
+nilno such file or directory
+nilinvalid argument
+nilno such file or directory
+5
+--- no_error_log
+[error]
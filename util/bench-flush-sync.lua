@@ -0,0 +1,75 @@
+-- Benchmark of the concurrent durable flushes (file:flush(true)), which
+-- share the fsync calls of the same file.
+--
+-- Usage (with the resty command line utility from OpenResty):
+--
+--   resty --main-conf "thread_pool default threads=4;" \
+--         util/bench-flush-sync.lua [directory] [seconds] [record size]
+--
+-- The directory should be on the storage to measure (the default is /tmp,
+-- which might be a tmpfs). For each concurrency level, the light threads
+-- append records to one file and flush each of them with fsync, the number
+-- of flushes per second and of fsync calls per flush are printed, e.g. run
+-- it against two builds to compare the throughput.
+
+local ngx_io = require "ngx.io"
+
+local dir = arg[1] or "/tmp"
+local seconds = tonumber(arg[2]) or 5
+local record_size = tonumber(arg[3]) or 128
+local levels = { 1, 4, 16, 64, 256 }
+
+local path = dir .. "/bench-flush-sync." .. ngx.worker.pid()
+local record = string.rep("x", record_size - 1) .. "\n"
+
+local function writer(deadline, counter)
+    local file = assert(ngx_io.open(path, "a"))
+
+    while ngx.now() < deadline do
+        assert(file:write(record))
+        assert(file:flush(true))
+
+        counter.n = counter.n + 1
+        ngx.update_time()
+    end
+
+    assert(file:close())
+end
+
+local function run(concurrency)
+    local counter = { n = 0 }
+    local threads = {}
+
+    os.remove(path)
+
+    local before = ngx_io.stats()
+
+    ngx.update_time()
+    local start = ngx.now()
+    local deadline = start + seconds
+
+    for i = 1, concurrency do
+        threads[i] = ngx.thread.spawn(writer, deadline, counter)
+    end
+
+    for i = 1, concurrency do
+        assert(ngx.thread.wait(threads[i]))
+    end
+
+    ngx.update_time()
+    local elapsed = ngx.now() - start
+
+    local after = ngx_io.stats()
+    local fsyncs = after.fsyncs - before.fsyncs
+
+    print(string.format("%4d writers: %8.0f flushes/s, %6.0f fsyncs/s, "
+                        .. "%.3f fsyncs per flush",
+                        concurrency, counter.n / elapsed, fsyncs / elapsed,
+                        fsyncs / counter.n))
+end
+
+for _, concurrency in ipairs(levels) do
+    run(concurrency)
+end
+
+os.remove(path)
@@ -0,0 +1,98 @@
+-- Microbenchmark of file:lines() / file:read("*l"), which are driven by the
+-- ngx_http_lua_io_read_line() input filter.
+--
+-- Usage (with the resty command line utility from OpenResty):
+--
+--   resty --main-conf "thread_pool default threads=4;" \
+--         --http-conf "lua_io_read_buffer_size 64k;" \
+--         util/bench-read-line.lua [megabytes] [average line length]
+--
+-- Run it against two builds (e.g. before and after changing the filter) to
+-- compare the lines per second, the test file stays in the page cache after
+-- the warming round, so the numbers are dominated by the line scanning.
+
+local ngx_io = require "ngx.io"
+
+local megabytes = tonumber(arg[1]) or 256
+local line_len = tonumber(arg[2]) or 120
+local rounds = 5
+
+local path = os.tmpname()
+
+local function generate()
+    local f = assert(io.open(path, "w"))
+    local lines = {}
+    local total = 0
+
+    math.randomseed(1)
+
+    for i = 1, 1024 do
+        local len = math.random(1, line_len * 2)
+        local line = string.rep(string.char(97 + i % 26), len)
+
+        -- mix LF and CRLF terminated lines
+        if i % 4 == 0 then
+            line = line .. "\r\n"
+
+        else
+            line = line .. "\n"
+        end
+
+        lines[i] = line
+        total = total + #line
+    end
+
+    local chunk = table.concat(lines)
+    local size = 0
+
+    while size < megabytes * 1024 * 1024 do
+        f:write(chunk)
+        size = size + total
+    end
+
+    f:close()
+
+    return size
+end
+
+local function run()
+    local file = assert(ngx_io.open(path))
+    local n = 0
+
+    ngx.update_time()
+    local start = ngx.now()
+
+    for _ in file:lines() do
+        n = n + 1
+    end
+
+    ngx.update_time()
+    local elapsed = ngx.now() - start
+
+    assert(file:close())
+
+    return n, elapsed
+end
+
+local size = generate()
+
+-- warm up the page cache
+run()
+
+local best
+
+for i = 1, rounds do
+    local n, elapsed = run()
+
+    print(string.format("round %d: %d lines in %.3fs, %.0f lines/s, %.1f MB/s",
+                        i, n, elapsed, n / elapsed,
+                        size / 1024 / 1024 / elapsed))
+
+    if not best or elapsed < best then
+        best = elapsed
+    end
+end
+
+print(string.format("best: %.1f MB/s", size / 1024 / 1024 / best))
+
+os.remove(path)